@@ -2,8 +2,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
 #include "bencode.h"
 
+/* arena 的默认块大小 */
+#define BENCODE_ARENA_DEFAULT_BLOCK (64 * 1024)
+/* arena 分配的对齐粒度 */
+#define BENCODE_ARENA_ALIGN (sizeof(max_align_t))
+
+/* arena 的一个内存块，块之间用单链表串起来，reset 后按顺序复用 */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;   // data 区域的字节数
+    size_t used;   // 已分配的字节数
+    max_align_t data[];
+};
+
+struct bencode_arena {
+    struct arena_block *head;  // 第一个块
+    struct arena_block *cur;   // 当前正在分配的块
+    size_t block_size;         // 新块的默认大小
+};
+
 /* Helper: 计算正数的位数 */
 static int num_digits(size_t num) {
     int digits = 1;
@@ -14,78 +38,365 @@ static int num_digits(size_t num) {
     return digits;
 }
 
+static size_t arena_align(size_t size) {
+    return (size + BENCODE_ARENA_ALIGN - 1) & ~(BENCODE_ARENA_ALIGN - 1);
+}
+
+static struct arena_block *arena_block_new(size_t size) {
+    struct arena_block *b = malloc(sizeof(struct arena_block) + size);
+    if (!b)
+        return NULL;
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+struct bencode_arena *bencode_arena_new(size_t block_size) {
+    struct bencode_arena *arena = malloc(sizeof(struct bencode_arena));
+    if (!arena)
+        return NULL;
+    arena->block_size = arena_align(block_size ? block_size : BENCODE_ARENA_DEFAULT_BLOCK);
+    arena->head = arena_block_new(arena->block_size);
+    if (!arena->head) {
+        free(arena);
+        return NULL;
+    }
+    arena->cur = arena->head;
+    return arena;
+}
+
+void bencode_arena_reset(struct bencode_arena *arena) {
+    /* O(1)：只回到第一个块，后续块在分配时按需清零复用 */
+    arena->cur = arena->head;
+    arena->head->used = 0;
+}
+
+void bencode_arena_free(struct bencode_arena *arena) {
+    if (!arena)
+        return;
+    struct arena_block *b = arena->head;
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    free(arena);
+}
+
+/* 从 arena 中分配 size 字节：当前块不够时依次复用后续块，都不够时插入新块 */
+static void *arena_alloc(struct bencode_arena *arena, size_t size) {
+    size = arena_align(size ? size : 1);
+    struct arena_block *b = arena->cur;
+    while (b->size - b->used < size) {
+        struct arena_block *next = b->next;
+        if (!next || next->size < size) {
+            size_t bsize = size > arena->block_size ? size : arena->block_size;
+            struct arena_block *nb = arena_block_new(bsize);
+            if (!nb)
+                return NULL;
+            nb->next = next;
+            b->next = nb;
+            next = nb;
+        }
+        b = next;
+        b->used = 0;
+    }
+    arena->cur = b;
+    void *p = (char *)b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void *bencode_arena_alloc(struct bencode_arena *arena, size_t size) {
+    return arena_alloc(arena, size);
+}
+
+/* arena 版 realloc：如果 ptr 是当前块的最后一次分配且空间足够，则原地扩展 */
+static void *arena_realloc(struct bencode_arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (new_size <= old_size)
+        return ptr;
+    struct arena_block *b = arena->cur;
+    size_t old_aligned = arena_align(old_size);
+    size_t new_aligned = arena_align(new_size);
+    if ((char *)ptr + old_aligned == (char *)b->data + b->used &&
+        b->size - b->used >= new_aligned - old_aligned) {
+        b->used += new_aligned - old_aligned;
+        return ptr;
+    }
+    void *np = arena_alloc(arena, new_size);
+    if (np)
+        memcpy(np, ptr, old_size);
+    return np;
+}
+
+/* 解码上下文：在递归过程中传递解码选项 */
+struct decode_ctx {
+    unsigned flags;                // enum bencode_decode_flags
+    struct bencode_arena *arena;   // 非 NULL 时所有分配都来自 arena
+    size_t *counts;                // BENCODE_DECODE_EXACT：按先序编号的容器子元素个数
+    size_t next_container;         // 下一个要解码的容器编号
+    const char *base;              // 输入起点，用于计算 BENCODE_DECODE_SPANS 的偏移
+};
+
+/* 以下三个函数根据是否使用 arena 选择分配方式 */
+static void *ctx_alloc(const struct decode_ctx *ctx, size_t size) {
+    return ctx->arena ? arena_alloc(ctx->arena, size) : malloc(size);
+}
+
+static void *ctx_realloc(const struct decode_ctx *ctx, void *ptr, size_t old_size, size_t new_size) {
+    return ctx->arena ? arena_realloc(ctx->arena, ptr, old_size, new_size) : realloc(ptr, new_size);
+}
+
+static void ctx_free(const struct decode_ctx *ctx, void *ptr) {
+    if (!ctx->arena)
+        free(ptr);
+}
+
+/*
+ * 解析 i<number>e：单次扫描累加数字，只读到 'e' 为止，不分配内存。
+ * 拒绝空数字、前导零、"-0" 和超出 long long 范围的值。
+ * 成功返回消耗的字节数（包括 'i' 和 'e'），失败返回 0。
+ */
+static size_t parse_int(const char *s, size_t n, long long *out) {
+    size_t pos = 1;  // 跳过 'i'
+    int neg = 0;
+    if (pos < n && s[pos] == '-') {
+        neg = 1;
+        pos++;
+    }
+    size_t first = pos;
+    unsigned long long limit = neg ? (unsigned long long)LLONG_MAX + 1 : (unsigned long long)LLONG_MAX;
+    unsigned long long acc = 0;
+    while (pos < n && s[pos] >= '0' && s[pos] <= '9') {
+        unsigned d = (unsigned)(s[pos] - '0');
+        if (acc > (limit - d) / 10)
+            return 0;  // 溢出
+        acc = acc * 10 + d;
+        pos++;
+    }
+    size_t ndigits = pos - first;
+    if (ndigits == 0 || pos >= n || s[pos] != 'e')
+        return 0;
+    if (s[first] == '0' && (ndigits > 1 || neg))
+        return 0;
+    *out = neg ? (long long)(0ULL - acc) : (long long)acc;
+    return pos + 1;
+}
+
+/*
+ * 解析字符串头部 <len>:，返回头部长度（包括冒号），失败返回 0。
+ * 与 parse_int 一样只看前 n 个字节：输入可能是没有 '\0' 结尾的文件映射。
+ */
+static size_t parse_str_len(const char *s, size_t n, size_t *len) {
+    size_t pos = 0, acc = 0;
+    while (pos < n && s[pos] >= '0' && s[pos] <= '9') {
+        size_t d = (size_t)(s[pos] - '0');
+        if (acc > (SIZE_MAX - d) / 10)
+            return 0;  // 溢出
+        acc = acc * 10 + d;
+        pos++;
+    }
+    if (pos == 0 || pos >= n || s[pos] != ':')
+        return 0;
+    *len = acc;
+    return pos + 1;
+}
+
+/*
+ * 预扫描：只做结构解析，不分配节点，按先序给每个容器编号并统计其直接子元素个数
+ * （字典的 key 和 value 都计数）。结构不完整时返回 0。
+ */
+static int prescan_counts(struct decode_ctx *ctx, const char *s, size_t n) {
+    size_t *counts = NULL, ncounts = 0, counts_cap = 0;
+    size_t *stack = NULL, depth = 0, stack_cap = 0;
+    size_t pos = 0;
+    do {
+        if (pos >= n)
+            goto fail;
+        if (depth > 0) {
+            if (s[pos] == 'e') {
+                depth--;
+                pos++;
+                continue;
+            }
+            counts[stack[depth - 1]]++;
+        }
+        char c = s[pos];
+        if (c >= '0' && c <= '9') {
+            size_t len;
+            size_t used = parse_str_len(s + pos, n - pos, &len);
+            if (used == 0 || len > n - pos - used)
+                goto fail;
+            pos += used + len;
+        } else if (c == 'i') {
+            long long num;
+            size_t used = parse_int(s + pos, n - pos, &num);
+            if (used == 0)
+                goto fail;
+            pos += used;
+        } else if (c == 'l' || c == 'd') {
+            if (ncounts == counts_cap) {
+                counts_cap = counts_cap ? counts_cap * 2 : 16;
+                size_t *nc = realloc(counts, counts_cap * sizeof(size_t));
+                if (!nc)
+                    goto fail;
+                counts = nc;
+            }
+            if (depth == stack_cap) {
+                stack_cap = stack_cap ? stack_cap * 2 : 16;
+                size_t *ns = realloc(stack, stack_cap * sizeof(size_t));
+                if (!ns)
+                    goto fail;
+                stack = ns;
+            }
+            counts[ncounts] = 0;
+            stack[depth++] = ncounts++;
+            pos++;
+        } else {
+            goto fail;
+        }
+    } while (depth > 0);
+    free(stack);
+    ctx->counts = counts;
+    ctx->next_container = 0;
+    return 1;
+
+ fail:
+    free(stack);
+    free(counts);
+    return 0;
+}
+
+/* 按字节序比较 key 与 (str, len)，较短的前缀排在前面，与 BitTorrent 规范一致 */
+static int key_cmp(const struct bencode_value *key, const char *str, size_t len) {
+    size_t klen = key->as.str_value.len;
+    int c = memcmp(key->as.str_value.str, str, klen < len ? klen : len);
+    if (c != 0)
+        return c;
+    return klen < len ? -1 : (klen > len ? 1 : 0);
+}
+
+/* 字典哈希索引使用的 FNV-1a 哈希 */
+static uint32_t key_hash(const char *str, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* 哈希表槽位数：不小于 2 * count 的 2 的幂，保证负载因子不超过 0.5 */
+static size_t index_slots(size_t count) {
+    size_t slots = 1;
+    while (slots < 2 * count)
+        slots <<= 1;
+    return slots;
+}
+
+/* 哈希表紧跟在 pairs 数组之后，与 pairs 一起分配和释放 */
+static uint32_t *map_index(const struct bencode_value *value) {
+    return (uint32_t *)(value->as.map_value.pairs + value->as.map_value.count);
+}
+
+/*
+ * 为字典构建开放寻址哈希索引：槽位保存 pair 下标 + 1，0 表示空槽。
+ * 分配失败时保持无索引状态，查找退回二分或线性扫描。
+ */
+static void build_map_index(struct decode_ctx *ctx, struct bencode_value *value, size_t capacity) {
+    size_t count = value->as.map_value.count;
+    size_t slots = index_slots(count);
+    if (count > UINT32_MAX - 1)
+        return;
+    struct bencode_pair *pairs = ctx_realloc(ctx, value->as.map_value.pairs,
+                                             capacity * sizeof(struct bencode_pair),
+                                             count * sizeof(struct bencode_pair) + slots * sizeof(uint32_t));
+    if (!pairs)
+        return;
+    value->as.map_value.pairs = pairs;
+    uint32_t *table = map_index(value);
+    memset(table, 0, slots * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        const struct bencode_value *k = &pairs[i].key;
+        size_t slot = key_hash(k->as.str_value.str, k->as.str_value.len) & (slots - 1);
+        while (table[slot] != 0)
+            slot = (slot + 1) & (slots - 1);
+        table[slot] = (uint32_t)(i + 1);
+    }
+    value->flags |= BENCODE_VALUE_INDEXED;
+}
+
+/* 容器的初始容量：EXACT 模式取预扫描得到的精确值，否则从 8 开始倍增 */
+static size_t initial_capacity(struct decode_ctx *ctx, size_t per_item) {
+    if (!ctx->counts)
+        return 8;
+    size_t count = ctx->counts[ctx->next_container++] / per_item;
+    return count ? count : 1;
+}
+
 /* 内部递归解析 bencode 值 */
-static size_t decode_bencode_value(struct bencode_value *value, const char *s, size_t n) {
+static size_t decode_bencode_value(struct decode_ctx *ctx, struct bencode_value *value, const char *s, size_t n);
+
+static size_t decode_value_body(struct decode_ctx *ctx, struct bencode_value *value, const char *s, size_t n) {
     if (n == 0) return 0;
+    value->flags = ctx->arena ? BENCODE_VALUE_ARENA : 0;
     if (isdigit((unsigned char)s[0])) {
         /* 解析字符串: <len>:<data> */
-        char *endptr;
-        long len = strtol(s, &endptr, 10);
-        if (endptr == s || *endptr != ':') return 0;
-        if (len < 0) return 0;
-        size_t header_len = (endptr - s) + 1; // 包括冒号
-        if ((size_t)len + header_len > n) return 0;
+        size_t len;
+        size_t header_len = parse_str_len(s, n, &len); // 包括冒号
+        if (header_len == 0) return 0;
+        if (len > n - header_len) return 0;
         value->type = BENCODE_STR;
-        value->as.str_value.len = (size_t)len;
-        value->as.str_value.str = malloc(value->as.str_value.len + 1);
+        value->as.str_value.len = len;
+        if (ctx->flags & BENCODE_DECODE_BORROW) {
+            /* 借用模式：直接指向输入缓冲区，不复制也不追加 '\0' */
+            value->flags |= BENCODE_VALUE_BORROWED;
+            value->as.str_value.str = (char *)(s + header_len);
+            return header_len + value->as.str_value.len;
+        }
+        value->as.str_value.str = ctx_alloc(ctx, value->as.str_value.len + 1);
         if (!value->as.str_value.str) return 0;
         memcpy(value->as.str_value.str, s + header_len, value->as.str_value.len);
         value->as.str_value.str[value->as.str_value.len] = '\0';
         return header_len + value->as.str_value.len;
     } else if (s[0] == 'i') {
         /* 解析整数: i<number>e */
-        if (n < 3) return 0; // 至少 "i0e"
-        const char *e_ptr = memchr(s, 'e', n);
-        if (!e_ptr) return 0;
-        size_t len = e_ptr - s; // 不包括 'e'
-        if (len < 2) return 0;
-        size_t index = 1;
-        if (s[1] == '-') {
-            index++;
-            if (index >= len) return 0; // 无数字
-        }
-        /* 检查前导零：如果数字部分长度大于 1 且首字符为 '0' 则非法 */
-        if (s[index] == '0' && (len - index) > 1) return 0;
-        /* 检查剩余字符是否都是数字 */
-        for (size_t i = index; i < len; i++) {
-            if (!isdigit((unsigned char)s[i])) return 0;
-        }
-        char *temp = strndup(s + 1, len - 1);
-        if (!temp) return 0;
-        char *endptr;
-        long long num = strtoll(temp, &endptr, 10);
-        free(temp);
-        if (endptr == temp) return 0;
+        long long num;
+        size_t used = parse_int(s, n, &num);
+        if (used == 0) return 0;
         value->type = BENCODE_INT;
         value->as.int_value = num;
-        return (e_ptr - s) + 1;
+        return used;
     } else if (s[0] == 'l') {
         /* 解析列表: l<元素...>e */
         value->type = BENCODE_LIST;
-        size_t capacity = 8;
-        value->as.list_value.values = malloc(capacity * sizeof(struct bencode_value));
+        size_t capacity = initial_capacity(ctx, 1);
+        value->as.list_value.values = ctx_alloc(ctx, capacity * sizeof(struct bencode_value));
         if (!value->as.list_value.values) return 0;
         size_t count = 0;
         size_t offset = 1; // 跳过 'l'
         while (offset < n && s[offset] != 'e') {
             if (count >= capacity) {
+                struct bencode_value *new_values = ctx_realloc(ctx, value->as.list_value.values,
+                                                               capacity * sizeof(struct bencode_value),
+                                                               2 * capacity * sizeof(struct bencode_value));
                 capacity *= 2;
-                struct bencode_value *new_values = realloc(value->as.list_value.values, capacity * sizeof(struct bencode_value));
                 if (!new_values) {
                     for (size_t j = 0; j < count; j++) {
                         bencode_value_free(&value->as.list_value.values[j]);
                     }
-                    free(value->as.list_value.values);
+                    ctx_free(ctx, value->as.list_value.values);
                     return 0;
                 }
                 value->as.list_value.values = new_values;
             }
-            size_t consumed = decode_bencode_value(&value->as.list_value.values[count], s + offset, n - offset);
+            size_t consumed = decode_bencode_value(ctx, &value->as.list_value.values[count], s + offset, n - offset);
             if (consumed == 0) {
                 for (size_t j = 0; j < count; j++) {
                     bencode_value_free(&value->as.list_value.values[j]);
                 }
-                free(value->as.list_value.values);
+                ctx_free(ctx, value->as.list_value.values);
                 return 0;
             }
             offset += consumed;
@@ -95,7 +406,7 @@ static size_t decode_bencode_value(struct bencode_value *value, const char *s, s
             for (size_t j = 0; j < count; j++) {
                 bencode_value_free(&value->as.list_value.values[j]);
             }
-            free(value->as.list_value.values);
+            ctx_free(ctx, value->as.list_value.values);
             return 0;
         }
         offset++; // 跳过 'e'
@@ -104,39 +415,51 @@ static size_t decode_bencode_value(struct bencode_value *value, const char *s, s
     } else if (s[0] == 'd') {
         /* 解析字典: d<key><value>...e */
         value->type = BENCODE_MAP;
-        size_t capacity = 8;
-        value->as.map_value.pairs = malloc(capacity * sizeof(struct bencode_pair));
+        size_t capacity = initial_capacity(ctx, 2);
+        value->as.map_value.pairs = ctx_alloc(ctx, capacity * sizeof(struct bencode_pair));
         if (!value->as.map_value.pairs) return 0;
         size_t count = 0;
         size_t offset = 1; // 跳过 'd'
+        int sorted = 1;
         while (offset < n && s[offset] != 'e') {
             struct bencode_value key;
-            size_t consumed = decode_bencode_value(&key, s + offset, n - offset);
-            if (consumed == 0 || key.type != BENCODE_STR) {
-                bencode_value_free(&key);
+            size_t consumed = decode_bencode_value(ctx, &key, s + offset, n - offset);
+            /* BitTorrent 要求字典的 key 严格升序；记录是否有序，STRICT 模式下直接拒绝 */
+            if (consumed != 0 && key.type == BENCODE_STR && count > 0 &&
+                key_cmp(&value->as.map_value.pairs[count - 1].key,
+                        key.as.str_value.str, key.as.str_value.len) >= 0) {
+                sorted = 0;
+            }
+            if (consumed == 0 || key.type != BENCODE_STR ||
+                (!sorted && (ctx->flags & BENCODE_DECODE_STRICT))) {
+                /* 解码失败时 key 未初始化，只释放成功解码但类型错误的 key */
+                if (consumed != 0)
+                    bencode_value_free(&key);
                 for (size_t j = 0; j < count; j++) {
                     bencode_value_free(&value->as.map_value.pairs[j].key);
                     bencode_value_free(&value->as.map_value.pairs[j].value);
                 }
-                free(value->as.map_value.pairs);
+                ctx_free(ctx, value->as.map_value.pairs);
                 return 0;
             }
             offset += consumed;
             struct bencode_value val;
-            consumed = decode_bencode_value(&val, s + offset, n - offset);
+            consumed = decode_bencode_value(ctx, &val, s + offset, n - offset);
             if (consumed == 0) {
                 bencode_value_free(&key);
                 for (size_t j = 0; j < count; j++) {
                     bencode_value_free(&value->as.map_value.pairs[j].key);
                     bencode_value_free(&value->as.map_value.pairs[j].value);
                 }
-                free(value->as.map_value.pairs);
+                ctx_free(ctx, value->as.map_value.pairs);
                 return 0;
             }
             offset += consumed;
             if (count >= capacity) {
+                struct bencode_pair *new_pairs = ctx_realloc(ctx, value->as.map_value.pairs,
+                                                             capacity * sizeof(struct bencode_pair),
+                                                             2 * capacity * sizeof(struct bencode_pair));
                 capacity *= 2;
-                struct bencode_pair *new_pairs = realloc(value->as.map_value.pairs, capacity * sizeof(struct bencode_pair));
                 if (!new_pairs) {
                     bencode_value_free(&key);
                     bencode_value_free(&val);
@@ -144,7 +467,7 @@ static size_t decode_bencode_value(struct bencode_value *value, const char *s, s
                         bencode_value_free(&value->as.map_value.pairs[j].key);
                         bencode_value_free(&value->as.map_value.pairs[j].value);
                     }
-                    free(value->as.map_value.pairs);
+                    ctx_free(ctx, value->as.map_value.pairs);
                     return 0;
                 }
                 value->as.map_value.pairs = new_pairs;
@@ -158,111 +481,288 @@ static size_t decode_bencode_value(struct bencode_value *value, const char *s, s
                 bencode_value_free(&value->as.map_value.pairs[j].key);
                 bencode_value_free(&value->as.map_value.pairs[j].value);
             }
-            free(value->as.map_value.pairs);
+            ctx_free(ctx, value->as.map_value.pairs);
             return 0;
         }
         offset++; // 跳过 'e'
         value->as.map_value.count = count;
+        if (sorted)
+            value->flags |= BENCODE_VALUE_SORTED;
+        if ((ctx->flags & BENCODE_DECODE_INDEX) && count >= BENCODE_MAP_INDEX_MIN)
+            build_map_index(ctx, value, capacity);
         return offset;
     }
     return 0;
 }
 
+/* 解码一个值；BENCODE_DECODE_SPANS 时顺便记录它在输入中的字节范围 */
+static size_t decode_bencode_value(struct decode_ctx *ctx, struct bencode_value *value, const char *s, size_t n) {
+    size_t used = decode_value_body(ctx, value, s, n);
+    if (used == 0)
+        return 0;
+    if (ctx->flags & BENCODE_DECODE_SPANS) {
+        value->flags |= BENCODE_VALUE_SPAN;
+        value->span_start = (uint32_t)(s - ctx->base);
+        value->span_end = (uint32_t)(s - ctx->base + used);
+    } else {
+        value->span_start = value->span_end = 0;
+    }
+    return used;
+}
+
 size_t bencode_value_decode(struct bencode_value *value, const char *enc_val, size_t n) {
-    return decode_bencode_value(value, enc_val, n);
+    return bencode_value_decode_opts(value, enc_val, n, 0);
 }
 
-/* 编码函数：支持两种模式
-   1. 当 buf 为 NULL 时，仅计算并返回所需总长度
-   2. 当 buf 不为 NULL 时，若 n 不足返回 0，否则写入编码数据（不包含终止符） */
-size_t bencode_value_encode(const struct bencode_value *value, char *buf, size_t n) {
-    size_t total = 0;
-    int len;
+size_t bencode_value_decode_opts(struct bencode_value *value, const char *enc_val,
+                                 size_t n, unsigned flags) {
+    return bencode_value_decode_arena(value, enc_val, n, NULL, flags);
+}
+
+size_t bencode_value_decode_arena(struct bencode_value *value, const char *enc_val,
+                                  size_t n, struct bencode_arena *arena, unsigned flags) {
+    struct decode_ctx ctx = { .flags = flags, .arena = arena, .counts = NULL, .base = enc_val };
+    if ((flags & BENCODE_DECODE_SPANS) && n > UINT32_MAX)
+        return 0;
+    if ((flags & BENCODE_DECODE_EXACT) && !prescan_counts(&ctx, enc_val, n))
+        return 0;
+    size_t decoded = decode_bencode_value(&ctx, value, enc_val, n);
+    free(ctx.counts);
+    return decoded;
+}
+
+/* 整数编码后的字符数（包括负号） */
+static size_t int_digits(long long v) {
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    size_t digits = 1;
+    while (u >= 10) {
+        u /= 10;
+        digits++;
+    }
+    return digits + (v < 0);
+}
+
+/* 把无符号数写成十进制，digits 为事先算好的位数，返回写入后的位置 */
+static char *write_digits(char *p, unsigned long long u, size_t digits) {
+    char *end = p + digits;
+    do {
+        *--end = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    return p + digits;
+}
+
+/* 整棵子树编码后的字节数，只做一次自底向上的累加 */
+static size_t encoded_size(const struct bencode_value *value) {
+    size_t i, total;
     switch (value->type) {
-        case BENCODE_STR: {
-            int digits = num_digits(value->as.str_value.len);
-            total = digits + 1 + value->as.str_value.len;  // 数字字符 + ':' + 数据
-            if (buf == NULL)
-                return total;
-            if (total > n)
-                return 0;
-            char header[32];
-            len = snprintf(header, sizeof(header), "%zu:", value->as.str_value.len);
-            if (len != digits + 1)
-                return 0;
-            memcpy(buf, header, len);
-            memcpy(buf + len, value->as.str_value.str, value->as.str_value.len);
+        case BENCODE_STR:
+            return num_digits(value->as.str_value.len) + 1 + value->as.str_value.len;
+        case BENCODE_INT:
+            return int_digits(value->as.int_value) + 2;
+        case BENCODE_LIST:
+            total = 2;
+            for (i = 0; i < value->as.list_value.count; i++)
+                total += encoded_size(&value->as.list_value.values[i]);
             return total;
-        }
-        case BENCODE_INT: {
-            char temp[32];
-            /* 生成 "i%llde" 格式，不包含字符串终止符 */
-            len = snprintf(temp, sizeof(temp), "i%llde", value->as.int_value);
-            if (len <= 0)
-                return 0;
-            total = (size_t)len;
-            if (buf == NULL)
-                return total;
-            if (total > n)
-                return 0;
-            memcpy(buf, temp, total);
+        case BENCODE_MAP:
+            total = 2;
+            for (i = 0; i < value->as.map_value.count; i++) {
+                total += encoded_size(&value->as.map_value.pairs[i].key);
+                total += encoded_size(&value->as.map_value.pairs[i].value);
+            }
             return total;
+    }
+    return 0;
+}
+
+/*
+ * 写出标量或容器的开头部分（不含字符串数据和子元素），p 至少有 32 字节可用。
+ * 返回写入后的位置。
+ */
+static char *write_header(const struct bencode_value *value, char *p) {
+    switch (value->type) {
+        case BENCODE_STR: {
+            size_t len = value->as.str_value.len;
+            p = write_digits(p, len, num_digits(len));
+            *p++ = ':';
+            return p;
         }
-        case BENCODE_LIST: {
-            total = 1; // 'l'
-            size_t i;
-            for (i = 0; i < value->as.list_value.count; i++) {
-                size_t item_size = bencode_value_encode(&value->as.list_value.values[i], NULL, 0);
-                total += item_size;
-            }
-            total += 1; // 'e'
-            if (buf == NULL)
-                return total;
-            if (total > n)
-                return 0;
-            buf[0] = 'l';
-            size_t pos = 1;
-            for (i = 0; i < value->as.list_value.count; i++) {
-                size_t item_size = bencode_value_encode(&value->as.list_value.values[i], buf + pos, n - pos);
-                if (item_size == 0)
-                    return 0;
-                pos += item_size;
-            }
-            buf[pos] = 'e';
-            pos++;
-            return pos;
+        case BENCODE_INT: {
+            long long v = value->as.int_value;
+            unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+            *p++ = 'i';
+            if (v < 0)
+                *p++ = '-';
+            p = write_digits(p, u, int_digits(v) - (v < 0));
+            *p++ = 'e';
+            return p;
         }
-        case BENCODE_MAP: {
-            total = 1; // 'd'
-            size_t i;
+        case BENCODE_LIST:
+            *p++ = 'l';
+            return p;
+        case BENCODE_MAP:
+            *p++ = 'd';
+            return p;
+    }
+    return p;
+}
+
+/* 缓冲区大小已经检查过，直接写出整棵子树 */
+static char *encode_write(const struct bencode_value *value, char *p) {
+    size_t i;
+    p = write_header(value, p);
+    switch (value->type) {
+        case BENCODE_STR:
+            memcpy(p, value->as.str_value.str, value->as.str_value.len);
+            return p + value->as.str_value.len;
+        case BENCODE_INT:
+            return p;
+        case BENCODE_LIST:
+            for (i = 0; i < value->as.list_value.count; i++)
+                p = encode_write(&value->as.list_value.values[i], p);
+            *p++ = 'e';
+            return p;
+        case BENCODE_MAP:
             for (i = 0; i < value->as.map_value.count; i++) {
-                size_t key_size = bencode_value_encode(&value->as.map_value.pairs[i].key, NULL, 0);
-                size_t val_size = bencode_value_encode(&value->as.map_value.pairs[i].value, NULL, 0);
-                total += key_size + val_size;
+                p = encode_write(&value->as.map_value.pairs[i].key, p);
+                p = encode_write(&value->as.map_value.pairs[i].value, p);
             }
-            total += 1; // 'e'
-            if (buf == NULL)
-                return total;
-            if (total > n)
-                return 0;
-            buf[0] = 'd';
-            size_t pos = 1;
+            *p++ = 'e';
+            return p;
+    }
+    return p;
+}
+
+/*
+ * 先一次性算出整棵树的大小，再单遍写出：每个节点只被访问两次。
+ * buf 为 NULL 时只返回所需长度；n 不足时返回 0，不写入任何数据（不包含终止符）。
+ */
+size_t bencode_value_encode(const struct bencode_value *value, char *buf, size_t n) {
+    size_t total = encoded_size(value);
+    if (buf == NULL)
+        return total;
+    if (total == 0 || total > n)
+        return 0;
+    encode_write(value, buf);
+    return total;
+}
+
+char *bencode_value_encode_alloc(const struct bencode_value *value, size_t *len) {
+    size_t total = encoded_size(value);
+    if (total == 0)
+        return NULL;
+    char *buf = malloc(total);
+    if (!buf)
+        return NULL;
+    encode_write(value, buf);
+    if (len)
+        *len = total;
+    return buf;
+}
+
+/* 流式编码：小片段先攒到 buf 中，满了再交给回调；长字符串直接透传 */
+#define ENCODE_STREAM_BUF 4096
+
+struct encode_stream {
+    bencode_write_fn write;
+    void *ctx;
+    char buf[ENCODE_STREAM_BUF];
+    size_t used;
+    size_t total;
+    int failed;
+};
+
+static void stream_flush(struct encode_stream *es) {
+    if (es->used > 0 && !es->failed && !es->write(es->ctx, es->buf, es->used))
+        es->failed = 1;
+    es->used = 0;
+}
+
+static void stream_put(struct encode_stream *es, const char *data, size_t len) {
+    es->total += len;
+    if (es->used + len > sizeof(es->buf)) {
+        stream_flush(es);
+        if (len > sizeof(es->buf) / 2) {
+            if (!es->failed && !es->write(es->ctx, data, len))
+                es->failed = 1;
+            return;
+        }
+    }
+    memcpy(es->buf + es->used, data, len);
+    es->used += len;
+}
+
+static void encode_stream_value(struct encode_stream *es, const struct bencode_value *value) {
+    size_t i;
+    if (es->failed)
+        return;
+    char header[32];
+    stream_put(es, header, (size_t)(write_header(value, header) - header));
+    switch (value->type) {
+        case BENCODE_STR:
+            stream_put(es, value->as.str_value.str, value->as.str_value.len);
+            break;
+        case BENCODE_INT:
+            break;
+        case BENCODE_LIST:
+            for (i = 0; i < value->as.list_value.count; i++)
+                encode_stream_value(es, &value->as.list_value.values[i]);
+            stream_put(es, "e", 1);
+            break;
+        case BENCODE_MAP:
             for (i = 0; i < value->as.map_value.count; i++) {
-                size_t key_size = bencode_value_encode(&value->as.map_value.pairs[i].key, buf + pos, n - pos);
-                if (key_size == 0)
-                    return 0;
-                pos += key_size;
-                size_t val_size = bencode_value_encode(&value->as.map_value.pairs[i].value, buf + pos, n - pos);
-                if (val_size == 0)
-                    return 0;
-                pos += val_size;
+                encode_stream_value(es, &value->as.map_value.pairs[i].key);
+                encode_stream_value(es, &value->as.map_value.pairs[i].value);
             }
-            buf[pos] = 'e';
-            pos++;
-            return pos;
+            stream_put(es, "e", 1);
+            break;
+    }
+}
+
+size_t bencode_value_encode_stream(const struct bencode_value *value, bencode_write_fn write,
+                                   void *ctx) {
+    struct encode_stream *es = malloc(sizeof(struct encode_stream));
+    if (!es)
+        return 0;
+    es->write = write;
+    es->ctx = ctx;
+    es->used = 0;
+    es->total = 0;
+    es->failed = 0;
+    encode_stream_value(es, value);
+    stream_flush(es);
+    size_t total = es->failed ? 0 : es->total;
+    free(es);
+    return total;
+}
+
+/* write(2) 可能只写出一部分，或被信号打断 */
+static int fd_write_all(void *ctx, const char *data, size_t len) {
+    int fd = *(int *)ctx;
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
         }
+        data += w;
+        len -= (size_t)w;
     }
-    return 0;
+    return 1;
+}
+
+size_t bencode_value_encode_fd(const struct bencode_value *value, int fd) {
+    return bencode_value_encode_stream(value, fd_write_all, &fd);
+}
+
+const char *bencode_value_span(const struct bencode_value *value, const char *enc_val,
+                               size_t *len) {
+    if (!(value->flags & BENCODE_VALUE_SPAN))
+        return NULL;
+    *len = value->span_end - value->span_start;
+    return enc_val + value->span_start;
 }
 
 enum bencode_t bencode_value_type(const struct bencode_value *value) {
@@ -302,21 +802,61 @@ const struct bencode_value *bencode_list_get(const struct bencode_value *value,
 }
 
 const struct bencode_pair *bencode_map_lookup(const struct bencode_value *value, const char *key) {
-    if (value->type == BENCODE_MAP) {
-        for (size_t i = 0; i < value->as.map_value.count; i++) {
-            const struct bencode_value *k = &value->as.map_value.pairs[i].key;
-            if (k->type == BENCODE_STR && strcmp(k->as.str_value.str, key) == 0)
-                return &value->as.map_value.pairs[i];
+    return bencode_map_lookup_n(value, key, strlen(key));
+}
+
+const struct bencode_pair *bencode_map_lookup_n(const struct bencode_value *value, const char *key, size_t keylen) {
+    if (value->type != BENCODE_MAP)
+        return NULL;
+    const struct bencode_pair *pairs = value->as.map_value.pairs;
+    size_t count = value->as.map_value.count;
+    if (value->flags & BENCODE_VALUE_INDEXED) {
+        /* 哈希索引：期望 O(1) */
+        const uint32_t *table = map_index(value);
+        size_t mask = index_slots(count) - 1;
+        size_t slot = key_hash(key, keylen) & mask;
+        while (table[slot] != 0) {
+            const struct bencode_pair *p = &pairs[table[slot] - 1];
+            if (key_cmp(&p->key, key, keylen) == 0)
+                return p;
+            slot = (slot + 1) & mask;
         }
+        return NULL;
+    }
+    if (value->flags & BENCODE_VALUE_SORTED) {
+        /* key 有序：O(log n) 二分查找 */
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            int c = key_cmp(&pairs[mid].key, key, keylen);
+            if (c == 0)
+                return &pairs[mid];
+            if (c < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return NULL;
+    }
+    /* 无序字典（非严格解码或手工构造）：线性扫描，按长度比较 */
+    for (size_t i = 0; i < count; i++) {
+        const struct bencode_value *k = &pairs[i].key;
+        if (k->type == BENCODE_STR && key_cmp(k, key, keylen) == 0)
+            return &pairs[i];
     }
     return NULL;
 }
 
 void bencode_value_free(struct bencode_value *value) {
     size_t i;
+    /* arena 中的整棵树由 bencode_arena_reset/free 统一回收 */
+    if (value->flags & BENCODE_VALUE_ARENA)
+        return;
     switch (value->type) {
         case BENCODE_STR:
-            free(value->as.str_value.str);
+            /* 借用的字符串属于调用者的输入缓冲区，不能释放 */
+            if (!(value->flags & BENCODE_VALUE_BORROWED))
+                free(value->as.str_value.str);
             break;
         case BENCODE_LIST:
             for (i = 0; i < value->as.list_value.count; i++) {
@@ -0,0 +1,386 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "bencode_stream.h"
+
+/* 解析器状态 */
+enum stream_state {
+    ST_VALUE,     // 等待一个值的开始（或容器的 'e'）
+    ST_INT,       // 位于 'i' 之后，累加整数
+    ST_STR_LEN,   // 累加字符串长度，直到 ':'
+    ST_STR_DATA,  // 输出字符串数据
+    ST_DONE,
+    ST_ERROR,
+};
+
+/* 容器栈中每层的状态 */
+enum frame_kind {
+    FRAME_LIST = 'l',
+    FRAME_MAP_KEY = 'k',    // 字典，下一个值是 key
+    FRAME_MAP_VALUE = 'v',  // 字典，下一个值是 value
+};
+
+/* 树构建器：values 是一个值栈，保存已完成的值和尚未闭合的容器 */
+struct tree_builder {
+    struct bencode_arena *arena;
+    struct bencode_value *values;
+    size_t count;
+    size_t cap;
+    size_t frames[BENCODE_STREAM_MAX_DEPTH];  // 每个未闭合容器在 values 中的下标
+    size_t nframes;
+};
+
+struct bencode_stream {
+    struct bencode_stream_callbacks cb;
+    void *ctx;
+    enum stream_state state;
+    unsigned char stack[BENCODE_STREAM_MAX_DEPTH];
+    size_t depth;
+    /* ST_INT */
+    int neg;
+    int ndigits;
+    unsigned long long acc;
+    /* ST_STR_LEN / ST_STR_DATA */
+    size_t max_str;  // 超过这个长度的字符串视为错误
+    size_t str_total;
+    size_t str_off;
+    struct tree_builder *tree;  // 仅 bencode_stream_new_tree 创建的解析器使用
+};
+
+struct bencode_stream *bencode_stream_new(const struct bencode_stream_callbacks *callbacks,
+                                          void *ctx) {
+    struct bencode_stream *st = calloc(1, sizeof(struct bencode_stream));
+    if (!st)
+        return NULL;
+    st->cb = *callbacks;
+    st->ctx = ctx;
+    st->state = ST_VALUE;
+    st->max_str = SIZE_MAX - 1;  // 树构建器分配 total + 1 字节，不能回绕
+    return st;
+}
+
+/* 一个值结束：回到父容器，字典在 key/value 之间切换 */
+static void value_done(struct bencode_stream *st) {
+    if (st->depth == 0) {
+        st->state = ST_DONE;
+        return;
+    }
+    unsigned char *top = &st->stack[st->depth - 1];
+    if (*top == FRAME_MAP_KEY)
+        *top = FRAME_MAP_VALUE;
+    else if (*top == FRAME_MAP_VALUE)
+        *top = FRAME_MAP_KEY;
+    st->state = ST_VALUE;
+}
+
+#define EMIT(st, name, ...) \
+    ((st)->cb.name == NULL || (st)->cb.name((st)->ctx, ##__VA_ARGS__))
+
+int bencode_stream_feed(struct bencode_stream *st, const char *data, size_t n,
+                        size_t *consumed) {
+    size_t i = 0;
+    while (i < n && st->state != ST_DONE && st->state != ST_ERROR) {
+        char c = data[i];
+        switch (st->state) {
+        case ST_VALUE: {
+            unsigned char top = st->depth > 0 ? st->stack[st->depth - 1] : 0;
+            if (c == 'e' && top != 0 && top != FRAME_MAP_VALUE) {
+                st->depth--;
+                int ok = (top == FRAME_LIST) ? EMIT(st, on_list_end) : EMIT(st, on_map_end);
+                if (!ok) {
+                    st->state = ST_ERROR;
+                    break;
+                }
+                i++;
+                value_done(st);
+            } else if (top == FRAME_MAP_KEY && !(c >= '0' && c <= '9')) {
+                /* 字典的 key 必须是字符串 */
+                st->state = ST_ERROR;
+            } else if (c == 'i') {
+                st->neg = 0;
+                st->ndigits = 0;
+                st->acc = 0;
+                st->state = ST_INT;
+                i++;
+            } else if (c == 'l' || c == 'd') {
+                if (st->depth == BENCODE_STREAM_MAX_DEPTH) {
+                    st->state = ST_ERROR;
+                    break;
+                }
+                int ok = (c == 'l') ? EMIT(st, on_list_begin) : EMIT(st, on_map_begin);
+                if (!ok) {
+                    st->state = ST_ERROR;
+                    break;
+                }
+                st->stack[st->depth++] = (c == 'l') ? FRAME_LIST : FRAME_MAP_KEY;
+                i++;
+            } else if (c >= '0' && c <= '9') {
+                st->str_total = (size_t)(c - '0');
+                if (st->str_total > st->max_str) {
+                    st->state = ST_ERROR;
+                    break;
+                }
+                st->state = ST_STR_LEN;
+                i++;
+            } else {
+                st->state = ST_ERROR;
+            }
+            break;
+        }
+        case ST_INT:
+            if (c == '-' && !st->neg && st->ndigits == 0) {
+                st->neg = 1;
+                i++;
+            } else if (c >= '0' && c <= '9') {
+                /* 禁止前导零和 "-0" */
+                if ((st->ndigits > 0 && st->acc == 0) || (st->neg && st->ndigits == 0 && c == '0')) {
+                    st->state = ST_ERROR;
+                    break;
+                }
+                unsigned long long limit = st->neg ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+                unsigned d = (unsigned)(c - '0');
+                if (st->acc > (limit - d) / 10) {
+                    st->state = ST_ERROR;  // 溢出
+                    break;
+                }
+                st->acc = st->acc * 10 + d;
+                st->ndigits++;
+                i++;
+            } else if (c == 'e' && st->ndigits > 0) {
+                long long v = st->neg ? (long long)(0ULL - st->acc) : (long long)st->acc;
+                if (!EMIT(st, on_int, v)) {
+                    st->state = ST_ERROR;
+                    break;
+                }
+                i++;
+                value_done(st);
+            } else {
+                st->state = ST_ERROR;
+            }
+            break;
+        case ST_STR_LEN:
+            if (c >= '0' && c <= '9') {
+                // 长度一读到就拒绝，不等数据到达，也不会为它分配内存
+                size_t d = (size_t)(c - '0');
+                if (d > st->max_str || st->str_total > (st->max_str - d) / 10) {
+                    st->state = ST_ERROR;
+                    break;
+                }
+                st->str_total = st->str_total * 10 + d;
+                i++;
+            } else if (c == ':') {
+                i++;
+                st->str_off = 0;
+                if (st->str_total == 0) {
+                    if (!EMIT(st, on_str, data + i, 0, 0, 0)) {
+                        st->state = ST_ERROR;
+                        break;
+                    }
+                    value_done(st);
+                } else {
+                    st->state = ST_STR_DATA;
+                }
+            } else {
+                st->state = ST_ERROR;
+            }
+            break;
+        case ST_STR_DATA: {
+            /* 字符串数据整段交给回调，不逐字节处理 */
+            size_t take = st->str_total - st->str_off;
+            if (take > n - i)
+                take = n - i;
+            if (!EMIT(st, on_str, data + i, take, st->str_off, st->str_total)) {
+                st->state = ST_ERROR;
+                break;
+            }
+            st->str_off += take;
+            i += take;
+            if (st->str_off == st->str_total)
+                value_done(st);
+            break;
+        }
+        case ST_DONE:
+        case ST_ERROR:
+            break;
+        }
+    }
+    if (consumed)
+        *consumed = i;
+    if (st->state == ST_ERROR)
+        return BENCODE_STREAM_ERROR;
+    return st->state == ST_DONE ? BENCODE_STREAM_DONE : BENCODE_STREAM_MORE;
+}
+
+/* ---------- 树构建器 ---------- */
+
+static void *tree_alloc(struct tree_builder *tb, size_t size) {
+    return tb->arena ? bencode_arena_alloc(tb->arena, size) : malloc(size);
+}
+
+/* 在值栈上压入一个新值，返回其指针（下一次压栈前有效） */
+static struct bencode_value *tree_push(struct tree_builder *tb, enum bencode_t type) {
+    if (tb->count == tb->cap) {
+        size_t cap = tb->cap ? tb->cap * 2 : 16;
+        struct bencode_value *nv = realloc(tb->values, cap * sizeof(struct bencode_value));
+        if (!nv)
+            return NULL;
+        tb->values = nv;
+        tb->cap = cap;
+    }
+    struct bencode_value *v = &tb->values[tb->count++];
+    memset(v, 0, sizeof(*v));
+    v->type = type;
+    v->flags = tb->arena ? BENCODE_VALUE_ARENA : 0;
+    return v;
+}
+
+static int tree_on_int(void *ctx, long long value) {
+    struct bencode_value *v = tree_push(ctx, BENCODE_INT);
+    if (!v)
+        return 0;
+    v->as.int_value = value;
+    return 1;
+}
+
+static int tree_on_str(void *ctx, const char *data, size_t len, size_t offset, size_t total) {
+    struct tree_builder *tb = ctx;
+    struct bencode_value *v;
+    if (offset == 0) {
+        v = tree_push(tb, BENCODE_STR);
+        if (!v)
+            return 0;
+        v->as.str_value.str = tree_alloc(tb, total + 1);
+        if (!v->as.str_value.str) {
+            tb->count--;
+            return 0;
+        }
+        v->as.str_value.len = total;
+        v->as.str_value.str[total] = '\0';
+    } else {
+        /* 后续片段：字符串总是值栈顶的元素 */
+        v = &tb->values[tb->count - 1];
+    }
+    memcpy(v->as.str_value.str + offset, data, len);
+    return 1;
+}
+
+static int tree_begin(struct tree_builder *tb, enum bencode_t type) {
+    if (!tree_push(tb, type))
+        return 0;
+    tb->frames[tb->nframes++] = tb->count - 1;
+    return 1;
+}
+
+static int tree_on_list_begin(void *ctx) {
+    return tree_begin(ctx, BENCODE_LIST);
+}
+
+static int tree_on_map_begin(void *ctx) {
+    return tree_begin(ctx, BENCODE_MAP);
+}
+
+/*
+ * 容器闭合：子元素已经连续排列在值栈上，一次性分配精确大小的数组并搬移过去。
+ * struct bencode_pair 就是相邻的 key/value 两个 bencode_value，所以字典同样可以直接拷贝。
+ */
+static struct bencode_value *tree_end(struct tree_builder *tb, size_t *nchildren, void **array) {
+    size_t base = tb->frames[--tb->nframes];
+    size_t k = tb->count - base - 1;
+    void *arr = NULL;
+    if (k > 0) {
+        arr = tree_alloc(tb, k * sizeof(struct bencode_value));
+        if (!arr) {
+            tb->nframes++;
+            return NULL;
+        }
+        memcpy(arr, &tb->values[base + 1], k * sizeof(struct bencode_value));
+    }
+    tb->count = base + 1;
+    *nchildren = k;
+    *array = arr;
+    return &tb->values[base];
+}
+
+static int tree_on_list_end(void *ctx) {
+    size_t k;
+    void *arr;
+    struct bencode_value *v = tree_end(ctx, &k, &arr);
+    if (!v)
+        return 0;
+    v->as.list_value.values = arr;
+    v->as.list_value.count = k;
+    return 1;
+}
+
+/* 检查字典 key 是否严格升序，有序时 bencode_map_lookup 可以二分查找 */
+static int pairs_sorted(const struct bencode_pair *pairs, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        const struct bencode_value *a = &pairs[i - 1].key, *b = &pairs[i].key;
+        size_t la = a->as.str_value.len, lb = b->as.str_value.len;
+        int c = memcmp(a->as.str_value.str, b->as.str_value.str, la < lb ? la : lb);
+        if (c > 0 || (c == 0 && la >= lb))
+            return 0;
+    }
+    return 1;
+}
+
+static int tree_on_map_end(void *ctx) {
+    size_t k;
+    void *arr;
+    struct bencode_value *v = tree_end(ctx, &k, &arr);
+    if (!v)
+        return 0;
+    v->as.map_value.pairs = arr;
+    v->as.map_value.count = k / 2;
+    if (pairs_sorted(arr, k / 2))
+        v->flags |= BENCODE_VALUE_SORTED;
+    return 1;
+}
+
+struct bencode_stream *bencode_stream_new_tree(struct bencode_arena *arena, size_t max_str_len) {
+    static const struct bencode_stream_callbacks tree_callbacks = {
+        .on_int = tree_on_int,
+        .on_str = tree_on_str,
+        .on_list_begin = tree_on_list_begin,
+        .on_list_end = tree_on_list_end,
+        .on_map_begin = tree_on_map_begin,
+        .on_map_end = tree_on_map_end,
+    };
+    struct tree_builder *tb = calloc(1, sizeof(struct tree_builder));
+    if (!tb)
+        return NULL;
+    tb->arena = arena;
+    struct bencode_stream *st = bencode_stream_new(&tree_callbacks, tb);
+    if (!st) {
+        free(tb);
+        return NULL;
+    }
+    st->tree = tb;
+    if (max_str_len > 0 && max_str_len < st->max_str)
+        st->max_str = max_str_len;
+    return st;
+}
+
+int bencode_stream_take(struct bencode_stream *stream, struct bencode_value *value) {
+    struct tree_builder *tb = stream->tree;
+    if (!tb || stream->state != ST_DONE || tb->count != 1)
+        return 0;
+    *value = tb->values[0];
+    tb->count = 0;
+    return 1;
+}
+
+void bencode_stream_free(struct bencode_stream *stream) {
+    if (!stream)
+        return;
+    struct tree_builder *tb = stream->tree;
+    if (tb) {
+        /* 未闭合容器的子元素仍在值栈上，容器本身的数组为空，逐个释放即可 */
+        for (size_t i = 0; i < tb->count; i++)
+            bencode_value_free(&tb->values[i]);
+        free(tb->values);
+        free(tb);
+    }
+    free(stream);
+}
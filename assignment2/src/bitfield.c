@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "bitfield.h"
+
+int bitfield_init(struct bitfield *bf, size_t count) {
+    bf->count = count;
+    bf->bytes = (count + 7) / 8;
+    // 至少分配一个 SIMD 字，空种子也有合法的指针
+    bf->padded = (bf->bytes + BITFIELD_ALIGN - 1) / BITFIELD_ALIGN * BITFIELD_ALIGN;
+    if (bf->padded == 0)
+        bf->padded = BITFIELD_ALIGN;
+    bf->bits = aligned_alloc(BITFIELD_ALIGN, bf->padded);
+    if (!bf->bits)
+        return 0;
+    memset(bf->bits, 0, bf->padded);
+    return 1;
+}
+
+void bitfield_free(struct bitfield *bf) {
+    free(bf->bits);
+    bf->bits = NULL;
+    bf->count = bf->bytes = bf->padded = 0;
+}
+
+/* 最后一个字节中属于片段的位，其余的位必须保持为 0 */
+static uint8_t last_byte_mask(const struct bitfield *bf) {
+    return bf->count % 8 ? (uint8_t)(0xff << (8 - bf->count % 8)) : 0xff;
+}
+
+void bitfield_fill(struct bitfield *bf, int value) {
+    memset(bf->bits, 0, bf->padded);
+    if (!value || bf->bytes == 0)
+        return;
+    memset(bf->bits, 0xff, bf->bytes);
+    bf->bits[bf->bytes - 1] = last_byte_mask(bf);
+}
+
+/* 按大端读 8 个字节：片段 64 * w 落在最高位，用 clz 就能得到片段号 */
+static inline uint64_t load_be64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline size_t popcount64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (size_t)__builtin_popcountll(v);
+}
+
+size_t bitfield_popcount(const struct bitfield *bf) {
+    size_t n = 0;
+    // 填充部分全是 0，可以直接按整字统计
+    for (size_t i = 0; i < bf->padded; i += 8)
+        n += popcount64(bf->bits + i);
+    return n;
+}
+
+/*
+ * 三种集合运算共用同一个循环，一次处理 BITFIELD_ALIGN 字节。
+ * 缓冲区对齐且长度是 BITFIELD_ALIGN 的倍数，所以不需要处理尾部。
+ */
+enum bitfield_op { OP_AND, OP_OR, OP_ANDNOT };
+
+static size_t bitfield_apply(struct bitfield *dst, const struct bitfield *a,
+                             const struct bitfield *b, enum bitfield_op op, int count) {
+    size_t n = 0;
+    for (size_t i = 0; i < dst->padded; i += BITFIELD_ALIGN) {
+#if defined(__SSE2__)
+        for (size_t j = i; j < i + BITFIELD_ALIGN; j += 16) {
+            __m128i va = _mm_load_si128((const __m128i *)(a->bits + j));
+            __m128i vb = _mm_load_si128((const __m128i *)(b->bits + j));
+            __m128i r;
+            if (op == OP_AND)
+                r = _mm_and_si128(va, vb);
+            else if (op == OP_OR)
+                r = _mm_or_si128(va, vb);
+            else
+                r = _mm_andnot_si128(vb, va);  // andnot(x, y) = ~x & y
+            _mm_store_si128((__m128i *)(dst->bits + j), r);
+            if (count)
+                n += popcount64(dst->bits + j) + popcount64(dst->bits + j + 8);
+        }
+#else
+        for (size_t j = i; j < i + BITFIELD_ALIGN; j += 8) {
+            uint64_t va, vb, r;
+            memcpy(&va, a->bits + j, 8);
+            memcpy(&vb, b->bits + j, 8);
+            r = op == OP_AND ? va & vb : op == OP_OR ? va | vb : va & ~vb;
+            memcpy(dst->bits + j, &r, 8);
+            if (count)
+                n += (size_t)__builtin_popcountll(r);
+        }
+#endif
+    }
+    return n;
+}
+
+void bitfield_and(struct bitfield *dst, const struct bitfield *a, const struct bitfield *b) {
+    bitfield_apply(dst, a, b, OP_AND, 0);
+}
+
+void bitfield_or(struct bitfield *dst, const struct bitfield *a, const struct bitfield *b) {
+    bitfield_apply(dst, a, b, OP_OR, 0);
+}
+
+size_t bitfield_andnot(struct bitfield *dst, const struct bitfield *a, const struct bitfield *b) {
+    return bitfield_apply(dst, a, b, OP_ANDNOT, 1);
+}
+
+int bitfield_any_andnot(const struct bitfield *a, const struct bitfield *b) {
+    for (size_t i = 0; i < a->padded; i += 16) {
+#if defined(__SSE2__)
+        __m128i va = _mm_load_si128((const __m128i *)(a->bits + i));
+        __m128i vb = _mm_load_si128((const __m128i *)(b->bits + i));
+        __m128i r = _mm_andnot_si128(vb, va);
+        // 16 个字节都为 0 时 movemask 为 0xffff
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(r, _mm_setzero_si128())) != 0xffff)
+            return 1;
+#else
+        for (size_t j = i; j < i + 16; j += 8) {
+            uint64_t va, vb;
+            memcpy(&va, a->bits + j, 8);
+            memcpy(&vb, b->bits + j, 8);
+            if (va & ~vb)
+                return 1;
+        }
+#endif
+    }
+    return 0;
+}
+
+/* invert 为 1 时查找值为 0 的位 */
+static size_t find_next(const struct bitfield *bf, size_t from, int invert) {
+    if (from >= bf->count)
+        return bf->count;
+    uint64_t flip = invert ? ~(uint64_t)0 : 0;
+    size_t w = from / 64;
+    uint64_t word = (load_be64(bf->bits + w * 8) ^ flip) & (~(uint64_t)0 >> (from % 64));
+    for (;;) {
+        if (word) {
+            size_t i = w * 64 + (size_t)__builtin_clzll(word);
+            // 取反查找时，末尾的空闲位也是 0，可能越过 count
+            return i < bf->count ? i : bf->count;
+        }
+        if (++w * 8 >= bf->bytes)
+            return bf->count;
+        word = load_be64(bf->bits + w * 8) ^ flip;
+    }
+}
+
+size_t bitfield_find_next(const struct bitfield *bf, size_t from) {
+    return find_next(bf, from, 0);
+}
+
+size_t bitfield_find_next_clear(const struct bitfield *bf, size_t from) {
+    return find_next(bf, from, 1);
+}
+
+int bitfield_from_wire(struct bitfield *bf, const uint8_t *payload, size_t len) {
+    if (len != bf->bytes)
+        return 0;
+    if (len > 0 && (payload[len - 1] & (uint8_t)~last_byte_mask(bf)))
+        return 0;
+    memcpy(bf->bits, payload, len);
+    return 1;
+}
+
+size_t bitfield_wire_size(const struct bitfield *bf) {
+    return 5 + bf->bytes;
+}
+
+size_t bitfield_to_wire(const struct bitfield *bf, uint8_t *buf) {
+    uint32_t len = (uint32_t)(1 + bf->bytes);
+    // <长度前缀，大端><消息 id><位图>
+    buf[0] = (uint8_t)(len >> 24);
+    buf[1] = (uint8_t)(len >> 16);
+    buf[2] = (uint8_t)(len >> 8);
+    buf[3] = (uint8_t)len;
+    buf[4] = BITFIELD_MSG_ID;
+    memcpy(buf + 5, bf->bits, bf->bytes);
+    return 5 + bf->bytes;
+}
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_tracker.h"
+#include "piece_assembler.h"
+#include "storage.h"
+
+/* 一个正在下载的片段和发出去的请求 */
+struct tracked_piece {
+    size_t index;
+    size_t length;
+    size_t blocks;
+    size_t received_count;
+    size_t open;             // 既没收到、也没有人请求的块
+    uint8_t *received;       // 按块号索引
+    uint8_t *requested;      // 每个块有几个请求在等待
+    struct block_request *reqs;
+    size_t nreqs;
+    size_t reqs_capacity;
+};
+
+struct block_tracker {
+    const struct metainfo_file *torrent;
+    struct piece_picker *picker;
+    // 同时下载的片段不多，线性查找足够
+    struct tracked_piece **pieces;
+    size_t count;
+    size_t capacity;
+    block_cancel_fn cancel;
+    void *cancel_ctx;
+    int endgame;
+    size_t outstanding;
+    uint64_t duplicate_bytes;
+};
+
+struct block_tracker *block_tracker_new(const struct metainfo_file *torrent,
+                                        struct piece_picker *picker) {
+    struct block_tracker *bt = calloc(1, sizeof(struct block_tracker));
+    if (!bt)
+        return NULL;
+    bt->torrent = torrent;
+    bt->picker = picker;
+    bt->endgame = 1;
+    return bt;
+}
+
+static void tracked_piece_free(struct tracked_piece *tp) {
+    free(tp->received);
+    free(tp->requested);
+    free(tp->reqs);
+    free(tp);
+}
+
+void block_tracker_free(struct block_tracker *bt) {
+    if (!bt)
+        return;
+    for (size_t i = 0; i < bt->count; i++)
+        tracked_piece_free(bt->pieces[i]);
+    free(bt->pieces);
+    free(bt);
+}
+
+void block_tracker_set_cancel(struct block_tracker *bt, block_cancel_fn cancel, void *ctx) {
+    bt->cancel = cancel;
+    bt->cancel_ctx = ctx;
+}
+
+void block_tracker_set_endgame(struct block_tracker *bt, int enabled) {
+    bt->endgame = enabled;
+}
+
+static struct tracked_piece *find_piece(const struct block_tracker *bt, size_t piece) {
+    for (size_t i = 0; i < bt->count; i++) {
+        if (bt->pieces[i]->index == piece)
+            return bt->pieces[i];
+    }
+    return NULL;
+}
+
+static struct tracked_piece *add_piece(struct block_tracker *bt, size_t piece) {
+    if (bt->count == bt->capacity) {
+        size_t capacity = bt->capacity ? bt->capacity * 2 : 8;
+        struct tracked_piece **pieces = realloc(bt->pieces, capacity * sizeof(struct tracked_piece *));
+        if (!pieces)
+            return NULL;
+        bt->pieces = pieces;
+        bt->capacity = capacity;
+    }
+    struct tracked_piece *tp = calloc(1, sizeof(struct tracked_piece));
+    if (!tp)
+        return NULL;
+    tp->index = piece;
+    tp->length = storage_piece_size(bt->torrent, piece);
+    tp->blocks = (tp->length + PIECE_BLOCK_SIZE - 1) / PIECE_BLOCK_SIZE;
+    tp->open = tp->blocks;
+    tp->received = calloc(tp->blocks ? tp->blocks : 1, 1);
+    tp->requested = calloc(tp->blocks ? tp->blocks : 1, 1);
+    if (!tp->received || !tp->requested) {
+        tracked_piece_free(tp);
+        return NULL;
+    }
+    bt->pieces[bt->count++] = tp;
+    return tp;
+}
+
+/* 删除片段，用最后一个填补空位；剩下的请求都作废 */
+static void remove_piece(struct block_tracker *bt, struct tracked_piece *tp) {
+    for (size_t i = 0; i < bt->count; i++) {
+        if (bt->pieces[i] == tp) {
+            bt->pieces[i] = bt->pieces[--bt->count];
+            break;
+        }
+    }
+    bt->outstanding -= tp->nreqs;
+    tracked_piece_free(tp);
+}
+
+static uint32_t block_length(const struct tracked_piece *tp, size_t b) {
+    return (uint32_t)(b == tp->blocks - 1 ? tp->length - b * PIECE_BLOCK_SIZE : PIECE_BLOCK_SIZE);
+}
+
+static int add_request(struct block_tracker *bt, struct tracked_piece *tp, int peer, size_t b,
+                       struct block_request *req) {
+    if (tp->nreqs == tp->reqs_capacity) {
+        size_t capacity = tp->reqs_capacity ? tp->reqs_capacity * 2 : 16;
+        struct block_request *reqs = realloc(tp->reqs, capacity * sizeof(struct block_request));
+        if (!reqs)
+            return 0;
+        tp->reqs = reqs;
+        tp->reqs_capacity = capacity;
+    }
+    req->peer = peer;
+    req->piece = (uint32_t)tp->index;
+    req->begin = (uint32_t)(b * PIECE_BLOCK_SIZE);
+    req->length = block_length(tp, b);
+    tp->reqs[tp->nreqs++] = *req;
+    if (tp->requested[b]++ == 0)
+        tp->open--;
+    bt->outstanding++;
+    return 1;
+}
+
+/* 删除第 i 个请求，用最后一个填补空位 */
+static void remove_request(struct block_tracker *bt, struct tracked_piece *tp, size_t i) {
+    size_t b = tp->reqs[i].begin / PIECE_BLOCK_SIZE;
+    tp->reqs[i] = tp->reqs[--tp->nreqs];
+    if (--tp->requested[b] == 0 && !tp->received[b])
+        tp->open++;
+    bt->outstanding--;
+}
+
+static int requested_by(const struct tracked_piece *tp, int peer, size_t b) {
+    for (size_t i = 0; i < tp->nreqs; i++) {
+        if (tp->reqs[i].peer == peer && tp->reqs[i].begin == b * PIECE_BLOCK_SIZE)
+            return 1;
+    }
+    return 0;
+}
+
+static int request_open(struct block_tracker *bt, struct tracked_piece *tp, int peer,
+                        struct block_request *req) {
+    for (size_t b = 0; b < tp->blocks; b++) {
+        if (!tp->received[b] && tp->requested[b] == 0)
+            return add_request(bt, tp, peer, b, req);
+    }
+    return 0;
+}
+
+/* 请求次数最少、这个 peer 还没请求过的块，没有就返回 blocks */
+static size_t least_requested(const struct tracked_piece *tp, int peer) {
+    size_t best = tp->blocks;
+    for (size_t b = 0; b < tp->blocks; b++) {
+        if (tp->received[b] || tp->requested[b] >= BLOCK_TRACKER_MAX_REQUESTS ||
+            requested_by(tp, peer, b))
+            continue;
+        if (best == tp->blocks || tp->requested[b] < tp->requested[best])
+            best = b;
+    }
+    return best;
+}
+
+int block_tracker_next(struct block_tracker *bt, int peer, const struct bitfield *peer_has,
+                       unsigned flags, struct block_request *req) {
+    // 先把已经在下载的片段请求完，片段越早完成越早能上传给别人
+    for (size_t i = 0; i < bt->count; i++) {
+        struct tracked_piece *tp = bt->pieces[i];
+        if (tp->open > 0 && bitfield_get(peer_has, tp->index))
+            return request_open(bt, tp, peer, req);
+    }
+
+    if (!piece_picker_in_endgame(bt->picker)) {
+        size_t p = piece_picker_pick_flags(bt->picker, peer_has, flags);
+        if (p != PIECE_PICKER_NONE) {
+            struct tracked_piece *tp = find_piece(bt, p);
+            if (!tp) {
+                tp = add_piece(bt, p);
+                if (!tp) {
+                    piece_picker_abort(bt->picker, p);
+                    return 0;
+                }
+                return request_open(bt, tp, peer, req);
+            }
+            // 流式下载时快的 peer 会再次拿到临近截止的片段：重复请求其中的块
+            size_t b = least_requested(tp, peer);
+            if (b < tp->blocks)
+                return add_request(bt, tp, peer, b, req);
+            piece_picker_abort(bt->picker, p);
+        }
+    }
+
+    if (!bt->endgame || !block_tracker_in_endgame(bt))
+        return 0;
+    // endgame：在对方拥有的片段里找请求次数最少的块
+    struct tracked_piece *best_tp = NULL;
+    size_t best = 0;
+    for (size_t i = 0; i < bt->count; i++) {
+        struct tracked_piece *tp = bt->pieces[i];
+        if (!bitfield_get(peer_has, tp->index))
+            continue;
+        size_t b = least_requested(tp, peer);
+        if (b < tp->blocks && (!best_tp || tp->requested[b] < best_tp->requested[best])) {
+            best_tp = tp;
+            best = b;
+        }
+    }
+    return best_tp ? add_request(bt, best_tp, peer, best, req) : 0;
+}
+
+enum block_tracker_result block_tracker_received(struct block_tracker *bt, int peer, size_t piece,
+                                                 uint32_t begin, uint32_t length) {
+    struct tracked_piece *tp = find_piece(bt, piece);
+    if (!tp) {
+        // 片段已经完成：这是一个晚到的重复块
+        if (piece >= metainfo_file_pieces_count(bt->torrent))
+            return BLOCK_TRACKER_INVALID;
+        bt->duplicate_bytes += length;
+        return BLOCK_TRACKER_DUPLICATE;
+    }
+    size_t b = begin / PIECE_BLOCK_SIZE;
+    if (begin % PIECE_BLOCK_SIZE || b >= tp->blocks || length != block_length(tp, b))
+        return BLOCK_TRACKER_INVALID;
+
+    for (size_t i = 0; i < tp->nreqs; i++) {
+        if (tp->reqs[i].peer == peer && tp->reqs[i].begin == begin) {
+            remove_request(bt, tp, i);
+            break;
+        }
+    }
+    if (tp->received[b]) {
+        bt->duplicate_bytes += length;
+        return BLOCK_TRACKER_DUPLICATE;
+    }
+    tp->received[b] = 1;
+    tp->received_count++;
+    if (tp->requested[b] == 0)
+        tp->open--;
+
+    // 同一个块发给其他 peer 的请求都取消掉
+    for (size_t i = 0; i < tp->nreqs;) {
+        if (tp->reqs[i].begin == begin) {
+            struct block_request req = tp->reqs[i];
+            remove_request(bt, tp, i);
+            if (bt->cancel)
+                bt->cancel(bt->cancel_ctx, &req);
+        } else {
+            i++;
+        }
+    }
+
+    if (tp->received_count < tp->blocks)
+        return BLOCK_TRACKER_ACCEPTED;
+    remove_piece(bt, tp);
+    return BLOCK_TRACKER_COMPLETE;
+}
+
+void block_tracker_drop_peer(struct block_tracker *bt, int peer) {
+    for (size_t k = 0; k < bt->count; k++) {
+        struct tracked_piece *tp = bt->pieces[k];
+        for (size_t i = 0; i < tp->nreqs;) {
+            if (tp->reqs[i].peer == peer)
+                remove_request(bt, tp, i);
+            else
+                i++;
+        }
+    }
+}
+
+int block_tracker_in_endgame(const struct block_tracker *bt) {
+    if (!piece_picker_in_endgame(bt->picker))
+        return 0;
+    for (size_t i = 0; i < bt->count; i++) {
+        if (bt->pieces[i]->open > 0)
+            return 0;
+    }
+    return 1;
+}
+
+size_t block_tracker_outstanding(const struct block_tracker *bt) {
+    return bt->outstanding;
+}
+
+uint64_t block_tracker_duplicate_bytes(const struct block_tracker *bt) {
+    return bt->duplicate_bytes;
+}
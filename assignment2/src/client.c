@@ -1,5 +1,16 @@
 #include <client.h>
 #include <bencode.h>
+#include <bencode_stream.h>
+#include <verify.h>
+#include <storage.h>
+#include <resume.h>
+#include <bitfield.h>
+#include <piece_picker.h>
+#include <block_tracker.h>
+#include <reactor.h>
+#include <peer_engine.h>
+#include <peer_table.h>
+#include <handoff_queue.h>
 #include <metainfo.h>
 #include <peer.h>
 #include <stdio.h>
@@ -13,6 +24,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <netdb.h>
 #include <curl/curl.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -25,52 +37,175 @@ struct client {
     size_t downloaded;        // 已下载字节数（经过验证或实际文件大小）
     size_t left;              // 剩余需要下载的字节数
     struct metainfo_file *torrent; // 指向 torrent 文件结构
-    int *peers;               // 动态数组，保存已连接 peer 的 socket fd
-    size_t num_peers;         // 已连接 peer 数量
+    struct peer_table *peers; // 已连接的 peer，包括 peer engine 的连接；各线程并发增删，无需加锁
     pthread_t listener_thread; // 监听线程句柄
     int listener_running;     // 标志是否正在运行监听线程
     int listener_sockfd;      // 监听 socket
+    struct bencode_arena *tracker_arena; // tracker 响应解码用的 arena，每次请求后整体 reset
+    struct bitfield have;     // 已验证片段的集合，布局与 peer wire 协议的 bitfield 消息一致
+    char *resume_path;        // fast-resume 文件路径，NULL 表示不使用
+    struct piece_picker *picker; // 下载时选择片段，稀有优先；流式播放时截止窗口优先
+    struct block_tracker *blocks; // 在下载的片段中每个块的请求，endgame 时重复请求
+    struct reactor *reactor;  // 单线程事件循环，所有 peer socket 都注册在这里
+    struct peer_engine *engine; // 非阻塞的 handshake 和消息收发
+    struct handoff_queue *incoming; // 监听线程完成 handshake 的连接，由事件循环取出
+    // 域名形式的 peer 地址由解析线程解析，第一次遇到时才启动线程和管道
+    pthread_t resolver_thread;
+    int resolver_running;
+    int resolver_stop;
+    pthread_mutex_t resolve_lock;   // 保护 resolve_head、resolve_tail 和 resolver_stop
+    pthread_cond_t resolve_cond;
+    struct resolve_req *resolve_head;
+    struct resolve_req *resolve_tail;
+    int resolved_fds[2];            // 解析结果：线程写入 [1]，事件循环从 [0] 读出后发起连接
 };
 
+/* 等待解析的域名 */
+struct resolve_req {
+    struct resolve_req *next;
+    uint16_t port;
+    char host[];
+};
+
+/* 管道里的一条解析结果，小于 PIPE_BUF，写入是原子的 */
+struct resolved_addr {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+
+/* 统计位图中已验证片段的总字节数 */
+static size_t have_bytes(const struct metainfo_file *torrent, const struct bitfield *have) {
+    size_t bytes = 0;
+    for (size_t i = bitfield_find_next(have, 0); i < have->count; i = bitfield_find_next(have, i + 1))
+        bytes += storage_piece_size(torrent, i);
+    return bytes;
+}
+
 /*
- * 辅助函数 validate_piece：
- * 从文件中读取第 piece_index 个片段，读取长度为 piece_len，
- * full_piece_length 用于计算该片段在文件中的起始偏移（始终以 torrent->info.piece_length 为单位），
- * 计算 SHA1 后与 expected_hash 比较，相符则返回 piece_len，否则返回 0。
+ * 验证已有数据：有可用的 resume 文件时，只重新验证元数据发生变化的文件所覆盖的片段；
+ * 否则（或 force_recheck）验证全部片段。返回 0 表示验证线程无法启动。
  */
-static size_t validate_piece(FILE *fp, size_t piece_index, size_t piece_len, size_t full_piece_length, const char *expected_hash) {
-    size_t offset = piece_index * full_piece_length;
-    if (fseek(fp, offset, SEEK_SET) != 0)
-        return 0;
-    char *buffer = malloc(piece_len);
-    if (!buffer)
-        return 0;
-    size_t read_bytes = fread(buffer, 1, piece_len, fp);
-    if (read_bytes != piece_len) {
-        free(buffer);
-        return 0;
+static int client_verify(struct client *c, const struct client_options *opts) {
+    const struct metainfo_file *torrent = c->torrent;
+    size_t have_len = (metainfo_file_pieces_count(torrent) + 7) / 8;
+    struct verify_options vopts = { 0 };
+    uint8_t *stale = NULL;
+    if (opts && opts->resume_path && !opts->force_recheck) {
+        stale = malloc(have_len ? have_len : 1);
+        if (stale && resume_load(opts->resume_path, torrent, c->have.bits, stale))
+            vopts.only = stale;
     }
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((unsigned char *)buffer, piece_len, hash);
-    free(buffer);
-    if (memcmp(hash, expected_hash, SHA_DIGEST_LENGTH) == 0)
-        return piece_len;
-    else
-        return 0;
+    // 没有可用的 resume 文件时 only 为 NULL，验证全部片段
+    size_t r = verify_torrent(torrent, c->have.bits, &vopts);
+    free(stale);
+    return r != (size_t)-1;
+}
+
+/* 每个完成 handshake 的连接的状态 */
+struct conn_state {
+    struct bitfield has;   // 对方拥有的片段
+    peer_handle_t handle;  // 在 client->peers 中的句柄
+};
+
+/*
+ * peer engine 的回调。每个完成 handshake 的连接登记到 peers 表中，并带一个对方的位图，
+ * 一开始为空并计入 picker，之后随 bitfield 和 have 消息更新。
+ */
+static void engine_ready(void *ctx, struct peer_conn *conn) {
+    struct client *c = ctx;
+    struct conn_state *st = malloc(sizeof(struct conn_state));
+    if (!st || !bitfield_init(&st->has, c->have.count)) {
+        free(st);
+        peer_conn_close(conn);
+        return;
+    }
+    st->handle = peer_table_insert(c->peers, peer_conn_fd(conn), conn);
+    if (st->handle == PEER_HANDLE_NONE) {
+        bitfield_free(&st->has);
+        free(st);
+        peer_conn_close(conn);
+        return;
+    }
+    peer_conn_set_user(conn, st);
+    piece_picker_add_peer(c->picker, &st->has);
+    // 一个片段都没有时可以不发 bitfield
+    if (bitfield_popcount(&c->have) > 0) {
+        struct peer_msg msg = { .id = PEER_MSG_BITFIELD, .payload = c->have.bits,
+                                .payload_len = c->have.bytes };
+        peer_conn_send(conn, &msg);
+    }
+}
+
+static int engine_message(void *ctx, struct peer_conn *conn, const struct peer_msg *msg) {
+    struct client *c = ctx;
+    struct conn_state *st = peer_conn_user(conn);
+    struct bitfield *has = &st->has;
+    switch (msg->id) {
+    case PEER_MSG_BITFIELD:
+        // 先撤下旧的位图再计入新的，重复的 bitfield 消息也不会多算
+        piece_picker_remove_peer(c->picker, has);
+        if (!bitfield_from_wire(has, msg->payload, msg->payload_len)) {
+            bitfield_fill(has, 0);
+            return 0;
+        }
+        piece_picker_add_peer(c->picker, has);
+        break;
+    case PEER_MSG_HAVE:
+        if (msg->index >= has->count)
+            return 0;
+        if (!bitfield_get(has, msg->index)) {
+            bitfield_set(has, msg->index);
+            piece_picker_peer_have(c->picker, msg->index);
+        }
+        break;
+    }
+    return 1;
+}
+
+static void engine_closed(void *ctx, struct peer_conn *conn) {
+    struct client *c = ctx;
+    struct conn_state *st = peer_conn_user(conn);
+    if (!st)
+        return;
+    // client_remove_peer 可能已经先把它从表中删掉了
+    peer_table_remove(c->peers, st->handle, NULL);
+    piece_picker_remove_peer(c->picker, &st->has);
+    bitfield_free(&st->has);
+    free(st);
+}
+
+static const struct peer_engine_ops engine_ops = {
+    .ready = engine_ready,
+    .message = engine_message,
+    .closed = engine_closed,
+};
+
+/* incoming 队列非空时在事件循环中调用：先清除唤醒，再取空队列 */
+static void on_incoming(void *arg, int fd, unsigned events) {
+    struct client *c = arg;
+    struct handoff item;
+    (void)fd;
+    (void)events;
+    handoff_queue_clear_wakeup(c->incoming);
+    while (handoff_queue_pop(c->incoming, &item))
+        peer_engine_adopt(c->engine, item.fd, item.peer_id);
+}
+
+struct client *client_new(struct metainfo_file *torrent, uint16_t port) {
+    return client_new_opts(torrent, port, NULL);
 }
 
 /*
  * client_new: 创建并初始化一个 client 对象
  *
  * 1. 分配内存并生成随机的 20字节 peer id。
- * 2. 打开 torrent->info.name 指定的文件：
- *    - 如果文件存在，则读取实际大小 actual_size，并验证文件内容：
- *         若实际大小达到 torrent->info.length，则遍历所有片段验证；
- *         否则仅验证文件中完整存在的片段。
- *    - 如果文件不存在，则创建一个空文件，downloaded = 0。
- * 3. 设置 left = torrent->info.length - valid_downloaded。
+ * 2. 用 storage_create 创建缺少的文件和目录（可选稀疏或完整预分配）。已有文件不会被截短，
+ *    数据也不会改动；多文件种子的 info.name 是目录，目录存在并不代表每个文件都存在。
+ * 3. 用 verify_torrent 多线程验证所有片段（文件中不完整的片段读取失败，自然不会通过验证），
+ *    结果记录在 have 位图中，left = torrent->info.length - valid_downloaded。
  */
-struct client *client_new(struct metainfo_file *torrent, uint16_t port) {
+struct client *client_new_opts(struct metainfo_file *torrent, uint16_t port,
+                               const struct client_options *opts) {
     struct client *c = malloc(sizeof(struct client));
     if (!c)
         return NULL;
@@ -81,68 +216,90 @@ struct client *client_new(struct metainfo_file *torrent, uint16_t port) {
     c->uploaded = 0;
     c->downloaded = 0;
     c->left = torrent->info.length;
-    c->peers = NULL;
-    c->num_peers = 0;
     c->listener_running = 0;
     c->listener_sockfd = -1;
+    c->resolved_fds[0] = c->resolved_fds[1] = -1;
+    pthread_mutex_init(&c->resolve_lock, NULL);
+    pthread_cond_init(&c->resolve_cond, NULL);
 
-    if (RAND_bytes(c->peer_id, SHA_DIGEST_LENGTH) != 1) {
-        free(c);
-        return NULL;
-    }
+    if (RAND_bytes(c->peer_id, SHA_DIGEST_LENGTH) != 1)
+        goto fail;
 
-    FILE *fp = fopen(torrent->info.name, "rb");
-    if (fp) {
-        if (fseek(fp, 0, SEEK_END) != 0) {
-            fclose(fp);
-            free(c);
-            return NULL;
-        }
-        long actual_size = ftell(fp);
-        rewind(fp);
-        if (actual_size < 0)
-            actual_size = 0;
-        size_t valid_downloaded = 0;
-        size_t pieces = metainfo_file_pieces_count(torrent);
-        if ((size_t)actual_size >= torrent->info.length) {
-            /* 文件完整：验证所有片段 */
-            for (size_t i = 0; i < pieces; i++) {
-                size_t expected_size;
-                if (i < pieces - 1)
-                    expected_size = torrent->info.piece_length;
-                else
-                    expected_size = torrent->info.length - (pieces - 1) * torrent->info.piece_length;
-                const char *expected_hash = metainfo_file_piece_hash(torrent, i);
-                valid_downloaded += validate_piece(fp, i, expected_size, torrent->info.piece_length, expected_hash);
-            }
-        } else {
-            /* 文件不完整：仅验证文件中完整存在的片段 */
-            size_t pieces_full = (size_t)actual_size / torrent->info.piece_length;
-            for (size_t i = 0; i < pieces_full; i++) {
-                const char *expected_hash = metainfo_file_piece_hash(torrent, i);
-                valid_downloaded += validate_piece(fp, i, torrent->info.piece_length, torrent->info.piece_length, expected_hash);
-            }
-        }
-        fclose(fp);
-        if (valid_downloaded > torrent->info.length)
-            valid_downloaded = torrent->info.length;
-        c->downloaded = valid_downloaded;
-        c->left = torrent->info.length - valid_downloaded;
-    } else {
-        /* 文件不存在，则创建空文件 */
-        fp = fopen(torrent->info.name, "wb");
-        if (!fp) {
-            free(c);
-            return NULL;
-        }
-        fclose(fp);
-        c->downloaded = 0;
-        c->left = torrent->info.length;
+    c->peers = peer_table_new();
+    if (!c->peers)
+        goto fail;
+    size_t pieces = metainfo_file_pieces_count(torrent);
+    if (!bitfield_init(&c->have, pieces))
+        goto fail;
+    if (opts && opts->resume_path) {
+        c->resume_path = strdup(opts->resume_path);
+        if (!c->resume_path)
+            goto fail;
     }
+
+    /* 补齐缺少或过短的文件，并按选项预分配空间（默认不预分配），再验证已有数据 */
+    if (!storage_create(torrent, opts ? opts->prealloc : STORAGE_PREALLOC_NONE))
+        goto fail;
+    if (!client_verify(c, opts))
+        goto fail;
+    size_t valid_downloaded = have_bytes(torrent, &c->have);
+    if (valid_downloaded > torrent->info.length)
+        valid_downloaded = torrent->info.length;
+    c->downloaded = valid_downloaded;
+    c->left = torrent->info.length - valid_downloaded;
+    // 立即写出 resume 文件，下次启动即可跳过刚才的验证
+    if (c->resume_path)
+        resume_save(c->resume_path, torrent, c->have.bits);
+    c->tracker_arena = bencode_arena_new(0);
+    if (!c->tracker_arena)
+        goto fail;
+    // 已验证的片段不会再被选中；peer id 是随机的，正好用作随机种子
+    uint32_t seed;
+    memcpy(&seed, c->peer_id, sizeof(seed));
+    c->picker = piece_picker_new(pieces, &c->have, seed);
+    if (!c->picker)
+        goto fail;
+    c->blocks = block_tracker_new(torrent, c->picker);
+    if (!c->blocks)
+        goto fail;
+    c->reactor = reactor_new();
+    if (!c->reactor)
+        goto fail;
+    c->engine = peer_engine_new(c->reactor, torrent->info_hash, c->peer_id, &engine_ops, c);
+    if (!c->engine)
+        goto fail;
+    if (opts && (opts->max_connecting || opts->connect_timeout_ms))
+        peer_engine_set_connect_limits(c->engine,
+                                       opts->max_connecting ? opts->max_connecting
+                                                            : PEER_ENGINE_MAX_CONNECTING,
+                                       opts->connect_timeout_ms);
+    c->incoming = handoff_queue_new(HANDOFF_QUEUE_CAPACITY);
+    if (!c->incoming)
+        goto fail;
+    if (!reactor_add(c->reactor, handoff_queue_fd(c->incoming), on_incoming, c))
+        goto fail;
     return c;
+
+ fail:
+    handoff_queue_free(c->incoming);
+    peer_engine_free(c->engine);
+    reactor_free(c->reactor);
+    block_tracker_free(c->blocks);
+    piece_picker_free(c->picker);
+    bencode_arena_free(c->tracker_arena);
+    free(c->resume_path);
+    bitfield_free(&c->have);
+    peer_table_free(c->peers);
+    pthread_cond_destroy(&c->resolve_cond);
+    pthread_mutex_destroy(&c->resolve_lock);
+    free(c);
+    return NULL;
 }
 
-/* 监听线程函数：循环调用 accept，将新连接加入 client->peers */
+/*
+ * 监听线程函数：循环调用 accept，完成 handshake 后放入 incoming 队列，
+ * 由运行 client_poll 的线程交给 peer engine；两边不共享任何锁。
+ */
 static void *client_listener_thread(void *arg) {
     struct client *c = (struct client *)arg;
     while (c->listener_running) {
@@ -152,7 +309,12 @@ static void *client_listener_thread(void *arg) {
                 perror("accept");
             break;
         }
-        client_add_connected_peer(c, newfd);
+        struct peer p;
+        if (!peer_accept(&p, c, newfd)) {
+            close(newfd);
+            continue;
+        }
+        client_handoff_peer(c, newfd, p.peer_id);
     }
     return NULL;
 }
@@ -200,27 +362,112 @@ int client_peer_listener_start(struct client *client) {
     return 1;
 }
 
+/* peer engine 释放后表里只剩 client_add_connected_peer 登记的 socket */
+static int close_peer(void *arg, peer_handle_t h, const struct peer_entry *entry) {
+    if (peer_table_remove(arg, h, NULL))
+        close(entry->fd);
+    return 1;
+}
+
+/* 停止解析线程：正在进行的解析要等它完成，排队的域名直接丢弃 */
+static void stop_resolver(struct client *c) {
+    if (c->resolver_running) {
+        pthread_mutex_lock(&c->resolve_lock);
+        c->resolver_stop = 1;
+        pthread_cond_signal(&c->resolve_cond);
+        pthread_mutex_unlock(&c->resolve_lock);
+        pthread_join(c->resolver_thread, NULL);
+        c->resolver_running = 0;
+    }
+    while (c->resolve_head) {
+        struct resolve_req *req = c->resolve_head;
+        c->resolve_head = req->next;
+        free(req);
+    }
+    c->resolve_tail = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (c->resolved_fds[i] < 0)
+            continue;
+        if (i == 0)
+            reactor_remove(c->reactor, c->resolved_fds[0]);
+        close(c->resolved_fds[i]);
+        c->resolved_fds[i] = -1;
+    }
+}
+
 /*
  * client_free: 释放 client 对象所有资源，包括关闭所有 peer 连接和监听服务
  */
 void client_free(struct client *client) {
     if (!client)
         return;
-    if (client->peers) {
-        for (size_t i = 0; i < client->num_peers; i++) {
-            close(client->peers[i]);
-        }
-        free(client->peers);
-    }
+    // 先停止监听线程，之后没有别的线程再往表里添加 peer
     if (client->listener_running) {
         client->listener_running = 0;
         shutdown(client->listener_sockfd, SHUT_RDWR);
         close(client->listener_sockfd);
         pthread_join(client->listener_thread, NULL);
     }
+    stop_resolver(client);
+    // 连接关闭时要从 picker 中撤下对方的位图、从 peers 表中删除，所以先于两者释放
+    peer_engine_free(client->engine);
+    handoff_queue_free(client->incoming);
+    peer_table_foreach(client->peers, close_peer, client->peers);
+    peer_table_free(client->peers);
+    bencode_arena_free(client->tracker_arena);
+    if (client->resume_path) {
+        resume_save(client->resume_path, client->torrent, client->have.bits);
+        free(client->resume_path);
+    }
+    reactor_free(client->reactor);
+    block_tracker_free(client->blocks);
+    piece_picker_free(client->picker);
+    bitfield_free(&client->have);
+    pthread_cond_destroy(&client->resolve_cond);
+    pthread_mutex_destroy(&client->resolve_lock);
     free(client);
 }
 
+const uint8_t *client_have(struct client *client) {
+    return client ? client->have.bits : NULL;
+}
+
+struct piece_picker *client_picker(struct client *client) {
+    return client ? client->picker : NULL;
+}
+
+int client_set_piece_priority(struct client *client, size_t piece, int priority) {
+    if (!client || piece >= metainfo_file_pieces_count(client->torrent))
+        return 0;
+    piece_picker_set_priority(client->picker, piece, priority);
+    return 1;
+}
+
+/* 播放位置换算成所在的片段，窗口从这个片段开始 */
+int client_set_streaming(struct client *client, size_t offset, size_t window, size_t urgent) {
+    if (!client || offset >= client->torrent->info.length)
+        return 0;
+    piece_picker_set_deadline_window(client->picker, offset / client->torrent->info.piece_length,
+                                     window, urgent);
+    return 1;
+}
+
+struct block_tracker *client_blocks(struct client *client) {
+    return client ? client->blocks : NULL;
+}
+
+uint64_t client_duplicate_bytes(struct client *client) {
+    return client ? block_tracker_duplicate_bytes(client->blocks) : 0;
+}
+
+struct peer_engine *client_engine(struct client *client) {
+    return client ? client->engine : NULL;
+}
+
+int client_poll(struct client *client, int timeout_ms) {
+    return client ? reactor_run_once(client->reactor, timeout_ms) : -1;
+}
+
 const unsigned char *client_peer_id(struct client *client) {
     return client ? client->peer_id : NULL;
 }
@@ -273,22 +520,19 @@ const char *client_tracker_url(void) {
     return last_tracker_url;
 }
 
-/* 用于存储 HTTP 响应数据 */
-struct MemoryStruct {
-    char *memory;
-    size_t size;
-};
+/*
+ * tracker 响应中单个字符串的上限。最长的是紧凑格式的 peers，每个 peer 6 字节，
+ * 1 MiB 足够；解析器读到长度就分配，不设上限时恶意响应可以让客户端预留任意大的内存。
+ */
+#define TRACKER_MAX_STR_LEN (1 << 20)
 
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+/* libcurl 写回调：每个到达的分片直接交给流式解析器，不再拼接整个响应体 */
+static size_t tracker_write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if (!ptr)
+    struct bencode_stream *stream = userp;
+    // 返回值不等于 realsize 时 libcurl 会中止传输
+    if (bencode_stream_feed(stream, contents, realsize, NULL) == BENCODE_STREAM_ERROR)
         return 0;
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = '\0';
     return realsize;
 }
 
@@ -355,38 +599,39 @@ int client_tracker_connect(struct client *client) {
         fprintf(stderr, "curl_easy_init failed\n");
         return 0;
     }
-    struct MemoryStruct {
-        char *memory;
-        size_t size;
-    } chunk;
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    // 响应边接收边解析，整棵树分配在 arena 中
+    struct bencode_stream *stream = bencode_stream_new_tree(client->tracker_arena,
+                                                            TRACKER_MAX_STR_LEN);
+    if (!stream) {
+        curl_easy_cleanup(curl);
+        return 0;
+    }
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, tracker_write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)stream);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);  // 超时 10 秒
 
     CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
     if (res != CURLE_OK) {
         fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        curl_easy_cleanup(curl);
-        free(chunk.memory);
+        bencode_stream_free(stream);
+        bencode_arena_reset(client->tracker_arena);
         return 0;
     }
-    // 解析 tracker 返回的 bencoded 数据
     struct bencode_value tracker_response;
-    size_t decoded = bencode_value_decode(&tracker_response, chunk.memory, chunk.size);
-    free(chunk.memory);
-    curl_easy_cleanup(curl);
+    int decoded = bencode_stream_take(stream, &tracker_response);
+    bencode_stream_free(stream);
     if (decoded == 0) {
         fprintf(stderr, "Failed to decode tracker response.\n");
+        bencode_arena_reset(client->tracker_arena);
         return 0;
     }
     const struct bencode_pair *failure = bencode_map_lookup(&tracker_response, "failure reason");
     if (failure) {
         fprintf(stderr, "Tracker failure: %s\n", bencode_value_str(&failure->value));
-        bencode_value_free(&tracker_response);
+        bencode_arena_reset(client->tracker_arena);
         return 0;
     }
     int interval = 30;
@@ -396,33 +641,184 @@ int client_tracker_connect(struct client *client) {
         if (interval <= 0)
             interval = 30;
     }
-    bencode_value_free(&tracker_response);
+    bencode_arena_reset(client->tracker_arena);
     return interval;
 }
 
 
 
 
-/* 将新连接的 peer 添加到 client->peers 数组 */
-void client_add_connected_peer(struct client *client, int sockfd) {
+/* 将新连接的 peer 添加到 client->peers 表中，任何线程都可以调用 */
+peer_handle_t client_add_connected_peer(struct client *client, int sockfd) {
     if (!client)
-        return;
-    int *new_peers = realloc(client->peers, (client->num_peers + 1) * sizeof(int));
-    if (new_peers) {
-        client->peers = new_peers;
-        client->peers[client->num_peers] = sockfd;
-        client->num_peers++;
-    } else {
+        return PEER_HANDLE_NONE;
+    peer_handle_t h = peer_table_insert(client->peers, sockfd, NULL);
+    if (h == PEER_HANDLE_NONE)
+        close(sockfd);
+    return h;
+}
+
+int client_handoff_peer(struct client *client, int sockfd, const uint8_t peer_id[20]) {
+    struct handoff item = { .fd = sockfd };
+    memcpy(item.peer_id, peer_id, 20);
+    if (!client || !handoff_queue_push(client->incoming, &item)) {
+        fprintf(stderr, "Incoming peer queue full, dropping connection\n");
         close(sockfd);
+        return 0;
+    }
+    return 1;
+}
+
+void client_incoming_stats(struct client *client, struct handoff_queue_stats *stats) {
+    handoff_queue_stats(client->incoming, stats);
+}
+
+int client_remove_peer(struct client *client, peer_handle_t peer) {
+    struct peer_entry entry;
+    if (!client || !peer_table_remove(client->peers, peer, &entry))
+        return 0;
+    // peer engine 的连接由 engine 关闭，engine_closed 中的删除会失败，不会重复关闭
+    if (entry.user)
+        peer_conn_close(entry.user);
+    else
+        close(entry.fd);
+    return 1;
+}
+
+size_t client_num_peers(struct client *client) {
+    return client ? peer_table_count(client->peers) : 0;
+}
+
+/*
+ * 解析数字形式的 peer 地址（IPv4 或 IPv6）。域名在这里不解析：getaddrinfo 会阻塞到 DNS
+ * 超时，所以交给解析线程（见 queue_resolve），这里返回 0。
+ */
+static int parse_peer_addr(const char *ip, uint16_t port, struct sockaddr_storage *addr,
+                           socklen_t *len) {
+    struct addrinfo hints, *res;
+    char port_str[6];
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(ip, port_str, &hints, &res) != 0)
+        return 0;
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 1;
+}
+
+/* 解析一个域名，取第一个地址写入管道；事件循环来不及读、管道满时丢弃 */
+static void resolve_one(struct client *c, const struct resolve_req *req) {
+    struct addrinfo hints, *res;
+    char port_str[6];
+    snprintf(port_str, sizeof(port_str), "%u", req->port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    int gai_err = getaddrinfo(req->host, port_str, &hints, &res);
+    if (gai_err != 0) {
+        fprintf(stderr, "Failed to resolve peer %s: %s\n", req->host, gai_strerror(gai_err));
+        return;
     }
+    struct resolved_addr r;
+    memset(&r, 0, sizeof(r));
+    memcpy(&r.addr, res->ai_addr, res->ai_addrlen);
+    r.len = res->ai_addrlen;
+    freeaddrinfo(res);
+    if (write(c->resolved_fds[1], &r, sizeof(r)) != (ssize_t)sizeof(r))
+        fprintf(stderr, "Dropping resolved peer %s: queue full\n", req->host);
+}
+
+/* 解析线程：按顺序取出排队的域名，直到 client_free 要求停止 */
+static void *client_resolver_thread(void *arg) {
+    struct client *c = arg;
+    pthread_mutex_lock(&c->resolve_lock);
+    for (;;) {
+        while (!c->resolve_head && !c->resolver_stop)
+            pthread_cond_wait(&c->resolve_cond, &c->resolve_lock);
+        if (c->resolver_stop)
+            break;
+        struct resolve_req *req = c->resolve_head;
+        c->resolve_head = req->next;
+        if (!c->resolve_head)
+            c->resolve_tail = NULL;
+        pthread_mutex_unlock(&c->resolve_lock);
+        resolve_one(c, req);
+        free(req);
+        pthread_mutex_lock(&c->resolve_lock);
+    }
+    pthread_mutex_unlock(&c->resolve_lock);
+    return NULL;
+}
+
+/* 解析结果到达时在事件循环中调用，交给 peer engine 连接 */
+static void on_resolved(void *arg, int fd, unsigned events) {
+    struct client *c = arg;
+    struct resolved_addr r;
+    (void)events;
+    while (read(fd, &r, sizeof(r)) == (ssize_t)sizeof(r))
+        peer_engine_connect(c->engine, (struct sockaddr *)&r.addr, r.len);
+}
+
+/* 第一次需要时创建结果管道并启动解析线程 */
+static int start_resolver(struct client *c) {
+    if (c->resolver_running)
+        return 1;
+    if (pipe(c->resolved_fds) < 0) {
+        perror("pipe");
+        c->resolved_fds[0] = c->resolved_fds[1] = -1;
+        return 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(c->resolved_fds[i], F_SETFD, FD_CLOEXEC) < 0 ||
+            !reactor_set_nonblocking(c->resolved_fds[i]))
+            goto fail;
+    }
+    if (!reactor_add(c->reactor, c->resolved_fds[0], on_resolved, c))
+        goto fail;
+    if (pthread_create(&c->resolver_thread, NULL, client_resolver_thread, c) != 0) {
+        perror("pthread_create");
+        goto fail;
+    }
+    c->resolver_running = 1;
+    return 1;
+
+ fail:
+    stop_resolver(c);
+    return 0;
+}
+
+/* 把域名排进解析队列，不等待解析完成 */
+static int queue_resolve(struct client *c, const char *host, uint16_t port) {
+    if (!start_resolver(c))
+        return 0;
+    size_t len = strlen(host);
+    struct resolve_req *req = malloc(sizeof(struct resolve_req) + len + 1);
+    if (!req)
+        return 0;
+    req->next = NULL;
+    req->port = port;
+    memcpy(req->host, host, len + 1);
+    pthread_mutex_lock(&c->resolve_lock);
+    if (c->resolve_tail)
+        c->resolve_tail->next = req;
+    else
+        c->resolve_head = req;
+    c->resolve_tail = req;
+    pthread_cond_signal(&c->resolve_cond);
+    pthread_mutex_unlock(&c->resolve_lock);
+    return 1;
 }
 
 /*
  * client_add_bencoded_peer_list:
  * 遍历 tracker 返回的 bencoded peer 列表，
  * 对于每个 peer 条目提取 "ip"、"port" 和 "peer id" 字段，
- * 然后调用 peer_connect 建立连接；
- * 如果连接成功，将该连接加入 client->peers 数组。
+ * 然后交给 peer engine 并发地连接；连接和 handshake 在 client_poll 中完成，
+ * 不可达的 peer 到截止时间后放弃，不会阻塞调用者。域名形式的 ip 由解析线程解析后再连接，
+ * 类型不对的条目跳过。
  */
 void client_add_bencoded_peer_list(struct client *client, const struct bencode_value *peers) {
     if (!client || !peers || peers->type != BENCODE_LIST)
@@ -432,10 +828,11 @@ void client_add_bencoded_peer_list(struct client *client, const struct bencode_v
          const struct bencode_value *peer_val = &peers->as.list_value.values[i];
          if (peer_val->type != BENCODE_MAP)
              continue;
-         const struct bencode_pair *id_pair = bencode_map_lookup(peer_val, "peer id");
-         const struct bencode_pair *ip_pair = bencode_map_lookup(peer_val, "ip");
-         const struct bencode_pair *port_pair = bencode_map_lookup(peer_val, "port");
-         if (!id_pair || !ip_pair || !port_pair)
+         const struct bencode_pair *id_pair = bencode_map_lookup_n(peer_val, "peer id", 7);
+         const struct bencode_pair *ip_pair = bencode_map_lookup_n(peer_val, "ip", 2);
+         const struct bencode_pair *port_pair = bencode_map_lookup_n(peer_val, "port", 4);
+         if (!id_pair || !ip_pair || !port_pair || id_pair->value.type != BENCODE_STR ||
+             ip_pair->value.type != BENCODE_STR || port_pair->value.type != BENCODE_INT)
              continue;
          
          char ip[128] = {0};
@@ -445,19 +842,22 @@ void client_add_bencoded_peer_list(struct client *client, const struct bencode_v
          memcpy(ip, ip_pair->value.as.str_value.str, ip_len);
          ip[ip_len] = '\0';
          
-         int port_val = (int) port_pair->value.as.int_value;
+         long long port_val = port_pair->value.as.int_value;
          if (port_val < 0 || port_val > 65535)
              continue;
          
-         printf("Peer found: id=%.*s, ip=%s, port=%d\n",
+         printf("Peer found: id=%.*s, ip=%s, port=%lld\n",
                 (int) id_pair->value.as.str_value.len, id_pair->value.as.str_value.str,
                 ip, port_val);
          
-         struct peer p;
-         if (peer_connect(&p, client, ip, (uint16_t) port_val)) {
-              client_add_connected_peer(client, p.sockfd);
-         } else {
-              printf("Failed to connect to peer: %s:%d\n", ip, port_val);
-         }
+         struct sockaddr_storage addr;
+         socklen_t addr_len;
+         int ok;
+         if (parse_peer_addr(ip, (uint16_t) port_val, &addr, &addr_len))
+              ok = peer_engine_connect(client->engine, (struct sockaddr *)&addr, addr_len);
+         else
+              ok = queue_resolve(client, ip, (uint16_t) port_val);
+         if (!ok)
+              printf("Failed to connect to peer: %s:%lld\n", ip, port_val);
     }
 }
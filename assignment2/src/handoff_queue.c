@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+#include "handoff_queue.h"
+
+/*
+ * seq == 位置：空闲，等待该位置的生产者；
+ * seq == 位置 + 1：已写入，等待消费者；
+ * 消费者取走后 seq = 位置 + 容量，留给下一圈的生产者。
+ */
+struct cell {
+    size_t seq;
+    struct handoff item;
+};
+
+struct handoff_queue {
+    struct cell *cells;
+    size_t mask;
+    int wake_rd;
+    int wake_wr;           // eventfd 时与 wake_rd 相同
+    size_t tail __attribute__((aligned(64)));   // 生产者争用
+    int idle __attribute__((aligned(64)));      // 消费者发现队列为空，可能在等待唤醒
+    int64_t depth __attribute__((aligned(64))); // 计入之前可能已被取走，所以可能暂时为负
+    size_t high_watermark;
+    uint64_t pushed;
+    uint64_t dropped;
+    size_t head __attribute__((aligned(64)));   // 只有消费者访问
+};
+
+/* 没有 eventfd 时用非阻塞的管道唤醒，读端和写端分开 */
+static int open_wake_pipe(struct handoff_queue *q) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(fds[i], F_SETFL, O_NONBLOCK) < 0 || fcntl(fds[i], F_SETFD, FD_CLOEXEC) < 0) {
+            perror("fcntl");
+            close(fds[0]);
+            close(fds[1]);
+            return 0;
+        }
+    }
+    q->wake_rd = fds[0];
+    q->wake_wr = fds[1];
+    return 1;
+}
+
+struct handoff_queue *handoff_queue_new(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+    struct handoff_queue *q = aligned_alloc(64, sizeof(struct handoff_queue));
+    if (!q)
+        return NULL;
+    memset(q, 0, sizeof(*q));
+    q->cells = malloc(size * sizeof(struct cell));
+    if (!q->cells) {
+        free(q);
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++)
+        q->cells[i].seq = i;
+    q->mask = size - 1;
+    q->idle = 1;
+
+#ifdef HAVE_EVENTFD
+    q->wake_rd = q->wake_wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    q->wake_rd = q->wake_wr = -1;
+#endif
+    // 内核不支持 eventfd 时同样退回管道
+    if (q->wake_rd < 0 && !open_wake_pipe(q)) {
+        free(q->cells);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+void handoff_queue_free(struct handoff_queue *q) {
+    if (!q)
+        return;
+    struct handoff item;
+    while (handoff_queue_pop(q, &item))
+        close(item.fd);
+    if (q->wake_wr != q->wake_rd)
+        close(q->wake_wr);
+    close(q->wake_rd);
+    free(q->cells);
+    free(q);
+}
+
+int handoff_queue_push(struct handoff_queue *q, const struct handoff *item) {
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct cell *c;
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // 上一圈的元素还没有被取走
+            __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    c->item = *item;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&q->pushed, 1, __ATOMIC_RELAXED);
+
+    int64_t depth = __atomic_add_fetch(&q->depth, 1, __ATOMIC_RELAXED);
+    size_t hwm = __atomic_load_n(&q->high_watermark, __ATOMIC_RELAXED);
+    while (depth > 0 && (size_t)depth > hwm &&
+           !__atomic_compare_exchange_n(&q->high_watermark, &hwm, (size_t)depth, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    /*
+     * 只唤醒空闲的消费者，且只由一个生产者唤醒。与 pop 中的屏障配对：
+     * 要么这里看到 idle，要么消费者重新检查时看到刚写入的元素。
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->idle, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&q->idle, 0, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        if (write(q->wake_wr, &one, sizeof(one)) < 0) {
+            // 计数器或管道已满，说明还有未处理的唤醒
+        }
+    }
+    return 1;
+}
+
+static int take(struct handoff_queue *q, struct handoff *item) {
+    struct cell *c = &q->cells[q->head & q->mask];
+    if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+        return 0;
+    *item = c->item;
+    __atomic_store_n(&c->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+    q->head++;
+    __atomic_sub_fetch(&q->depth, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * 队头的元素可能还没有写完，而后面的已经写好了，所以不能根据计数判断是否
+ * 需要唤醒：消费者在取不到元素时标记 idle，再检查一次，之后写完的生产者负责唤醒。
+ */
+int handoff_queue_pop(struct handoff_queue *q, struct handoff *item) {
+    if (take(q, item))
+        return 1;
+    __atomic_store_n(&q->idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!take(q, item))
+        return 0;
+    __atomic_store_n(&q->idle, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+int handoff_queue_fd(const struct handoff_queue *q) {
+    return q->wake_rd;
+}
+
+void handoff_queue_clear_wakeup(struct handoff_queue *q) {
+    uint8_t buf[64];
+    while (read(q->wake_rd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+void handoff_queue_stats(const struct handoff_queue *q, struct handoff_queue_stats *stats) {
+    int64_t depth = __atomic_load_n(&q->depth, __ATOMIC_RELAXED);
+    stats->depth = depth > 0 ? (size_t)depth : 0;
+    stats->high_watermark = __atomic_load_n(&q->high_watermark, __ATOMIC_RELAXED);
+    stats->pushed = __atomic_load_n(&q->pushed, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
@@ -2,6 +2,7 @@
 #define BENCODE_H_INCLUDED
 
 #include <stdlib.h>
+#include <stdint.h>
 
 enum bencode_t {
     BENCODE_STR,
@@ -13,10 +14,76 @@ enum bencode_t {
 struct bencode_list;
 struct bencode_map;
 struct bencode_str;
+struct bencode_arena;
+
+/*
+ * Per-node flags stored in bencode_value.flags.
+ *
+ * BENCODE_VALUE_BORROWED marks a BENCODE_STR whose data points into
+ * the buffer passed to the decoder instead of a private heap copy.
+ *
+ * BENCODE_VALUE_ARENA marks a node whose storage belongs to a
+ * bencode_arena; bencode_value_free() leaves such nodes alone.
+ *
+ * BENCODE_VALUE_SORTED marks a BENCODE_MAP whose keys the decoder
+ * found in strictly increasing byte order, enabling binary search.
+ *
+ * BENCODE_VALUE_INDEXED marks a BENCODE_MAP carrying a hash index
+ * stored right after its pairs array.
+ *
+ * BENCODE_VALUE_SPAN marks a node whose span_start/span_end were
+ * recorded by a decode with BENCODE_DECODE_SPANS.
+ */
+enum bencode_value_flags {
+    BENCODE_VALUE_BORROWED = 1 << 0,
+    BENCODE_VALUE_ARENA = 1 << 1,
+    BENCODE_VALUE_SORTED = 1 << 2,
+    BENCODE_VALUE_INDEXED = 1 << 3,
+    BENCODE_VALUE_SPAN = 1 << 4,
+};
+
+/*
+ * Maps with at least this many pairs get a hash index when decoded
+ * with BENCODE_DECODE_INDEX.
+ */
+#define BENCODE_MAP_INDEX_MIN 32
+
+/*
+ * Options accepted by bencode_value_decode_opts().
+ *
+ * BENCODE_DECODE_BORROW makes every decoded string a view into the
+ * input buffer (see bencode_value_decode_opts() for the lifetime
+ * contract).
+ *
+ * BENCODE_DECODE_EXACT runs a structural pre-scan that counts the
+ * children of every list and map first, so each array is allocated
+ * once at its exact size instead of growing by doubling.
+ *
+ * BENCODE_DECODE_STRICT rejects maps whose keys are not sorted or
+ * contain duplicates, as BitTorrent requires. Without it unsorted
+ * maps are accepted but fall back to a linear lookup.
+ *
+ * BENCODE_DECODE_INDEX builds a hash index for maps with at least
+ * BENCODE_MAP_INDEX_MIN pairs.
+ *
+ * BENCODE_DECODE_SPANS records, for every node, the byte range
+ * [span_start, span_end) it was decoded from, relative to the start
+ * of the input. The input must be shorter than 4 GiB.
+ */
+enum bencode_decode_flags {
+    BENCODE_DECODE_BORROW = 1 << 0,
+    BENCODE_DECODE_EXACT = 1 << 1,
+    BENCODE_DECODE_STRICT = 1 << 2,
+    BENCODE_DECODE_INDEX = 1 << 3,
+    BENCODE_DECODE_SPANS = 1 << 4,
+};
 
 struct bencode_value {
     // TODO fill this structure
     enum bencode_t type;
+    unsigned char flags;
+    uint32_t span_start;  // BENCODE_VALUE_SPAN only
+    uint32_t span_end;
     union {
         long long int_value;
         
@@ -62,6 +129,82 @@ void bencode_value_free(struct bencode_value *value);
  */
 size_t bencode_value_decode(struct bencode_value *value, const char *enc_val, size_t n);
 
+/**
+ * Decode a bencoded string into value like bencode_value_decode(),
+ * with decoding options.
+ *
+ * With BENCODE_DECODE_BORROW strings are not copied: their str
+ * pointer refers directly to the bytes inside enc_val and they are
+ * not NUL-terminated, so they must always be read together with
+ * their length. enc_val must stay valid and unmodified until
+ * bencode_value_free() has been called on value; bencode_value_free()
+ * never releases borrowed strings.
+ *
+ * @param value An output parameter that will contain the decoded value.
+ * @param enc_val A bencode string to decode.
+ * @param n The length of enc_val in bytes.
+ * @param flags A bitwise OR of enum bencode_decode_flags values.
+ * @return The number of bytes decoded from enc_val. If decoding
+ * fails it should return 0.
+ */
+size_t bencode_value_decode_opts(struct bencode_value *value, const char *enc_val,
+                                 size_t n, unsigned flags);
+
+/**
+ * Decode a bencoded string into value like bencode_value_decode_opts(),
+ * taking every node array and string from arena instead of the heap.
+ *
+ * The decoded tree stays valid until the next bencode_arena_reset()
+ * or bencode_arena_free() on arena. Calling bencode_value_free() on
+ * it is allowed and does nothing.
+ *
+ * @param value An output parameter that will contain the decoded value.
+ * @param enc_val A bencode string to decode.
+ * @param n The length of enc_val in bytes.
+ * @param arena The arena backing the decoded tree.
+ * @param flags A bitwise OR of enum bencode_decode_flags values.
+ * @return The number of bytes decoded from enc_val. If decoding
+ * fails it should return 0.
+ */
+size_t bencode_value_decode_arena(struct bencode_value *value, const char *enc_val,
+                                  size_t n, struct bencode_arena *arena, unsigned flags);
+
+/**
+ * Allocate a bump allocator for decoded bencode trees.
+ *
+ * @param block_size The size in bytes of each block the arena grabs
+ * from the heap, or 0 for a default size. Larger allocations get a
+ * dedicated block.
+ * @return A pointer to the arena, or NULL on allocation failure.
+ */
+struct bencode_arena *bencode_arena_new(size_t block_size);
+
+/**
+ * Allocate size bytes from arena, suitably aligned for any type. The
+ * memory lives until the next bencode_arena_reset() or
+ * bencode_arena_free() on arena.
+ *
+ * @param arena A pointer to the arena.
+ * @param size The number of bytes to allocate.
+ * @return A pointer to the memory, or NULL on allocation failure.
+ */
+void *bencode_arena_alloc(struct bencode_arena *arena, size_t size);
+
+/**
+ * Release every tree decoded into arena at once in O(1). The blocks
+ * are kept and reused by later decodes.
+ *
+ * @param arena A pointer to the arena.
+ */
+void bencode_arena_reset(struct bencode_arena *arena);
+
+/**
+ * Release the arena and all the memory it owns.
+ *
+ * @param arena A pointer to the arena, may be NULL.
+ */
+void bencode_arena_free(struct bencode_arena *arena);
+
 /**
  * Encode a bencoded value into buf using at most n bytes.
  *
@@ -74,6 +217,57 @@ size_t bencode_value_decode(struct bencode_value *value, const char *enc_val, si
  */
 size_t bencode_value_encode(const struct bencode_value *value, char *buf, size_t n);
 
+/**
+ * Encode value into a newly allocated buffer of exactly the right size.
+ *
+ * @param value The value to encode.
+ * @param len If not NULL, receives the length of the encoding.
+ * @return The encoding, not NUL-terminated, which the caller must
+ * free(); NULL on allocation failure.
+ */
+char *bencode_value_encode_alloc(const struct bencode_value *value, size_t *len);
+
+/*
+ * Sink used by the streaming encoder. Returns 0 to abort encoding,
+ * non-zero once all len bytes of data have been consumed.
+ */
+typedef int (*bencode_write_fn)(void *ctx, const char *data, size_t len);
+
+/**
+ * Encode value through write without materializing the whole
+ * encoding. Small pieces are batched in a fixed-size buffer; long
+ * strings are passed to write directly.
+ *
+ * @param value The value to encode.
+ * @param write The sink receiving the encoded bytes in order.
+ * @param ctx An opaque pointer passed to write.
+ * @return The number of bytes written, or 0 if write aborted or
+ * memory ran out.
+ */
+size_t bencode_value_encode_stream(const struct bencode_value *value, bencode_write_fn write,
+                                   void *ctx);
+
+/**
+ * Encode value to the file descriptor fd, retrying short and
+ * interrupted writes.
+ *
+ * @param value The value to encode.
+ * @param fd An open file descriptor.
+ * @return The number of bytes written, or 0 on error.
+ */
+size_t bencode_value_encode_fd(const struct bencode_value *value, int fd);
+
+/**
+ * Get the bytes of the original input value was decoded from.
+ *
+ * @param value A value decoded with BENCODE_DECODE_SPANS.
+ * @param enc_val The buffer that was passed to the decoder.
+ * @param len An output parameter receiving the length of the span.
+ * @return A pointer into enc_val, or NULL if no span was recorded.
+ */
+const char *bencode_value_span(const struct bencode_value *value, const char *enc_val,
+                               size_t *len);
+
 /**
  * Get the type of value.
  *
@@ -105,7 +299,8 @@ long long bencode_value_int(const struct bencode_value *value);
 
 /**
  * Get the value as a string. It only makes sense if the value is
- * BENCODE_STR.  Otherwise, its behavior is undefined.
+ * BENCODE_STR.  Otherwise, its behavior is undefined. Strings decoded
+ * with BENCODE_DECODE_BORROW are not NUL-terminated.
  *
  * @param value The bencoded value.
  * @return The value as a string.
@@ -128,6 +323,9 @@ const struct bencode_value *bencode_list_get(const struct bencode_value *value,
  * if the value is BENCODE_MAP.  Otherwise, its behavior is
  * undefined.
  *
+ * Lookups take O(1) on maps with a hash index, O(log n) on maps the
+ * decoder found sorted, and fall back to a linear scan otherwise.
+ *
  * @param value The bencoded value.
  * @param key The key to lookup.
  * @return The pair containg the bencoded key and its associated
@@ -136,4 +334,15 @@ const struct bencode_value *bencode_list_get(const struct bencode_value *value,
  */
 const struct bencode_pair *bencode_map_lookup(const struct bencode_value *value, const char *key);
 
+/**
+ * Like bencode_map_lookup(), but the key is given with an explicit
+ * length so it may contain NUL bytes.
+ *
+ * @param value The bencoded value.
+ * @param key The key to lookup.
+ * @param keylen The length of key in bytes.
+ * @return The matching pair, or NULL if no mapping is found for key.
+ */
+const struct bencode_pair *bencode_map_lookup_n(const struct bencode_value *value, const char *key, size_t keylen);
+
 #endif
@@ -0,0 +1,101 @@
+#ifndef BENCODE_STREAM_H_INCLUDED
+#define BENCODE_STREAM_H_INCLUDED
+
+#include <stddef.h>
+#include <bencode.h>
+
+/* Maximum nesting of lists and maps accepted by the stream parser. */
+#define BENCODE_STREAM_MAX_DEPTH 64
+
+enum bencode_stream_status {
+    BENCODE_STREAM_ERROR = -1,
+    BENCODE_STREAM_MORE = 0,
+    BENCODE_STREAM_DONE = 1,
+};
+
+/*
+ * Events emitted by the stream parser. Every callback may be NULL and
+ * returns 0 to abort parsing, non-zero to continue.
+ *
+ * on_str is called one or more times per string, once for every
+ * fragment that arrives: offset is the position of data inside the
+ * string and total its full length, so offset == 0 starts a string
+ * and offset + len == total ends it. Empty strings produce a single
+ * call with len == total == 0.
+ */
+struct bencode_stream_callbacks {
+    int (*on_int)(void *ctx, long long value);
+    int (*on_str)(void *ctx, const char *data, size_t len, size_t offset, size_t total);
+    int (*on_list_begin)(void *ctx);
+    int (*on_list_end)(void *ctx);
+    int (*on_map_begin)(void *ctx);
+    int (*on_map_end)(void *ctx);
+};
+
+struct bencode_stream;
+
+/**
+ * Allocate a resumable push parser that reports a single bencoded
+ * value as events while it is fed in arbitrary chunks.
+ *
+ * @param callbacks The event callbacks, copied by the parser.
+ * @param ctx An opaque pointer passed to every callback.
+ * @return A pointer to the parser, or NULL on allocation failure.
+ */
+struct bencode_stream *bencode_stream_new(const struct bencode_stream_callbacks *callbacks,
+                                          void *ctx);
+
+/**
+ * Allocate a push parser that builds a bencode tree incrementally.
+ * Only the strings and the children of still-open containers are
+ * kept while parsing; no copy of the encoded input is retained.
+ *
+ * Each string is allocated as soon as its length is read, before its
+ * data arrives, so lengths above max_str_len are rejected as invalid
+ * input.
+ *
+ * @param arena If not NULL, the tree is allocated in this arena (see
+ * bencode_value_decode_arena()); otherwise it is allocated on the heap.
+ * @param max_str_len The longest string accepted, or 0 for no limit
+ * other than SIZE_MAX - 1.
+ * @return A pointer to the parser, or NULL on allocation failure.
+ */
+struct bencode_stream *bencode_stream_new_tree(struct bencode_arena *arena, size_t max_str_len);
+
+/**
+ * Feed the next chunk of input to the parser.
+ *
+ * @param stream A pointer to the parser.
+ * @param data The next chunk of encoded bytes.
+ * @param n The length of data in bytes.
+ * @param consumed If not NULL, receives the number of bytes of data
+ * used. It is smaller than n only when the value completes inside
+ * the chunk or an error occurs.
+ * @return BENCODE_STREAM_MORE if the value is not complete yet,
+ * BENCODE_STREAM_DONE once it is, BENCODE_STREAM_ERROR if the input
+ * is invalid or a callback aborted. Once DONE or ERROR is returned,
+ * further calls return the same status without consuming input.
+ */
+int bencode_stream_feed(struct bencode_stream *stream, const char *data, size_t n,
+                        size_t *consumed);
+
+/**
+ * Move the tree built by a parser created with bencode_stream_new_tree()
+ * into value. The caller becomes responsible for releasing it with
+ * bencode_value_free() (or the arena).
+ *
+ * @param stream A pointer to the parser.
+ * @param value An output parameter that will contain the decoded value.
+ * @return Returns 0 if the value is not complete; otherwise returns a
+ * non-zero value.
+ */
+int bencode_stream_take(struct bencode_stream *stream, struct bencode_value *value);
+
+/**
+ * Release the parser and any partially built tree.
+ *
+ * @param stream A pointer to the parser, may be NULL.
+ */
+void bencode_stream_free(struct bencode_stream *stream);
+
+#endif
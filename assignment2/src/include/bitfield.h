@@ -0,0 +1,138 @@
+#ifndef BITFIELD_H_INCLUDED
+#define BITFIELD_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A set of pieces, one bit per piece, kept in the layout of the peer
+ * wire protocol's bitfield message: byte i / 8 holds piece i, most
+ * significant bit first. The buffer is padded with zero bytes to a
+ * multiple of BITFIELD_ALIGN so set operations can run on whole SIMD
+ * words; the spare bits of the last byte are always zero.
+ */
+
+#define BITFIELD_ALIGN 32
+
+/* Message id of the bitfield message in the peer wire protocol */
+#define BITFIELD_MSG_ID 5
+
+struct bitfield {
+    uint8_t *bits;   // aligned to BITFIELD_ALIGN
+    size_t count;    // number of pieces
+    size_t bytes;    // (count + 7) / 8, the length on the wire
+    size_t padded;   // allocated length, a multiple of BITFIELD_ALIGN
+};
+
+/**
+ * Allocate an empty set of count pieces.
+ *
+ * @param bf A pointer to the bitfield.
+ * @param count The number of pieces, usually metainfo_file_pieces_count().
+ * @return Returns 0 on allocation failure; otherwise returns a non-zero value.
+ */
+int bitfield_init(struct bitfield *bf, size_t count);
+
+/**
+ * Release the memory of the bitfield. Calling it twice is harmless.
+ *
+ * @param bf A pointer to the bitfield.
+ */
+void bitfield_free(struct bitfield *bf);
+
+static inline int bitfield_get(const struct bitfield *bf, size_t i) {
+    return (bf->bits[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static inline void bitfield_set(struct bitfield *bf, size_t i) {
+    bf->bits[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+}
+
+static inline void bitfield_clear(struct bitfield *bf, size_t i) {
+    bf->bits[i / 8] &= (uint8_t)~(0x80 >> (i % 8));
+}
+
+/**
+ * Set every piece (value != 0) or none (value == 0).
+ */
+void bitfield_fill(struct bitfield *bf, int value);
+
+/**
+ * Returns the number of pieces in the set.
+ */
+size_t bitfield_popcount(const struct bitfield *bf);
+
+/**
+ * dst = a & b. All three bitfields must have the same count; dst may
+ * be one of the operands.
+ */
+void bitfield_and(struct bitfield *dst, const struct bitfield *a, const struct bitfield *b);
+
+/**
+ * dst = a | b. All three bitfields must have the same count; dst may
+ * be one of the operands.
+ */
+void bitfield_or(struct bitfield *dst, const struct bitfield *a, const struct bitfield *b);
+
+/**
+ * dst = a & ~b. With a the pieces a peer has and b the pieces we have,
+ * this gives the pieces we are interested in from that peer. All three
+ * bitfields must have the same count; dst may be one of the operands.
+ *
+ * @return The number of pieces in dst.
+ */
+size_t bitfield_andnot(struct bitfield *dst, const struct bitfield *a, const struct bitfield *b);
+
+/**
+ * Tell whether a & ~b is not empty, stopping at the first piece found.
+ * This is the check behind the interested message.
+ */
+int bitfield_any_andnot(const struct bitfield *a, const struct bitfield *b);
+
+/**
+ * Find the first piece in the set at or after from.
+ *
+ * @param bf A pointer to the bitfield.
+ * @param from The index to start from.
+ * @return The index of the piece, or bf->count if there is none.
+ */
+size_t bitfield_find_next(const struct bitfield *bf, size_t from);
+
+/**
+ * Find the first piece not in the set at or after from.
+ *
+ * @param bf A pointer to the bitfield.
+ * @param from The index to start from.
+ * @return The index of the piece, or bf->count if there is none.
+ */
+size_t bitfield_find_next_clear(const struct bitfield *bf, size_t from);
+
+/**
+ * Load the payload of a bitfield message received from a peer. As
+ * the protocol requires, the payload must be exactly bf->bytes long
+ * and its spare bits must be zero.
+ *
+ * @param bf A pointer to an initialized bitfield.
+ * @param payload The message payload, after the message id.
+ * @param len The length of the payload.
+ * @return Returns 0 if the payload is invalid, leaving bf unchanged;
+ * otherwise returns a non-zero value.
+ */
+int bitfield_from_wire(struct bitfield *bf, const uint8_t *payload, size_t len);
+
+/**
+ * Returns the size of the complete bitfield message: the 4-byte length
+ * prefix, the message id and bf->bytes of payload.
+ */
+size_t bitfield_wire_size(const struct bitfield *bf);
+
+/**
+ * Write the complete bitfield message into buf.
+ *
+ * @param bf A pointer to the bitfield.
+ * @param buf The output buffer, at least bitfield_wire_size() bytes.
+ * @return The number of bytes written.
+ */
+size_t bitfield_to_wire(const struct bitfield *bf, uint8_t *buf);
+
+#endif
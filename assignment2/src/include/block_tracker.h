@@ -0,0 +1,126 @@
+#ifndef BLOCK_TRACKER_H_INCLUDED
+#define BLOCK_TRACKER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <metainfo.h>
+#include <piece_picker.h>
+
+/*
+ * Block requests of the pieces in flight. Pieces come from the piece
+ * picker; each one is split into PIECE_BLOCK_SIZE blocks, and every
+ * block is normally requested from a single peer.
+ *
+ * Once every missing piece is in flight and every block of them is
+ * requested, the tracker enters endgame: blocks that have not arrived
+ * yet are requested again from other peers, up to
+ * BLOCK_TRACKER_MAX_REQUESTS times, so a slow peer cannot hold up the
+ * end of the download. When a block arrives, the other requests for it
+ * are cancelled through a callback, and bytes received twice are
+ * counted as duplicate overhead.
+ */
+
+/* How many peers a block is requested from at most in endgame */
+#define BLOCK_TRACKER_MAX_REQUESTS 3
+
+struct block_request {
+    int peer;         // the caller's handle of the peer, e.g. its socket
+    uint32_t piece;
+    uint32_t begin;
+    uint32_t length;
+};
+
+enum block_tracker_result {
+    BLOCK_TRACKER_INVALID,    // not a block of the torrent
+    BLOCK_TRACKER_DUPLICATE,  // the block had already arrived, its bytes are overhead
+    BLOCK_TRACKER_ACCEPTED,   // the piece still misses blocks
+    BLOCK_TRACKER_COMPLETE,   // every block of the piece has arrived
+};
+
+/* Called for every request that must be cancelled, with the peer it was sent to */
+typedef void (*block_cancel_fn)(void *ctx, const struct block_request *req);
+
+struct block_tracker;
+
+/**
+ * Create a tracker.
+ *
+ * @param torrent The torrent file structure, which must outlive the
+ * tracker.
+ * @param picker The picker new pieces are taken from.
+ * @return A pointer to the tracker, or NULL on allocation failure.
+ */
+struct block_tracker *block_tracker_new(const struct metainfo_file *torrent,
+                                        struct piece_picker *picker);
+
+/**
+ * Release the tracker.
+ *
+ * @param bt A pointer to the tracker, may be NULL.
+ */
+void block_tracker_free(struct block_tracker *bt);
+
+/**
+ * Set the function called to send cancel messages.
+ */
+void block_tracker_set_cancel(struct block_tracker *bt, block_cancel_fn cancel, void *ctx);
+
+/**
+ * Enable or disable endgame (enabled by default).
+ */
+void block_tracker_set_endgame(struct block_tracker *bt, int enabled);
+
+/**
+ * Choose the next block to request from a peer: an unrequested block
+ * of a piece in flight, else the first block of a new piece from the
+ * picker, else, in endgame, a block requested from other peers only.
+ *
+ * @param bt A pointer to the tracker.
+ * @param peer The handle of the peer.
+ * @param peer_has The pieces the peer has.
+ * @param flags Flags for piece_picker_pick_flags().
+ * @param req Filled with the request on success.
+ * @return Returns 0 if there is nothing to request from the peer;
+ * otherwise returns a non-zero value
+ */
+int block_tracker_next(struct block_tracker *bt, int peer, const struct bitfield *peer_has,
+                       unsigned flags, struct block_request *req);
+
+/**
+ * Record a block received from a peer, and cancel the requests for it
+ * sent to other peers. On BLOCK_TRACKER_COMPLETE the piece is no
+ * longer tracked; report it to the picker with piece_picker_done() or
+ * piece_picker_abort() once it is verified.
+ *
+ * @param bt A pointer to the tracker.
+ * @param peer The handle of the peer.
+ * @param piece The index of the piece.
+ * @param begin The offset of the block in the piece.
+ * @param length The length of the block.
+ * @return What became of the block.
+ */
+enum block_tracker_result block_tracker_received(struct block_tracker *bt, int peer, size_t piece,
+                                                 uint32_t begin, uint32_t length);
+
+/**
+ * Forget the requests sent to a peer, because it choked us or went
+ * away; its blocks can be requested from other peers.
+ */
+void block_tracker_drop_peer(struct block_tracker *bt, int peer);
+
+/**
+ * Returns 1 if every block still missing is requested, 0 otherwise.
+ */
+int block_tracker_in_endgame(const struct block_tracker *bt);
+
+/**
+ * Returns the number of requests waiting for a block.
+ */
+size_t block_tracker_outstanding(const struct block_tracker *bt);
+
+/**
+ * Returns the number of bytes received more than once.
+ */
+uint64_t block_tracker_duplicate_bytes(const struct block_tracker *bt);
+
+#endif
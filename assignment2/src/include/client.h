@@ -5,9 +5,24 @@
 #include <metainfo.h>
 #include <stdint.h>
 #include <peer.h>
+#include <storage.h>
+#include <piece_picker.h>
+#include <block_tracker.h>
+#include <peer_engine.h>
+#include <peer_table.h>
+#include <handoff_queue.h>
 
 struct client;
 
+/* Optional settings for client_new_opts(). */
+struct client_options {
+    const char *resume_path;  // fast-resume sidecar, NULL to always verify everything
+    int force_recheck;        // ignore the sidecar and verify every piece
+    enum storage_prealloc prealloc;  // how to reserve space when the data does not exist yet
+    size_t max_connecting;    // outbound connects in flight at once, 0 for the default
+    int connect_timeout_ms;   // deadline of each connect and handshake, 0 for the default
+};
+
 
 /**
  * Initializes a structure representing the internal state needed to
@@ -22,6 +37,22 @@ struct client;
  */
 struct client *client_new(struct metainfo_file *torrent, uint16_t port);
 
+/**
+ * Like client_new(), with options. With a resume_path, pieces recorded
+ * as verified in the sidecar are trusted as long as the size and mtime
+ * of their files are unchanged, so only the other pieces are hashed.
+ * The sidecar is rewritten after startup and when the client is
+ * released. When the data does not exist yet, its files are created
+ * and preallocated according to prealloc.
+ *
+ * @param torrent A pointer to the torrent file structure.
+ * @param port The port a peer listener should listen on.
+ * @param opts The options, may be NULL.
+ * @return Returns a pointer to the allocated client structure.
+ */
+struct client *client_new_opts(struct metainfo_file *torrent, uint16_t port,
+                               const struct client_options *opts);
+
 /**
  * Release all the memory internally used by the client.
  *
@@ -74,6 +105,94 @@ size_t client_downloaded(struct client *client);
  */
 size_t client_left(struct client *client);
 
+/**
+ * Returns the pieces the client has verified on disk.
+ *
+ * @param client A pointer to the client structure.
+ * @return A bitfield with one bit per piece, most significant bit
+ * first as in the peer wire protocol.
+ */
+const uint8_t *client_have(struct client *client);
+
+/**
+ * Returns the piece picker of the client. It starts with the pieces
+ * verified at startup marked as complete; peers' bitfield and have
+ * messages, and completed downloads, are reported to it.
+ *
+ * @param client A pointer to the client structure.
+ * @return A pointer to the picker.
+ */
+struct piece_picker *client_picker(struct client *client);
+
+/**
+ * Returns the block requests of the client, which take their pieces
+ * from client_picker() and switch to endgame at the end of the
+ * download.
+ *
+ * @param client A pointer to the client structure.
+ * @return A pointer to the block tracker.
+ */
+struct block_tracker *client_blocks(struct client *client);
+
+/**
+ * Returns the number of bytes downloaded more than once, the overhead
+ * of endgame and of duplicate requests for urgent pieces.
+ *
+ * @param client A pointer to the client structure.
+ * @return The number of duplicate bytes received by the client.
+ */
+uint64_t client_duplicate_bytes(struct client *client);
+
+/**
+ * Returns the engine that drives the client's non-blocking peer
+ * connections. Sockets handed to peer_engine_add() are reported to
+ * client_picker() once their handshake completes.
+ *
+ * @param client A pointer to the client structure.
+ * @return A pointer to the peer engine.
+ */
+struct peer_engine *client_engine(struct client *client);
+
+/**
+ * Wait for events on the peer connections and handle them, one round
+ * of the client's event loop.
+ *
+ * @param client A pointer to the client structure.
+ * @param timeout_ms The longest wait, -1 for no limit.
+ * @return The number of events handled, or -1 on failure.
+ */
+int client_poll(struct client *client, int timeout_ms);
+
+/**
+ * Set the download priority of a piece, see piece_picker_set_priority().
+ *
+ * @param client A pointer to the client structure.
+ * @param piece The index of the piece.
+ * @param priority PIECE_PRIORITY_SKIP to never download the piece, up
+ * to PIECE_PRIORITY_MAX.
+ * @return Returns 0 if the piece does not exist; otherwise returns a
+ * non-zero value
+ */
+int client_set_piece_priority(struct client *client, size_t piece, int priority);
+
+/**
+ * Download in playback order: the window pieces starting at the one
+ * that holds byte offset are fetched first and in order, and the first
+ * urgent of them are also requested from fast peers when they are
+ * already in flight. Call it again as playback advances.
+ *
+ * @param client A pointer to the client structure.
+ * @param offset The playback position, in bytes from the start of the
+ * torrent.
+ * @param window The number of pieces in the window, 0 to go back to
+ * rarest-first.
+ * @param urgent The number of pieces at the start of the window whose
+ * deadline is close.
+ * @return Returns 0 if offset is past the end of the torrent; otherwise
+ * returns a non-zero value
+ */
+int client_set_streaming(struct client *client, size_t offset, size_t window, size_t urgent);
+
 /**
  * Obtain the torrent file structure the client is
  * torrenting.
@@ -101,15 +220,67 @@ int client_tracker_connect(struct client *client);
 int client_peer_listener_start(struct client *client);
 
 /**
- * Register a peer connection.
+ * Register a peer connection. Safe to call from any thread. The
+ * connections of the event loop are registered by the client itself
+ * once their handshake completes, and unregistered when they close.
+ *
+ * @param client A pointer to the client structure.
+ * @param sockfd The socket of the connected peer, closed on failure.
+ * @return The handle of the peer, or PEER_HANDLE_NONE on failure.
+ */
+peer_handle_t client_add_connected_peer(struct client *client, int sockfd);
+
+/**
+ * Pass a connection whose handshake is done to the thread running
+ * client_poll(), which adds it to client_engine(). Safe to call from
+ * any thread, without locks; the listener threads use it.
+ *
+ * @param client A pointer to the client structure.
+ * @param sockfd The socket of the peer, closed on failure.
+ * @param peer_id The peer id received in the handshake.
+ * @return Returns 0 if the queue is full; otherwise returns a non-zero
+ * value
+ */
+int client_handoff_peer(struct client *client, int sockfd, const uint8_t peer_id[20]);
+
+/**
+ * Obtain the load counters of the queue between the listener threads
+ * and client_poll(): its depth, high watermark and dropped connections.
+ *
+ * @param client A pointer to the client structure.
+ * @param stats Receives the counters.
+ */
+void client_incoming_stats(struct client *client, struct handoff_queue_stats *stats);
+
+/**
+ * Unregister a peer connection and close its socket. Safe to call from
+ * any thread for peers added with client_add_connected_peer(); the
+ * connections of the event loop must be removed from the thread
+ * running client_poll(). A handle already removed is ignored.
+ *
+ * @param client A pointer to the client structure.
+ * @param peer The handle of the peer.
+ * @return Returns 0 if the peer was not registered; otherwise returns
+ * a non-zero value
+ */
+int client_remove_peer(struct client *client, peer_handle_t peer);
+
+/**
+ * Returns the number of registered peer connections, those of the
+ * event loop included.
  *
  * @param client A pointer to the client structure.
- * @param sockfd The socket of the connected peer.
  */
-void client_add_connected_peer(struct client *client, int sockfd);
+size_t client_num_peers(struct client *client);
 
 /**
- * Connect to each peer in a bencoded list of peers.
+ * Connect to each peer in a bencoded list of peers. The connects run
+ * concurrently and without blocking, within the limits set in
+ * client_options, and complete in client_poll(), so this must be
+ * called from the thread running it. Numeric IPv4 and IPv6 addresses
+ * are connected to right away; host names are resolved on a resolver
+ * thread, started on first use and joined by client_free(), and
+ * connected to from client_poll() once resolved.
  *
  * @param client A pointer to the client structure.
  * @param peers A bencoded list of peers.
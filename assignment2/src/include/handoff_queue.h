@@ -0,0 +1,92 @@
+#ifndef HANDOFF_QUEUE_H_INCLUDED
+#define HANDOFF_QUEUE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hands accepted, handshaken sockets from listener threads to the
+ * thread running the event loop. The queue is a bounded ring written
+ * by any number of threads and read by one, without locks: each cell
+ * carries a sequence number that tells producers whether it is free
+ * and the consumer whether it is filled.
+ *
+ * The consumer watches handoff_queue_fd(): an eventfd on Linux, or a
+ * pipe on systems without eventfd, such as macOS, and on kernels that
+ * do not support it. It becomes readable when an item arrives after
+ * the consumer found the queue empty, so a busy consumer costs
+ * producers no system calls.
+ */
+
+/* Default capacity, a power of two */
+#define HANDOFF_QUEUE_CAPACITY 1024
+
+/* A socket whose handshake is done */
+struct handoff {
+    int fd;
+    uint8_t peer_id[20];
+};
+
+/* Load counters, for diagnostics */
+struct handoff_queue_stats {
+    size_t depth;           // waiting to be popped
+    size_t high_watermark;  // the largest depth seen
+    uint64_t pushed;
+    uint64_t dropped;       // pushes refused because the queue was full
+};
+
+struct handoff_queue;
+
+/**
+ * Create an empty queue.
+ *
+ * @param capacity The number of cells, rounded up to a power of two.
+ * @return A pointer to the queue, or NULL on failure.
+ */
+struct handoff_queue *handoff_queue_new(size_t capacity);
+
+/**
+ * Release the queue, closing the sockets still in it.
+ *
+ * @param q A pointer to the queue, may be NULL.
+ */
+void handoff_queue_free(struct handoff_queue *q);
+
+/**
+ * Append an item. Safe to call from any number of threads.
+ *
+ * @param q A pointer to the queue.
+ * @param item The item, copied.
+ * @return Returns 0 if the queue is full; otherwise returns a non-zero
+ * value
+ */
+int handoff_queue_push(struct handoff_queue *q, const struct handoff *item);
+
+/**
+ * Take the oldest item. Only one thread may pop.
+ *
+ * @param q A pointer to the queue.
+ * @param item Receives the item.
+ * @return Returns 0 if the queue is empty; otherwise returns a non-zero
+ * value
+ */
+int handoff_queue_pop(struct handoff_queue *q, struct handoff *item);
+
+/**
+ * Returns the descriptor that becomes readable when items arrive. The
+ * consumer calls handoff_queue_clear_wakeup() and then pops until the
+ * queue is empty.
+ */
+int handoff_queue_fd(const struct handoff_queue *q);
+
+/**
+ * Consume the pending wakeups, before popping.
+ */
+void handoff_queue_clear_wakeup(struct handoff_queue *q);
+
+/**
+ * Fill stats with the current counters.
+ */
+void handoff_queue_stats(const struct handoff_queue *q, struct handoff_queue_stats *stats);
+
+#endif
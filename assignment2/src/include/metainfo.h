@@ -2,13 +2,32 @@
 #define METAINFO_H_INCLUDED
 
 #include <stddef.h>
+#include <stdint.h>
 #include <openssl/sha.h>
 
+/* Alignment of the piece-hash table, one cache line */
+#define METAINFO_HASHES_ALIGN 64
+
+/*
+ * One file of the torrent's content. Files are laid out back to back
+ * in piece space: offset is the position of the file's first byte in
+ * the concatenated content.
+ */
+struct metainfo_file_span {
+    const char *path;  // "name" for single-file torrents, "name/dir/file" otherwise
+    size_t offset;
+    size_t length;
+};
+
 struct metainfo_info {
     char *name;
     size_t piece_length;
-    size_t length;
-    char *pieces;
+    size_t length;  // total length of all files
+    uint8_t (*hashes)[SHA_DIGEST_LENGTH];  // cache-aligned, one SHA1 per piece
+    size_t pieces_count;
+    struct metainfo_file_span *files;  // sorted by offset
+    size_t files_count;
+    char *path_pool;  // storage for every files[i].path of a multi-file torrent
 };
 
 struct metainfo_file {
@@ -42,9 +61,14 @@ void metainfo_file_free(struct metainfo_file *file);
  *
  * @param file The torrent file structure.
  * @param i The index of the piece.
- * @return The hash value of the i-th piece.
+ * @return The hash value of the i-th piece, or NULL if i is out of
+ * range.
  */
-const char *metainfo_file_piece_hash(struct metainfo_file *file, size_t i);
+static inline const char *metainfo_file_piece_hash(const struct metainfo_file *file, size_t i) {
+    if (i >= file->info.pieces_count)
+        return NULL;
+    return (const char *)file->info.hashes[i];
+}
 
 /**
  * Returns the number of pieces.
@@ -52,6 +76,41 @@ const char *metainfo_file_piece_hash(struct metainfo_file *file, size_t i);
  * @param file The torrent file structure.
  * @return The number of pieces.
  */
-size_t metainfo_file_pieces_count(struct metainfo_file *file);
+static inline size_t metainfo_file_pieces_count(const struct metainfo_file *file) {
+    return file->info.pieces_count;
+}
+
+/**
+ * Compare n computed digests against the hashes of pieces first to
+ * first + n - 1 in one call, using SIMD compares where available.
+ *
+ * @param file The torrent file structure.
+ * @param first The index of the piece digests[0] belongs to.
+ * @param n The number of digests.
+ * @param digests The computed SHA1 digests.
+ * @param ok If not NULL, ok[k] is set to 1 if digests[k] matches and
+ * to 0 otherwise.
+ * @return The number of matching digests. Digests past the last piece
+ * never match.
+ */
+size_t metainfo_file_verify_hashes(const struct metainfo_file *file, size_t first, size_t n,
+                                   const uint8_t (*digests)[SHA_DIGEST_LENGTH], uint8_t *ok);
+
+/**
+ * Find the files the i-th piece overlaps, in O(log n) in the number
+ * of files. first and last never name a zero-length file, but
+ * zero-length files between them are part of the range.
+ *
+ * @param file The torrent file structure.
+ * @param i The index of the piece.
+ * @param first An output parameter receiving the index in info.files
+ * of the file holding the first byte of the piece.
+ * @param last An output parameter receiving the index of the file
+ * holding the last byte of the piece.
+ * @return The number of files in [first, last], or 0 if i is out of
+ * range.
+ */
+size_t metainfo_file_piece_files(const struct metainfo_file *file, size_t i,
+                                 size_t *first, size_t *last);
 
 #endif
@@ -39,6 +39,18 @@ int peer_init(struct peer *peer, struct client *client, int sockfd);
 int peer_connect(struct peer *peer, struct client *client,
 		 const char *ip, uint16_t port);
 
+/**
+ * Completes the handshake of an incoming connection: it receives and
+ * checks the peer's handshake, then answers with ours. An invalid
+ * handshake shuts the connection down for writing.
+ *
+ * @param peer A pointer to the peer connection structure.
+ * @param client A pointer to the client.
+ * @param sockfd The accepted socket.
+ * @return Returns 0 on failure; otherwise return a non-zero value.
+ */
+int peer_accept(struct peer *peer, struct client *client, int sockfd);
+
 /**
  * Release all the memory internally used by the peer connection, and
  * closes the associated socket. Note that the peer pointer should not
@@ -0,0 +1,193 @@
+#ifndef PEER_ENGINE_H_INCLUDED
+#define PEER_ENGINE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <reactor.h>
+#include <peer_wire.h>
+
+/*
+ * Peer connections driven by a reactor. Each connection is a small
+ * state machine: it waits for a non-blocking connect to finish, then
+ * exchanges the 68-byte handshake, then reads and writes peer wire
+ * messages, never blocking and without a thread per peer. Outgoing
+ * messages are sent directly when the socket has room, and queued
+ * until it becomes writable otherwise.
+ *
+ * The engine also connects to peers itself: addresses handed to
+ * peer_engine_connect() are attempted concurrently, at most
+ * max_connecting at a time, and an attempt that has not completed its
+ * handshake by its deadline is given up, so dead entries in a peer
+ * list cost one timeout in total rather than one each.
+ */
+
+/* Defaults of peer_engine_set_connect_limits() */
+#define PEER_ENGINE_MAX_CONNECTING 32
+#define PEER_ENGINE_CONNECT_TIMEOUT_MS 10000
+
+enum peer_conn_state {
+    PEER_CONN_CONNECTING,  // waiting for connect() to complete
+    PEER_CONN_HANDSHAKE,   // exchanging handshakes
+    PEER_CONN_ACTIVE,      // exchanging messages
+    PEER_CONN_CLOSED,      // closed from a callback, released after it returns
+};
+
+struct peer_conn;
+struct peer_engine;
+
+/* Outcome of the attempts made by peer_engine_connect() */
+struct peer_engine_connect_stats {
+    size_t queued;      // waiting for a free slot
+    size_t connecting;  // connecting or exchanging handshakes
+    size_t succeeded;   // reached the active state
+    size_t failed;      // refused, reset or invalid handshake
+    size_t timed_out;   // past their deadline
+};
+
+/* What the owner of the engine is told; every callback may be NULL */
+struct peer_engine_ops {
+    /* The handshake completed */
+    void (*ready)(void *ctx, struct peer_conn *conn);
+    /* A message arrived; return 0 to close the connection */
+    int (*message)(void *ctx, struct peer_conn *conn, const struct peer_msg *msg);
+    /* The connection is about to be released, whatever the reason */
+    void (*closed)(void *ctx, struct peer_conn *conn);
+};
+
+/**
+ * Create an engine for one torrent.
+ *
+ * @param r The reactor the connections are registered with.
+ * @param info_hash The info hash of the torrent.
+ * @param peer_id Our peer id.
+ * @param ops The callbacks.
+ * @param ctx Passed to the callbacks.
+ * @return A pointer to the engine, or NULL on allocation failure.
+ */
+struct peer_engine *peer_engine_new(struct reactor *r, const uint8_t info_hash[20],
+                                    const uint8_t peer_id[20],
+                                    const struct peer_engine_ops *ops, void *ctx);
+
+/**
+ * Close every connection and release the engine.
+ *
+ * @param pe A pointer to the engine, may be NULL.
+ */
+void peer_engine_free(struct peer_engine *pe);
+
+/**
+ * Hand a socket over to the engine, which owns it from then on and
+ * sends our handshake.
+ *
+ * @param pe A pointer to the engine.
+ * @param fd A connected socket, or one with a non-blocking connect in
+ * progress; it is made non-blocking.
+ * @param connecting Whether connect() returned EINPROGRESS.
+ * @return The connection, or NULL on failure, in which case fd is
+ * closed.
+ */
+struct peer_conn *peer_engine_add(struct peer_engine *pe, int fd, int connecting);
+
+/**
+ * Hand over a socket whose handshake was already exchanged elsewhere,
+ * e.g. by a listener thread. The connection starts in the active state
+ * and the ready callback is called before this returns.
+ *
+ * @param pe A pointer to the engine.
+ * @param fd The socket; it is made non-blocking.
+ * @param peer_id The peer id received in the handshake.
+ * @return The connection, or NULL on failure or if the ready callback
+ * closed it; fd is closed in both cases.
+ */
+struct peer_conn *peer_engine_adopt(struct peer_engine *pe, int fd, const uint8_t peer_id[20]);
+
+/**
+ * Set how many outbound attempts may be in flight at once, and how long
+ * each may take from connect() to the end of the handshake.
+ *
+ * @param pe A pointer to the engine.
+ * @param max_connecting The parallelism cap, at least 1.
+ * @param timeout_ms The deadline of each attempt.
+ */
+void peer_engine_set_connect_limits(struct peer_engine *pe, size_t max_connecting,
+                                    int timeout_ms);
+
+/**
+ * Connect to a peer without blocking. The attempt starts right away if
+ * a slot is free, or when one frees up. A successful attempt is
+ * reported through the ready callback like any other connection; a
+ * failed one through the closed callback, if it got a socket.
+ *
+ * @param pe A pointer to the engine.
+ * @param addr The address of the peer.
+ * @param addrlen The length of addr.
+ * @return Returns 0 on allocation failure; otherwise returns a non-zero
+ * value
+ */
+int peer_engine_connect(struct peer_engine *pe, const struct sockaddr *addr, socklen_t addrlen);
+
+/**
+ * Fill stats with the state of the outbound attempts so far.
+ */
+void peer_engine_connect_stats(const struct peer_engine *pe,
+                               struct peer_engine_connect_stats *stats);
+
+/**
+ * Send a message, or queue it until the socket is writable. The
+ * payload is copied only when it has to be queued.
+ *
+ * @param conn The connection, in the handshake or active state.
+ * @param msg The message.
+ * @return Returns 0 if the connection is closed or out of memory;
+ * otherwise returns a non-zero value
+ */
+int peer_conn_send(struct peer_conn *conn, const struct peer_msg *msg);
+
+/**
+ * Close a connection. From inside a callback of the same connection,
+ * it is released once the callback returns.
+ */
+void peer_conn_close(struct peer_conn *conn);
+
+/**
+ * Returns the state of the connection.
+ */
+enum peer_conn_state peer_conn_state(const struct peer_conn *conn);
+
+/**
+ * Returns the socket of the connection, owned by the engine.
+ */
+int peer_conn_fd(const struct peer_conn *conn);
+
+/**
+ * Returns the peer id received in the handshake.
+ */
+const uint8_t *peer_conn_peer_id(const struct peer_conn *conn);
+
+/**
+ * Returns the choke and interest state of the connection.
+ */
+const struct peer_wire *peer_conn_wire(const struct peer_conn *conn);
+
+/**
+ * Returns the number of bytes waiting in the send queue.
+ */
+size_t peer_conn_queued(const struct peer_conn *conn);
+
+/**
+ * Attach caller data to the connection.
+ */
+void peer_conn_set_user(struct peer_conn *conn, void *user);
+
+/**
+ * Returns the data attached with peer_conn_set_user(), NULL at first.
+ */
+void *peer_conn_user(const struct peer_conn *conn);
+
+/**
+ * Returns the number of open connections.
+ */
+size_t peer_engine_count(const struct peer_engine *pe);
+
+#endif
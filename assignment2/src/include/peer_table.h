@@ -0,0 +1,104 @@
+#ifndef PEER_TABLE_H_INCLUDED
+#define PEER_TABLE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The set of connected peers, shared by the threads that accept or
+ * connect peers and the one that uses them. Slots live in slabs that
+ * are never moved or freed before the table, so a peer is named by a
+ * stable handle: the slot index and the slot's generation. Removing a
+ * peer bumps the generation, so a handle kept after the removal, even
+ * once the slot is reused, no longer matches.
+ *
+ * Insert, remove and lookup are O(1) and lock-free: free slots form a
+ * stack whose head carries a tag bumped on every pop, and lookups read
+ * the generation before and after copying the entry.
+ */
+
+/* Slots per slab, and the most slabs the table grows to */
+#define PEER_TABLE_SLAB 256
+#define PEER_TABLE_MAX_SLABS 4096
+
+/* A peer: (generation << 32) | slot; 0 is never a valid handle */
+typedef uint64_t peer_handle_t;
+
+#define PEER_HANDLE_NONE 0
+
+struct peer_entry {
+    int fd;       // the socket of the peer
+    void *user;   // caller data
+};
+
+struct peer_table;
+
+/**
+ * Create an empty table. The first slab is allocated right away.
+ *
+ * @return A pointer to the table, or NULL on allocation failure.
+ */
+struct peer_table *peer_table_new(void);
+
+/**
+ * Release the table. Sockets are not closed.
+ *
+ * @param pt A pointer to the table, may be NULL.
+ */
+void peer_table_free(struct peer_table *pt);
+
+/**
+ * Add a peer. Safe to call from any thread.
+ *
+ * @param pt A pointer to the table.
+ * @param fd The socket of the peer.
+ * @param user Caller data.
+ * @return The handle of the peer, or PEER_HANDLE_NONE when the table
+ * is full or out of memory.
+ */
+peer_handle_t peer_table_insert(struct peer_table *pt, int fd, void *user);
+
+/**
+ * Remove a peer. Of several threads removing the same handle, exactly
+ * one succeeds.
+ *
+ * @param pt A pointer to the table.
+ * @param h The handle of the peer.
+ * @param entry If not NULL, receives the removed entry.
+ * @return Returns 0 if h is not in the table (already removed, or
+ * never valid); otherwise returns a non-zero value
+ */
+int peer_table_remove(struct peer_table *pt, peer_handle_t h, struct peer_entry *entry);
+
+/**
+ * Look a peer up.
+ *
+ * @param pt A pointer to the table.
+ * @param h The handle of the peer.
+ * @param entry Receives a copy of the entry.
+ * @return Returns 0 if h is not in the table; otherwise returns a
+ * non-zero value
+ */
+int peer_table_get(const struct peer_table *pt, peer_handle_t h, struct peer_entry *entry);
+
+/**
+ * Called by peer_table_foreach() for each peer; return 0 to stop.
+ */
+typedef int (*peer_table_fn)(void *arg, peer_handle_t h, const struct peer_entry *entry);
+
+/**
+ * Call fn for every peer in the table. Peers inserted or removed
+ * meanwhile by other threads may or may not be visited.
+ *
+ * @param pt A pointer to the table.
+ * @param fn The callback, which may remove the peer it is given.
+ * @param arg Passed to fn.
+ */
+void peer_table_foreach(const struct peer_table *pt, peer_table_fn fn, void *arg);
+
+/**
+ * Returns the number of peers in the table.
+ */
+size_t peer_table_count(const struct peer_table *pt);
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef PEER_WIRE_H_INCLUDED
+#define PEER_WIRE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The length-prefixed messages exchanged after the handshake. Bytes
+ * read from the socket land in a per-connection ring buffer and are
+ * parsed in place: a piece or bitfield payload is handed to the
+ * callback as a pointer into the ring, so a block can go from the
+ * socket to storage_write() without being copied.
+ *
+ * The ring maps the same memfd pages twice, back to back, so a message
+ * that wraps around the end of the ring is still contiguous in memory.
+ * Where that is not possible the ring falls back to a flat buffer that
+ * moves the unread tail to the front before each read.
+ */
+
+/* Default receive ring: a 16 KiB block and plenty of small messages */
+#define PEER_WIRE_RING_SIZE (256 * 1024)
+/* The longest message header, request and cancel */
+#define PEER_WIRE_HEADER_MAX 17
+
+enum peer_msg_id {
+    PEER_MSG_KEEP_ALIVE = -1,  // a length of zero, no id
+    PEER_MSG_CHOKE = 0,
+    PEER_MSG_UNCHOKE = 1,
+    PEER_MSG_INTERESTED = 2,
+    PEER_MSG_NOT_INTERESTED = 3,
+    PEER_MSG_HAVE = 4,
+    PEER_MSG_BITFIELD = 5,
+    PEER_MSG_REQUEST = 6,
+    PEER_MSG_PIECE = 7,
+    PEER_MSG_CANCEL = 8,
+};
+
+struct peer_msg {
+    int id;                  // enum peer_msg_id, or an id this module does not know
+    uint32_t index;          // have, request, piece, cancel
+    uint32_t begin;          // request, piece, cancel
+    uint32_t length;         // request, cancel
+    const uint8_t *payload;  // bitfield, piece block, or unknown message body
+    size_t payload_len;
+};
+
+struct peer_ring {
+    uint8_t *buf;
+    size_t size;    // a power of two, and a multiple of the page size
+    size_t head;    // bytes consumed
+    size_t tail;    // bytes written
+    int mirrored;
+};
+
+/* Connection state and receive buffer of one peer */
+struct peer_wire {
+    struct peer_ring in;
+    int am_choking;
+    int am_interested;
+    int peer_choking;
+    int peer_interested;
+};
+
+/**
+ * Called for every complete message. Payload pointers are only valid
+ * during the call.
+ *
+ * @return Returns 0 to stop parsing and drop the connection; otherwise
+ * returns a non-zero value
+ */
+typedef int (*peer_msg_fn)(void *ctx, const struct peer_msg *msg);
+
+/**
+ * Allocate a ring of at least size bytes.
+ *
+ * @param ring A pointer to the ring.
+ * @param size The minimum capacity, rounded up to a power of two.
+ * @param mirrored Whether to try the double mapping; on failure, or
+ * with 0, the ring is a flat buffer.
+ * @return Returns 0 on failure; otherwise returns a non-zero value
+ */
+int peer_ring_init(struct peer_ring *ring, size_t size, int mirrored);
+
+/**
+ * Release the memory of the ring.
+ */
+void peer_ring_free(struct peer_ring *ring);
+
+/**
+ * Returns where the next bytes should be written, and in space how
+ * many fit contiguously.
+ */
+uint8_t *peer_ring_write_ptr(struct peer_ring *ring, size_t *space);
+
+/**
+ * Make n bytes written at peer_ring_write_ptr() readable.
+ */
+void peer_ring_commit(struct peer_ring *ring, size_t n);
+
+/**
+ * Returns the unread bytes, contiguous, and in avail how many there are.
+ */
+const uint8_t *peer_ring_read_ptr(const struct peer_ring *ring, size_t *avail);
+
+/**
+ * Drop n bytes from the front of the unread bytes.
+ */
+void peer_ring_consume(struct peer_ring *ring, size_t n);
+
+/**
+ * Initialize the state of a new connection: both sides choked and not
+ * interested, as the protocol starts.
+ *
+ * @param pw A pointer to the structure.
+ * @param ring_size The size of the receive ring, at least the longest
+ * message expected (e.g. PEER_WIRE_RING_SIZE).
+ * @return Returns 0 on failure; otherwise returns a non-zero value
+ */
+int peer_wire_init(struct peer_wire *pw, size_t ring_size);
+
+/**
+ * Release the receive ring.
+ */
+void peer_wire_free(struct peer_wire *pw);
+
+/**
+ * Read once from fd into the receive ring.
+ *
+ * @param pw A pointer to the structure.
+ * @param fd The socket of the peer, blocking or not.
+ * @return The number of bytes read, 0 if the peer closed the
+ * connection, or -1 with errno set (EAGAIN on a non-blocking socket
+ * with nothing to read, ENOBUFS if the ring is full).
+ */
+ssize_t peer_wire_recv(struct peer_wire *pw, int fd);
+
+/**
+ * Hand every complete message in the receive ring to fn, in order,
+ * updating the choke and interest state first. An incomplete message
+ * is left in the ring for the next read.
+ *
+ * @param pw A pointer to the structure.
+ * @param fn The message callback.
+ * @param ctx Passed to fn.
+ * @return The number of messages handled, or -1 on a malformed
+ * message, a message longer than the ring, or when fn returns 0.
+ */
+int peer_wire_parse(struct peer_wire *pw, peer_msg_fn fn, void *ctx);
+
+/**
+ * Write the length prefix, id and fixed fields of msg; the payload of
+ * bitfield and piece messages is not copied.
+ *
+ * @param msg The message.
+ * @param buf A buffer of at least PEER_WIRE_HEADER_MAX bytes.
+ * @return The number of bytes written.
+ */
+size_t peer_wire_encode(const struct peer_msg *msg, uint8_t *buf);
+
+/**
+ * Send msg, with its payload taken by reference, and update the choke
+ * and interest state.
+ *
+ * @param pw A pointer to the structure.
+ * @param fd The blocking socket of the peer.
+ * @param msg The message.
+ * @return Returns 0 on failure; otherwise returns a non-zero value
+ */
+int peer_wire_send(struct peer_wire *pw, int fd, const struct peer_msg *msg);
+
+/**
+ * Update the choke and interest state for a message sent by other
+ * means, e.g. queued by an event loop.
+ *
+ * @param pw A pointer to the structure.
+ * @param id The id of the message sent.
+ */
+void peer_wire_sent(struct peer_wire *pw, int id);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef PIECE_ASSEMBLER_H_INCLUDED
+#define PIECE_ASSEMBLER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <metainfo.h>
+
+/*
+ * Incremental verification of downloaded pieces. Every in-flight piece
+ * keeps a streaming SHA1 context; blocks are hashed in offset order as
+ * they arrive, and a block that lands ahead of the hashed prefix is
+ * copied aside until the gap before it is filled. The piece is checked
+ * as soon as its last block is added, so it never has to be read back
+ * from disk. Writing the blocks to disk is left to the caller.
+ */
+
+/* Size of a request in the peer wire protocol; every block but the
+ * last one of a piece has this length. */
+#define PIECE_BLOCK_SIZE 16384
+
+enum piece_block_result {
+    PIECE_BLOCK_ERROR,      // out of range, misaligned, wrong length, or out of memory
+    PIECE_BLOCK_DUPLICATE,  // the block was already added; it is ignored
+    PIECE_BLOCK_ACCEPTED,   // the piece still misses blocks
+    PIECE_BLOCK_VALID,      // the piece is complete and matches its hash
+    PIECE_BLOCK_CORRUPT,    // the piece is complete but does not match
+};
+
+struct piece_assembler;
+
+/**
+ * Create an assembler for torrent.
+ *
+ * @param torrent The torrent file structure, which must outlive the
+ * assembler.
+ * @return A pointer to the assembler, or NULL on allocation failure.
+ */
+struct piece_assembler *piece_assembler_new(const struct metainfo_file *torrent);
+
+/**
+ * Release the assembler and every in-flight piece.
+ *
+ * @param pa A pointer to the assembler, may be NULL.
+ */
+void piece_assembler_free(struct piece_assembler *pa);
+
+/**
+ * Add a block received in a piece message. begin must be a multiple of
+ * PIECE_BLOCK_SIZE and len the full length of that block.
+ *
+ * Once a piece completes, valid or not, its state is dropped: adding
+ * a block of it again starts the piece over.
+ *
+ * @param pa A pointer to the assembler.
+ * @param piece The index of the piece.
+ * @param begin The offset of the block within the piece.
+ * @param data The block data; it is only read during the call.
+ * @param len The length of the block.
+ * @return The outcome, see enum piece_block_result.
+ */
+enum piece_block_result piece_assembler_add(struct piece_assembler *pa, size_t piece,
+                                            size_t begin, const void *data, size_t len);
+
+/**
+ * Forget an in-flight piece, for example when the only peer sending
+ * it disconnects. Does nothing if the piece is not in flight.
+ *
+ * @param pa A pointer to the assembler.
+ * @param piece The index of the piece.
+ */
+void piece_assembler_abort(struct piece_assembler *pa, size_t piece);
+
+/**
+ * Returns the number of pieces with at least one block added.
+ */
+size_t piece_assembler_in_flight(const struct piece_assembler *pa);
+
+/**
+ * Returns the number of bytes held in out-of-order blocks waiting for
+ * the gap before them to be filled.
+ */
+size_t piece_assembler_buffered(const struct piece_assembler *pa);
+
+#endif
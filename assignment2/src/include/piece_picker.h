@@ -0,0 +1,179 @@
+#ifndef PIECE_PICKER_H_INCLUDED
+#define PIECE_PICKER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <bitfield.h>
+
+/*
+ * Rarest-first piece selection. The picker counts, for every piece,
+ * how many connected peers have it, and keeps the pieces that can be
+ * picked in one array sorted by that count. Pieces with the same count
+ * form a bucket; a have message or a peer going away moves a piece to
+ * the neighbouring bucket with a single swap, so updates are O(1) and
+ * the rarest pieces are always at the front of the array. Pieces in
+ * flight, skipped or done are moved out of the buckets, at a cost of
+ * one swap per bucket, so picks never walk over them.
+ *
+ * A pick returns the first piece of the array the peer has: O(1) for
+ * a peer with the rarest pieces, such as a seed, but up to the number
+ * of pickable pieces for a peer that only has common ones.
+ *
+ * Until random_first pieces are complete, pieces are picked at random
+ * instead, so a new client quickly has something to trade. Once every
+ * missing piece is being downloaded the picker enters endgame and
+ * hands out pieces that are already in flight.
+ *
+ * For streaming, callers can raise or lower the priority of single
+ * pieces, and set a deadline window: the pieces in the window are
+ * picked in order before anything else, and the first urgent ones,
+ * whose deadline is closest, are also handed out a second time to
+ * peers the caller marks as fast, so a slow peer cannot hold up
+ * playback.
+ */
+
+#define PIECE_PICKER_NONE ((size_t)-1)
+/* Default number of pieces picked at random before rarest-first */
+#define PIECE_PICKER_RANDOM_FIRST 4
+/* How many peers an urgent piece is requested from at most */
+#define PIECE_PICKER_MAX_REQUESTS 2
+
+/* Flags for piece_picker_pick_flags() */
+#define PIECE_PICKER_FAST_PEER 1
+
+/* Piece priorities: SKIP pieces are never picked, higher ones are
+ * picked before NORMAL ones regardless of their availability */
+#define PIECE_PRIORITY_SKIP 0
+#define PIECE_PRIORITY_NORMAL 1
+#define PIECE_PRIORITY_MAX 7
+
+struct piece_picker;
+
+/**
+ * Create a picker.
+ *
+ * @param pieces The number of pieces of the torrent.
+ * @param have The pieces we already have, or NULL for none.
+ * @param seed The seed for random-first and for breaking ties between
+ * pieces that are equally rare.
+ * @return A pointer to the picker, or NULL on allocation failure.
+ */
+struct piece_picker *piece_picker_new(size_t pieces, const struct bitfield *have, uint32_t seed);
+
+/**
+ * Release the picker.
+ *
+ * @param pp A pointer to the picker, may be NULL.
+ */
+void piece_picker_free(struct piece_picker *pp);
+
+/**
+ * Count the pieces of a peer, on its bitfield message.
+ */
+void piece_picker_add_peer(struct piece_picker *pp, const struct bitfield *peer_has);
+
+/**
+ * Stop counting the pieces of a peer, when it disconnects.
+ */
+void piece_picker_remove_peer(struct piece_picker *pp, const struct bitfield *peer_has);
+
+/**
+ * Count one more peer having piece, on its have message.
+ */
+void piece_picker_peer_have(struct piece_picker *pp, size_t piece);
+
+/**
+ * Choose the next piece to download from a peer and mark it as being
+ * downloaded.
+ *
+ * @param pp A pointer to the picker.
+ * @param peer_has The pieces the peer has.
+ * @return The index of the piece, or PIECE_PICKER_NONE if the peer
+ * has nothing we need. In endgame the piece may already be in flight
+ * from another peer.
+ */
+size_t piece_picker_pick(struct piece_picker *pp, const struct bitfield *peer_has);
+
+/**
+ * Like piece_picker_pick(), with flags. With PIECE_PICKER_FAST_PEER,
+ * an urgent piece of the deadline window that is already in flight may
+ * be returned again, up to PIECE_PICKER_MAX_REQUESTS times; whichever
+ * request completes first wins and the others should be cancelled.
+ *
+ * @param pp A pointer to the picker.
+ * @param peer_has The pieces the peer has.
+ * @param flags A combination of PIECE_PICKER_* flags.
+ * @return The index of the piece, or PIECE_PICKER_NONE.
+ */
+size_t piece_picker_pick_flags(struct piece_picker *pp, const struct bitfield *peer_has,
+                               unsigned flags);
+
+/**
+ * Record that piece was downloaded and verified. It is never picked
+ * again.
+ */
+void piece_picker_done(struct piece_picker *pp, size_t piece);
+
+/**
+ * Give a piece that was being downloaded back to the picker, because
+ * it failed verification or its peer went away. If the piece was
+ * handed out more than once, only one of its requests is given back.
+ */
+void piece_picker_abort(struct piece_picker *pp, size_t piece);
+
+/**
+ * Returns the number of connected peers that have piece.
+ */
+uint32_t piece_picker_availability(const struct piece_picker *pp, size_t piece);
+
+/**
+ * Returns the number of pieces we still need, in flight or not.
+ * Pieces with PIECE_PRIORITY_SKIP are not needed.
+ */
+size_t piece_picker_missing(const struct piece_picker *pp);
+
+/**
+ * Returns 1 if every missing piece is being downloaded, 0 otherwise.
+ */
+int piece_picker_in_endgame(const struct piece_picker *pp);
+
+/**
+ * Set how many pieces are picked at random before switching to
+ * rarest-first (PIECE_PICKER_RANDOM_FIRST by default, 0 to disable).
+ */
+void piece_picker_set_random_first(struct piece_picker *pp, size_t n);
+
+/**
+ * Set the priority of a piece.
+ *
+ * @param pp A pointer to the picker.
+ * @param piece The index of the piece.
+ * @param priority From PIECE_PRIORITY_SKIP to PIECE_PRIORITY_MAX,
+ * clamped; PIECE_PRIORITY_NORMAL by default.
+ */
+void piece_picker_set_priority(struct piece_picker *pp, size_t piece, int priority);
+
+/**
+ * Returns the priority of a piece.
+ */
+int piece_picker_priority(const struct piece_picker *pp, size_t piece);
+
+/**
+ * Set the deadline window, e.g. the pieces after the playback position.
+ * Move it forward as playback advances.
+ *
+ * @param pp A pointer to the picker.
+ * @param first The first piece of the window.
+ * @param count The number of pieces in the window, 0 to disable it.
+ * @param urgent How many pieces at the start of the window may be
+ * requested from several fast peers.
+ */
+void piece_picker_set_deadline_window(struct piece_picker *pp, size_t first, size_t count,
+                                      size_t urgent);
+
+/**
+ * Returns how many times a piece in flight has been handed out.
+ */
+unsigned piece_picker_requests(const struct piece_picker *pp, size_t piece);
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef REACTOR_H_INCLUDED
+#define REACTOR_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A single-threaded event loop over epoll on Linux and kqueue on macOS
+ * and the BSDs. Every descriptor is registered edge-triggered for both
+ * directions once, so a handler is called when a socket becomes
+ * readable or writable and must then read or write until the call
+ * would block. Handlers may add and remove descriptors, including their
+ * own, while events are dispatched.
+ *
+ * Timers are kept in the loop as well: reactor_run_once() waits no
+ * longer than the earliest armed deadline, so a descriptor is not
+ * needed to time out connections.
+ */
+
+#define REACTOR_READ 0x1
+#define REACTOR_WRITE 0x2
+#define REACTOR_HANGUP 0x4  // error, or the peer closed its side
+
+/**
+ * Called with the events that occurred on fd, a combination of
+ * REACTOR_* flags.
+ */
+typedef void (*reactor_fn)(void *arg, int fd, unsigned events);
+
+struct reactor;
+
+/**
+ * Called once when a timer expires; the timer is disarmed by then and
+ * may be set again.
+ */
+typedef void (*reactor_timer_fn)(void *arg);
+
+/**
+ * A one-shot timer, embedded in its owner. The fields are private to
+ * the reactor; zero-initialize it before the first use.
+ */
+struct reactor_timer {
+    uint64_t deadline;  // reactor_now_ms() time
+    reactor_timer_fn fn;
+    void *arg;
+    int armed;
+    struct reactor_timer *next;
+};
+
+/**
+ * Create an event loop.
+ *
+ * @return A pointer to the reactor, or NULL on failure.
+ */
+struct reactor *reactor_new(void);
+
+/**
+ * Release the event loop. Registered descriptors are not closed.
+ *
+ * @param r A pointer to the reactor, may be NULL.
+ */
+void reactor_free(struct reactor *r);
+
+/**
+ * Watch a non-blocking descriptor.
+ *
+ * @param r A pointer to the reactor.
+ * @param fd The descriptor, not already watched.
+ * @param fn The handler.
+ * @param arg Passed to fn.
+ * @return Returns 0 on failure; otherwise returns a non-zero value
+ */
+int reactor_add(struct reactor *r, int fd, reactor_fn fn, void *arg);
+
+/**
+ * Stop watching a descriptor, before closing it. Events already
+ * collected for it are not dispatched.
+ */
+void reactor_remove(struct reactor *r, int fd);
+
+/**
+ * Wait for events and dispatch them, then call the expired timers.
+ *
+ * @param r A pointer to the reactor.
+ * @param timeout_ms The longest wait, -1 for no limit; shortened to
+ * the earliest timer deadline.
+ * @return The number of events dispatched and timers called, or -1 on
+ * failure.
+ */
+int reactor_run_once(struct reactor *r, int timeout_ms);
+
+/**
+ * Returns a monotonic time in milliseconds, the clock of timer
+ * deadlines.
+ */
+uint64_t reactor_now_ms(void);
+
+/**
+ * Arm or re-arm a timer. Expired timers are called by
+ * reactor_run_once() after the descriptor events it collected.
+ *
+ * @param r A pointer to the reactor.
+ * @param t The timer.
+ * @param deadline When to call fn, in reactor_now_ms() time.
+ * @param fn The callback.
+ * @param arg Passed to fn.
+ */
+void reactor_timer_set(struct reactor *r, struct reactor_timer *t, uint64_t deadline,
+                       reactor_timer_fn fn, void *arg);
+
+/**
+ * Disarm a timer, before freeing it. Does nothing if it is not armed.
+ */
+void reactor_timer_cancel(struct reactor *r, struct reactor_timer *t);
+
+/**
+ * Returns the number of descriptors watched.
+ */
+size_t reactor_count(const struct reactor *r);
+
+/**
+ * Put fd in non-blocking mode.
+ *
+ * @return Returns 0 on failure; otherwise returns a non-zero value
+ */
+int reactor_set_nonblocking(int fd);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef RESUME_H_INCLUDED
+#define RESUME_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <metainfo.h>
+
+/*
+ * Fast-resume sidecar. It is a bencoded dictionary holding the
+ * torrent's info_hash, the verified-piece bitfield and, for every
+ * file, the size and modification time it had when the bitfield was
+ * written:
+ *
+ *   d5:filesld6:lengthi..e5:mtimei..e8:mtime nsi..eee
+ *    9:info hash20:...6:pieces..:...e
+ *
+ * A file that did not exist is recorded with length -1.
+ */
+
+/**
+ * Load the sidecar at path and work out which pieces can be trusted.
+ *
+ * @param path The path of the sidecar.
+ * @param torrent The torrent file structure.
+ * @param have An output bitfield of (pieces + 7) / 8 bytes receiving
+ * the saved bitfield, restricted to trusted pieces.
+ * @param stale An output bitfield of the same size with a bit set for
+ * every piece that touches a file whose size or mtime changed; those
+ * pieces must be verified again.
+ * @return Returns 0 if there is no usable sidecar for this torrent
+ * (missing, corrupt, or written for another info_hash); otherwise
+ * returns a non-zero value.
+ */
+int resume_load(const char *path, const struct metainfo_file *torrent, uint8_t *have,
+                uint8_t *stale);
+
+/**
+ * Write the sidecar for torrent, recording the current size and
+ * mtime of its files. The file is replaced atomically.
+ *
+ * @param path The path of the sidecar.
+ * @param torrent The torrent file structure.
+ * @param have The bitfield of verified pieces.
+ * @return Returns 0 on failure; otherwise returns a non-zero value.
+ */
+int resume_save(const char *path, const struct metainfo_file *torrent, const uint8_t *have);
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef SHA1_MB_H_INCLUDED
+#define SHA1_MB_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA1 kernels for bulk piece hashing. The compression function is
+ * picked at run time from what the CPU supports:
+ *
+ *   SHA1_IMPL_AVX2    eight independent streams in the lanes of AVX2
+ *                     registers (multi-buffer)
+ *   SHA1_IMPL_SHANI   one stream at a time with the SHA extensions
+ *   SHA1_IMPL_SCALAR  portable C, always available
+ *
+ * For bulk work eight full AVX2 lanes out-run a single stream on the
+ * SHA extensions, so AVX2 is preferred. Single-stream hashing (sha1(),
+ * sha1_ctx) and short batches still use the SHA extensions when the
+ * CPU has them.
+ */
+
+#define SHA1_MB_DIGEST_LENGTH 20
+/* The most buffers hashed together by one multi-buffer kernel call */
+#define SHA1_MB_LANES 8
+
+enum sha1_impl {
+    SHA1_IMPL_AUTO,
+    SHA1_IMPL_SCALAR,
+    SHA1_IMPL_AVX2,
+    SHA1_IMPL_SHANI,
+};
+
+/* Incremental single-stream hashing, for data that arrives in pieces */
+struct sha1_ctx {
+    uint32_t state[5];
+    uint64_t length;
+    uint8_t block[64];
+    size_t block_len;
+};
+
+/**
+ * Hash n independent buffers. Buffers of different lengths may be
+ * mixed freely; the multi-buffer kernel masks lanes that finish early.
+ *
+ * @param data An array of n pointers to the buffers.
+ * @param len An array of n buffer lengths.
+ * @param n The number of buffers.
+ * @param out An array of n digests receiving the results.
+ */
+void sha1_mb(const uint8_t *const *data, const size_t *len, size_t n,
+             uint8_t (*out)[SHA1_MB_DIGEST_LENGTH]);
+
+/**
+ * Hash a single buffer with the fastest single-stream kernel.
+ *
+ * @param data The buffer.
+ * @param len The buffer length.
+ * @param out The output digest.
+ */
+void sha1(const void *data, size_t len, uint8_t out[SHA1_MB_DIGEST_LENGTH]);
+
+/**
+ * Start an incremental hash.
+ *
+ * @param ctx A pointer to the context.
+ */
+void sha1_init(struct sha1_ctx *ctx);
+
+/**
+ * Append len bytes to the hash. Whole blocks are compressed straight
+ * from data; only a trailing partial block is copied.
+ *
+ * @param ctx A pointer to the context.
+ * @param data The bytes to append.
+ * @param len The number of bytes.
+ */
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+
+/**
+ * Finish the hash. The context must be initialized again before reuse.
+ *
+ * @param ctx A pointer to the context.
+ * @param out The output digest.
+ */
+void sha1_final(struct sha1_ctx *ctx, uint8_t out[SHA1_MB_DIGEST_LENGTH]);
+
+/**
+ * Returns the number of buffers worth handing to sha1_mb() at once:
+ * SHA1_MB_LANES with the multi-buffer kernel, 1 otherwise.
+ */
+size_t sha1_mb_batch(void);
+
+/**
+ * Override the run-time selection, mostly for tests and benchmarks.
+ * The setting is process wide and must not change while other threads
+ * are hashing.
+ *
+ * @param impl The kernel to use; SHA1_IMPL_AUTO restores the default.
+ * @return Returns 0 if the CPU does not support impl and leaves the
+ * selection unchanged; otherwise returns a non-zero value.
+ */
+int sha1_mb_set_impl(enum sha1_impl impl);
+
+/**
+ * Returns the kernel currently in use (never SHA1_IMPL_AUTO).
+ */
+enum sha1_impl sha1_mb_get_impl(void);
+
+/**
+ * Returns a short name for impl, such as "avx2".
+ */
+const char *sha1_impl_name(enum sha1_impl impl);
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef STORAGE_H_INCLUDED
+#define STORAGE_H_INCLUDED
+
+#include <stddef.h>
+#include <metainfo.h>
+
+/*
+ * Positional I/O over the files of a torrent. Offsets are in piece
+ * space (see struct metainfo_file_span), so a single read may cross
+ * several files. All calls use pread/pwrite and are safe to issue
+ * from several threads at once.
+ */
+struct storage;
+
+/* How storage_create() reserves space for the files of a torrent. */
+enum storage_prealloc {
+    STORAGE_PREALLOC_NONE,    // create missing files empty, as before
+    STORAGE_PREALLOC_SPARSE,  // set every file to its full size without allocating blocks
+    STORAGE_PREALLOC_FULL,    // allocate every block up front with posix_fallocate
+};
+
+/**
+ * Create the files of the torrent, and the directories above them,
+ * and reserve their space according to mode. Existing files are never
+ * shrunk and their data is left untouched; with a preallocation mode
+ * they are extended to their full size. Once the space is reserved,
+ * writing pieces in any order never grows a file. Files that need no
+ * work are not opened for writing, so read-only data can be seeded.
+ *
+ * @param torrent The torrent file structure.
+ * @param mode The preallocation mode.
+ * @return Returns 0 on failure; otherwise returns a non-zero value.
+ */
+int storage_create(const struct metainfo_file *torrent, enum storage_prealloc mode);
+
+/**
+ * Open every file of the torrent for reading. Missing files are not
+ * an error: reads over them come back short.
+ *
+ * @param torrent The torrent file structure, which must outlive the
+ * storage.
+ * @return A pointer to the storage, or NULL on allocation failure.
+ */
+struct storage *storage_open(const struct metainfo_file *torrent);
+
+/**
+ * Like storage_open(), with the files open for reading and writing.
+ * Create them first with storage_create().
+ *
+ * @param torrent The torrent file structure, which must outlive the
+ * storage.
+ * @return A pointer to the storage, or NULL on allocation failure.
+ */
+struct storage *storage_open_rw(const struct metainfo_file *torrent);
+
+/**
+ * Close every file and release the storage.
+ *
+ * @param storage A pointer to the storage, may be NULL.
+ */
+void storage_close(struct storage *storage);
+
+/**
+ * Read len bytes starting at offset in piece space.
+ *
+ * @param storage A pointer to the storage.
+ * @param offset The offset of the first byte in the torrent content.
+ * @param buf The output buffer.
+ * @param len The number of bytes to read.
+ * @return The number of bytes read. It is smaller than len when a
+ * file is missing, shorter than expected or a read fails.
+ */
+size_t storage_read(struct storage *storage, size_t offset, void *buf, size_t len);
+
+/**
+ * Write len bytes starting at offset in piece space, e.g. a block
+ * received from a peer, straight from the receive buffer.
+ *
+ * @param storage A pointer to the storage, opened with
+ * storage_open_rw().
+ * @param offset The offset of the first byte in the torrent content.
+ * @param buf The bytes to write.
+ * @param len The number of bytes to write.
+ * @return The number of bytes written. It is smaller than len when a
+ * file is missing, read-only, or a write fails.
+ */
+size_t storage_write(struct storage *storage, size_t offset, const void *buf, size_t len);
+
+/**
+ * Read the i-th piece into buf, which must hold at least
+ * torrent->info.piece_length bytes.
+ *
+ * @param storage A pointer to the storage.
+ * @param i The index of the piece.
+ * @param buf The output buffer.
+ * @return Returns 0 if the piece could not be read in full; otherwise
+ * returns its length.
+ */
+size_t storage_read_piece(struct storage *storage, size_t i, void *buf);
+
+/**
+ * Returns the length of the i-th piece: piece_length for every piece
+ * but the last one, which may be shorter.
+ *
+ * @param torrent The torrent file structure.
+ * @param i The index of the piece.
+ * @return The length of the piece in bytes, or 0 if i is out of range.
+ */
+size_t storage_piece_size(const struct metainfo_file *torrent, size_t i);
+
+/**
+ * Tell whether the i-th piece lies entirely in holes of sparse files,
+ * found with SEEK_DATA. Depending on the file system, blocks that were
+ * allocated but never written may count as holes too. Either way the
+ * piece reads back as zeros, so it can be checked against the hash of
+ * a zero piece without reading it.
+ *
+ * @param storage A pointer to the storage.
+ * @param i The index of the piece.
+ * @return Returns 1 if every byte of the piece is in a hole; returns 0
+ * if some byte may hold data, a file is missing, or the system cannot
+ * report holes.
+ */
+int storage_piece_is_hole(struct storage *storage, size_t i);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef VERIFY_H_INCLUDED
+#define VERIFY_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <metainfo.h>
+
+/* Number of consecutive pieces a worker claims at a time. */
+#define VERIFY_CHUNK_PIECES 16
+
+/*
+ * Called after every chunk of pieces with the number of pieces checked
+ * so far and the total. Calls come from the worker threads but never
+ * overlap, and done only grows.
+ */
+typedef void (*verify_progress_fn)(void *ctx, size_t done, size_t total);
+
+struct verify_options {
+    unsigned threads;             // 0 picks the number of online CPUs
+    verify_progress_fn progress;  // may be NULL
+    void *progress_ctx;
+    const uint8_t *only;          // if not NULL, only pieces whose bit is set are checked
+};
+
+/**
+ * Check the data on disk of every piece of torrent against its SHA1
+ * hash. The piece range is shared between a pool of worker threads,
+ * each with its own piece buffers, reading with pread. Pieces are
+ * hashed sha1_mb_batch() at a time with the multi-buffer SHA1 kernel.
+ * Pieces lying entirely in holes of sparse files are not read: they
+ * are checked against the hash of a zero piece.
+ *
+ * @param torrent The torrent file structure; its files are read
+ * through storage_open().
+ * @param have A bitfield of (pieces + 7) / 8 bytes. Bit i is set, most
+ * significant bit first as in the peer wire protocol, when piece i is
+ * valid and cleared otherwise. With opts->only, the bits of pieces
+ * that are not checked are left as they are.
+ * @param opts Options, may be NULL for the defaults.
+ * @return The number of bytes in the checked pieces found valid, or
+ * (size_t)-1 if the files could not be opened or no worker could
+ * allocate its piece buffers, so nothing was checked. Progress counts
+ * checked pieces only.
+ */
+size_t verify_torrent(const struct metainfo_file *torrent, uint8_t *have,
+                      const struct verify_options *opts);
+
+#endif
@@ -1,59 +1,218 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <openssl/sha.h>
 #include "metainfo.h"
 #include "bencode.h"
+#include "sha1_mb.h"
 
-int metainfo_file_read(struct metainfo_file *file, const char *path) {
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        perror("fopen");
+/* 种子文件的原始内容：普通文件用 mmap 映射，其他情况读入堆内存 */
+struct torrent_data {
+    char *buf;
+    size_t size;
+    int mapped;
+};
+
+/* 非普通文件（管道、设备等）无法映射，循环 read 到 EOF */
+static int torrent_data_read_all(struct torrent_data *data, int fd) {
+    size_t cap = 4096;
+    data->buf = malloc(cap);
+    data->size = 0;
+    data->mapped = 0;
+    if (!data->buf)
         return 0;
+    for (;;) {
+        if (data->size == cap) {
+            char *nb = realloc(data->buf, cap * 2);
+            if (!nb)
+                goto fail;
+            data->buf = nb;
+            cap *= 2;
+        }
+        ssize_t r = read(fd, data->buf + data->size, cap - data->size);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            goto fail;
+        }
+        if (r == 0)
+            return 1;
+        data->size += (size_t)r;
     }
-    // 获取文件大小
-    fseek(fp, 0, SEEK_END);
-    long filesize = ftell(fp);
-    rewind(fp);
+ fail:
+    free(data->buf);
+    data->buf = NULL;
+    return 0;
+}
 
-    char *buffer = malloc(filesize);
-    if (!buffer) {
-        fclose(fp);
+static int torrent_data_load(struct torrent_data *data, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
         return 0;
     }
-    if (fread(buffer, 1, filesize, fp) != (size_t)filesize) {
-        fclose(fp);
-        free(buffer);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
         return 0;
     }
-    fclose(fp);
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            // 解码器从头到尾顺序扫描一遍
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            data->buf = p;
+            data->size = (size_t)st.st_size;
+            data->mapped = 1;
+            return 1;
+        }
+    }
+    int ok = torrent_data_read_all(data, fd);
+    close(fd);
+    return ok;
+}
+
+static void torrent_data_release(struct torrent_data *data) {
+    if (data->mapped)
+        munmap(data->buf, data->size);
+    else
+        free(data->buf);
+    data->buf = NULL;
+}
+
+/* 路径的每一段都必须是普通名字，防止写到下载目录之外 */
+static int valid_path_component(const struct bencode_value *v) {
+    if (v->type != BENCODE_STR || v->as.str_value.len == 0)
+        return 0;
+    const char *s = v->as.str_value.str;
+    size_t len = v->as.str_value.len;
+    if ((len == 1 && s[0] == '.') || (len == 2 && s[0] == '.' && s[1] == '.'))
+        return 0;
+    return memchr(s, '/', len) == NULL && memchr(s, '\0', len) == NULL;
+}
+
+/*
+ * 解析多文件种子的 "files" 列表，展开成连续的 (path, offset, length) 数组。
+ * 所有路径（"name/段1/段2"）放在同一块 path_pool 中：第一遍计算大小，第二遍填充。
+ */
+static int parse_files(struct metainfo_info *info, const struct bencode_value *files) {
+    if (files->type != BENCODE_LIST || files->as.list_value.count == 0) {
+        fprintf(stderr, "Missing or invalid 'files' field in info.\n");
+        return 0;
+    }
+    size_t count = files->as.list_value.count;
+    size_t name_len = strlen(info->name);
+    size_t pool_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct bencode_value *entry = &files->as.list_value.values[i];
+        if (entry->type != BENCODE_MAP)
+            goto invalid;
+        const struct bencode_pair *len_pair = bencode_map_lookup(entry, "length");
+        const struct bencode_pair *path_pair = bencode_map_lookup(entry, "path");
+        if (!len_pair || len_pair->value.type != BENCODE_INT || len_pair->value.as.int_value < 0 ||
+            !path_pair || path_pair->value.type != BENCODE_LIST ||
+            path_pair->value.as.list_value.count == 0)
+            goto invalid;
+        pool_size += name_len + 1;  // "name" + '\0'
+        for (size_t j = 0; j < path_pair->value.as.list_value.count; j++) {
+            const struct bencode_value *comp = &path_pair->value.as.list_value.values[j];
+            if (!valid_path_component(comp))
+                goto invalid;
+            pool_size += 1 + comp->as.str_value.len;  // '/' + 段
+        }
+    }
 
-    // 解析 bencode 数据
+    info->files = malloc(count * sizeof(struct metainfo_file_span));
+    info->path_pool = malloc(pool_size);
+    if (!info->files || !info->path_pool)
+        return 0;
+    char *p = info->path_pool;
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct bencode_value *entry = &files->as.list_value.values[i];
+        const struct bencode_value *path = &bencode_map_lookup(entry, "path")->value;
+        size_t length = (size_t)bencode_map_lookup(entry, "length")->value.as.int_value;
+        if (length > SIZE_MAX - offset) {
+            fprintf(stderr, "Total length of 'files' overflows.\n");
+            return 0;
+        }
+        info->files[i].path = p;
+        info->files[i].offset = offset;
+        info->files[i].length = length;
+        memcpy(p, info->name, name_len);
+        p += name_len;
+        for (size_t j = 0; j < path->as.list_value.count; j++) {
+            const struct bencode_value *comp = &path->as.list_value.values[j];
+            *p++ = '/';
+            memcpy(p, comp->as.str_value.str, comp->as.str_value.len);
+            p += comp->as.str_value.len;
+        }
+        *p++ = '\0';
+        offset += length;
+    }
+    info->files_count = count;
+    info->length = offset;
+    return 1;
+
+ invalid:
+    fprintf(stderr, "Invalid entry in 'files' field in info.\n");
+    return 0;
+}
+
+int metainfo_file_read(struct metainfo_file *file, const char *path) {
+    int ok = 0;
+    int root_valid = 0;
     struct bencode_value root;
-    size_t decoded = bencode_value_decode(&root, buffer, filesize);
-    free(buffer);
+
+    file->announce = NULL;
+    file->info.name = NULL;
+    file->info.hashes = NULL;
+    file->info.pieces_count = 0;
+    file->info.files = NULL;
+    file->info.files_count = 0;
+    file->info.path_pool = NULL;
+
+    struct torrent_data data;
+    if (!torrent_data_load(&data, path))
+        return 0;
+    const char *buffer = data.buf;
+    size_t filesize = data.size;
+
+    // 以借用模式解析 bencode 数据：字符串直接指向映射的文件内容，
+    // 因此映射必须在 root 释放之后才能解除
+    size_t decoded = bencode_value_decode_opts(&root, buffer, filesize,
+                                               BENCODE_DECODE_BORROW | BENCODE_DECODE_SPANS);
     if (decoded == 0) {
         fprintf(stderr, "Failed to decode bencode data.\n");
-        return 0;
+        goto out;
     }
+    root_valid = 1;
     if (root.type != BENCODE_MAP) {
         fprintf(stderr, "Torrent file root is not a dictionary.\n");
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
 
     // 提取 "announce" 字段（必需）
     const struct bencode_pair *announce_pair = bencode_map_lookup(&root, "announce");
     if (!announce_pair || announce_pair->value.type != BENCODE_STR) {
         fprintf(stderr, "Missing or invalid 'announce' field.\n");
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
     file->announce = malloc(announce_pair->value.as.str_value.len + 1);
-    if (!file->announce) {
-        bencode_value_free(&root);
-        return 0;
-    }
+    if (!file->announce)
+        goto out;
     memcpy(file->announce, announce_pair->value.as.str_value.str, announce_pair->value.as.str_value.len);
     file->announce[announce_pair->value.as.str_value.len] = '\0';
 
@@ -61,8 +220,7 @@ int metainfo_file_read(struct metainfo_file *file, const char *path) {
     const struct bencode_pair *info_pair = bencode_map_lookup(&root, "info");
     if (!info_pair || info_pair->value.type != BENCODE_MAP) {
         fprintf(stderr, "Missing or invalid 'info' field.\n");
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
 
     // 对 info 字典中的必需字段进行校验
@@ -71,14 +229,11 @@ int metainfo_file_read(struct metainfo_file *file, const char *path) {
     const struct bencode_pair *name_pair = bencode_map_lookup(&info_pair->value, "name");
     if (!name_pair || name_pair->value.type != BENCODE_STR) {
         fprintf(stderr, "Missing or invalid 'name' field in info.\n");
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
     file->info.name = malloc(name_pair->value.as.str_value.len + 1);
-    if (!file->info.name) {
-        bencode_value_free(&root);
-        return 0;
-    }
+    if (!file->info.name)
+        goto out;
     memcpy(file->info.name, name_pair->value.as.str_value.str, name_pair->value.as.str_value.len);
     file->info.name[name_pair->value.as.str_value.len] = '\0';
 
@@ -87,72 +242,82 @@ int metainfo_file_read(struct metainfo_file *file, const char *path) {
     if (!piece_length_pair || piece_length_pair->value.type != BENCODE_INT ||
         piece_length_pair->value.as.int_value < 0) {
         fprintf(stderr, "Missing or invalid 'piece length' field in info.\n");
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
     file->info.piece_length = (size_t) piece_length_pair->value.as.int_value;
 
-    // 3. "length" 字段
+    // 3. 单文件种子有 "length" 字段，多文件种子有 "files" 列表
     const struct bencode_pair *length_pair = bencode_map_lookup(&info_pair->value, "length");
-    if (!length_pair || length_pair->value.type != BENCODE_INT ||
-        length_pair->value.as.int_value < 0) {
+    const struct bencode_pair *files_pair = bencode_map_lookup(&info_pair->value, "files");
+    if (length_pair) {
+        if (length_pair->value.type != BENCODE_INT || length_pair->value.as.int_value < 0) {
+            fprintf(stderr, "Missing or invalid 'length' field in info.\n");
+            goto out;
+        }
+        file->info.length = (size_t) length_pair->value.as.int_value;
+        file->info.files = malloc(sizeof(struct metainfo_file_span));
+        if (!file->info.files)
+            goto out;
+        file->info.files[0].path = file->info.name;
+        file->info.files[0].offset = 0;
+        file->info.files[0].length = file->info.length;
+        file->info.files_count = 1;
+    } else if (files_pair) {
+        if (!parse_files(&file->info, &files_pair->value))
+            goto out;
+    } else {
         fprintf(stderr, "Missing or invalid 'length' field in info.\n");
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
-    file->info.length = (size_t) length_pair->value.as.int_value;
 
     // 4. "pieces" 字段
     const struct bencode_pair *pieces_pair = bencode_map_lookup(&info_pair->value, "pieces");
     if (!pieces_pair || pieces_pair->value.type != BENCODE_STR) {
         fprintf(stderr, "Missing or invalid 'pieces' field in info.\n");
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
     size_t p_len = pieces_pair->value.as.str_value.len;
     if (p_len % SHA_DIGEST_LENGTH != 0) {
         fprintf(stderr, "The 'pieces' field length is not a multiple of %d.\n", SHA_DIGEST_LENGTH);
-        bencode_value_free(&root);
-        return 0;
+        goto out;
     }
     {
-        char *p_buf = malloc(sizeof(size_t) + p_len);
-        if (!p_buf) {
-            bencode_value_free(&root);
-            return 0;
-        }
-        memcpy(p_buf, &p_len, sizeof(size_t));  // 保存 pieces 长度
-        memcpy(p_buf + sizeof(size_t), pieces_pair->value.as.str_value.str, p_len);
-        file->info.pieces = p_buf + sizeof(size_t);
+        // 拷贝到按缓存行对齐的哈希表中；aligned_alloc 要求大小是对齐值的整数倍
+        size_t count = p_len / SHA_DIGEST_LENGTH;
+        size_t size = (p_len + METAINFO_HASHES_ALIGN - 1) / METAINFO_HASHES_ALIGN * METAINFO_HASHES_ALIGN;
+        file->info.hashes = aligned_alloc(METAINFO_HASHES_ALIGN, size ? size : METAINFO_HASHES_ALIGN);
+        if (!file->info.hashes)
+            goto out;
+        memcpy(file->info.hashes, pieces_pair->value.as.str_value.str, p_len);
+        file->info.pieces_count = count;
     }
 
-    // 重新编码 info 字典，用于计算 info_hash
+    // info_hash 是原始 info 字节的 SHA1：直接对 buffer 中的那一段求摘要，
+    // 既不需要重新编码，也能正确处理非规范编码的种子文件
     {
-        size_t needed = bencode_value_encode(&info_pair->value, NULL, 0);
-        if (needed == 0) {
-             fprintf(stderr, "Failed to compute needed size for encoding info dictionary.\n");
-             bencode_value_free(&root);
-             return 0;
-        }
-        char *temp_buf = malloc(needed);
-        if (!temp_buf) {
-             bencode_value_free(&root);
-             return 0;
-        }
-        size_t encoded_len = bencode_value_encode(&info_pair->value, temp_buf, needed);
-        if (encoded_len == 0) {
-             fprintf(stderr, "Failed to encode info dictionary.\n");
-             free(temp_buf);
-             bencode_value_free(&root);
-             return 0;
-        }
-        SHA1((unsigned char *)temp_buf, encoded_len, file->info_hash);
-        free(temp_buf);
+        size_t info_len;
+        const char *info_raw = bencode_value_span(&info_pair->value, buffer, &info_len);
+        if (!info_raw)
+            goto out;
+        sha1(info_raw, info_len, file->info_hash);
     }
-    
+    ok = 1;
 
-    bencode_value_free(&root);
-    return 1;
+ out:
+    if (root_valid)
+        bencode_value_free(&root);
+    torrent_data_release(&data);
+    if (!ok) {
+        metainfo_file_free(file);
+        file->announce = NULL;
+        file->info.name = NULL;
+        file->info.hashes = NULL;
+        file->info.pieces_count = 0;
+        file->info.files = NULL;
+        file->info.files_count = 0;
+        file->info.path_pool = NULL;
+    }
+    return ok;
 }
 
 void metainfo_file_free(struct metainfo_file *file) {
@@ -160,26 +325,64 @@ void metainfo_file_free(struct metainfo_file *file) {
         free(file->announce);
     if (file->info.name)
         free(file->info.name);
-    if (file->info.pieces)
-        // 释放时将指针还原到 malloc 返回的位置
-        free(file->info.pieces - sizeof(size_t));
+    free(file->info.hashes);
+    free(file->info.files);
+    free(file->info.path_pool);
 }
 
-const char *metainfo_file_piece_hash(struct metainfo_file *file, size_t i) {
-    if (!file->info.pieces)
-        return NULL;
-    size_t p_len;
-    memcpy(&p_len, file->info.pieces - sizeof(size_t), sizeof(size_t));
-    size_t count = p_len / SHA_DIGEST_LENGTH;
-    if (i >= count)
-        return NULL;
-    return file->info.pieces + i * SHA_DIGEST_LENGTH;
+/* 比较两个 20 字节摘要：前 16 字节用一次 SSE2 比较，剩下 4 字节按整数比较 */
+static inline int digest_equal(const uint8_t *a, const uint8_t *b) {
+#if defined(__SSE2__)
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vb = _mm_loadu_si128((const __m128i *)b);
+    uint32_t ta, tb;
+    memcpy(&ta, a + 16, 4);
+    memcpy(&tb, b + 16, 4);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xFFFF && ta == tb;
+#else
+    return memcmp(a, b, SHA_DIGEST_LENGTH) == 0;
+#endif
 }
 
-size_t metainfo_file_pieces_count(struct metainfo_file *file) {
-    if (!file->info.pieces)
+size_t metainfo_file_verify_hashes(const struct metainfo_file *file, size_t first, size_t n,
+                                   const uint8_t (*digests)[SHA_DIGEST_LENGTH], uint8_t *ok) {
+    size_t count = file->info.pieces_count;
+    size_t matched = 0;
+    for (size_t k = 0; k < n; k++) {
+        int eq = first < count && k < count - first &&
+                 digest_equal(digests[k], file->info.hashes[first + k]);
+        if (ok)
+            ok[k] = (uint8_t)eq;
+        matched += (size_t)eq;
+    }
+    return matched;
+}
+
+/* 找到包含字节 pos 的文件：offset <= pos 的最后一个文件（跳过其后的空文件） */
+static size_t file_at(const struct metainfo_info *info, size_t pos) {
+    size_t lo = 0, hi = info->files_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (info->files[mid].offset <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t metainfo_file_piece_files(const struct metainfo_file *file, size_t i,
+                                 size_t *first, size_t *last) {
+    const struct metainfo_info *info = &file->info;
+    if (info->files_count == 0 || info->piece_length == 0)
         return 0;
-    size_t p_len;
-    memcpy(&p_len, file->info.pieces - sizeof(size_t), sizeof(size_t));
-    return p_len / SHA_DIGEST_LENGTH;
-}
\ No newline at end of file
+    if (i >= (info->length + info->piece_length - 1) / info->piece_length)
+        return 0;
+    size_t start = i * info->piece_length;
+    size_t end = start + info->piece_length;
+    if (end > info->length)
+        end = info->length;
+    *first = file_at(info, start);
+    *last = file_at(info, end - 1);
+    return *last - *first + 1;
+}
@@ -181,6 +181,76 @@ int peer_connect(struct peer *peer, struct client *client, const char *ip, uint1
     return 1;
 }
 
+/*
+ * peer_accept - 处理入站连接的 handshake 流程（监听线程使用）
+ *
+ * 1. 设置接收超时，循环读取 68 字节 handshake 消息
+ * 2. 验证 handshake 各字段：pstrlen、pstr、reserved 字段、info_hash
+ * 3. 如果验证失败，调用 shutdown() 关闭写端，让对方的读返回 EOF，然后返回 0
+ * 4. 如果验证通过，构造 handshake 响应并发送给对端，保存对方的 peer_id，返回 1
+ */
+int peer_accept(struct peer *peer, struct client *client, int sockfd) {
+    // 与 peer_init 相同的接收超时，不发送 handshake 的连接不会一直占住监听线程
+    struct timeval timeout;
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("setsockopt SO_RCVTIMEO");
+        return 0;
+    }
+
+    unsigned char request[68];
+    size_t total_recv = 0;
+    while (total_recv < sizeof(request)) {
+        ssize_t n = recv(sockfd, request + total_recv, sizeof(request) - total_recv, 0);
+        if (n <= 0) {
+            perror("recv handshake from incoming peer");
+            return 0;
+        }
+        total_recv += n;
+    }
+
+    // 验证 handshake 消息格式
+    if (request[0] != 19) {
+        fprintf(stderr, "Incoming handshake invalid pstrlen: %d\n", request[0]);
+        shutdown(sockfd, SHUT_WR);
+        return 0;
+    }
+    if (memcmp(request + 1, "BitTorrent protocol", 19) != 0) {
+        fprintf(stderr, "Incoming handshake invalid pstr\n");
+        shutdown(sockfd, SHUT_WR);
+        return 0;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (request[20 + i] != 0) {
+            fprintf(stderr, "Incoming handshake invalid reserved bytes\n");
+            shutdown(sockfd, SHUT_WR);
+            return 0;
+        }
+    }
+    if (memcmp(request + 28, client_torrent(client)->info_hash, 20) != 0) {
+        fprintf(stderr, "Incoming handshake info_hash mismatch\n");
+        shutdown(sockfd, SHUT_WR);
+        return 0;
+    }
+
+    // 构造 handshake 响应
+    unsigned char response[68];
+    response[0] = 19;
+    memcpy(response + 1, "BitTorrent protocol", 19);
+    memset(response + 20, 0, 8);
+    memcpy(response + 28, client_torrent(client)->info_hash, 20);
+    memcpy(response + 48, client_peer_id(client), 20);
+    ssize_t sent = send(sockfd, response, sizeof(response), 0);
+    if (sent != sizeof(response)) {
+        perror("send handshake response");
+        return 0;
+    }
+    memcpy(peer->peer_id, request + 48, 20);
+    peer->sockfd = sockfd;
+    return 1;
+}
+
 // peer_free：释放 peer 连接资源
 void peer_free(struct peer *peer) {
     if (peer->sockfd > 0) {
@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "peer_engine.h"
+
+#define HANDSHAKE_LENGTH 68
+
+/* macOS 没有 MSG_NOSIGNAL，改为在 peer_engine_add 里给套接字设置 SO_NOSIGPIPE */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct peer_conn {
+    struct peer_engine *pe;
+    int fd;
+    enum peer_conn_state state;
+    uint8_t handshake[HANDSHAKE_LENGTH];  // 收到的 handshake
+    size_t handshake_len;
+    struct peer_wire wire;
+    uint8_t *out;             // 发送队列，out[out_off .. out_len) 还没有发出去
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    int busy;                 // 正在处理这个连接的事件，关闭要推迟到处理完
+    void *user;
+    struct peer_conn *prev;
+    struct peer_conn *next;
+    int attempt;              // 由 peer_engine_connect 发起，还没有完成 handshake
+    int timed_out;
+    uint64_t deadline;        // 单调时钟，毫秒
+    struct peer_conn *attempt_prev;
+    struct peer_conn *attempt_next;
+};
+
+/* 等待空位的地址 */
+struct pending_addr {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+
+struct peer_engine {
+    struct reactor *reactor;
+    uint8_t handshake[HANDSHAKE_LENGTH];  // 我们发出的 handshake，所有连接都一样
+    struct peer_engine_ops ops;
+    void *ctx;
+    struct peer_conn *conns;  // 双向链表
+    size_t count;
+    int freeing;
+
+    // 主动连接：超时时间都相同，所以按发起顺序排队的尝试也按截止时间排好了序
+    size_t max_connecting;
+    int timeout_ms;
+    struct peer_conn *attempts;       // 最早的尝试
+    struct peer_conn *attempts_tail;
+    struct pending_addr *pending;     // pending[pending_head .. pending_len) 还在等
+    size_t pending_head;
+    size_t pending_len;
+    size_t pending_cap;
+    struct reactor_timer timer;       // 设在最早的截止时间
+    struct peer_engine_connect_stats stats;
+};
+
+static void start_pending(struct peer_engine *pe);
+
+struct peer_engine *peer_engine_new(struct reactor *r, const uint8_t info_hash[20],
+                                    const uint8_t peer_id[20],
+                                    const struct peer_engine_ops *ops, void *ctx) {
+    struct peer_engine *pe = calloc(1, sizeof(struct peer_engine));
+    if (!pe)
+        return NULL;
+    pe->reactor = r;
+    pe->ops = *ops;
+    pe->ctx = ctx;
+    pe->max_connecting = PEER_ENGINE_MAX_CONNECTING;
+    pe->timeout_ms = PEER_ENGINE_CONNECT_TIMEOUT_MS;
+    // [pstrlen][pstr][reserved (8 bytes)][info_hash (20 bytes)][peer_id (20 bytes)]
+    pe->handshake[0] = 19;
+    memcpy(pe->handshake + 1, "BitTorrent protocol", 19);
+    memset(pe->handshake + 20, 0, 8);
+    memcpy(pe->handshake + 28, info_hash, 20);
+    memcpy(pe->handshake + 48, peer_id, 20);
+    return pe;
+}
+
+/* 尝试结束（成功或失败），从队列中取出，空出来的位置留给下一个地址 */
+static void attempt_done(struct peer_conn *conn) {
+    struct peer_engine *pe = conn->pe;
+    if (conn->attempt_prev)
+        conn->attempt_prev->attempt_next = conn->attempt_next;
+    else
+        pe->attempts = conn->attempt_next;
+    if (conn->attempt_next)
+        conn->attempt_next->attempt_prev = conn->attempt_prev;
+    else
+        pe->attempts_tail = conn->attempt_prev;
+    conn->attempt = 0;
+    pe->stats.connecting--;
+    if (conn->state == PEER_CONN_ACTIVE)
+        pe->stats.succeeded++;
+    else if (conn->timed_out)
+        pe->stats.timed_out++;
+    else
+        pe->stats.failed++;
+}
+
+static void destroy(struct peer_conn *conn) {
+    struct peer_engine *pe = conn->pe;
+    int was_attempt = conn->attempt;
+    if (was_attempt)
+        attempt_done(conn);
+    if (pe->ops.closed)
+        pe->ops.closed(pe->ctx, conn);
+    reactor_remove(pe->reactor, conn->fd);
+    close(conn->fd);
+    peer_wire_free(&conn->wire);
+    free(conn->out);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        pe->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    pe->count--;
+    free(conn);
+    // 描述符已经关闭，再发起新的连接
+    if (was_attempt)
+        start_pending(pe);
+}
+
+void peer_engine_free(struct peer_engine *pe) {
+    if (!pe)
+        return;
+    pe->freeing = 1;
+    while (pe->conns)
+        destroy(pe->conns);
+    reactor_timer_cancel(pe->reactor, &pe->timer);
+    free(pe->pending);
+    free(pe);
+}
+
+void peer_conn_close(struct peer_conn *conn) {
+    conn->state = PEER_CONN_CLOSED;
+    if (!conn->busy)
+        destroy(conn);
+}
+
+/* 追加到发送队列的末尾，先把已经发出的部分挪走 */
+static int enqueue(struct peer_conn *conn, const void *data, size_t len) {
+    if (conn->out_off > 0) {
+        memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : 4096;
+        while (cap < conn->out_len + len)
+            cap *= 2;
+        uint8_t *out = realloc(conn->out, cap);
+        if (!out)
+            return 0;
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 1;
+}
+
+/* 尽量发出队列里的数据；socket 写满时返回 1，出错返回 0 */
+static int flush(struct peer_conn *conn) {
+    while (conn->out_off < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->out_off += (size_t)n;
+    }
+    conn->out_off = conn->out_len = 0;
+    return 1;
+}
+
+int peer_conn_send(struct peer_conn *conn, const struct peer_msg *msg) {
+    if (conn->state == PEER_CONN_CLOSED)
+        return 0;
+    uint8_t header[PEER_WIRE_HEADER_MAX];
+    size_t header_len = peer_wire_encode(msg, header);
+    size_t payload_len = msg->payload ? msg->payload_len : 0;
+    size_t sent = 0;
+
+    // 队列为空时直接发送，消息体不经过队列；发不完的部分再复制进队列
+    if (conn->state != PEER_CONN_CONNECTING && conn->out_off == conn->out_len) {
+        struct iovec iov[2] = {
+            { header, header_len },
+            { (void *)msg->payload, payload_len },
+        };
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = 2;
+        ssize_t n;
+        do {
+            n = sendmsg(conn->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            peer_conn_close(conn);
+            return 0;
+        }
+        if (n > 0)
+            sent = (size_t)n;
+    }
+    int ok = 1;
+    if (sent < header_len)
+        ok = enqueue(conn, header + sent, header_len - sent) &&
+             (payload_len == 0 || enqueue(conn, msg->payload, payload_len));
+    else if (sent < header_len + payload_len)
+        ok = enqueue(conn, msg->payload + (sent - header_len), header_len + payload_len - sent);
+    if (!ok) {
+        peer_conn_close(conn);
+        return 0;
+    }
+    peer_wire_sent(&conn->wire, msg->id);
+    return 1;
+}
+
+/* 与 peer_init 的检查相同 */
+static int handshake_valid(const struct peer_engine *pe, const uint8_t *hs) {
+    if (hs[0] != 19 || memcmp(hs + 1, "BitTorrent protocol", 19) != 0) {
+        fprintf(stderr, "Invalid handshake header\n");
+        return 0;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (hs[20 + i] != 0) {
+            fprintf(stderr, "Invalid reserved bytes in handshake\n");
+            return 0;
+        }
+    }
+    if (memcmp(hs + 28, pe->handshake + 28, 20) != 0) {
+        fprintf(stderr, "Info hash mismatch in handshake\n");
+        return 0;
+    }
+    return 1;
+}
+
+static int on_message(void *arg, const struct peer_msg *msg) {
+    struct peer_conn *conn = arg;
+    struct peer_engine *pe = conn->pe;
+    if (pe->ops.message && !pe->ops.message(pe->ctx, conn, msg))
+        return 0;
+    // 回调里可能关闭了连接
+    return conn->state != PEER_CONN_CLOSED;
+}
+
+/* 边沿触发：一直读到 EAGAIN 为止；返回 0 表示连接应当关闭 */
+static int read_all(struct peer_conn *conn) {
+    struct peer_engine *pe = conn->pe;
+    while (conn->state == PEER_CONN_HANDSHAKE || conn->state == PEER_CONN_ACTIVE) {
+        ssize_t n;
+        if (conn->state == PEER_CONN_HANDSHAKE) {
+            // 只读 handshake 的长度，后面的消息留给 peer_wire
+            n = recv(conn->fd, conn->handshake + conn->handshake_len,
+                     HANDSHAKE_LENGTH - conn->handshake_len, 0);
+            if (n > 0) {
+                conn->handshake_len += (size_t)n;
+                if (conn->handshake_len < HANDSHAKE_LENGTH)
+                    continue;
+                if (!handshake_valid(pe, conn->handshake))
+                    return 0;
+                conn->state = PEER_CONN_ACTIVE;
+                if (conn->attempt) {
+                    attempt_done(conn);
+                    start_pending(pe);
+                }
+                if (pe->ops.ready)
+                    pe->ops.ready(pe->ctx, conn);
+                continue;
+            }
+        } else {
+            n = peer_wire_recv(&conn->wire, conn->fd);
+            if (n > 0) {
+                if (peer_wire_parse(&conn->wire, on_message, conn) < 0)
+                    return 0;
+                continue;
+            }
+        }
+        if (n == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    return conn->state != PEER_CONN_CLOSED;
+}
+
+static void on_event(void *arg, int fd, unsigned events) {
+    struct peer_conn *conn = arg;
+    int ok = 1;
+    (void)fd;
+
+    conn->busy++;
+    if (conn->state == PEER_CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (!(events & (REACTOR_WRITE | REACTOR_HANGUP)))
+            goto out;
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            ok = 0;
+            goto out;
+        }
+        conn->state = PEER_CONN_HANDSHAKE;
+        events |= REACTOR_WRITE;
+    }
+    if (events & REACTOR_WRITE)
+        ok = flush(conn);
+    if (ok && (events & (REACTOR_READ | REACTOR_HANGUP)))
+        ok = read_all(conn);
+ out:
+    conn->busy--;
+    if (!ok || conn->state == PEER_CONN_CLOSED)
+        peer_conn_close(conn);
+}
+
+struct peer_conn *peer_engine_add(struct peer_engine *pe, int fd, int connecting) {
+    struct peer_conn *conn = calloc(1, sizeof(struct peer_conn));
+    if (!conn || !reactor_set_nonblocking(fd)) {
+        free(conn);
+        close(fd);
+        return NULL;
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    conn->pe = pe;
+    conn->fd = fd;
+    conn->state = connecting ? PEER_CONN_CONNECTING : PEER_CONN_HANDSHAKE;
+    if (!peer_wire_init(&conn->wire, PEER_WIRE_RING_SIZE)) {
+        free(conn);
+        close(fd);
+        return NULL;
+    }
+    if (!enqueue(conn, pe->handshake, HANDSHAKE_LENGTH) ||
+        !reactor_add(pe->reactor, fd, on_event, conn)) {
+        peer_wire_free(&conn->wire);
+        free(conn->out);
+        free(conn);
+        close(fd);
+        return NULL;
+    }
+    conn->next = pe->conns;
+    if (pe->conns)
+        pe->conns->prev = conn;
+    pe->conns = conn;
+    pe->count++;
+    return conn;
+}
+
+static void on_timer(void *arg);
+
+/* 让定时器在最早的截止时间到期 */
+static void arm_timer(struct peer_engine *pe) {
+    if (pe->attempts)
+        reactor_timer_set(pe->reactor, &pe->timer, pe->attempts->deadline, on_timer, pe);
+    else
+        reactor_timer_cancel(pe->reactor, &pe->timer);
+}
+
+static void on_timer(void *arg) {
+    struct peer_engine *pe = arg;
+    // 关闭会发起排队的地址，新的尝试排在队尾，截止时间更晚
+    uint64_t now = reactor_now_ms();
+    while (pe->attempts && pe->attempts->deadline <= now) {
+        pe->attempts->timed_out = 1;
+        peer_conn_close(pe->attempts);
+    }
+    arm_timer(pe);
+}
+
+/* 发起一个非阻塞连接；立即失败的地址只计数 */
+static void start_attempt(struct peer_engine *pe, const struct pending_addr *p) {
+    int fd = socket(p->addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        pe->stats.failed++;
+        return;
+    }
+    // SOCK_NONBLOCK 和 SOCK_CLOEXEC 只有 Linux 有，分开设置
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || !reactor_set_nonblocking(fd)) {
+        close(fd);
+        pe->stats.failed++;
+        return;
+    }
+    int rc = connect(fd, (const struct sockaddr *)&p->addr, p->len);
+    if (rc < 0 && errno != EINPROGRESS) {
+        close(fd);
+        pe->stats.failed++;
+        return;
+    }
+    struct peer_conn *conn = peer_engine_add(pe, fd, rc != 0);
+    if (!conn) {
+        pe->stats.failed++;
+        return;
+    }
+    conn->attempt = 1;
+    conn->deadline = reactor_now_ms() + (uint64_t)pe->timeout_ms;
+    conn->attempt_prev = pe->attempts_tail;
+    if (pe->attempts_tail)
+        pe->attempts_tail->attempt_next = conn;
+    else
+        pe->attempts = conn;
+    pe->attempts_tail = conn;
+    pe->stats.connecting++;
+    if (!conn->attempt_prev)
+        arm_timer(pe);
+}
+
+static void start_pending(struct peer_engine *pe) {
+    while (!pe->freeing && pe->stats.connecting < pe->max_connecting &&
+           pe->pending_head < pe->pending_len) {
+        struct pending_addr p = pe->pending[pe->pending_head++];
+        pe->stats.queued--;
+        start_attempt(pe, &p);
+    }
+    if (pe->pending_head == pe->pending_len)
+        pe->pending_head = pe->pending_len = 0;
+}
+
+void peer_engine_set_connect_limits(struct peer_engine *pe, size_t max_connecting,
+                                    int timeout_ms) {
+    pe->max_connecting = max_connecting ? max_connecting : 1;
+    pe->timeout_ms = timeout_ms > 0 ? timeout_ms : PEER_ENGINE_CONNECT_TIMEOUT_MS;
+    start_pending(pe);
+}
+
+int peer_engine_connect(struct peer_engine *pe, const struct sockaddr *addr, socklen_t addrlen) {
+    if (addrlen > sizeof(struct sockaddr_storage))
+        return 0;
+    if (pe->pending_len == pe->pending_cap && pe->pending_head > 0) {
+        memmove(pe->pending, pe->pending + pe->pending_head,
+                (pe->pending_len - pe->pending_head) * sizeof(struct pending_addr));
+        pe->pending_len -= pe->pending_head;
+        pe->pending_head = 0;
+    }
+    if (pe->pending_len == pe->pending_cap) {
+        size_t cap = pe->pending_cap ? pe->pending_cap * 2 : 16;
+        struct pending_addr *pending = realloc(pe->pending, cap * sizeof(struct pending_addr));
+        if (!pending)
+            return 0;
+        pe->pending = pending;
+        pe->pending_cap = cap;
+    }
+    struct pending_addr *p = &pe->pending[pe->pending_len++];
+    memset(p, 0, sizeof(*p));
+    memcpy(&p->addr, addr, addrlen);
+    p->len = addrlen;
+    pe->stats.queued++;
+    start_pending(pe);
+    return 1;
+}
+
+void peer_engine_connect_stats(const struct peer_engine *pe,
+                               struct peer_engine_connect_stats *stats) {
+    *stats = pe->stats;
+}
+
+struct peer_conn *peer_engine_adopt(struct peer_engine *pe, int fd, const uint8_t peer_id[20]) {
+    struct peer_conn *conn = peer_engine_add(pe, fd, 0);
+    if (!conn)
+        return NULL;
+    // 对方已经收到过我们的 handshake，丢掉排队的那一份
+    conn->out_off = conn->out_len = 0;
+    memcpy(conn->handshake, pe->handshake, 48);
+    memcpy(conn->handshake + 48, peer_id, 20);
+    conn->handshake_len = HANDSHAKE_LENGTH;
+    conn->state = PEER_CONN_ACTIVE;
+    if (pe->ops.ready) {
+        conn->busy++;
+        pe->ops.ready(pe->ctx, conn);
+        conn->busy--;
+        if (conn->state == PEER_CONN_CLOSED) {
+            destroy(conn);
+            return NULL;
+        }
+    }
+    return conn;
+}
+
+enum peer_conn_state peer_conn_state(const struct peer_conn *conn) {
+    return conn->state;
+}
+
+const uint8_t *peer_conn_peer_id(const struct peer_conn *conn) {
+    return conn->handshake + 48;
+}
+
+int peer_conn_fd(const struct peer_conn *conn) {
+    return conn->fd;
+}
+
+const struct peer_wire *peer_conn_wire(const struct peer_conn *conn) {
+    return &conn->wire;
+}
+
+size_t peer_conn_queued(const struct peer_conn *conn) {
+    return conn->out_len - conn->out_off;
+}
+
+void peer_conn_set_user(struct peer_conn *conn, void *user) {
+    conn->user = user;
+}
+
+void *peer_conn_user(const struct peer_conn *conn) {
+    return conn->user;
+}
+
+size_t peer_engine_count(const struct peer_engine *pe) {
+    return pe->count;
+}
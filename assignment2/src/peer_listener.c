@@ -6,6 +6,7 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include "peer_listener.h"
+#include "peer.h"
 #include "client.h"  // 注意：只能通过 accessor 访问 client 内部数据
 
 // 定义 peer_listener 结构体，隐藏实现细节
@@ -16,70 +17,12 @@ struct peer_listener {
     int running;            // 标志是否继续运行
 };
 
-/*
- * handle_incoming_handshake - 处理入站连接的 handshake 流程
- *
- * 1. 循环读取 68 字节 handshake 消息
- * 2. 验证 handshake 各字段：pstrlen、pstr、reserved 字段、info_hash
- * 3. 如果验证失败，调用 shutdown() 关闭写端，让对方的读返回 EOF，然后返回 0
- * 4. 如果验证通过，构造 handshake 响应并发送给对端，返回 1
- */
-static int handle_incoming_handshake(int sockfd, struct client *client) {
-    unsigned char request[68];
-    size_t total_recv = 0;
-    while (total_recv < sizeof(request)) {
-        ssize_t n = recv(sockfd, request + total_recv, sizeof(request) - total_recv, 0);
-        if (n <= 0) {
-            perror("recv handshake from incoming peer");
-            return 0;
-        }
-        total_recv += n;
-    }
-
-    // 验证 handshake 消息格式
-    if (request[0] != 19) {
-        fprintf(stderr, "Incoming handshake invalid pstrlen: %d\n", request[0]);
-        shutdown(sockfd, SHUT_WR);
-        return 0;
-    }
-    if (memcmp(request + 1, "BitTorrent protocol", 19) != 0) {
-        fprintf(stderr, "Incoming handshake invalid pstr\n");
-        shutdown(sockfd, SHUT_WR);
-        return 0;
-    }
-    for (int i = 0; i < 8; i++) {
-        if (request[20 + i] != 0) {
-            fprintf(stderr, "Incoming handshake invalid reserved bytes\n");
-            shutdown(sockfd, SHUT_WR);
-            return 0;
-        }
-    }
-    if (memcmp(request + 28, client_torrent(client)->info_hash, 20) != 0) {
-        fprintf(stderr, "Incoming handshake info_hash mismatch\n");
-        shutdown(sockfd, SHUT_WR);
-        return 0;
-    }
-
-    // 构造 handshake 响应
-    unsigned char response[68];
-    response[0] = 19;
-    memcpy(response + 1, "BitTorrent protocol", 19);
-    memset(response + 20, 0, 8);
-    memcpy(response + 28, client_torrent(client)->info_hash, 20);
-    memcpy(response + 48, client_peer_id(client), 20);
-    ssize_t sent = send(sockfd, response, sizeof(response), 0);
-    if (sent != sizeof(response)) {
-        perror("send handshake response");
-        return 0;
-    }
-    return 1;
-}
-
 /*
  * peer_listener_thread - 内部线程函数
  * 循环等待新连接，通过 select() 设置超时，
- * 接收到新连接后，调用 handle_incoming_handshake() 自动处理 handshake，
- * 若 handshake 成功则将连接加入 client 的 peer 列表，否则关闭该连接。
+ * 接收到新连接后，调用 peer_accept() 自动处理 handshake，
+ * 若 handshake 成功则通过无锁队列交给 client 的事件循环，否则关闭该连接。
+ * 监听线程不再直接修改 client 的状态。
  */
 static void *peer_listener_thread(void *arg) {
     struct peer_listener *listener = (struct peer_listener *)arg;
@@ -110,12 +53,13 @@ static void *peer_listener_thread(void *arg) {
         }
 
         // 自动处理 handshake：处理入站 handshake，若失败则关闭连接
-        if (!handle_incoming_handshake(newfd, listener->client)) {
+        struct peer p;
+        if (!peer_accept(&p, listener->client, newfd)) {
             close(newfd);
             continue;
         }
-        // handshake 通过后，将该连接加入 client 的 peer 列表
-        client_add_connected_peer(listener->client, newfd);
+        // handshake 通过后交给事件循环；队列满时连接被关闭
+        client_handoff_peer(listener->client, newfd, p.peer_id);
     }
     return NULL;
 }
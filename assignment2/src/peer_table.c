@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include "peer_table.h"
+
+#define SLOT_MASK 0xffffffffu
+#define MAX_SLOTS ((uint32_t)PEER_TABLE_SLAB * PEER_TABLE_MAX_SLABS)
+
+/* gen 为奇数表示占用；每次插入和删除都加一 */
+struct slot {
+    uint32_t gen;
+    uint32_t next_free;  // 空闲栈中下一个空位的编号加一，0 表示栈底
+    int fd;
+    void *user;
+};
+
+struct peer_table {
+    struct slot *slabs[PEER_TABLE_MAX_SLABS];  // 只增不减，发布后不再移动
+    uint32_t next_index;  // 还没有用过的第一个编号
+    // 各线程都会修改的字段各占一个缓存行
+    uint64_t free_head __attribute__((aligned(64)));  // (tag << 32) | (编号 + 1)
+    size_t count __attribute__((aligned(64)));
+};
+
+static struct slot *slot_at(const struct peer_table *pt, uint32_t idx) {
+    if (idx >= MAX_SLOTS)
+        return NULL;
+    struct slot *slab = __atomic_load_n(&pt->slabs[idx / PEER_TABLE_SLAB], __ATOMIC_ACQUIRE);
+    return slab ? &slab[idx % PEER_TABLE_SLAB] : NULL;
+}
+
+/* 分配并发布 slab；别的线程抢先发布时用它的 */
+static int ensure_slab(struct peer_table *pt, uint32_t idx) {
+    struct slot **p = &pt->slabs[idx / PEER_TABLE_SLAB];
+    if (__atomic_load_n(p, __ATOMIC_ACQUIRE))
+        return 1;
+    struct slot *slab = calloc(PEER_TABLE_SLAB, sizeof(struct slot));
+    if (!slab)
+        return 0;
+    struct slot *expected = NULL;
+    if (!__atomic_compare_exchange_n(p, &expected, slab, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        free(slab);
+    return 1;
+}
+
+struct peer_table *peer_table_new(void) {
+    struct peer_table *pt = aligned_alloc(64, sizeof(struct peer_table));
+    if (!pt)
+        return NULL;
+    memset(pt, 0, sizeof(*pt));
+    if (!ensure_slab(pt, 0)) {
+        free(pt);
+        return NULL;
+    }
+    return pt;
+}
+
+void peer_table_free(struct peer_table *pt) {
+    if (!pt)
+        return;
+    for (size_t i = 0; i < PEER_TABLE_MAX_SLABS; i++)
+        free(pt->slabs[i]);
+    free(pt);
+}
+
+/*
+ * 从空闲栈弹出一个编号。tag 每次弹出加一：即使栈顶在读取 next_free 之后
+ * 被弹出又压回（ABA），CAS 也会因为 tag 不同而失败。
+ */
+static int pop_free(struct peer_table *pt, uint32_t *idx) {
+    uint64_t head = __atomic_load_n(&pt->free_head, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t top = (uint32_t)(head & SLOT_MASK);
+        if (top == 0)
+            return 0;
+        // 空位永远不会被释放，即使已经被别的线程弹出，读取也是安全的
+        uint32_t next = __atomic_load_n(&slot_at(pt, top - 1)->next_free, __ATOMIC_RELAXED);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&pt->free_head, &head, new_head, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *idx = top - 1;
+            return 1;
+        }
+    }
+}
+
+static void push_free(struct peer_table *pt, uint32_t idx) {
+    struct slot *s = slot_at(pt, idx);
+    uint64_t head = __atomic_load_n(&pt->free_head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+    do {
+        __atomic_store_n(&s->next_free, (uint32_t)(head & SLOT_MASK), __ATOMIC_RELAXED);
+        new_head = (head & ~(uint64_t)SLOT_MASK) | (idx + 1);
+    } while (!__atomic_compare_exchange_n(&pt->free_head, &head, new_head, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* 取一个从未用过的编号，必要时分配它所在的 slab */
+static int take_new(struct peer_table *pt, uint32_t *idx) {
+    uint32_t n = __atomic_load_n(&pt->next_index, __ATOMIC_RELAXED);
+    do {
+        if (n >= MAX_SLOTS)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&pt->next_index, &n, n + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    // 分配失败时这个编号就丢掉了，同一个 slab 的后续编号会再次尝试分配
+    if (!ensure_slab(pt, n))
+        return 0;
+    *idx = n;
+    return 1;
+}
+
+peer_handle_t peer_table_insert(struct peer_table *pt, int fd, void *user) {
+    uint32_t idx;
+    if (!pop_free(pt, &idx) && !take_new(pt, &idx))
+        return PEER_HANDLE_NONE;
+    struct slot *s = slot_at(pt, idx);
+    /*
+     * seqlock 的写端：删除时推进的 gen 必须先于新内容对其他线程可见，否则持有旧句柄的
+     * read_slot 可能在两次读到旧 gen 之间读到新内容（x86 上不会重排，ARM/POWER 上会）。
+     */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&s->fd, fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->user, user, __ATOMIC_RELAXED);
+    // 先写好内容再发布新的 gen
+    uint32_t gen = __atomic_load_n(&s->gen, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&s->gen, gen, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&pt->count, 1, __ATOMIC_RELAXED);
+    return (uint64_t)gen << 32 | idx;
+}
+
+int peer_table_remove(struct peer_table *pt, peer_handle_t h, struct peer_entry *entry) {
+    uint32_t gen = (uint32_t)(h >> 32);
+    struct slot *s = slot_at(pt, (uint32_t)(h & SLOT_MASK));
+    if (!s || !(gen & 1) || __atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != gen)
+        return 0;
+    struct peer_entry e = {
+        .fd = __atomic_load_n(&s->fd, __ATOMIC_RELAXED),
+        .user = __atomic_load_n(&s->user, __ATOMIC_RELAXED),
+    };
+    // 只有一个线程能把 gen 从奇数推进到偶数；gen 只增不减，成功说明内容没有变过
+    uint32_t expected = gen;
+    if (!__atomic_compare_exchange_n(&s->gen, &expected, gen + 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 0;
+    push_free(pt, (uint32_t)(h & SLOT_MASK));
+    __atomic_fetch_sub(&pt->count, 1, __ATOMIC_RELAXED);
+    if (entry)
+        *entry = e;
+    return 1;
+}
+
+/* 类似 seqlock：复制前后 gen 都与句柄一致，复制的内容才有效 */
+static int read_slot(const struct slot *s, uint32_t gen, struct peer_entry *entry) {
+    if (__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != gen)
+        return 0;
+    entry->fd = __atomic_load_n(&s->fd, __ATOMIC_RELAXED);
+    entry->user = __atomic_load_n(&s->user, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->gen, __ATOMIC_RELAXED) == gen;
+}
+
+int peer_table_get(const struct peer_table *pt, peer_handle_t h, struct peer_entry *entry) {
+    uint32_t gen = (uint32_t)(h >> 32);
+    const struct slot *s = slot_at(pt, (uint32_t)(h & SLOT_MASK));
+    return s && (gen & 1) && read_slot(s, gen, entry);
+}
+
+void peer_table_foreach(const struct peer_table *pt, peer_table_fn fn, void *arg) {
+    uint32_t n = __atomic_load_n(&pt->next_index, __ATOMIC_ACQUIRE);
+    for (uint32_t idx = 0; idx < n; idx++) {
+        const struct slot *s = slot_at(pt, idx);
+        if (!s)
+            continue;
+        uint32_t gen = __atomic_load_n(&s->gen, __ATOMIC_ACQUIRE);
+        struct peer_entry e;
+        if (!(gen & 1) || !read_slot(s, gen, &e))
+            continue;
+        if (!fn(arg, (uint64_t)gen << 32 | idx, &e))
+            return;
+    }
+}
+
+size_t peer_table_count(const struct peer_table *pt) {
+    return __atomic_load_n(&pt->count, __ATOMIC_RELAXED);
+}
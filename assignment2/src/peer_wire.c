@@ -0,0 +1,307 @@
+#define _GNU_SOURCE  // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "peer_wire.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * 同一段 memfd 连续映射两次：buf[i] 和 buf[i + size] 是同一个字节，
+ * 从任意位置开始读写 size 个字节都不需要处理回绕
+ */
+static int map_mirrored(struct peer_ring *ring) {
+#if defined(MFD_CLOEXEC)
+    int fd = memfd_create("peer_ring", MFD_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    if (ftruncate(fd, (off_t)ring->size) < 0) {
+        close(fd);
+        return 0;
+    }
+    // 先占住两倍大小的地址空间，再把两半都固定映射到同一个文件
+    uint8_t *base = mmap(NULL, 2 * ring->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    if (mmap(base, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + ring->size, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * ring->size);
+        close(fd);
+        return 0;
+    }
+    // 映射会保持文件的引用，描述符可以关掉
+    close(fd);
+    ring->buf = base;
+    return 1;
+#else
+    (void)ring;
+    return 0;
+#endif
+}
+
+int peer_ring_init(struct peer_ring *ring, size_t size, int mirrored) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    memset(ring, 0, sizeof(*ring));
+    ring->size = page;
+    while (ring->size < size)
+        ring->size *= 2;
+    if (mirrored && map_mirrored(ring)) {
+        ring->mirrored = 1;
+        return 1;
+    }
+    ring->buf = malloc(ring->size);
+    return ring->buf != NULL;
+}
+
+void peer_ring_free(struct peer_ring *ring) {
+    if (!ring->buf)
+        return;
+    if (ring->mirrored)
+        munmap(ring->buf, 2 * ring->size);
+    else
+        free(ring->buf);
+    ring->buf = NULL;
+}
+
+uint8_t *peer_ring_write_ptr(struct peer_ring *ring, size_t *space) {
+    size_t used = ring->tail - ring->head;
+    if (ring->mirrored) {
+        *space = ring->size - used;
+        return ring->buf + (ring->tail & (ring->size - 1));
+    }
+    // 平坦缓冲区：把没读完的部分（通常只是半条消息）移到开头
+    if (ring->head > 0) {
+        memmove(ring->buf, ring->buf + ring->head, used);
+        ring->head = 0;
+        ring->tail = used;
+    }
+    *space = ring->size - used;
+    return ring->buf + ring->tail;
+}
+
+void peer_ring_commit(struct peer_ring *ring, size_t n) {
+    ring->tail += n;
+}
+
+const uint8_t *peer_ring_read_ptr(const struct peer_ring *ring, size_t *avail) {
+    *avail = ring->tail - ring->head;
+    return ring->buf + (ring->mirrored ? ring->head & (ring->size - 1) : ring->head);
+}
+
+void peer_ring_consume(struct peer_ring *ring, size_t n) {
+    ring->head += n;
+    // 读空时回到开头，平坦缓冲区就不需要搬移
+    if (ring->head == ring->tail)
+        ring->head = ring->tail = 0;
+}
+
+int peer_wire_init(struct peer_wire *pw, size_t ring_size) {
+    memset(pw, 0, sizeof(*pw));
+    pw->am_choking = 1;
+    pw->peer_choking = 1;
+    return peer_ring_init(&pw->in, ring_size, 1);
+}
+
+void peer_wire_free(struct peer_wire *pw) {
+    peer_ring_free(&pw->in);
+}
+
+ssize_t peer_wire_recv(struct peer_wire *pw, int fd) {
+    size_t space;
+    uint8_t *p = peer_ring_write_ptr(&pw->in, &space);
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t n;
+    do {
+        n = recv(fd, p, space, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        peer_ring_commit(&pw->in, (size_t)n);
+    return n;
+}
+
+/* 解析一条消息的内容，len 不含长度前缀；格式不对返回 0 */
+static int decode(const uint8_t *p, uint32_t len, struct peer_msg *msg) {
+    memset(msg, 0, sizeof(*msg));
+    if (len == 0) {
+        msg->id = PEER_MSG_KEEP_ALIVE;
+        return 1;
+    }
+    msg->id = p[0];
+    switch (msg->id) {
+    case PEER_MSG_CHOKE:
+    case PEER_MSG_UNCHOKE:
+    case PEER_MSG_INTERESTED:
+    case PEER_MSG_NOT_INTERESTED:
+        return len == 1;
+    case PEER_MSG_HAVE:
+        if (len != 5)
+            return 0;
+        msg->index = get_be32(p + 1);
+        return 1;
+    case PEER_MSG_REQUEST:
+    case PEER_MSG_CANCEL:
+        if (len != 13)
+            return 0;
+        msg->index = get_be32(p + 1);
+        msg->begin = get_be32(p + 5);
+        msg->length = get_be32(p + 9);
+        return 1;
+    case PEER_MSG_PIECE:
+        if (len < 9)
+            return 0;
+        msg->index = get_be32(p + 1);
+        msg->begin = get_be32(p + 5);
+        msg->payload = p + 9;
+        msg->payload_len = len - 9;
+        return 1;
+    default:
+        // bitfield 和不认识的扩展消息：整个消息体交给回调
+        msg->payload = p + 1;
+        msg->payload_len = len - 1;
+        return 1;
+    }
+}
+
+int peer_wire_parse(struct peer_wire *pw, peer_msg_fn fn, void *ctx) {
+    size_t avail, done = 0;
+    const uint8_t *p = peer_ring_read_ptr(&pw->in, &avail);
+    int count = 0, ok = 1;
+
+    while (avail - done >= 4) {
+        uint32_t len = get_be32(p + done);
+        // 永远装不下的消息不可能等到完整
+        if (len > pw->in.size - 4) {
+            fprintf(stderr, "peer message of %u bytes is too long\n", len);
+            ok = 0;
+            break;
+        }
+        if (avail - done - 4 < len)
+            break;
+        struct peer_msg msg;
+        if (!decode(p + done + 4, len, &msg)) {
+            fprintf(stderr, "malformed peer message %d of %u bytes\n", p[done + 4], len);
+            ok = 0;
+            break;
+        }
+        switch (msg.id) {
+        case PEER_MSG_CHOKE: pw->peer_choking = 1; break;
+        case PEER_MSG_UNCHOKE: pw->peer_choking = 0; break;
+        case PEER_MSG_INTERESTED: pw->peer_interested = 1; break;
+        case PEER_MSG_NOT_INTERESTED: pw->peer_interested = 0; break;
+        }
+        done += 4 + len;
+        count++;
+        if (!fn(ctx, &msg)) {
+            ok = 0;
+            break;
+        }
+    }
+    peer_ring_consume(&pw->in, done);
+    return ok ? count : -1;
+}
+
+size_t peer_wire_encode(const struct peer_msg *msg, uint8_t *buf) {
+    switch (msg->id) {
+    case PEER_MSG_KEEP_ALIVE:
+        put_be32(buf, 0);
+        return 4;
+    case PEER_MSG_HAVE:
+        put_be32(buf, 5);
+        buf[4] = (uint8_t)msg->id;
+        put_be32(buf + 5, msg->index);
+        return 9;
+    case PEER_MSG_REQUEST:
+    case PEER_MSG_CANCEL:
+        put_be32(buf, 13);
+        buf[4] = (uint8_t)msg->id;
+        put_be32(buf + 5, msg->index);
+        put_be32(buf + 9, msg->begin);
+        put_be32(buf + 13, msg->length);
+        return 17;
+    case PEER_MSG_PIECE:
+        put_be32(buf, (uint32_t)(9 + msg->payload_len));
+        buf[4] = (uint8_t)msg->id;
+        put_be32(buf + 5, msg->index);
+        put_be32(buf + 9, msg->begin);
+        return 13;
+    default:
+        // choke 等只有 id 的消息，以及带消息体的 bitfield
+        put_be32(buf, (uint32_t)(1 + msg->payload_len));
+        buf[4] = (uint8_t)msg->id;
+        return 5;
+    }
+}
+
+int peer_wire_send(struct peer_wire *pw, int fd, const struct peer_msg *msg) {
+    uint8_t header[PEER_WIRE_HEADER_MAX];
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = peer_wire_encode(msg, header);
+    iov[1].iov_base = (void *)msg->payload;
+    iov[1].iov_len = msg->payload ? msg->payload_len : 0;
+
+    // 可能只写出一部分，跳过已经写出的字节继续；对方断开时不要收到 SIGPIPE
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    struct iovec *v = iov;
+    int n = 2;
+    while (n > 0) {
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = v;
+        mh.msg_iovlen = (size_t)n;
+        ssize_t w = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("send peer message");
+            return 0;
+        }
+        while (n > 0 && (size_t)w >= v->iov_len) {
+            w -= (ssize_t)v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (uint8_t *)v->iov_base + w;
+            v->iov_len -= (size_t)w;
+        }
+    }
+
+    peer_wire_sent(pw, msg->id);
+    return 1;
+}
+
+void peer_wire_sent(struct peer_wire *pw, int id) {
+    switch (id) {
+    case PEER_MSG_CHOKE: pw->am_choking = 1; break;
+    case PEER_MSG_UNCHOKE: pw->am_choking = 0; break;
+    case PEER_MSG_INTERESTED: pw->am_interested = 1; break;
+    case PEER_MSG_NOT_INTERESTED: pw->am_interested = 0; break;
+    }
+}
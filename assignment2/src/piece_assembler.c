@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piece_assembler.h"
+#include "sha1_mb.h"
+#include "storage.h"
+
+/* 一个正在下载的片段 */
+struct piece_state {
+    size_t index;
+    size_t length;
+    size_t blocks;
+    size_t next;         // 下一个要哈希的块，之前的块都已经进入 sha
+    uint8_t **pending;   // 提前到达的块的副本，按块号索引，NULL 表示还没收到
+    struct sha1_ctx sha;
+};
+
+struct piece_assembler {
+    const struct metainfo_file *torrent;
+    // 同时下载的片段不多，线性查找足够
+    struct piece_state **pieces;
+    size_t count;
+    size_t capacity;
+    size_t buffered;
+};
+
+struct piece_assembler *piece_assembler_new(const struct metainfo_file *torrent) {
+    struct piece_assembler *pa = calloc(1, sizeof(struct piece_assembler));
+    if (!pa)
+        return NULL;
+    pa->torrent = torrent;
+    return pa;
+}
+
+static void piece_state_free(struct piece_assembler *pa, struct piece_state *ps) {
+    for (size_t k = ps->next; k < ps->blocks; k++) {
+        if (ps->pending[k]) {
+            pa->buffered -= k == ps->blocks - 1 ? ps->length - k * PIECE_BLOCK_SIZE : PIECE_BLOCK_SIZE;
+            free(ps->pending[k]);
+        }
+    }
+    free(ps->pending);
+    free(ps);
+}
+
+void piece_assembler_free(struct piece_assembler *pa) {
+    if (!pa)
+        return;
+    for (size_t i = 0; i < pa->count; i++)
+        piece_state_free(pa, pa->pieces[i]);
+    free(pa->pieces);
+    free(pa);
+}
+
+static size_t find_piece(const struct piece_assembler *pa, size_t piece) {
+    for (size_t i = 0; i < pa->count; i++) {
+        if (pa->pieces[i]->index == piece)
+            return i;
+    }
+    return pa->count;
+}
+
+/* 删除第 i 个片段，用最后一个填补空位 */
+static void remove_piece(struct piece_assembler *pa, size_t i) {
+    piece_state_free(pa, pa->pieces[i]);
+    pa->pieces[i] = pa->pieces[--pa->count];
+}
+
+static struct piece_state *add_piece(struct piece_assembler *pa, size_t piece, size_t length) {
+    if (pa->count == pa->capacity) {
+        size_t capacity = pa->capacity ? pa->capacity * 2 : 8;
+        struct piece_state **pieces = realloc(pa->pieces, capacity * sizeof(struct piece_state *));
+        if (!pieces)
+            return NULL;
+        pa->pieces = pieces;
+        pa->capacity = capacity;
+    }
+    struct piece_state *ps = malloc(sizeof(struct piece_state));
+    if (!ps)
+        return NULL;
+    ps->index = piece;
+    ps->length = length;
+    ps->blocks = (length + PIECE_BLOCK_SIZE - 1) / PIECE_BLOCK_SIZE;
+    ps->next = 0;
+    ps->pending = calloc(ps->blocks, sizeof(uint8_t *));
+    if (!ps->pending) {
+        free(ps);
+        return NULL;
+    }
+    sha1_init(&ps->sha);
+    pa->pieces[pa->count++] = ps;
+    return ps;
+}
+
+enum piece_block_result piece_assembler_add(struct piece_assembler *pa, size_t piece,
+                                            size_t begin, const void *data, size_t len) {
+    size_t length = storage_piece_size(pa->torrent, piece);
+    if (length == 0 || begin % PIECE_BLOCK_SIZE != 0 || begin >= length)
+        return PIECE_BLOCK_ERROR;
+    size_t expected = length - begin < PIECE_BLOCK_SIZE ? length - begin : PIECE_BLOCK_SIZE;
+    if (len != expected)
+        return PIECE_BLOCK_ERROR;
+
+    size_t i = find_piece(pa, piece);
+    struct piece_state *ps = i < pa->count ? pa->pieces[i] : add_piece(pa, piece, length);
+    if (!ps)
+        return PIECE_BLOCK_ERROR;
+    if (i == pa->count)
+        i = pa->count - 1;
+
+    size_t k = begin / PIECE_BLOCK_SIZE;
+    if (k < ps->next || ps->pending[k])
+        return PIECE_BLOCK_DUPLICATE;
+    if (k > ps->next) {
+        // 前面还有空缺，先复制下来，等空缺补上后再哈希
+        ps->pending[k] = malloc(len);
+        if (!ps->pending[k])
+            return PIECE_BLOCK_ERROR;
+        memcpy(ps->pending[k], data, len);
+        pa->buffered += len;
+        return PIECE_BLOCK_ACCEPTED;
+    }
+
+    // 正好接在已哈希的前缀之后：直接哈希，不复制，然后冲刷后面已缓存的连续块
+    sha1_update(&ps->sha, data, len);
+    ps->next++;
+    while (ps->next < ps->blocks && ps->pending[ps->next]) {
+        size_t n = ps->next == ps->blocks - 1 ? ps->length - ps->next * PIECE_BLOCK_SIZE
+                                              : PIECE_BLOCK_SIZE;
+        sha1_update(&ps->sha, ps->pending[ps->next], n);
+        free(ps->pending[ps->next]);
+        ps->pending[ps->next] = NULL;
+        pa->buffered -= n;
+        ps->next++;
+    }
+    if (ps->next < ps->blocks)
+        return PIECE_BLOCK_ACCEPTED;
+
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    sha1_final(&ps->sha, digest);
+    size_t ok = metainfo_file_verify_hashes(pa->torrent, piece, 1,
+                                            (const uint8_t (*)[SHA_DIGEST_LENGTH])&digest, NULL);
+    remove_piece(pa, i);
+    return ok ? PIECE_BLOCK_VALID : PIECE_BLOCK_CORRUPT;
+}
+
+void piece_assembler_abort(struct piece_assembler *pa, size_t piece) {
+    size_t i = find_piece(pa, piece);
+    if (i < pa->count)
+        remove_piece(pa, i);
+}
+
+size_t piece_assembler_in_flight(const struct piece_assembler *pa) {
+    return pa->count;
+}
+
+size_t piece_assembler_buffered(const struct piece_assembler *pa) {
+    return pa->buffered;
+}
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piece_picker.h"
+
+struct piece_picker {
+    size_t pieces;
+    uint32_t *avail;        // 每个片段有多少个 peer 拥有
+    /*
+     * order 分成三段：[0, wanted_end) 是可以挑选的片段，按 avail 升序排列；
+     * [wanted_end, missing_end) 是还没有、但正在下载或被跳过的片段，不排序；
+     * 之后是已经完成的片段。pos 是 order 的逆映射。
+     * 第 k 个桶是 order[bucket[k] .. bucket[k + 1])，其中 avail 都等于 k，
+     * bucket[buckets] 就是 wanted_end。
+     */
+    size_t *order;
+    size_t missing_end;
+    size_t *pos;
+    size_t *bucket;
+    size_t buckets;
+    size_t bucket_capacity;
+    struct bitfield have;
+    struct bitfield downloading;
+    struct bitfield blocked;  // have | downloading | 跳过的片段，即不在可挑选区的片段
+    struct bitfield scratch;
+    size_t done_count;
+    size_t downloading_count;
+    size_t skipped_count;     // 还没有、但优先级为 SKIP 的片段
+    size_t random_first;
+    uint32_t rng;
+    uint8_t *priority;
+    uint8_t *requests;        // 每个在下载的片段被分出去了几次
+    size_t *elevated;         // 优先级高于 NORMAL 的片段，数量通常很少，线性扫描
+    size_t elevated_count;
+    size_t window_first;      // 截止窗口：[window_first, window_first + window_count)
+    size_t window_count;
+    size_t window_urgent;     // 窗口开头这么多片段的截止时间已经很近
+};
+
+/* xorshift32，只用于打乱顺序，不需要密码学强度 */
+static uint32_t next_random(struct piece_picker *pp) {
+    uint32_t x = pp->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pp->rng = x;
+    return x;
+}
+
+static void swap_order(struct piece_picker *pp, size_t i, size_t j) {
+    size_t a = pp->order[i], b = pp->order[j];
+    pp->order[i] = b;
+    pp->order[j] = a;
+    pp->pos[b] = i;
+    pp->pos[a] = j;
+}
+
+void piece_picker_free(struct piece_picker *pp) {
+    if (!pp)
+        return;
+    free(pp->avail);
+    free(pp->order);
+    free(pp->pos);
+    free(pp->bucket);
+    free(pp->priority);
+    free(pp->requests);
+    free(pp->elevated);
+    bitfield_free(&pp->have);
+    bitfield_free(&pp->downloading);
+    bitfield_free(&pp->blocked);
+    bitfield_free(&pp->scratch);
+    free(pp);
+}
+
+struct piece_picker *piece_picker_new(size_t pieces, const struct bitfield *have, uint32_t seed) {
+    struct piece_picker *pp = calloc(1, sizeof(struct piece_picker));
+    if (!pp)
+        return NULL;
+    pp->pieces = pieces;
+    pp->random_first = PIECE_PICKER_RANDOM_FIRST;
+    pp->rng = seed ? seed : 0x9e3779b9;
+    pp->bucket_capacity = 16;
+    pp->avail = calloc(pieces ? pieces : 1, sizeof(uint32_t));
+    pp->order = malloc((pieces ? pieces : 1) * sizeof(size_t));
+    pp->pos = malloc((pieces ? pieces : 1) * sizeof(size_t));
+    pp->bucket = malloc(pp->bucket_capacity * sizeof(size_t));
+    pp->priority = malloc(pieces ? pieces : 1);
+    pp->requests = calloc(pieces ? pieces : 1, 1);
+    pp->elevated = malloc((pieces ? pieces : 1) * sizeof(size_t));
+    if (!pp->avail || !pp->order || !pp->pos || !pp->bucket ||
+        !pp->priority || !pp->requests || !pp->elevated ||
+        !bitfield_init(&pp->have, pieces) || !bitfield_init(&pp->downloading, pieces) ||
+        !bitfield_init(&pp->blocked, pieces) || !bitfield_init(&pp->scratch, pieces)) {
+        piece_picker_free(pp);
+        return NULL;
+    }
+    if (have) {
+        memcpy(pp->have.bits, have->bits, pp->have.bytes);
+        memcpy(pp->blocked.bits, have->bits, pp->blocked.bytes);
+        pp->done_count = bitfield_popcount(&pp->have);
+    }
+    memset(pp->priority, PIECE_PRIORITY_NORMAL, pieces);
+
+    // 需要的片段放在前面，已完成的放在后面
+    size_t wanted = 0, done = pieces;
+    for (size_t i = 0; i < pieces; i++) {
+        size_t at = bitfield_get(&pp->have, i) ? --done : wanted++;
+        pp->order[at] = i;
+        pp->pos[i] = at;
+    }
+    // 打乱需要的片段，一样稀有的片段之间随机排列
+    for (size_t i = wanted; i > 1; i--)
+        swap_order(pp, i - 1, next_random(pp) % i);
+    pp->buckets = 1;
+    pp->bucket[0] = 0;
+    pp->bucket[1] = wanted;
+    pp->missing_end = wanted;
+    return pp;
+}
+
+/* 确保第 k 个桶存在，新桶都是空的，位于需要的片段的末尾 */
+static int ensure_bucket(struct piece_picker *pp, size_t k) {
+    if (k + 2 > pp->bucket_capacity) {
+        size_t capacity = pp->bucket_capacity * 2 > k + 2 ? pp->bucket_capacity * 2 : k + 2;
+        size_t *bucket = realloc(pp->bucket, capacity * sizeof(size_t));
+        if (!bucket)
+            return 0;
+        pp->bucket = bucket;
+        pp->bucket_capacity = capacity;
+    }
+    while (pp->buckets <= k) {
+        pp->bucket[pp->buckets + 1] = pp->bucket[pp->buckets];
+        pp->buckets++;
+    }
+    return 1;
+}
+
+/*
+ * 把片段和自己桶里的最后一个元素交换，然后缩小这个桶：片段就成了下一个桶的第一个元素。
+ * 不在可挑选区的片段只计数，但桶要先建好，片段回到可挑选区时直接放进去。
+ */
+static void increment(struct piece_picker *pp, size_t piece) {
+    uint32_t a = pp->avail[piece];
+    if (!bitfield_get(&pp->have, piece) && !ensure_bucket(pp, a + 1))
+        return;
+    if (!bitfield_get(&pp->blocked, piece)) {
+        size_t last = pp->bucket[a + 1] - 1;
+        swap_order(pp, pp->pos[piece], last);
+        pp->bucket[a + 1]--;
+    }
+    pp->avail[piece] = a + 1;
+}
+
+/* 与 increment 对称：和桶里第一个元素交换，片段成为上一个桶的最后一个元素 */
+static void decrement(struct piece_picker *pp, size_t piece) {
+    uint32_t a = pp->avail[piece];
+    if (a == 0)
+        return;
+    if (!bitfield_get(&pp->blocked, piece)) {
+        size_t first = pp->bucket[a];
+        swap_order(pp, pp->pos[piece], first);
+        pp->bucket[a]++;
+    }
+    pp->avail[piece] = a - 1;
+}
+
+void piece_picker_add_peer(struct piece_picker *pp, const struct bitfield *peer_has) {
+    for (size_t i = bitfield_find_next(peer_has, 0); i < pp->pieces;
+         i = bitfield_find_next(peer_has, i + 1))
+        increment(pp, i);
+}
+
+void piece_picker_remove_peer(struct piece_picker *pp, const struct bitfield *peer_has) {
+    for (size_t i = bitfield_find_next(peer_has, 0); i < pp->pieces;
+         i = bitfield_find_next(peer_has, i + 1))
+        decrement(pp, i);
+}
+
+void piece_picker_peer_have(struct piece_picker *pp, size_t piece) {
+    if (piece < pp->pieces)
+        increment(pp, piece);
+}
+
+/*
+ * 移出可挑选区：逐桶上移到可挑选区的末尾，再把 wanted_end 减一，
+ * 片段就成了不可挑选区的第一个元素。代价与桶数（最多 peer 数 + 1）成正比。
+ */
+static void block(struct piece_picker *pp, size_t piece) {
+    if (bitfield_get(&pp->blocked, piece))
+        return;
+    for (size_t k = pp->avail[piece]; k < pp->buckets; k++) {
+        size_t last = pp->bucket[k + 1] - 1;
+        swap_order(pp, pp->pos[piece], last);
+        pp->bucket[k + 1]--;
+    }
+    bitfield_set(&pp->blocked, piece);
+}
+
+/* 与 block 对称：换到不可挑选区的开头，扩大最后一个桶，再逐桶下移到自己的桶 */
+static void unblock(struct piece_picker *pp, size_t piece) {
+    swap_order(pp, pp->pos[piece], pp->bucket[pp->buckets]);
+    pp->bucket[pp->buckets]++;
+    for (size_t k = pp->buckets - 1; k > pp->avail[piece]; k--) {
+        swap_order(pp, pp->pos[piece], pp->bucket[k]);
+        pp->bucket[k]++;
+    }
+    bitfield_clear(&pp->blocked, piece);
+}
+
+static void mark_downloading(struct piece_picker *pp, size_t piece) {
+    block(pp, piece);
+    bitfield_set(&pp->downloading, piece);
+    pp->downloading_count++;
+    pp->requests[piece] = 1;
+}
+
+/* 再分出去一次已经在下载的片段 */
+static size_t mark_duplicate(struct piece_picker *pp, size_t piece) {
+    if (pp->requests[piece] < UINT8_MAX)
+        pp->requests[piece]++;
+    return piece;
+}
+
+/* 对方拥有、我们还需要、而且没有被跳过的片段 */
+static int eligible(const struct piece_picker *pp, const struct bitfield *peer_has, size_t piece) {
+    return bitfield_get(peer_has, piece) && !bitfield_get(&pp->have, piece) &&
+           pp->priority[piece] != PIECE_PRIORITY_SKIP;
+}
+
+/*
+ * 截止窗口内按顺序挑选。快的 peer 优先拿临近截止的片段：
+ * 都已经在下载时，把最早的、只请求过一次的片段重复分给它，谁先下完算谁的。
+ */
+static size_t pick_window(struct piece_picker *pp, const struct bitfield *peer_has, unsigned flags) {
+    size_t end = pp->window_first + pp->window_count;
+    size_t urgent_end = pp->window_first + pp->window_urgent;
+    if (end > pp->pieces)
+        end = pp->pieces;
+    if (urgent_end > end)
+        urgent_end = end;
+
+    if (flags & PIECE_PICKER_FAST_PEER) {
+        size_t dup = PIECE_PICKER_NONE;
+        for (size_t i = pp->window_first; i < urgent_end; i++) {
+            if (!eligible(pp, peer_has, i))
+                continue;
+            if (!bitfield_get(&pp->downloading, i)) {
+                mark_downloading(pp, i);
+                return i;
+            }
+            if (dup == PIECE_PICKER_NONE && pp->requests[i] < PIECE_PICKER_MAX_REQUESTS)
+                dup = i;
+        }
+        if (dup != PIECE_PICKER_NONE)
+            return mark_duplicate(pp, dup);
+    }
+    for (size_t i = pp->window_first; i < end; i++) {
+        if (eligible(pp, peer_has, i) && !bitfield_get(&pp->downloading, i)) {
+            mark_downloading(pp, i);
+            return i;
+        }
+    }
+    return PIECE_PICKER_NONE;
+}
+
+/* endgame：在下载中的片段里挑对方拥有的、最稀有的那个 */
+static size_t pick_endgame(struct piece_picker *pp, const struct bitfield *peer_has) {
+    size_t best = PIECE_PICKER_NONE;
+    for (size_t i = pp->bucket[pp->buckets]; i < pp->missing_end; i++) {
+        size_t p = pp->order[i];
+        if (eligible(pp, peer_has, p) && (best == PIECE_PICKER_NONE || pp->avail[p] < pp->avail[best]))
+            best = p;
+    }
+    return best == PIECE_PICKER_NONE ? best : mark_duplicate(pp, best);
+}
+
+/* 优先级最高的片段，同一优先级里最稀有的 */
+static size_t pick_elevated(struct piece_picker *pp, const struct bitfield *peer_has) {
+    size_t best = PIECE_PICKER_NONE;
+    for (size_t k = 0; k < pp->elevated_count; k++) {
+        size_t p = pp->elevated[k];
+        if (bitfield_get(&pp->blocked, p) || !bitfield_get(peer_has, p))
+            continue;
+        if (best == PIECE_PICKER_NONE || pp->priority[p] > pp->priority[best] ||
+            (pp->priority[p] == pp->priority[best] && pp->avail[p] < pp->avail[best]))
+            best = p;
+    }
+    if (best != PIECE_PICKER_NONE)
+        mark_downloading(pp, best);
+    return best;
+}
+
+size_t piece_picker_pick(struct piece_picker *pp, const struct bitfield *peer_has) {
+    return piece_picker_pick_flags(pp, peer_has, 0);
+}
+
+size_t piece_picker_pick_flags(struct piece_picker *pp, const struct bitfield *peer_has,
+                               unsigned flags) {
+    size_t wanted_end = pp->bucket[pp->buckets];
+    if (pp->missing_end == 0)
+        return PIECE_PICKER_NONE;
+
+    size_t p;
+    if (pp->window_count > 0 && (p = pick_window(pp, peer_has, flags)) != PIECE_PICKER_NONE)
+        return p;
+    if (pp->elevated_count > 0 && (p = pick_elevated(pp, peer_has)) != PIECE_PICKER_NONE)
+        return p;
+
+    if (pp->done_count < pp->random_first && bitfield_andnot(&pp->scratch, peer_has, &pp->blocked)) {
+        // 随机起点向后找第一个可选的片段，找不到再从头找
+        size_t p = bitfield_find_next(&pp->scratch, next_random(pp) % pp->pieces);
+        if (p == pp->pieces)
+            p = bitfield_find_next(&pp->scratch, 0);
+        mark_downloading(pp, p);
+        return p;
+    }
+
+    /*
+     * 可挑选区里只有还没有人在下载、也没有被跳过的片段，从最稀有的桶开始找对方拥有的。
+     * 对方拥有最稀有的片段时第一个就是；只有常见片段的 peer 要跳过前面的桶。
+     */
+    for (size_t i = 0; i < wanted_end; i++) {
+        p = pp->order[i];
+        if (bitfield_get(peer_has, p)) {
+            mark_downloading(pp, p);
+            return p;
+        }
+    }
+    // endgame：所有缺少的片段都在下载中，把最稀有的那个再分给这个 peer
+    if (piece_picker_in_endgame(pp))
+        return pick_endgame(pp, peer_has);
+    return PIECE_PICKER_NONE;
+}
+
+static void remove_elevated(struct piece_picker *pp, size_t piece) {
+    for (size_t k = 0; k < pp->elevated_count; k++) {
+        if (pp->elevated[k] == piece) {
+            pp->elevated[k] = pp->elevated[--pp->elevated_count];
+            return;
+        }
+    }
+}
+
+void piece_picker_done(struct piece_picker *pp, size_t piece) {
+    if (piece >= pp->pieces || bitfield_get(&pp->have, piece))
+        return;
+    if (bitfield_get(&pp->downloading, piece)) {
+        bitfield_clear(&pp->downloading, piece);
+        pp->downloading_count--;
+        pp->requests[piece] = 0;
+    }
+    if (pp->priority[piece] == PIECE_PRIORITY_SKIP)
+        pp->skipped_count--;
+    else if (pp->priority[piece] > PIECE_PRIORITY_NORMAL)
+        remove_elevated(pp, piece);
+    // 先移出可挑选区，再换到不可挑选区的末尾，把 missing_end 减一，片段就进入已完成区
+    block(pp, piece);
+    swap_order(pp, pp->pos[piece], --pp->missing_end);
+    bitfield_set(&pp->have, piece);
+    pp->done_count++;
+}
+
+void piece_picker_abort(struct piece_picker *pp, size_t piece) {
+    if (piece >= pp->pieces || !bitfield_get(&pp->downloading, piece))
+        return;
+    // 还有别的请求在进行，片段仍然算在下载中
+    if (pp->requests[piece] > 1) {
+        pp->requests[piece]--;
+        return;
+    }
+    pp->requests[piece] = 0;
+    bitfield_clear(&pp->downloading, piece);
+    if (pp->priority[piece] != PIECE_PRIORITY_SKIP)
+        unblock(pp, piece);
+    pp->downloading_count--;
+}
+
+void piece_picker_set_priority(struct piece_picker *pp, size_t piece, int priority) {
+    if (piece >= pp->pieces)
+        return;
+    if (priority < PIECE_PRIORITY_SKIP)
+        priority = PIECE_PRIORITY_SKIP;
+    if (priority > PIECE_PRIORITY_MAX)
+        priority = PIECE_PRIORITY_MAX;
+    int old = pp->priority[piece];
+    pp->priority[piece] = (uint8_t)priority;
+    // 已经完成的片段只记下优先级
+    if (old == priority || bitfield_get(&pp->have, piece))
+        return;
+
+    if (old > PIECE_PRIORITY_NORMAL && priority <= PIECE_PRIORITY_NORMAL)
+        remove_elevated(pp, piece);
+    else if (old <= PIECE_PRIORITY_NORMAL && priority > PIECE_PRIORITY_NORMAL)
+        pp->elevated[pp->elevated_count++] = piece;
+
+    if (priority == PIECE_PRIORITY_SKIP) {
+        block(pp, piece);
+        pp->skipped_count++;
+    } else if (old == PIECE_PRIORITY_SKIP) {
+        if (!bitfield_get(&pp->downloading, piece))
+            unblock(pp, piece);
+        pp->skipped_count--;
+    }
+}
+
+int piece_picker_priority(const struct piece_picker *pp, size_t piece) {
+    return piece < pp->pieces ? pp->priority[piece] : PIECE_PRIORITY_SKIP;
+}
+
+void piece_picker_set_deadline_window(struct piece_picker *pp, size_t first, size_t count,
+                                      size_t urgent) {
+    pp->window_first = first < pp->pieces ? first : pp->pieces;
+    pp->window_count = count;
+    pp->window_urgent = urgent < count ? urgent : count;
+}
+
+unsigned piece_picker_requests(const struct piece_picker *pp, size_t piece) {
+    return piece < pp->pieces ? pp->requests[piece] : 0;
+}
+
+uint32_t piece_picker_availability(const struct piece_picker *pp, size_t piece) {
+    return piece < pp->pieces ? pp->avail[piece] : 0;
+}
+
+size_t piece_picker_missing(const struct piece_picker *pp) {
+    return pp->pieces - pp->done_count - pp->skipped_count;
+}
+
+int piece_picker_in_endgame(const struct piece_picker *pp) {
+    size_t missing = piece_picker_missing(pp);
+    return missing > 0 && pp->downloading_count == missing;
+}
+
+void piece_picker_set_random_first(struct piece_picker *pp, size_t n) {
+    pp->random_first = n;
+}
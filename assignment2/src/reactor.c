@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define REACTOR_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__) || defined(__DragonFly__)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define REACTOR_KQUEUE
+#else
+#error "reactor needs epoll or kqueue"
+#endif
+#include "reactor.h"
+
+#define REACTOR_BATCH 256
+
+/* 按描述符编号索引；gen 每次注册加一，用来识别同一批事件里已经过期的条目 */
+struct handler {
+    reactor_fn fn;
+    void *arg;
+    uint32_t gen;
+    int active;
+};
+
+struct reactor {
+    int pollfd;  // epoll 或 kqueue 描述符
+    struct handler *handlers;
+    size_t capacity;
+    size_t count;
+    struct reactor_timer *timers;  // 已设置的定时器，数量很少，不排序
+};
+
+#if defined(REACTOR_EPOLL)
+
+static int backend_open(void) {
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0)
+        perror("epoll_create1");
+    return fd;
+}
+
+static int backend_add(struct reactor *r, int fd, uint32_t gen) {
+    // data 里放描述符和 gen，事件到达时先核对 gen
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = (uint64_t)gen << 32 | (uint32_t)fd;
+    if (epoll_ctl(r->pollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return 0;
+    }
+    return 1;
+}
+
+static void backend_remove(struct reactor *r, int fd) {
+    epoll_ctl(r->pollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+typedef struct epoll_event backend_event;
+
+static int backend_wait(struct reactor *r, backend_event *events, int timeout_ms) {
+    int n = epoll_wait(r->pollfd, events, REACTOR_BATCH, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+    }
+    return n;
+}
+
+static int event_fd(const backend_event *ev, uint32_t *gen) {
+    *gen = (uint32_t)(ev->data.u64 >> 32);
+    return (int)(uint32_t)ev->data.u64;
+}
+
+static unsigned event_flags(const backend_event *ev) {
+    unsigned flags = 0;
+    if (ev->events & EPOLLIN)
+        flags |= REACTOR_READ;
+    if (ev->events & EPOLLOUT)
+        flags |= REACTOR_WRITE;
+    if (ev->events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+        flags |= REACTOR_HANGUP;
+    return flags;
+}
+
+#else
+
+static int backend_open(void) {
+    int fd = kqueue();
+    if (fd < 0) {
+        perror("kqueue");
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void backend_remove(struct reactor *r, int fd) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE | EV_RECEIPT, 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE | EV_RECEIPT, 0, 0, NULL);
+    struct kevent receipts[2];
+    kevent(r->pollfd, changes, 2, receipts, 2, NULL);
+}
+
+static int backend_add(struct reactor *r, int fd, uint32_t gen) {
+    /*
+     * 读写各是一个过滤器，EV_CLEAR 相当于 epoll 的边沿触发；gen 放在 udata 里。
+     * EV_RECEIPT 让两个过滤器分别报告结果：有些描述符（比如管道的读端）
+     * 不能等待可写，只要读过滤器注册成功就够了
+     */
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR | EV_RECEIPT, 0, 0, (void *)(uintptr_t)gen);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR | EV_RECEIPT, 0, 0, (void *)(uintptr_t)gen);
+    struct kevent receipts[2];
+    int n = kevent(r->pollfd, changes, 2, receipts, 2, NULL);
+    if (n < 0) {
+        perror("kevent");
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (receipts[i].filter == EVFILT_READ && receipts[i].data != 0) {
+            errno = (int)receipts[i].data;
+            perror("kevent");
+            backend_remove(r, fd);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct kevent backend_event;
+
+static int backend_wait(struct reactor *r, backend_event *events, int timeout_ms) {
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    int n = kevent(r->pollfd, NULL, 0, events, REACTOR_BATCH, timeout_ms < 0 ? NULL : &ts);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("kevent");
+    }
+    return n;
+}
+
+static int event_fd(const backend_event *ev, uint32_t *gen) {
+    *gen = (uint32_t)(uintptr_t)ev->udata;
+    return (int)ev->ident;
+}
+
+static unsigned event_flags(const backend_event *ev) {
+    // 读写分两条事件到达；EV_EOF 时缓冲区里可能还有数据，照样报告可读
+    unsigned flags = ev->filter == EVFILT_READ ? REACTOR_READ : REACTOR_WRITE;
+    if (ev->flags & (EV_EOF | EV_ERROR))
+        flags |= REACTOR_HANGUP;
+    return flags;
+}
+
+#endif
+
+struct reactor *reactor_new(void) {
+    struct reactor *r = calloc(1, sizeof(struct reactor));
+    if (!r)
+        return NULL;
+    r->pollfd = backend_open();
+    if (r->pollfd < 0) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void reactor_free(struct reactor *r) {
+    if (!r)
+        return;
+    close(r->pollfd);
+    free(r->handlers);
+    free(r);
+}
+
+int reactor_add(struct reactor *r, int fd, reactor_fn fn, void *arg) {
+    if (fd < 0)
+        return 0;
+    if ((size_t)fd >= r->capacity) {
+        size_t capacity = r->capacity ? r->capacity : 64;
+        while (capacity <= (size_t)fd)
+            capacity *= 2;
+        struct handler *handlers = realloc(r->handlers, capacity * sizeof(struct handler));
+        if (!handlers)
+            return 0;
+        memset(handlers + r->capacity, 0, (capacity - r->capacity) * sizeof(struct handler));
+        r->handlers = handlers;
+        r->capacity = capacity;
+    }
+    struct handler *h = &r->handlers[fd];
+    if (h->active)
+        return 0;
+
+    if (!backend_add(r, fd, h->gen + 1))
+        return 0;
+    h->fn = fn;
+    h->arg = arg;
+    h->gen++;
+    h->active = 1;
+    r->count++;
+    return 1;
+}
+
+void reactor_remove(struct reactor *r, int fd) {
+    if (fd < 0 || (size_t)fd >= r->capacity || !r->handlers[fd].active)
+        return;
+    backend_remove(r, fd);
+    r->handlers[fd].active = 0;
+    r->count--;
+}
+
+uint64_t reactor_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void reactor_timer_set(struct reactor *r, struct reactor_timer *t, uint64_t deadline,
+                       reactor_timer_fn fn, void *arg) {
+    if (!t->armed) {
+        t->next = r->timers;
+        r->timers = t;
+        t->armed = 1;
+    }
+    t->deadline = deadline;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void reactor_timer_cancel(struct reactor *r, struct reactor_timer *t) {
+    if (!t->armed)
+        return;
+    struct reactor_timer **link = &r->timers;
+    while (*link != t)
+        link = &(*link)->next;
+    *link = t->next;
+    t->armed = 0;
+}
+
+/* 等待时间不超过最早的截止时间 */
+static int wait_timeout(const struct reactor *r, int timeout_ms) {
+    if (!r->timers)
+        return timeout_ms;
+    uint64_t earliest = r->timers->deadline;
+    for (const struct reactor_timer *t = r->timers->next; t; t = t->next)
+        if (t->deadline < earliest)
+            earliest = t->deadline;
+    uint64_t now = reactor_now_ms();
+    uint64_t left = earliest > now ? earliest - now : 0;
+    if (timeout_ms < 0 || left < (uint64_t)timeout_ms)
+        return (int)left;
+    return timeout_ms;
+}
+
+/* 回调可能设置或取消任意定时器，所以每调用一个都从头重新找 */
+static int run_timers(struct reactor *r) {
+    uint64_t now = reactor_now_ms();
+    int called = 0;
+    for (;;) {
+        struct reactor_timer *t = r->timers;
+        while (t && t->deadline > now)
+            t = t->next;
+        if (!t)
+            return called;
+        reactor_timer_cancel(r, t);
+        t->fn(t->arg);
+        called++;
+    }
+}
+
+int reactor_run_once(struct reactor *r, int timeout_ms) {
+    backend_event events[REACTOR_BATCH];
+    int n = backend_wait(r, events, wait_timeout(r, timeout_ms));
+    if (n < 0)
+        return -1;
+
+    int dispatched = 0;
+    for (int i = 0; i < n; i++) {
+        uint32_t gen;
+        int fd = event_fd(&events[i], &gen);
+        // 前面的回调可能已经删除了这个描述符，甚至又用同一个编号注册了新的连接
+        struct handler *h = &r->handlers[fd];
+        if (!h->active || h->gen != gen)
+            continue;
+        h->fn(h->arg, fd, event_flags(&events[i]));
+        dispatched++;
+    }
+    return dispatched + run_timers(r);
+}
+
+size_t reactor_count(const struct reactor *r) {
+    return r->count;
+}
+
+int reactor_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
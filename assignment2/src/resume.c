@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "resume.h"
+#include "bencode.h"
+
+#ifdef __APPLE__
+#define ST_MTIM(st) ((st).st_mtimespec)
+#else
+#define ST_MTIM(st) ((st).st_mtim)
+#endif
+
+/* 文件的元数据，不存在的文件 length 记为 -1 */
+struct file_meta {
+    long long length;
+    long long mtime;
+    long long mtime_ns;
+};
+
+static void file_meta_get(const char *path, struct file_meta *meta) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        meta->length = -1;
+        meta->mtime = 0;
+        meta->mtime_ns = 0;
+        return;
+    }
+    meta->length = (long long)st.st_size;
+    meta->mtime = (long long)ST_MTIM(st).tv_sec;
+    meta->mtime_ns = (long long)ST_MTIM(st).tv_nsec;
+}
+
+static void set_str(struct bencode_value *v, const char *s, size_t len) {
+    memset(v, 0, sizeof(*v));
+    v->type = BENCODE_STR;
+    v->as.str_value.str = (char *)s;
+    v->as.str_value.len = len;
+}
+
+static void set_int(struct bencode_value *v, long long n) {
+    memset(v, 0, sizeof(*v));
+    v->type = BENCODE_INT;
+    v->as.int_value = n;
+}
+
+int resume_save(const char *path, const struct metainfo_file *torrent, const uint8_t *have) {
+    size_t count = torrent->info.files_count;
+    size_t have_len = (metainfo_file_pieces_count(torrent) + 7) / 8;
+    int ok = 0;
+
+    // 树中的字符串都指向调用者的数据，所以这里只释放自己分配的数组，不调用 bencode_value_free
+    struct bencode_value *file_maps = calloc(count ? count : 1, sizeof(struct bencode_value));
+    struct bencode_pair *file_pairs = calloc(count ? count * 3 : 1, sizeof(struct bencode_pair));
+    char *tmp_path = malloc(strlen(path) + 5);
+    if (!file_maps || !file_pairs || !tmp_path)
+        goto out;
+    for (size_t i = 0; i < count; i++) {
+        struct file_meta meta;
+        struct bencode_pair *p = &file_pairs[i * 3];
+        file_meta_get(torrent->info.files[i].path, &meta);
+        set_str(&p[0].key, "length", 6);
+        set_int(&p[0].value, meta.length);
+        set_str(&p[1].key, "mtime", 5);
+        set_int(&p[1].value, meta.mtime);
+        set_str(&p[2].key, "mtime ns", 8);
+        set_int(&p[2].value, meta.mtime_ns);
+        file_maps[i].type = BENCODE_MAP;
+        file_maps[i].as.map_value.pairs = p;
+        file_maps[i].as.map_value.count = 3;
+    }
+
+    struct bencode_pair root_pairs[3];
+    set_str(&root_pairs[0].key, "files", 5);
+    memset(&root_pairs[0].value, 0, sizeof(struct bencode_value));
+    root_pairs[0].value.type = BENCODE_LIST;
+    root_pairs[0].value.as.list_value.values = file_maps;
+    root_pairs[0].value.as.list_value.count = count;
+    set_str(&root_pairs[1].key, "info hash", 9);
+    set_str(&root_pairs[1].value, (const char *)torrent->info_hash, SHA_DIGEST_LENGTH);
+    set_str(&root_pairs[2].key, "pieces", 6);
+    set_str(&root_pairs[2].value, (const char *)have, have_len);
+    struct bencode_value root;
+    memset(&root, 0, sizeof(root));
+    root.type = BENCODE_MAP;
+    root.as.map_value.pairs = root_pairs;
+    root.as.map_value.count = 3;
+
+    // 先写临时文件再 rename，崩溃时不会留下写了一半的 sidecar
+    sprintf(tmp_path, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        goto out;
+    }
+    size_t written = bencode_value_encode_fd(&root, fd);
+    if (close(fd) < 0 || written == 0 || rename(tmp_path, path) < 0) {
+        perror("resume_save");
+        unlink(tmp_path);
+        goto out;
+    }
+    ok = 1;
+
+ out:
+    free(file_maps);
+    free(file_pairs);
+    free(tmp_path);
+    return ok;
+}
+
+/* 把与第 i 个文件重叠的所有片段标记为需要重新验证 */
+static void mark_file_stale(const struct metainfo_file *torrent, size_t i, uint8_t *stale) {
+    const struct metainfo_file_span *f = &torrent->info.files[i];
+    size_t plen = torrent->info.piece_length;
+    if (f->length == 0 || plen == 0)
+        return;
+    size_t pieces = metainfo_file_pieces_count(torrent);
+    size_t last = (f->offset + f->length - 1) / plen;
+    for (size_t p = f->offset / plen; p <= last && p < pieces; p++)
+        stale[p / 8] |= (uint8_t)(0x80 >> (p % 8));
+}
+
+static long long map_int(const struct bencode_value *map, const char *key, int *valid) {
+    const struct bencode_pair *p = bencode_map_lookup(map, key);
+    if (!p || p->value.type != BENCODE_INT) {
+        *valid = 0;
+        return 0;
+    }
+    return p->value.as.int_value;
+}
+
+int resume_load(const char *path, const struct metainfo_file *torrent, uint8_t *have,
+                uint8_t *stale) {
+    size_t pieces = metainfo_file_pieces_count(torrent);
+    size_t have_len = (pieces + 7) / 8;
+    size_t count = torrent->info.files_count;
+    int ok = 0;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+    char *buf = NULL;
+    size_t len = 0;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        long size = ftell(fp);
+        rewind(fp);
+        if (size > 0 && (buf = malloc((size_t)size)) != NULL)
+            len = fread(buf, 1, (size_t)size, fp);
+    }
+    fclose(fp);
+    if (!buf)
+        return 0;
+
+    struct bencode_value root;
+    if (bencode_value_decode_opts(&root, buf, len, BENCODE_DECODE_BORROW) == 0) {
+        free(buf);
+        return 0;
+    }
+    const struct bencode_pair *hash = bencode_map_lookup(&root, "info hash");
+    const struct bencode_pair *bits = bencode_map_lookup(&root, "pieces");
+    const struct bencode_pair *files = bencode_map_lookup(&root, "files");
+    if (root.type != BENCODE_MAP || !hash || !bits || !files ||
+        hash->value.type != BENCODE_STR || hash->value.as.str_value.len != SHA_DIGEST_LENGTH ||
+        memcmp(hash->value.as.str_value.str, torrent->info_hash, SHA_DIGEST_LENGTH) != 0 ||
+        bits->value.type != BENCODE_STR || bits->value.as.str_value.len != have_len ||
+        files->value.type != BENCODE_LIST || files->value.as.list_value.count != count)
+        goto out;
+
+    memset(stale, 0, have_len);
+    for (size_t i = 0; i < count; i++) {
+        const struct bencode_value *entry = &files->value.as.list_value.values[i];
+        int valid = entry->type == BENCODE_MAP;
+        struct file_meta saved, now;
+        if (valid) {
+            saved.length = map_int(entry, "length", &valid);
+            saved.mtime = map_int(entry, "mtime", &valid);
+            saved.mtime_ns = map_int(entry, "mtime ns", &valid);
+        }
+        file_meta_get(torrent->info.files[i].path, &now);
+        if (!valid || saved.length != now.length || saved.mtime != now.mtime ||
+            saved.mtime_ns != now.mtime_ns)
+            mark_file_stale(torrent, i, stale);
+    }
+    // 只信任所在文件都没有变化的片段
+    for (size_t b = 0; b < have_len; b++)
+        have[b] = (uint8_t)(bits->value.as.str_value.str[b] & ~stale[b]);
+    // 最后一个字节中的空闲位必须为 0
+    if (pieces % 8)
+        have[have_len - 1] &= (uint8_t)(0xff << (8 - pieces % 8));
+    ok = 1;
+
+ out:
+    bencode_value_free(&root);
+    free(buf);
+    return ok;
+}
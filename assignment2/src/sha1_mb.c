@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sha1_mb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_MB_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t sha1_iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static inline uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t rol32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+/* 单流压缩函数：处理 nblocks 个连续的 64 字节块 */
+typedef void (*sha1_compress_fn)(uint32_t state[5], const uint8_t *blocks, size_t nblocks);
+
+static void compress_scalar(uint32_t state[5], const uint8_t *blocks, size_t nblocks) {
+    for (; nblocks > 0; nblocks--, blocks += 64) {
+        uint32_t w[16];
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int t = 0; t < 16; t++)
+            w[t] = load_be32(blocks + 4 * t);
+        for (int t = 0; t < 80; t++) {
+            uint32_t f, k;
+            if (t >= 16)
+                w[t & 15] = rol32(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);
+            if (t < 20) {
+                f = d ^ (b & (c ^ d));
+                k = 0x5a827999;
+            } else if (t < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (t < 60) {
+                f = (b & c) | (d & (b | c));
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t tmp = rol32(a, 5) + f + e + k + w[t & 15];
+            e = d;
+            d = c;
+            c = rol32(b, 30);
+            b = a;
+            a = tmp;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+/*
+ * 把最后不满一块的数据和填充写进 tail，返回填充后的块数（1 或 2）。
+ * total 是整条消息的字节数。
+ */
+static size_t sha1_pad(uint8_t tail[128], const uint8_t *rest, size_t rest_len, uint64_t total) {
+    size_t nblocks = rest_len + 9 > 64 ? 2 : 1;
+    if (rest_len > 0)
+        memcpy(tail, rest, rest_len);
+    tail[rest_len] = 0x80;
+    memset(tail + rest_len + 1, 0, nblocks * 64 - rest_len - 1);
+    uint64_t bits = total * 8;
+    store_be32(tail + nblocks * 64 - 8, (uint32_t)(bits >> 32));
+    store_be32(tail + nblocks * 64 - 4, (uint32_t)bits);
+    return nblocks;
+}
+
+static void sha1_oneshot(sha1_compress_fn compress, const uint8_t *data, size_t len,
+                         uint8_t out[SHA1_MB_DIGEST_LENGTH]) {
+    uint32_t state[5];
+    uint8_t tail[128];
+    memcpy(state, sha1_iv, sizeof(state));
+    // 整块直接从调用者的缓冲区压缩，只有尾部需要复制
+    compress(state, data, len / 64);
+    size_t full = len & ~(size_t)63;
+    compress(state, tail, sha1_pad(tail, data + full, len - full, len));
+    for (int i = 0; i < 5; i++)
+        store_be32(out + 4 * i, state[i]);
+}
+
+#ifdef SHA1_MB_X86
+
+/*
+ * SHA 扩展指令：每条 sha1rnds4 完成 4 轮，sha1msg1/sha1msg2 计算消息扩展。
+ * 第 k 组（轮 4k..4k+3）使用 M0，同时为第 k+1、k+2、k+3 组推进 M1、M2、M3。
+ * 最后几组多算出的消息字用不到，不影响结果。
+ */
+#define SHANI_QROUND(Ea, Eb, M0, M1, M2, M3, f) \
+    do { \
+        Ea = _mm_sha1nexte_epu32(Ea, M0); \
+        Eb = abcd; \
+        M1 = _mm_sha1msg2_epu32(M1, M0); \
+        abcd = _mm_sha1rnds4_epu32(abcd, Ea, f); \
+        M3 = _mm_sha1msg1_epu32(M3, M0); \
+        M2 = _mm_xor_si128(M2, M0); \
+    } while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compress_shani(uint32_t state[5], const uint8_t *blocks, size_t nblocks) {
+    // 整个 128 位字节序翻转：大端字序转换的同时让 W0 落在最高的 32 位
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1, m0, m1, m2, m3;
+
+    for (; nblocks > 0; nblocks--, blocks += 64) {
+        __m128i abcd_save = abcd, e0_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 0)), mask);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 48)), mask);
+        SHANI_QROUND(e1, e0, m3, m0, m1, m2, 0);
+        SHANI_QROUND(e0, e1, m0, m1, m2, m3, 0);
+        SHANI_QROUND(e1, e0, m1, m2, m3, m0, 1);
+        SHANI_QROUND(e0, e1, m2, m3, m0, m1, 1);
+        SHANI_QROUND(e1, e0, m3, m0, m1, m2, 1);
+        SHANI_QROUND(e0, e1, m0, m1, m2, m3, 1);
+        SHANI_QROUND(e1, e0, m1, m2, m3, m0, 1);
+        SHANI_QROUND(e0, e1, m2, m3, m0, m1, 2);
+        SHANI_QROUND(e1, e0, m3, m0, m1, m2, 2);
+        SHANI_QROUND(e0, e1, m0, m1, m2, m3, 2);
+        SHANI_QROUND(e1, e0, m1, m2, m3, m0, 2);
+        SHANI_QROUND(e0, e1, m2, m3, m0, m1, 2);
+        SHANI_QROUND(e1, e0, m3, m0, m1, m2, 3);
+        SHANI_QROUND(e0, e1, m0, m1, m2, m3, 3);
+        SHANI_QROUND(e1, e0, m1, m2, m3, m0, 3);
+        SHANI_QROUND(e0, e1, m2, m3, m0, m1, 3);
+        SHANI_QROUND(e1, e0, m3, m0, m1, m2, 3);
+
+        // e0 保存着最后 4 轮之前的 A，nexte 把它循环左移 30 位后加到旧的 E 上
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+/* AVX2 多缓冲：每个 32 位通道是一条独立的消息 */
+#define AVX2_ROL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+/* 8 行各 8 个字的转置，行是通道，转置后第 i 个向量是所有通道的第 i 个字 */
+__attribute__((target("avx2")))
+static inline void avx2_transpose8(__m256i r[8]) {
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/*
+ * 同时压缩 8 个通道各一块。block[i] 是第 i 个通道的 64 字节，
+ * active 中为 0 的通道只参与计算，状态保持不变。
+ */
+__attribute__((target("avx2")))
+static void compress_avx2_x8(__m256i state[5], const uint8_t *const block[SHA1_MB_LANES],
+                             __m256i active) {
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i w[16];
+    for (int half = 0; half < 2; half++) {
+        for (int i = 0; i < SHA1_MB_LANES; i++)
+            w[half * 8 + i] = _mm256_loadu_si256((const __m256i *)(block[i] + half * 32));
+        avx2_transpose8(&w[half * 8]);
+    }
+    for (int t = 0; t < 16; t++)
+        w[t] = _mm256_shuffle_epi8(w[t], bswap);
+
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int t = 0; t < 80; t++) {
+        __m256i f, k;
+        if (t >= 16) {
+            __m256i x = _mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),
+                                         _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));
+            w[t & 15] = AVX2_ROL(x, 1);
+        }
+        if (t < 20) {
+            f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+            k = _mm256_set1_epi32(0x5a827999);
+        } else if (t < 40) {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32(0x6ed9eba1);
+        } else if (t < 60) {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            k = _mm256_set1_epi32((int)0x8f1bbcdc);
+        } else {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32((int)0xca62c1d6);
+        }
+        __m256i tmp = _mm256_add_epi32(_mm256_add_epi32(AVX2_ROL(a, 5), f),
+                                       _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+        e = d;
+        d = c;
+        c = AVX2_ROL(b, 30);
+        b = a;
+        a = tmp;
+    }
+    state[0] = _mm256_blendv_epi8(state[0], _mm256_add_epi32(state[0], a), active);
+    state[1] = _mm256_blendv_epi8(state[1], _mm256_add_epi32(state[1], b), active);
+    state[2] = _mm256_blendv_epi8(state[2], _mm256_add_epi32(state[2], c), active);
+    state[3] = _mm256_blendv_epi8(state[3], _mm256_add_epi32(state[3], d), active);
+    state[4] = _mm256_blendv_epi8(state[4], _mm256_add_epi32(state[4], e), active);
+}
+
+/* 最多 8 条消息一起哈希，长度不同的通道在自己的块用完后被屏蔽 */
+__attribute__((target("avx2")))
+static void sha1_avx2_x8(const uint8_t *const *data, const size_t *len, size_t n,
+                         uint8_t (*out)[SHA1_MB_DIGEST_LENGTH]) {
+    uint8_t tail[SHA1_MB_LANES][128];
+    size_t full[SHA1_MB_LANES], total[SHA1_MB_LANES];
+    size_t max_blocks = 0;
+    __m256i state[5];
+
+    for (size_t i = 0; i < SHA1_MB_LANES; i++) {
+        if (i < n) {
+            full[i] = len[i] / 64;
+            total[i] = full[i] + sha1_pad(tail[i], data[i] + full[i] * 64, len[i] % 64, len[i]);
+        } else {
+            // 空闲的通道从不激活，tail 只是为了有合法的地址可读
+            full[i] = total[i] = 0;
+            memset(tail[i], 0, 64);
+        }
+        if (total[i] > max_blocks)
+            max_blocks = total[i];
+    }
+    for (int j = 0; j < 5; j++)
+        state[j] = _mm256_set1_epi32((int)sha1_iv[j]);
+
+    for (size_t blk = 0; blk < max_blocks; blk++) {
+        const uint8_t *block[SHA1_MB_LANES];
+        int32_t act[SHA1_MB_LANES];
+        for (size_t i = 0; i < SHA1_MB_LANES; i++) {
+            if (blk < full[i])
+                block[i] = data[i] + blk * 64;
+            else if (blk < total[i])
+                block[i] = tail[i] + (blk - full[i]) * 64;
+            else
+                block[i] = tail[i];
+            act[i] = blk < total[i] ? -1 : 0;
+        }
+        compress_avx2_x8(state, block, _mm256_loadu_si256((const __m256i *)act));
+    }
+
+    uint32_t words[5][SHA1_MB_LANES];
+    for (int j = 0; j < 5; j++)
+        _mm256_storeu_si256((__m256i *)words[j], state[j]);
+    for (size_t i = 0; i < n; i++) {
+        for (int j = 0; j < 5; j++)
+            store_be32(out[i] + 4 * j, words[j][i]);
+    }
+}
+
+#endif /* SHA1_MB_X86 */
+
+static int cpu_has(enum sha1_impl impl) {
+    if (impl == SHA1_IMPL_SCALAR)
+        return 1;
+#ifdef SHA1_MB_X86
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    int ssse3 = (ecx & bit_SSSE3) != 0, sse41 = (ecx & bit_SSE4_1) != 0;
+    // AVX 还要求操作系统用 XSAVE 保存 YMM 寄存器
+    int avx_os = 0;
+    if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+        unsigned lo, hi;
+        __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        avx_os = (lo & 6) == 6;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    if (impl == SHA1_IMPL_SHANI)
+        return ssse3 && sse41 && (ebx & bit_SHA) != 0;
+    if (impl == SHA1_IMPL_AVX2)
+        return avx_os && (ebx & bit_AVX2) != 0;
+#endif
+    return 0;
+}
+
+static enum sha1_impl current_impl = SHA1_IMPL_SCALAR;
+static int have_shani;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+/* 批量哈希时 8 通道的 AVX2 比单流的 SHA 扩展吞吐更高，优先使用 */
+static enum sha1_impl detect_impl(void) {
+    if (cpu_has(SHA1_IMPL_AVX2))
+        return SHA1_IMPL_AVX2;
+    if (have_shani)
+        return SHA1_IMPL_SHANI;
+    return SHA1_IMPL_SCALAR;
+}
+
+static void impl_init(void) {
+    have_shani = cpu_has(SHA1_IMPL_SHANI);
+    current_impl = detect_impl();
+}
+
+enum sha1_impl sha1_mb_get_impl(void) {
+    pthread_once(&impl_once, impl_init);
+    return current_impl;
+}
+
+int sha1_mb_set_impl(enum sha1_impl impl) {
+    pthread_once(&impl_once, impl_init);
+    if (impl == SHA1_IMPL_AUTO)
+        impl = detect_impl();
+    if (!cpu_has(impl))
+        return 0;
+    current_impl = impl;
+    return 1;
+}
+
+const char *sha1_impl_name(enum sha1_impl impl) {
+    switch (impl) {
+    case SHA1_IMPL_AUTO:
+        return "auto";
+    case SHA1_IMPL_SCALAR:
+        return "scalar";
+    case SHA1_IMPL_AVX2:
+        return "avx2";
+    case SHA1_IMPL_SHANI:
+        return "sha-ni";
+    }
+    return "unknown";
+}
+
+/*
+ * 单流场景下最快的压缩函数。AVX2 对单条消息没有帮助，
+ * 所以选了 AVX2 时单流仍然使用 SHA 扩展（如果有的话）。
+ */
+static sha1_compress_fn single_compress(void) {
+#ifdef SHA1_MB_X86
+    if (sha1_mb_get_impl() != SHA1_IMPL_SCALAR && have_shani)
+        return compress_shani;
+#endif
+    return compress_scalar;
+}
+
+size_t sha1_mb_batch(void) {
+    return sha1_mb_get_impl() == SHA1_IMPL_AVX2 ? SHA1_MB_LANES : 1;
+}
+
+void sha1_mb(const uint8_t *const *data, const size_t *len, size_t n,
+             uint8_t (*out)[SHA1_MB_DIGEST_LENGTH]) {
+#ifdef SHA1_MB_X86
+    if (sha1_mb_get_impl() == SHA1_IMPL_AVX2) {
+        for (size_t i = 0; i < n; i += SHA1_MB_LANES) {
+            size_t lanes = n - i < SHA1_MB_LANES ? n - i : SHA1_MB_LANES;
+            // 剩下的几条消息填不满一半通道时，单流的 SHA 扩展更快
+            if (lanes < SHA1_MB_LANES / 2 && have_shani) {
+                for (size_t j = i; j < n; j++)
+                    sha1_oneshot(compress_shani, data[j], len[j], out[j]);
+                break;
+            }
+            sha1_avx2_x8(data + i, len + i, lanes, out + i);
+        }
+        return;
+    }
+#endif
+    sha1_compress_fn compress = single_compress();
+    for (size_t i = 0; i < n; i++)
+        sha1_oneshot(compress, data[i], len[i], out[i]);
+}
+
+void sha1(const void *data, size_t len, uint8_t out[SHA1_MB_DIGEST_LENGTH]) {
+    sha1_oneshot(single_compress(), data, len, out);
+}
+
+void sha1_init(struct sha1_ctx *ctx) {
+    memcpy(ctx->state, sha1_iv, sizeof(ctx->state));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    sha1_compress_fn compress = single_compress();
+    ctx->length += len;
+    if (ctx->block_len > 0) {
+        size_t take = 64 - ctx->block_len;
+        if (take > len)
+            take = len;
+        memcpy(ctx->block + ctx->block_len, p, take);
+        ctx->block_len += take;
+        p += take;
+        len -= take;
+        if (ctx->block_len < 64)
+            return;
+        compress(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+    compress(ctx->state, p, len / 64);
+    p += len & ~(size_t)63;
+    len &= 63;
+    memcpy(ctx->block, p, len);
+    ctx->block_len = len;
+}
+
+void sha1_final(struct sha1_ctx *ctx, uint8_t out[SHA1_MB_DIGEST_LENGTH]) {
+    uint8_t tail[128];
+    single_compress()(ctx->state, tail, sha1_pad(tail, ctx->block, ctx->block_len, ctx->length));
+    for (int i = 0; i < 5; i++)
+        store_be32(out + 4 * i, ctx->state[i]);
+}
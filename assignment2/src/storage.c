@@ -0,0 +1,297 @@
+#define _GNU_SOURCE  // SEEK_DATA
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "storage.h"
+
+struct storage {
+    const struct metainfo_file *torrent;
+    int *fds;  // 与 torrent->info.files 一一对应，-1 表示文件不存在
+};
+
+/* 创建 path 上面的所有目录，已存在的目录不算错误 */
+static int make_parent_dirs(const char *path) {
+    char *copy = strdup(path);
+    if (!copy)
+        return 0;
+    for (char *p = strchr(copy + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(copy, 0755) < 0 && errno != EEXIST) {
+            perror("mkdir");
+            free(copy);
+            return 0;
+        }
+        *p = '/';
+    }
+    free(copy);
+    return 1;
+}
+
+static int prealloc_file(int fd, size_t length, enum storage_prealloc mode) {
+    struct stat st;
+    if (mode == STORAGE_PREALLOC_NONE || length == 0)
+        return 1;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        return 0;
+    }
+    if (mode == STORAGE_PREALLOC_FULL) {
+#ifndef __APPLE__
+        // 已有的数据不受影响，只为空洞分配块
+        int err = posix_fallocate(fd, 0, (off_t)length);
+        if (err == 0)
+            return 1;
+        // 文件系统不支持时退化为稀疏分配
+        if (err != EINVAL && err != EOPNOTSUPP) {
+            errno = err;
+            perror("posix_fallocate");
+            return 0;
+        }
+#endif
+    }
+    // 稀疏分配：只设置文件大小，不分配块；从不截短已有的文件
+    if ((size_t)st.st_size < length && ftruncate(fd, (off_t)length) < 0) {
+        perror("ftruncate");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * 已有的文件只在需要扩展或分配块时才写打开，这样已经完整的只读文件也能用来做种。
+ * 块数按 512 字节计，完整预分配时以此判断文件里是否还有空洞
+ */
+static int needs_write(const char *path, size_t length, enum storage_prealloc mode) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return 1;  // 文件不存在，或者路径上是目录等，交给 open 报错
+    if (mode == STORAGE_PREALLOC_NONE || length == 0)
+        return 0;
+    if ((size_t)st.st_size < length)
+        return 1;
+    return mode == STORAGE_PREALLOC_FULL && (size_t)st.st_blocks * 512 < length;
+}
+
+int storage_create(const struct metainfo_file *torrent, enum storage_prealloc mode) {
+    for (size_t i = 0; i < torrent->info.files_count; i++) {
+        const struct metainfo_file_span *f = &torrent->info.files[i];
+        if (!needs_write(f->path, f->length, mode))
+            continue;
+        if (!make_parent_dirs(f->path))
+            return 0;
+        int fd = open(f->path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            perror("open");
+            return 0;
+        }
+        int ok = prealloc_file(fd, f->length, mode);
+        close(fd);
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+static struct storage *open_files(const struct metainfo_file *torrent, int flags) {
+    struct storage *st = malloc(sizeof(struct storage));
+    if (!st)
+        return NULL;
+    size_t count = torrent->info.files_count;
+    st->torrent = torrent;
+    st->fds = malloc((count ? count : 1) * sizeof(int));
+    if (!st->fds) {
+        free(st);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        // 空文件不会被读到，也就不需要打开
+        if (torrent->info.files[i].length == 0)
+            st->fds[i] = -1;
+        else
+            st->fds[i] = open(torrent->info.files[i].path, flags);
+    }
+    return st;
+}
+
+struct storage *storage_open(const struct metainfo_file *torrent) {
+    return open_files(torrent, O_RDONLY);
+}
+
+struct storage *storage_open_rw(const struct metainfo_file *torrent) {
+    return open_files(torrent, O_RDWR);
+}
+
+void storage_close(struct storage *storage) {
+    if (!storage)
+        return;
+    for (size_t i = 0; i < storage->torrent->info.files_count; i++) {
+        if (storage->fds[i] >= 0)
+            close(storage->fds[i]);
+    }
+    free(storage->fds);
+    free(storage);
+}
+
+/* pread 可能返回部分数据或被信号打断，循环直到读满或遇到 EOF */
+static size_t pread_full(int fd, char *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread(fd, buf + done, len - done, off + (off_t)done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (r == 0)
+            break;
+        done += (size_t)r;
+    }
+    return done;
+}
+
+static size_t pwrite_full(int fd, const char *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pwrite(fd, buf + done, len - done, off + (off_t)done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        done += (size_t)r;
+    }
+    return done;
+}
+
+/* 二分查找 offset 所在的文件：最后一个起始位置不大于 offset 的文件 */
+static size_t find_file(const struct metainfo_info *info, size_t offset) {
+    size_t lo = 0, hi = info->files_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (info->files[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t storage_read(struct storage *storage, size_t offset, void *buf, size_t len) {
+    const struct metainfo_info *info = &storage->torrent->info;
+    if (info->files_count == 0 || offset >= info->length)
+        return 0;
+    if (len > info->length - offset)
+        len = info->length - offset;
+
+    // 找到 offset 所在的文件，之后顺序向后读
+    char *out = buf;
+    size_t done = 0;
+    for (size_t i = find_file(info, offset); i < info->files_count && done < len; i++) {
+        const struct metainfo_file_span *f = &info->files[i];
+        size_t pos = offset + done;
+        if (f->length == 0 || pos >= f->offset + f->length)
+            continue;
+        size_t n = f->offset + f->length - pos;
+        if (n > len - done)
+            n = len - done;
+        if (storage->fds[i] < 0)
+            break;
+        size_t r = pread_full(storage->fds[i], out + done, n, (off_t)(pos - f->offset));
+        done += r;
+        if (r < n)
+            break;
+    }
+    return done;
+}
+
+size_t storage_piece_size(const struct metainfo_file *torrent, size_t i) {
+    size_t pieces = metainfo_file_pieces_count(torrent);
+    size_t piece_length = torrent->info.piece_length;
+    if (i >= pieces)
+        return 0;
+    if (i < pieces - 1)
+        return piece_length;
+    // pieces 个数与 length 不一致的种子：最后一片不存在
+    if ((pieces - 1) * piece_length >= torrent->info.length)
+        return 0;
+    return torrent->info.length - (pieces - 1) * piece_length;
+}
+
+size_t storage_write(struct storage *storage, size_t offset, const void *buf, size_t len) {
+    const struct metainfo_info *info = &storage->torrent->info;
+    if (info->files_count == 0 || offset >= info->length)
+        return 0;
+    if (len > info->length - offset)
+        len = info->length - offset;
+
+    // 与 storage_read 相同，一个块可能跨越几个文件
+    const char *in = buf;
+    size_t done = 0;
+    for (size_t i = find_file(info, offset); i < info->files_count && done < len; i++) {
+        const struct metainfo_file_span *f = &info->files[i];
+        size_t pos = offset + done;
+        if (f->length == 0 || pos >= f->offset + f->length)
+            continue;
+        size_t n = f->offset + f->length - pos;
+        if (n > len - done)
+            n = len - done;
+        if (storage->fds[i] < 0)
+            break;
+        size_t w = pwrite_full(storage->fds[i], in + done, n, (off_t)(pos - f->offset));
+        done += w;
+        if (w < n)
+            break;
+    }
+    return done;
+}
+
+size_t storage_read_piece(struct storage *storage, size_t i, void *buf) {
+    size_t len = storage_piece_size(storage->torrent, i);
+    if (len == 0)
+        return 0;
+    if (storage_read(storage, i * storage->torrent->info.piece_length, buf, len) != len)
+        return 0;
+    return len;
+}
+
+int storage_piece_is_hole(struct storage *storage, size_t i) {
+#ifdef SEEK_DATA
+    const struct metainfo_info *info = &storage->torrent->info;
+    size_t len = storage_piece_size(storage->torrent, i);
+    if (len == 0 || info->files_count == 0)
+        return 0;
+    size_t start = i * info->piece_length, end = start + len;
+    for (size_t k = find_file(info, start); k < info->files_count; k++) {
+        const struct metainfo_file_span *f = &info->files[k];
+        if (f->offset >= end)
+            break;
+        if (f->length == 0 || f->offset + f->length <= start)
+            continue;
+        if (storage->fds[k] < 0)
+            return 0;
+        size_t from = start > f->offset ? start - f->offset : 0;
+        size_t to = (end < f->offset + f->length ? end : f->offset + f->length) - f->offset;
+        // 从 from 开始的下一段数据在 to 之后（或文件末尾之后都是空洞）才算空洞
+        off_t data = lseek(storage->fds[k], (off_t)from, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO)
+                return 0;
+            // ENXIO：from 之后没有数据，但 from 也可能已经超出了文件末尾
+            struct stat st;
+            if (fstat(storage->fds[k], &st) < 0 || (size_t)st.st_size < to)
+                return 0;
+        } else if ((size_t)data < to) {
+            return 0;
+        }
+    }
+    return 1;
+#else
+    (void)storage;
+    (void)i;
+    return 0;
+#endif
+}
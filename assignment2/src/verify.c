@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include "verify.h"
+#include "storage.h"
+#include "sha1_mb.h"
+
+/* 所有 worker 共享的状态 */
+struct verify_job {
+    const struct metainfo_file *torrent;
+    struct storage *storage;
+    uint8_t *have;
+    const uint8_t *only;  // 需要检查的片段，NULL 表示全部
+    size_t pieces;
+    size_t total;         // 需要检查的片段数，用于进度
+    size_t next;          // 下一个未被领取的片段，原子递增
+    size_t valid_bytes;   // 原子累加
+    size_t done;          // 已完成的片段数，受 progress_lock 保护
+    int failed;           // 有 worker 没能分配缓冲区，原子设置
+    pthread_mutex_t progress_lock;
+    const struct verify_options *opts;
+};
+
+/* 一次哈希已读入的 n 个片段，结果写回它们在块内的位置 slots */
+static void hash_batch(const uint8_t *const *data, const size_t *lens, const size_t *slots,
+                       size_t n, uint8_t (*digests)[SHA_DIGEST_LENGTH]) {
+    uint8_t out[VERIFY_CHUNK_PIECES][SHA_DIGEST_LENGTH];
+    sha1_mb(data, lens, n, out);
+    for (size_t j = 0; j < n; j++)
+        memcpy(digests[slots[j]], out[j], SHA_DIGEST_LENGTH);
+}
+
+/* len 个零字节的摘要 */
+static void zero_digest(size_t len, uint8_t out[SHA_DIGEST_LENGTH]) {
+    static const uint8_t zeros[4096];
+    struct sha1_ctx ctx;
+    sha1_init(&ctx);
+    for (; len > sizeof(zeros); len -= sizeof(zeros))
+        sha1_update(&ctx, zeros, sizeof(zeros));
+    sha1_update(&ctx, zeros, len);
+    sha1_final(&ctx, out);
+}
+
+static void *verify_worker(void *arg) {
+    struct verify_job *job = arg;
+    const struct metainfo_file *torrent = job->torrent;
+    size_t piece_length = torrent->info.piece_length ? torrent->info.piece_length : 1;
+    // 多缓冲内核一次哈希 batch 个片段，每个 worker 复用自己的缓冲区，不再每片 malloc
+    size_t batch = sha1_mb_batch();
+    char *buffer = malloc(batch * piece_length);
+    uint8_t digests[VERIFY_CHUNK_PIECES][SHA_DIGEST_LENGTH];
+    uint8_t ok[VERIFY_CHUNK_PIECES];
+    // 全零片段的摘要：[0] 是完整片段，[1] 是较短的最后一片
+    uint8_t zero[2][SHA_DIGEST_LENGTH];
+    int zero_ready[2] = { 0, 0 };
+    if (!buffer) {
+        // 没有领取任何片段，其他 worker 会把它们做完
+        fprintf(stderr, "verify: cannot allocate %zu piece buffers\n", batch);
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for (;;) {
+        size_t first = __atomic_fetch_add(&job->next, VERIFY_CHUNK_PIECES, __ATOMIC_RELAXED);
+        if (first >= job->pieces)
+            break;
+        size_t n = job->pieces - first;
+        if (n > VERIFY_CHUNK_PIECES)
+            n = VERIFY_CHUNK_PIECES;
+
+        const uint8_t *data[VERIFY_CHUNK_PIECES];
+        size_t lens[VERIFY_CHUNK_PIECES];
+        size_t slots[VERIFY_CHUNK_PIECES];
+        size_t pending = 0;
+        size_t checked = 0;
+        for (size_t k = 0; k < n; k++) {
+            size_t i = first + k;
+            // 跳过的片段和读不全的片段，全零摘要不会匹配
+            memset(digests[k], 0, SHA_DIGEST_LENGTH);
+            if (job->only && !(job->only[i / 8] & (0x80 >> (i % 8))))
+                continue;
+            checked++;
+            // 完全落在稀疏文件空洞里的片段读出来全是零，不必读盘
+            if (storage_piece_is_hole(job->storage, i)) {
+                size_t len = storage_piece_size(torrent, i);
+                int last = len != piece_length;
+                if (!zero_ready[last]) {
+                    zero_digest(len, zero[last]);
+                    zero_ready[last] = 1;
+                }
+                memcpy(digests[k], zero[last], SHA_DIGEST_LENGTH);
+                continue;
+            }
+            char *slot = buffer + pending * piece_length;
+            size_t len = storage_read_piece(job->storage, i, slot);
+            if (len == 0)
+                continue;
+            data[pending] = (const uint8_t *)slot;
+            lens[pending] = len;
+            slots[pending++] = k;
+            if (pending == batch) {
+                hash_batch(data, lens, slots, pending, digests);
+                pending = 0;
+            }
+        }
+        hash_batch(data, lens, slots, pending, digests);
+        metainfo_file_verify_hashes(torrent, first, n, (const uint8_t (*)[SHA_DIGEST_LENGTH])digests, ok);
+
+        size_t bytes = 0;
+        for (size_t k = 0; k < n; k++) {
+            size_t i = first + k;
+            if (!ok[k] || (job->only && !(job->only[i / 8] & (0x80 >> (i % 8)))))
+                continue;
+            bytes += storage_piece_size(torrent, i);
+            // 相邻的块可能共享同一个字节，按位或必须是原子的
+            __atomic_fetch_or(&job->have[i / 8], (uint8_t)(0x80 >> (i % 8)), __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&job->valid_bytes, bytes, __ATOMIC_RELAXED);
+
+        if (job->opts && job->opts->progress && checked > 0) {
+            pthread_mutex_lock(&job->progress_lock);
+            job->done += checked;
+            job->opts->progress(job->opts->progress_ctx, job->done, job->total);
+            pthread_mutex_unlock(&job->progress_lock);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+size_t verify_torrent(const struct metainfo_file *torrent, uint8_t *have,
+                      const struct verify_options *opts) {
+    size_t pieces = metainfo_file_pieces_count(torrent);
+    const uint8_t *only = opts ? opts->only : NULL;
+    size_t total = pieces;
+    if (only) {
+        // 只清除要检查的片段对应的位，其余保持调用者的结果
+        total = 0;
+        for (size_t b = 0; b < (pieces + 7) / 8; b++) {
+            have[b] &= (uint8_t)~only[b];
+            total += (size_t)__builtin_popcount(only[b]);
+        }
+        if (pieces % 8)
+            total -= (size_t)__builtin_popcount(only[pieces / 8] & (0xff >> (pieces % 8)));
+    } else {
+        memset(have, 0, (pieces + 7) / 8);
+    }
+    if (pieces == 0 || total == 0)
+        return 0;
+
+    unsigned threads = opts ? opts->threads : 0;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    // 线程数不超过块数，多出来的线程没有活干
+    size_t chunks = (pieces + VERIFY_CHUNK_PIECES - 1) / VERIFY_CHUNK_PIECES;
+    if (threads > chunks)
+        threads = (unsigned)chunks;
+
+    struct verify_job job = {
+        .torrent = torrent,
+        .have = have,
+        .only = only,
+        .pieces = pieces,
+        .total = total,
+        .opts = opts,
+    };
+    job.storage = storage_open(torrent);
+    if (!job.storage)
+        return (size_t)-1;
+    pthread_mutex_init(&job.progress_lock, NULL);
+
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    unsigned started = 0;
+    if (tids) {
+        // 调用线程自己也作为一个 worker，只需另外创建 threads - 1 个
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&tids[started], NULL, verify_worker, &job) != 0)
+                break;
+        }
+    }
+    verify_worker(&job);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    pthread_mutex_destroy(&job.progress_lock);
+    storage_close(job.storage);
+    // 所有 worker 都失败时片段根本没有被检查，不能当作磁盘上没有数据
+    if (job.failed && job.next < pieces)
+        return (size_t)-1;
+    return job.valid_bytes;
+}
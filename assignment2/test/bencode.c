@@ -1,10 +1,45 @@
 #include "unity_fixture.h"
 #include "unity.h"
 #include "unity_internals.h"
+#include "test_util.h"
 #include <bencode.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 static struct bencode_value value;
 
+/* Buffers allocated inside the library bypass the fixture's malloc() */
+static void free_real(void *p)
+{
+#pragma push_macro("free")
+#undef free
+    free(p);
+#pragma pop_macro("free")
+}
+
+/* Builds "l" + count copies of item + "e" */
+static char *make_list(const char *item, size_t count, size_t *len)
+{
+    size_t item_len = strlen(item);
+    char *enc = malloc(item_len * count + 2);
+    size_t pos = 0;
+
+    if (!enc)
+	return NULL;
+    enc[pos++] = 'l';
+    for (size_t i = 0; i < count; ++i) {
+	memcpy(enc + pos, item, item_len);
+	pos += item_len;
+    }
+    enc[pos++] = 'e';
+    *len = pos;
+    return enc;
+}
+
 TEST_GROUP(bencode);
 
 TEST_SETUP(bencode) {}
@@ -661,6 +696,619 @@ TEST(bencode, encode_map_small_buf)
     bencode_value_free(&value);
 }
 
+TEST(bencode, borrow_string)
+{
+    const char *enc = "5:hello";
+
+    TEST_ASSERT_EQUAL(7, bencode_value_decode_opts(&value, enc, 7, BENCODE_DECODE_BORROW));
+    TEST_ASSERT_EQUAL(BENCODE_STR, bencode_value_type(&value));
+    TEST_ASSERT_EQUAL(5, bencode_value_len(&value));
+    TEST_ASSERT_EQUAL_PTR(enc + 2, bencode_value_str(&value));
+    TEST_ASSERT_TRUE(value.flags & BENCODE_VALUE_BORROWED);
+
+    bencode_value_free(&value);
+}
+
+TEST(bencode, borrow_nested_map)
+{
+    const char *enc = "d3:cow3:moo4:spaml1:a2:bcee";
+    const struct bencode_pair *pair;
+    const struct bencode_value *item;
+
+    TEST_ASSERT_EQUAL(27, bencode_value_decode_opts(&value, enc, 27, BENCODE_DECODE_BORROW));
+    TEST_ASSERT_EQUAL(BENCODE_MAP, bencode_value_type(&value));
+
+    pair = bencode_map_lookup(&value, "cow");
+    TEST_ASSERT_NOT_NULL(pair);
+    TEST_ASSERT_EQUAL(3, bencode_value_len(&pair->value));
+    TEST_ASSERT_EQUAL_STRING_LEN("moo", bencode_value_str(&pair->value), 3);
+    TEST_ASSERT_EQUAL_PTR(enc + 8, bencode_value_str(&pair->value));
+
+    pair = bencode_map_lookup(&value, "spam");
+    TEST_ASSERT_NOT_NULL(pair);
+    item = bencode_list_get(&pair->value, 1);
+    TEST_ASSERT_NOT_NULL(item);
+    TEST_ASSERT_EQUAL_STRING_LEN("bc", bencode_value_str(item), 2);
+
+    TEST_ASSERT_NULL(bencode_map_lookup(&value, "co"));
+
+    bencode_value_free(&value);
+}
+
+TEST(bencode, borrow_invalid)
+{
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "d4:spam4:eggs", 13, BENCODE_DECODE_BORROW));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "l5:helloi1", 10, BENCODE_DECODE_BORROW));
+}
+
+TEST(bencode, borrow_encode)
+{
+    const char *expected = "d3:cow3:moo4:spam4:eggse";
+    char buf[24];
+
+    TEST_ASSERT_EQUAL(24, bencode_value_decode_opts(&value, expected, 24, BENCODE_DECODE_BORROW));
+    TEST_ASSERT_EQUAL(24, bencode_value_encode(&value, buf, 24));
+    TEST_ASSERT_EQUAL_STRING_LEN(expected, buf, 24);
+
+    bencode_value_free(&value);
+}
+
+TEST(bencode, arena_decode)
+{
+    struct bencode_arena *arena = bencode_arena_new(0);
+    const struct bencode_pair *pair;
+
+    TEST_ASSERT_NOT_NULL(arena);
+    TEST_ASSERT_EQUAL(24, bencode_value_decode_arena(&value, "d3:cow3:moo4:spam4:eggse", 24, arena, 0));
+    TEST_ASSERT_EQUAL(BENCODE_MAP, bencode_value_type(&value));
+    TEST_ASSERT_TRUE(value.flags & BENCODE_VALUE_ARENA);
+
+    pair = bencode_map_lookup(&value, "spam");
+    TEST_ASSERT_NOT_NULL(pair);
+    TEST_ASSERT_EQUAL_STRING("eggs", bencode_value_str(&pair->value));
+
+    /* bencode_value_free must be a harmless no-op on arena trees */
+    bencode_value_free(&value);
+    bencode_arena_free(arena);
+}
+
+TEST(bencode, arena_reset_reuse)
+{
+    struct bencode_arena *arena = bencode_arena_new(64);
+    const struct bencode_value *item;
+    const char *first;
+
+    TEST_ASSERT_NOT_NULL(arena);
+    TEST_ASSERT_EQUAL(19, bencode_value_decode_arena(&value, "li12el5:helloi52eee", 19, arena, 0));
+    first = bencode_value_str(bencode_list_get(bencode_list_get(&value, 1), 0));
+
+    for (int round = 0; round < 4; ++round) {
+	bencode_arena_reset(arena);
+	TEST_ASSERT_EQUAL(19, bencode_value_decode_arena(&value, "li12el5:helloi52eee", 19, arena, 0));
+	item = bencode_list_get(bencode_list_get(&value, 1), 0);
+	TEST_ASSERT_NOT_NULL(item);
+	TEST_ASSERT_EQUAL_STRING("hello", bencode_value_str(item));
+	TEST_ASSERT_EQUAL_PTR(first, bencode_value_str(item));
+    }
+
+    bencode_arena_free(arena);
+}
+
+TEST(bencode, arena_many_blocks)
+{
+    struct bencode_arena *arena = bencode_arena_new(256);
+    size_t n = 2 + 1000 * 3 + 2 + 300 + 4;
+    char *enc = malloc(n);
+    size_t pos = 0;
+
+    TEST_ASSERT_NOT_NULL(arena);
+    TEST_ASSERT_NOT_NULL(enc);
+
+    /* 1000 small ints followed by one string larger than a block */
+    enc[pos++] = 'l';
+    for (int i = 0; i < 1000; ++i) {
+	memcpy(enc + pos, "i7e", 3);
+	pos += 3;
+    }
+    memcpy(enc + pos, "300:", 4);
+    pos += 4;
+    memset(enc + pos, 'x', 300);
+    pos += 300;
+    enc[pos++] = 'e';
+
+    TEST_ASSERT_EQUAL(pos, bencode_value_decode_arena(&value, enc, pos, arena, 0));
+    TEST_ASSERT_EQUAL(1001, bencode_value_len(&value));
+    for (size_t i = 0; i < 1000; ++i)
+	TEST_ASSERT_EQUAL(7, bencode_value_int(bencode_list_get(&value, i)));
+    TEST_ASSERT_EQUAL(300, bencode_value_len(bencode_list_get(&value, 1000)));
+
+    bencode_arena_reset(arena);
+    TEST_ASSERT_EQUAL(pos, bencode_value_decode_arena(&value, enc, pos, arena, BENCODE_DECODE_BORROW));
+    TEST_ASSERT_EQUAL_PTR(enc + pos - 301, bencode_value_str(bencode_list_get(&value, 1000)));
+
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_arena(&value, enc, pos - 1, arena, 0));
+
+    bencode_arena_free(arena);
+    free(enc);
+}
+
+TEST(bencode, exact_decode)
+{
+    const char *expected = "d4:spamd4:eggsl1:ai2eee3:zzzllelli1eeeee";
+    size_t len = strlen(expected);
+    char buf[64];
+    const struct bencode_pair *pair;
+
+    TEST_ASSERT_EQUAL(len, bencode_value_decode_opts(&value, expected, len, BENCODE_DECODE_EXACT));
+    TEST_ASSERT_EQUAL(2, bencode_value_len(&value));
+
+    pair = bencode_map_lookup(&value, "zzz");
+    TEST_ASSERT_NOT_NULL(pair);
+    TEST_ASSERT_EQUAL(2, bencode_value_len(&pair->value));
+    TEST_ASSERT_EQUAL(0, bencode_value_len(bencode_list_get(&pair->value, 0)));
+    TEST_ASSERT_EQUAL(1, bencode_value_len(bencode_list_get(&pair->value, 1)));
+
+    TEST_ASSERT_EQUAL(len, bencode_value_encode(&value, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_STRING_LEN(expected, buf, len);
+
+    bencode_value_free(&value);
+}
+
+TEST(bencode, exact_decode_invalid)
+{
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "li0e", 4, BENCODE_DECODE_EXACT));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "l10:abce", 8, BENCODE_DECODE_EXACT));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "d4:eggse", 8, BENCODE_DECODE_EXACT));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "lxe", 3, BENCODE_DECODE_EXACT));
+    TEST_ASSERT_EQUAL(3, bencode_value_decode_opts(&value, "i5e", 3, BENCODE_DECODE_EXACT));
+}
+
+static void bench_decode(const char *name, const char *item, size_t count)
+{
+    size_t len;
+    char *enc = make_list(item, count, &len);
+    double t0, t_grow, t_exact;
+    const int rounds = 5;
+
+    TEST_ASSERT_NOT_NULL(enc);
+
+    t0 = now_ms();
+    for (int r = 0; r < rounds; ++r) {
+	TEST_ASSERT_EQUAL(len, bencode_value_decode(&value, enc, len));
+	bencode_value_free(&value);
+    }
+    t_grow = (now_ms() - t0) / rounds;
+
+    t0 = now_ms();
+    for (int r = 0; r < rounds; ++r) {
+	TEST_ASSERT_EQUAL(len, bencode_value_decode_opts(&value, enc, len, BENCODE_DECODE_EXACT));
+	TEST_ASSERT_EQUAL(count, bencode_value_len(&value));
+	bencode_value_free(&value);
+    }
+    t_exact = (now_ms() - t0) / rounds;
+
+    printf("\n  %zu-element %s list: doubling %.2f ms, exact %.2f ms",
+	   count, name, t_grow, t_exact);
+    free(enc);
+}
+
+TEST(bencode, bench_exact_decode)
+{
+    BENCH_ONLY();
+    bench_decode("int", "i123456e", 100000);
+    bench_decode("peer dict",
+		 "d2:ip9:127.0.0.17:peer id20:aaaaaaaaaaaaaaaaaaaa4:porti6881ee",
+		 100000);
+}
+
+TEST(bencode, number_limits)
+{
+    TEST_ASSERT_EQUAL(21, bencode_value_decode(&value, "i9223372036854775807e", 21));
+    TEST_ASSERT_EQUAL(9223372036854775807LL, bencode_value_int(&value));
+    TEST_ASSERT_EQUAL(22, bencode_value_decode(&value, "i-9223372036854775808e", 22));
+    TEST_ASSERT_TRUE(bencode_value_int(&value) == -9223372036854775807LL - 1);
+    TEST_ASSERT_EQUAL(0, bencode_value_decode(&value, "i9223372036854775808e", 21));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode(&value, "i-9223372036854775809e", 22));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode(&value, "i99999999999999999999999e", 25));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode(&value, "i-0e", 4));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode(&value, "i-e", 3));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode(&value, "i12", 3));
+    /* The parser must stop at the first non-digit instead of searching for 'e' */
+    TEST_ASSERT_EQUAL(0, bencode_value_decode(&value, "i1x2:ee", 7));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "li-0ee", 6, BENCODE_DECODE_EXACT));
+}
+
+/* The integer branch as it used to be: memchr for 'e', then strndup + strtoll */
+static size_t legacy_parse_int(const char *s, size_t n, long long *out)
+{
+    const char *e_ptr = memchr(s, 'e', n);
+    char *temp, *endptr;
+
+    if (!e_ptr)
+	return 0;
+    /* strndup, spelled with malloc so the fixture's free() accepts it */
+    temp = malloc(e_ptr - s);
+    if (!temp)
+	return 0;
+    memcpy(temp, s + 1, e_ptr - s - 1);
+    temp[e_ptr - s - 1] = '\0';
+    *out = strtoll(temp, &endptr, 10);
+    free(temp);
+    return (e_ptr - s) + 1;
+}
+
+TEST(bencode, bench_int_decode)
+{
+    BENCH_ONLY();
+    const size_t count = 1000000;
+    size_t len;
+    char *enc = make_list("i-1234567e", count, &len);
+    double t0, t_legacy, t_decode, t_list;
+    long long sum = 0, num;
+
+    TEST_ASSERT_NOT_NULL(enc);
+
+    t0 = now_ms();
+    for (size_t pos = 1; enc[pos] != 'e'; ) {
+	size_t used = legacy_parse_int(enc + pos, len - pos, &num);
+	TEST_ASSERT_NOT_EQUAL(0, used);
+	sum += num;
+	pos += used;
+    }
+    t_legacy = now_ms() - t0;
+    TEST_ASSERT_TRUE(sum == -1234567LL * (long long)count);
+
+    sum = 0;
+    t0 = now_ms();
+    for (size_t pos = 1; enc[pos] != 'e'; ) {
+	size_t used = bencode_value_decode(&value, enc + pos, len - pos);
+	TEST_ASSERT_NOT_EQUAL(0, used);
+	sum += bencode_value_int(&value);
+	pos += used;
+    }
+    t_decode = now_ms() - t0;
+    TEST_ASSERT_TRUE(sum == -1234567LL * (long long)count);
+
+    t0 = now_ms();
+    TEST_ASSERT_EQUAL(len, bencode_value_decode(&value, enc, len));
+    t_list = now_ms() - t0;
+    TEST_ASSERT_EQUAL(count, bencode_value_len(&value));
+    TEST_ASSERT_EQUAL(-1234567, bencode_value_int(&value.as.list_value.values[count - 1]));
+    bencode_value_free(&value);
+
+    printf("\n  %zu integers: strndup+strtoll %.2f ms, bencode_value_decode %.2f ms"
+	   " (whole list %.2f ms)", count, t_legacy, t_decode, t_list);
+    free(enc);
+}
+
+TEST(bencode, encode_int_limits)
+{
+    char buf[32];
+
+    TEST_ASSERT_EQUAL(22, bencode_value_decode(&value, "i-9223372036854775808e", 22));
+    TEST_ASSERT_EQUAL(22, bencode_value_encode(&value, NULL, 0));
+    TEST_ASSERT_EQUAL(22, bencode_value_encode(&value, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY("i-9223372036854775808e", buf, 22);
+    TEST_ASSERT_EQUAL(0, bencode_value_encode(&value, buf, 21));
+}
+
+TEST(bencode, encode_alloc)
+{
+    const char *enc = "d3:cowli1ei-20e0:e4:spamd3:abci100eee";
+    size_t n = strlen(enc), len = 0;
+    char *buf;
+
+    TEST_ASSERT_EQUAL(n, bencode_value_decode(&value, enc, n));
+    buf = bencode_value_encode_alloc(&value, &len);
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_EQUAL(n, len);
+    TEST_ASSERT_EQUAL_MEMORY(enc, buf, n);
+
+    free_real(buf);
+    bencode_value_free(&value);
+}
+
+struct sink {
+    char buf[8192];
+    size_t len;
+    size_t calls;
+    size_t fail_after;
+};
+
+static int sink_write(void *ctx, const char *data, size_t len)
+{
+    struct sink *sink = ctx;
+
+    if (sink->fail_after && sink->calls == sink->fail_after)
+	return 0;
+    sink->calls++;
+    if (sink->len + len > sizeof(sink->buf))
+	return 0;
+    memcpy(sink->buf + sink->len, data, len);
+    sink->len += len;
+    return 1;
+}
+
+TEST(bencode, encode_stream)
+{
+    /* A 6000-byte string is passed through, the rest is batched */
+    size_t n = 9 + 6000 + 10, len;
+    char *enc = malloc(n);
+    struct sink *sink = calloc(1, sizeof(struct sink));
+
+    memcpy(enc, "li7e6000:", 9);
+    memset(enc + 9, 'x', 6000);
+    memcpy(enc + 9 + 6000, "d1:ai-1eee", 10);
+
+    TEST_ASSERT_EQUAL(n, bencode_value_decode(&value, enc, n));
+    len = bencode_value_encode_stream(&value, sink_write, sink);
+    TEST_ASSERT_EQUAL(n, len);
+    TEST_ASSERT_EQUAL(n, sink->len);
+    TEST_ASSERT_EQUAL_MEMORY(enc, sink->buf, n);
+    TEST_ASSERT_EQUAL(3, sink->calls);
+
+    memset(sink, 0, sizeof(*sink));
+    sink->fail_after = 1;
+    TEST_ASSERT_EQUAL(0, bencode_value_encode_stream(&value, sink_write, sink));
+
+    free(sink);
+    free(enc);
+    bencode_value_free(&value);
+}
+
+TEST(bencode, encode_fd)
+{
+    const char *enc = "d4:infod6:lengthi3e4:name1:aee";
+    size_t n = strlen(enc);
+    char buf[64];
+    FILE *f = tmpfile();
+
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(n, bencode_value_decode(&value, enc, n));
+    TEST_ASSERT_EQUAL(n, bencode_value_encode_fd(&value, fileno(f)));
+    rewind(f);
+    TEST_ASSERT_EQUAL(n, fread(buf, 1, sizeof(buf), f));
+    TEST_ASSERT_EQUAL_MEMORY(enc, buf, n);
+    TEST_ASSERT_EQUAL(0, bencode_value_encode_fd(&value, -1));
+
+    fclose(f);
+    bencode_value_free(&value);
+}
+
+TEST(bencode, bench_encode_deep)
+{
+    BENCH_ONLY();
+    /* 2000 nested lists around a single string: the old encoder re-sized every level */
+    const size_t depth = 2000;
+    size_t n = 2 * depth + 3, len;
+    char *enc = malloc(n);
+    char *buf = malloc(n);
+    double t0;
+
+    memset(enc, 'l', depth);
+    memcpy(enc + depth, "1:a", 3);
+    memset(enc + depth + 3, 'e', depth);
+    TEST_ASSERT_EQUAL(n, bencode_value_decode(&value, enc, n));
+
+    t0 = now_ms();
+    for (int r = 0; r < 10; ++r)
+	TEST_ASSERT_EQUAL(n, bencode_value_encode(&value, buf, n));
+    printf("\n  depth-%zu tree: encode %.3f ms", depth, (now_ms() - t0) / 10);
+    TEST_ASSERT_EQUAL_MEMORY(enc, buf, n);
+    TEST_ASSERT_EQUAL(n, bencode_value_encode(&value, NULL, 0));
+    len = 0;
+    free(buf);
+    buf = bencode_value_encode_alloc(&value, &len);
+    TEST_ASSERT_EQUAL(n, len);
+
+    free_real(buf);
+    free(enc);
+    bencode_value_free(&value);
+}
+
+TEST(bencode, decode_spans)
+{
+    const char *enc = "d4:infod4:name1:a6:lengthi3ee4:listli-1e0:ee";
+    size_t n = strlen(enc), len;
+    const struct bencode_pair *info, *list;
+    const char *span;
+
+    TEST_ASSERT_EQUAL(n, bencode_value_decode_opts(&value, enc, n, BENCODE_DECODE_SPANS));
+    span = bencode_value_span(&value, enc, &len);
+    TEST_ASSERT_EQUAL_PTR(enc, span);
+    TEST_ASSERT_EQUAL(n, len);
+
+    info = bencode_map_lookup(&value, "info");
+    span = bencode_value_span(&info->value, enc, &len);
+    TEST_ASSERT_EQUAL(22, len);
+    TEST_ASSERT_EQUAL_MEMORY("d4:name1:a6:lengthi3ee", span, len);
+    span = bencode_value_span(&info->key, enc, &len);
+    TEST_ASSERT_EQUAL_MEMORY("4:info", span, len);
+
+    list = bencode_map_lookup(&value, "list");
+    span = bencode_value_span(&list->value.as.list_value.values[1], enc, &len);
+    TEST_ASSERT_EQUAL_MEMORY("0:", span, len);
+    bencode_value_free(&value);
+
+    TEST_ASSERT_EQUAL(n, bencode_value_decode(&value, enc, n));
+    TEST_ASSERT_NULL(bencode_value_span(&value, enc, &len));
+    bencode_value_free(&value);
+}
+
+TEST(bencode, map_sorted_flag)
+{
+    TEST_ASSERT_EQUAL(24, bencode_value_decode(&value, "d3:cow3:moo4:spam4:eggse", 24));
+    TEST_ASSERT_TRUE(value.flags & BENCODE_VALUE_SORTED);
+    TEST_ASSERT_NOT_NULL(bencode_map_lookup(&value, "cow"));
+    TEST_ASSERT_NOT_NULL(bencode_map_lookup(&value, "spam"));
+    TEST_ASSERT_NULL(bencode_map_lookup(&value, "dog"));
+    TEST_ASSERT_NULL(bencode_map_lookup(&value, "a"));
+    TEST_ASSERT_NULL(bencode_map_lookup(&value, "zzzz"));
+    bencode_value_free(&value);
+
+    /* unsorted maps are still accepted by default and looked up linearly */
+    TEST_ASSERT_EQUAL(24, bencode_value_decode(&value, "d4:spam4:eggs3:cow3:mooe", 24));
+    TEST_ASSERT_FALSE(value.flags & BENCODE_VALUE_SORTED);
+    TEST_ASSERT_NOT_NULL(bencode_map_lookup(&value, "cow"));
+    TEST_ASSERT_NOT_NULL(bencode_map_lookup(&value, "spam"));
+    bencode_value_free(&value);
+}
+
+TEST(bencode, map_strict_order)
+{
+    TEST_ASSERT_EQUAL(24, bencode_value_decode_opts(&value, "d3:cow3:moo4:spam4:eggse", 24, BENCODE_DECODE_STRICT));
+    bencode_value_free(&value);
+
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "d4:spam4:eggs3:cow3:mooe", 24, BENCODE_DECODE_STRICT));
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "d3:cow3:moo3:cow3:mooe", 22, BENCODE_DECODE_STRICT));
+    /* a key sorts after its own prefix */
+    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, "d3:cowi1e2:coi2ee", 17, BENCODE_DECODE_STRICT));
+}
+
+TEST(bencode, map_lookup_n_nul_key)
+{
+    const char enc[] = "d3:a\0bi1e3:a\0ci2ee";
+    const struct bencode_pair *pair;
+
+    TEST_ASSERT_EQUAL(sizeof(enc) - 1, bencode_value_decode(&value, enc, sizeof(enc) - 1));
+
+    pair = bencode_map_lookup_n(&value, "a\0c", 3);
+    TEST_ASSERT_NOT_NULL(pair);
+    TEST_ASSERT_EQUAL(2, bencode_value_int(&pair->value));
+
+    pair = bencode_map_lookup_n(&value, "a\0b", 3);
+    TEST_ASSERT_NOT_NULL(pair);
+    TEST_ASSERT_EQUAL(1, bencode_value_int(&pair->value));
+
+    /* "a" alone must not match keys that merely start with it */
+    TEST_ASSERT_NULL(bencode_map_lookup(&value, "a"));
+
+    bencode_value_free(&value);
+}
+
+TEST(bencode, str_len_at_end_of_input)
+{
+    static const char *tails[] = { "123", "l1:a45", "d1:a1:b1:c9" };
+    static const unsigned modes[] = { 0, BENCODE_DECODE_EXACT, BENCODE_DECODE_BORROW };
+    long page = sysconf(_SC_PAGESIZE);
+
+    /* The input ends right before an inaccessible page, with no NUL after it */
+    char *map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    TEST_ASSERT_TRUE(map != MAP_FAILED);
+    TEST_ASSERT_EQUAL(0, mprotect(map + page, page, PROT_NONE));
+
+    for (size_t i = 0; i < sizeof(tails) / sizeof(tails[0]); ++i) {
+	size_t n = strlen(tails[i]);
+	char *enc = map + page - n;
+
+	memcpy(enc, tails[i], n);
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+	    TEST_ASSERT_EQUAL(0, bencode_value_decode_opts(&value, enc, n, modes[m]));
+    }
+    munmap(map, 2 * page);
+}
+
+/* Builds a sorted map with count keys "k00000".."k<count-1>" mapped to their index */
+static char *make_map(size_t count, size_t *len)
+{
+    char *enc = malloc(count * 32 + 2);
+    size_t pos = 0;
+
+    if (!enc)
+	return NULL;
+    enc[pos++] = 'd';
+    for (size_t i = 0; i < count; ++i)
+	pos += sprintf(enc + pos, "6:k%05zui%zue", i, i);
+    enc[pos++] = 'e';
+    *len = pos;
+    return enc;
+}
+
+TEST(bencode, map_hash_index)
+{
+    size_t len;
+    char *enc = make_map(1000, &len);
+    struct bencode_arena *arena = bencode_arena_new(0);
+    char key[8];
+
+    TEST_ASSERT_NOT_NULL(enc);
+    TEST_ASSERT_NOT_NULL(arena);
+
+    TEST_ASSERT_EQUAL(len, bencode_value_decode_opts(&value, enc, len, BENCODE_DECODE_INDEX));
+    TEST_ASSERT_TRUE(value.flags & BENCODE_VALUE_INDEXED);
+    for (size_t i = 0; i < 1000; ++i) {
+	sprintf(key, "k%05zu", i);
+	const struct bencode_pair *pair = bencode_map_lookup(&value, key);
+	TEST_ASSERT_NOT_NULL(pair);
+	TEST_ASSERT_EQUAL(i, bencode_value_int(&pair->value));
+    }
+    TEST_ASSERT_NULL(bencode_map_lookup(&value, "k01000"));
+    TEST_ASSERT_NULL(bencode_map_lookup(&value, "k0000"));
+    bencode_value_free(&value);
+
+    TEST_ASSERT_EQUAL(len, bencode_value_decode_arena(&value, enc, len, arena,
+						      BENCODE_DECODE_INDEX | BENCODE_DECODE_EXACT |
+						      BENCODE_DECODE_BORROW));
+    TEST_ASSERT_TRUE(value.flags & BENCODE_VALUE_INDEXED);
+    TEST_ASSERT_EQUAL(999, bencode_value_int(&bencode_map_lookup(&value, "k00999")->value));
+
+    /* small maps stay unindexed */
+    bencode_arena_reset(arena);
+    TEST_ASSERT_EQUAL(24, bencode_value_decode_arena(&value, "d3:cow3:moo4:spam4:eggse", 24, arena,
+						     BENCODE_DECODE_INDEX));
+    TEST_ASSERT_FALSE(value.flags & BENCODE_VALUE_INDEXED);
+
+    bencode_arena_free(arena);
+    free(enc);
+}
+
+TEST(bencode, bench_map_lookup)
+{
+    BENCH_ONLY();
+    size_t len;
+    char *enc = make_map(10000, &len);
+    struct bencode_value linear, sorted, indexed;
+    char key[8];
+    double t0, t_linear, t_sorted, t_indexed;
+    long long sum = 0;
+
+    TEST_ASSERT_NOT_NULL(enc);
+    TEST_ASSERT_EQUAL(len, bencode_value_decode(&sorted, enc, len));
+    TEST_ASSERT_EQUAL(len, bencode_value_decode(&linear, enc, len));
+    linear.flags &= ~BENCODE_VALUE_SORTED;
+    TEST_ASSERT_EQUAL(len, bencode_value_decode_opts(&indexed, enc, len, BENCODE_DECODE_INDEX));
+
+    t0 = now_ms();
+    for (size_t i = 0; i < 10000; i += 10) {
+	sprintf(key, "k%05zu", i);
+	sum += bencode_value_int(&bencode_map_lookup(&linear, key)->value);
+    }
+    t_linear = now_ms() - t0;
+
+    t0 = now_ms();
+    for (size_t i = 0; i < 10000; i += 10) {
+	sprintf(key, "k%05zu", i);
+	sum += bencode_value_int(&bencode_map_lookup(&sorted, key)->value);
+    }
+    t_sorted = now_ms() - t0;
+
+    t0 = now_ms();
+    for (size_t i = 0; i < 10000; i += 10) {
+	sprintf(key, "k%05zu", i);
+	sum += bencode_value_int(&bencode_map_lookup(&indexed, key)->value);
+    }
+    t_indexed = now_ms() - t0;
+
+    TEST_ASSERT_EQUAL(3 * 4995000, sum);
+    printf("\n  1000 lookups in a 10000-key map: linear %.3f ms, binary %.3f ms, hashed %.3f ms",
+	   t_linear, t_sorted, t_indexed);
+
+    bencode_value_free(&linear);
+    bencode_value_free(&sorted);
+    bencode_value_free(&indexed);
+    free(enc);
+}
+
 
 TEST_GROUP_RUNNER(bencode)
 {
@@ -729,4 +1377,32 @@ TEST_GROUP_RUNNER(bencode)
     RUN_TEST_CASE(bencode, encode_string_small_buf);
     RUN_TEST_CASE(bencode, encode_list_small_buf);
     RUN_TEST_CASE(bencode, encode_map_small_buf);
+
+    RUN_TEST_CASE(bencode, borrow_string);
+    RUN_TEST_CASE(bencode, borrow_nested_map);
+    RUN_TEST_CASE(bencode, borrow_invalid);
+    RUN_TEST_CASE(bencode, borrow_encode);
+
+    RUN_TEST_CASE(bencode, arena_decode);
+    RUN_TEST_CASE(bencode, arena_reset_reuse);
+    RUN_TEST_CASE(bencode, arena_many_blocks);
+
+    RUN_TEST_CASE(bencode, exact_decode);
+    RUN_TEST_CASE(bencode, exact_decode_invalid);
+    RUN_TEST_CASE(bencode, bench_exact_decode);
+    RUN_TEST_CASE(bencode, number_limits);
+    RUN_TEST_CASE(bencode, bench_int_decode);
+    RUN_TEST_CASE(bencode, encode_int_limits);
+    RUN_TEST_CASE(bencode, encode_alloc);
+    RUN_TEST_CASE(bencode, encode_stream);
+    RUN_TEST_CASE(bencode, encode_fd);
+    RUN_TEST_CASE(bencode, bench_encode_deep);
+    RUN_TEST_CASE(bencode, decode_spans);
+
+    RUN_TEST_CASE(bencode, map_sorted_flag);
+    RUN_TEST_CASE(bencode, map_strict_order);
+    RUN_TEST_CASE(bencode, map_lookup_n_nul_key);
+    RUN_TEST_CASE(bencode, str_len_at_end_of_input);
+    RUN_TEST_CASE(bencode, map_hash_index);
+    RUN_TEST_CASE(bencode, bench_map_lookup);
 }
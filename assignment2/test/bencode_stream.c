@@ -0,0 +1,315 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include <bencode.h>
+#include <bencode_stream.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static const char *samples[] = {
+    "i42e",
+    "i-9223372036854775808e",
+    "0:",
+    "11:hello world",
+    "le",
+    "de",
+    "li1ei2e3:abce",
+    "d3:cow3:moo4:spaml1:a2:bcee",
+    "d8:completei5e10:incompletei0e8:intervali1800e5:peersld2:ip9:127.0.0.17:peer id"
+    "20:-qB4650-abcdefghijkl4:porti6881eeee",
+    "lld1:ali1eeee0:e",
+};
+
+/* Events are appended to a log so chunked and one-shot parses can be compared */
+struct event_log {
+    char buf[512];
+    size_t len;
+};
+
+static void log_append(struct event_log *log, const char *s)
+{
+    size_t n = strlen(s);
+
+    if (log->len + n < sizeof(log->buf)) {
+	memcpy(log->buf + log->len, s, n);
+	log->len += n;
+	log->buf[log->len] = '\0';
+    }
+}
+
+static int log_int(void *ctx, long long value)
+{
+    char tmp[32];
+
+    snprintf(tmp, sizeof(tmp), "I%lld ", value);
+    log_append(ctx, tmp);
+    return 1;
+}
+
+static int log_str(void *ctx, const char *data, size_t len, size_t offset, size_t total)
+{
+    char tmp[64];
+
+    if (offset == 0)
+	log_append(ctx, "S");
+    snprintf(tmp, sizeof(tmp), "%.*s", (int)len, data);
+    log_append(ctx, tmp);
+    if (offset + len == total)
+	log_append(ctx, " ");
+    return 1;
+}
+
+static int log_list_begin(void *ctx) { log_append(ctx, "[ "); return 1; }
+static int log_list_end(void *ctx) { log_append(ctx, "] "); return 1; }
+static int log_map_begin(void *ctx) { log_append(ctx, "{ "); return 1; }
+static int log_map_end(void *ctx) { log_append(ctx, "} "); return 1; }
+
+static const struct bencode_stream_callbacks log_callbacks = {
+    .on_int = log_int,
+    .on_str = log_str,
+    .on_list_begin = log_list_begin,
+    .on_list_end = log_list_end,
+    .on_map_begin = log_map_begin,
+    .on_map_end = log_map_end,
+};
+
+static int abort_on_str(void *ctx, const char *data, size_t len, size_t offset, size_t total)
+{
+    return 0;
+}
+
+/* Feeds enc in chunks of at most step bytes, returns the final status */
+static int feed_chunks(struct bencode_stream *stream, const char *enc, size_t n, size_t step)
+{
+    int status = BENCODE_STREAM_MORE;
+
+    for (size_t pos = 0; pos < n && status == BENCODE_STREAM_MORE; pos += step) {
+	size_t len = n - pos < step ? n - pos : step;
+	status = bencode_stream_feed(stream, enc + pos, len, NULL);
+    }
+    return status;
+}
+
+TEST_GROUP(bencode_stream);
+
+TEST_SETUP(bencode_stream) {}
+
+TEST_TEAR_DOWN(bencode_stream) {}
+
+
+TEST(bencode_stream, events)
+{
+    const char *enc = "d3:cowli1ei-2ee4:spam0:e";
+    struct event_log log = {0};
+    struct bencode_stream *stream = bencode_stream_new(&log_callbacks, &log);
+    size_t consumed;
+
+    TEST_ASSERT_NOT_NULL(stream);
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE, bencode_stream_feed(stream, enc, strlen(enc), &consumed));
+    TEST_ASSERT_EQUAL(strlen(enc), consumed);
+    TEST_ASSERT_EQUAL_STRING("{ Scow [ I1 I-2 ] Sspam S } ", log.buf);
+
+    bencode_stream_free(stream);
+}
+
+TEST(bencode_stream, events_every_split)
+{
+    for (size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); ++s) {
+	size_t n = strlen(samples[s]);
+	struct event_log whole = {0};
+	struct bencode_stream *stream = bencode_stream_new(&log_callbacks, &whole);
+
+	TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE, bencode_stream_feed(stream, samples[s], n, NULL));
+	bencode_stream_free(stream);
+
+	for (size_t step = 1; step <= n; ++step) {
+	    struct event_log log = {0};
+
+	    stream = bencode_stream_new(&log_callbacks, &log);
+	    TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE, feed_chunks(stream, samples[s], n, step));
+	    /* Strings split across chunks are reported in fragments, but concatenate to the same log */
+	    TEST_ASSERT_EQUAL_STRING(whole.buf, log.buf);
+	    bencode_stream_free(stream);
+	}
+    }
+}
+
+TEST(bencode_stream, tree_every_split)
+{
+    char expected[512], got[512];
+
+    for (size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); ++s) {
+	size_t n = strlen(samples[s]);
+	struct bencode_value ref;
+
+	TEST_ASSERT_EQUAL(n, bencode_value_decode(&ref, samples[s], n));
+	size_t ref_len = bencode_value_encode(&ref, expected, sizeof(expected));
+
+	/* Split the input in two at every position */
+	for (size_t cut = 0; cut <= n; ++cut) {
+	    struct bencode_stream *stream = bencode_stream_new_tree(NULL, 0);
+	    struct bencode_value value;
+	    int status = bencode_stream_feed(stream, samples[s], cut, NULL);
+
+	    if (status == BENCODE_STREAM_MORE)
+		status = bencode_stream_feed(stream, samples[s] + cut, n - cut, NULL);
+	    TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE, status);
+	    TEST_ASSERT_TRUE(bencode_stream_take(stream, &value));
+	    bencode_stream_free(stream);
+
+	    TEST_ASSERT_EQUAL(ref_len, bencode_value_encode(&value, got, sizeof(got)));
+	    TEST_ASSERT_EQUAL_MEMORY(expected, got, ref_len);
+	    bencode_value_free(&value);
+	}
+	bencode_value_free(&ref);
+    }
+}
+
+TEST(bencode_stream, tree_arena)
+{
+    const char *enc = samples[8];
+    struct bencode_arena *arena = bencode_arena_new(0);
+    struct bencode_stream *stream = bencode_stream_new_tree(arena, 0);
+    struct bencode_value value;
+
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE, feed_chunks(stream, enc, strlen(enc), 3));
+    TEST_ASSERT_TRUE(bencode_stream_take(stream, &value));
+    bencode_stream_free(stream);
+
+    TEST_ASSERT_EQUAL(BENCODE_MAP, bencode_value_type(&value));
+    TEST_ASSERT_TRUE(value.flags & BENCODE_VALUE_ARENA);
+    TEST_ASSERT_TRUE(value.flags & BENCODE_VALUE_SORTED);
+    const struct bencode_pair *interval = bencode_map_lookup(&value, "interval");
+    TEST_ASSERT_NOT_NULL(interval);
+    TEST_ASSERT_EQUAL(1800, bencode_value_int(&interval->value));
+    const struct bencode_pair *peers = bencode_map_lookup(&value, "peers");
+    TEST_ASSERT_NOT_NULL(peers);
+    TEST_ASSERT_EQUAL(1, bencode_value_len(&peers->value));
+    const struct bencode_pair *port = bencode_map_lookup(&peers->value.as.list_value.values[0], "port");
+    TEST_ASSERT_EQUAL(6881, bencode_value_int(&port->value));
+
+    bencode_arena_free(arena);
+}
+
+TEST(bencode_stream, trailing_data)
+{
+    struct bencode_stream *stream = bencode_stream_new_tree(NULL, 0);
+    struct bencode_value value;
+    size_t consumed;
+
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE, bencode_stream_feed(stream, "i7ei8e", 6, &consumed));
+    TEST_ASSERT_EQUAL(3, consumed);
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE, bencode_stream_feed(stream, "i8e", 3, &consumed));
+    TEST_ASSERT_EQUAL(0, consumed);
+    TEST_ASSERT_TRUE(bencode_stream_take(stream, &value));
+    TEST_ASSERT_EQUAL(7, bencode_value_int(&value));
+
+    bencode_stream_free(stream);
+}
+
+TEST(bencode_stream, incomplete)
+{
+    struct bencode_stream *stream = bencode_stream_new_tree(NULL, 0);
+    struct bencode_value value;
+
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_MORE, bencode_stream_feed(stream, "d3:cowl5:hel", 12, NULL));
+    TEST_ASSERT_FALSE(bencode_stream_take(stream, &value));
+
+    /* The partial tree is released here */
+    bencode_stream_free(stream);
+}
+
+TEST(bencode_stream, invalid)
+{
+    static const char *invalid[] = {
+	"x",
+	"e",
+	"i-0e",
+	"i03e",
+	"ie",
+	"i-e",
+	"i1-2e",
+	"i9223372036854775808e",
+	"i-9223372036854775809e",
+	"3x",
+	"di1ei2ee",
+	"d3:cowe",
+	"l1:ai1ex",
+    };
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+	size_t n = strlen(invalid[i]);
+
+	for (size_t step = 1; step <= n; ++step) {
+	    struct bencode_stream *stream = bencode_stream_new_tree(NULL, 0);
+
+	    TEST_ASSERT_EQUAL(BENCODE_STREAM_ERROR, feed_chunks(stream, invalid[i], n, step));
+	    TEST_ASSERT_EQUAL(BENCODE_STREAM_ERROR, bencode_stream_feed(stream, "i1e", 3, NULL));
+	    bencode_stream_free(stream);
+	}
+    }
+}
+
+TEST(bencode_stream, too_deep)
+{
+    char enc[BENCODE_STREAM_MAX_DEPTH + 2];
+    struct bencode_stream *stream = bencode_stream_new_tree(NULL, 0);
+
+    memset(enc, 'l', sizeof(enc));
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_ERROR, bencode_stream_feed(stream, enc, sizeof(enc), NULL));
+
+    bencode_stream_free(stream);
+}
+
+TEST(bencode_stream, string_too_long)
+{
+    struct bencode_stream *stream = bencode_stream_new_tree(NULL, 16);
+    struct bencode_value value;
+
+    /* Exactly the limit is fine */
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_DONE,
+		      bencode_stream_feed(stream, "16:0123456789abcdef", 19, NULL));
+    TEST_ASSERT_TRUE(bencode_stream_take(stream, &value));
+    bencode_value_free(&value);
+    bencode_stream_free(stream);
+
+    /* Rejected on the length, before any data arrives */
+    stream = bencode_stream_new_tree(NULL, 16);
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_ERROR, bencode_stream_feed(stream, "17", 2, NULL));
+    bencode_stream_free(stream);
+    stream = bencode_stream_new_tree(NULL, 1024);
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_ERROR, bencode_stream_feed(stream, "99999999999:", 12, NULL));
+    bencode_stream_free(stream);
+
+    /* Without a limit, a length whose buffer size would wrap */
+    stream = bencode_stream_new_tree(NULL, 0);
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_ERROR,
+		      bencode_stream_feed(stream, "18446744073709551615:", 21, NULL));
+    bencode_stream_free(stream);
+}
+
+TEST(bencode_stream, callback_abort)
+{
+    struct bencode_stream_callbacks cb = {.on_str = abort_on_str};
+    struct bencode_stream *stream = bencode_stream_new(&cb, NULL);
+
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_MORE, bencode_stream_feed(stream, "li1e", 4, NULL));
+    TEST_ASSERT_EQUAL(BENCODE_STREAM_ERROR, bencode_stream_feed(stream, "1:ae", 4, NULL));
+
+    bencode_stream_free(stream);
+}
+
+TEST_GROUP_RUNNER(bencode_stream)
+{
+    RUN_TEST_CASE(bencode_stream, events);
+    RUN_TEST_CASE(bencode_stream, events_every_split);
+    RUN_TEST_CASE(bencode_stream, tree_every_split);
+    RUN_TEST_CASE(bencode_stream, tree_arena);
+    RUN_TEST_CASE(bencode_stream, trailing_data);
+    RUN_TEST_CASE(bencode_stream, incomplete);
+    RUN_TEST_CASE(bencode_stream, invalid);
+    RUN_TEST_CASE(bencode_stream, too_deep);
+    RUN_TEST_CASE(bencode_stream, string_too_long);
+    RUN_TEST_CASE(bencode_stream, callback_abort);
+}
@@ -0,0 +1,216 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <bitfield.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct bitfield a, b, c;
+
+static void random_fill(struct bitfield *bf, int percent)
+{
+    for (size_t i = 0; i < bf->count; ++i) {
+	if (rand() % 100 < percent)
+	    bitfield_set(bf, i);
+	else
+	    bitfield_clear(bf, i);
+    }
+}
+
+
+TEST_GROUP(bitfield);
+
+TEST_SETUP(bitfield)
+{
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&c, 0, sizeof(c));
+}
+
+TEST_TEAR_DOWN(bitfield)
+{
+    bitfield_free(&a);
+    bitfield_free(&b);
+    bitfield_free(&c);
+}
+
+
+TEST(bitfield, set_get_popcount)
+{
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&a, 70));
+    TEST_ASSERT_EQUAL(9, a.bytes);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)a.bits % BITFIELD_ALIGN);
+    TEST_ASSERT_EQUAL(0, bitfield_popcount(&a));
+
+    bitfield_set(&a, 0);
+    bitfield_set(&a, 9);
+    bitfield_set(&a, 69);
+    TEST_ASSERT_EQUAL(0x80, a.bits[0]);
+    TEST_ASSERT_EQUAL(0x40, a.bits[1]);
+    TEST_ASSERT_EQUAL(0x04, a.bits[8]);
+    TEST_ASSERT_EQUAL(1, bitfield_get(&a, 9));
+    TEST_ASSERT_EQUAL(0, bitfield_get(&a, 10));
+    TEST_ASSERT_EQUAL(3, bitfield_popcount(&a));
+
+    bitfield_clear(&a, 9);
+    TEST_ASSERT_EQUAL(2, bitfield_popcount(&a));
+}
+
+TEST(bitfield, fill_keeps_spare_bits_clear)
+{
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&a, 70));
+    bitfield_fill(&a, 1);
+    TEST_ASSERT_EQUAL(70, bitfield_popcount(&a));
+    TEST_ASSERT_EQUAL(0xfc, a.bits[8]);
+    TEST_ASSERT_EQUAL(0, a.bits[9]);
+    bitfield_fill(&a, 0);
+    TEST_ASSERT_EQUAL(0, bitfield_popcount(&a));
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&b, 0));
+    bitfield_fill(&b, 1);
+    TEST_ASSERT_EQUAL(0, bitfield_popcount(&b));
+    TEST_ASSERT_EQUAL(0, bitfield_find_next(&b, 0));
+}
+
+TEST(bitfield, set_operations)
+{
+    const size_t count = 1000;
+    size_t and_n = 0, or_n = 0, andnot_n = 0;
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&a, count));
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&b, count));
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&c, count));
+    random_fill(&a, 50);
+    random_fill(&b, 30);
+    for (size_t i = 0; i < count; ++i) {
+	and_n += bitfield_get(&a, i) && bitfield_get(&b, i);
+	or_n += bitfield_get(&a, i) || bitfield_get(&b, i);
+	andnot_n += bitfield_get(&a, i) && !bitfield_get(&b, i);
+    }
+
+    bitfield_and(&c, &a, &b);
+    TEST_ASSERT_EQUAL(and_n, bitfield_popcount(&c));
+    bitfield_or(&c, &a, &b);
+    TEST_ASSERT_EQUAL(or_n, bitfield_popcount(&c));
+    TEST_ASSERT_EQUAL(andnot_n, bitfield_andnot(&c, &a, &b));
+    TEST_ASSERT_EQUAL(andnot_n, bitfield_popcount(&c));
+    for (size_t i = 0; i < count; ++i)
+	TEST_ASSERT_EQUAL(bitfield_get(&a, i) && !bitfield_get(&b, i), bitfield_get(&c, i));
+
+    /* In place */
+    bitfield_andnot(&a, &a, &b);
+    TEST_ASSERT_EQUAL(andnot_n, bitfield_popcount(&a));
+}
+
+TEST(bitfield, any_andnot)
+{
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&a, 300));
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&b, 300));
+
+    TEST_ASSERT_EQUAL(0, bitfield_any_andnot(&a, &b));
+    bitfield_set(&a, 299);
+    TEST_ASSERT_EQUAL(1, bitfield_any_andnot(&a, &b));
+    bitfield_set(&b, 299);
+    TEST_ASSERT_EQUAL(0, bitfield_any_andnot(&a, &b));
+    bitfield_set(&b, 3);
+    TEST_ASSERT_EQUAL(0, bitfield_any_andnot(&a, &b));
+}
+
+TEST(bitfield, find_next)
+{
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&a, 200));
+
+    TEST_ASSERT_EQUAL(200, bitfield_find_next(&a, 0));
+    bitfield_set(&a, 5);
+    bitfield_set(&a, 64);
+    bitfield_set(&a, 199);
+    TEST_ASSERT_EQUAL(5, bitfield_find_next(&a, 0));
+    TEST_ASSERT_EQUAL(5, bitfield_find_next(&a, 5));
+    TEST_ASSERT_EQUAL(64, bitfield_find_next(&a, 6));
+    TEST_ASSERT_EQUAL(199, bitfield_find_next(&a, 65));
+    TEST_ASSERT_EQUAL(200, bitfield_find_next(&a, 200));
+
+    bitfield_fill(&a, 1);
+    TEST_ASSERT_EQUAL(200, bitfield_find_next_clear(&a, 0));
+    bitfield_clear(&a, 63);
+    bitfield_clear(&a, 128);
+    TEST_ASSERT_EQUAL(63, bitfield_find_next_clear(&a, 0));
+    TEST_ASSERT_EQUAL(128, bitfield_find_next_clear(&a, 64));
+    /* The spare bits after piece 199 are zero but not pieces */
+    TEST_ASSERT_EQUAL(200, bitfield_find_next_clear(&a, 129));
+}
+
+TEST(bitfield, wire)
+{
+    uint8_t msg[16];
+    const uint8_t expected[] = { 0, 0, 0, 3, 5, 0x81, 0x80 };
+    const uint8_t spare[] = { 0x00, 0x40 };
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&a, 9));
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&b, 9));
+    bitfield_set(&a, 0);
+    bitfield_set(&a, 7);
+    bitfield_set(&a, 8);
+
+    TEST_ASSERT_EQUAL(7, bitfield_wire_size(&a));
+    TEST_ASSERT_EQUAL(7, bitfield_to_wire(&a, msg));
+    TEST_ASSERT_EQUAL_MEMORY(expected, msg, 7);
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_from_wire(&b, msg + 5, 2));
+    TEST_ASSERT_EQUAL(3, bitfield_popcount(&b));
+    TEST_ASSERT_EQUAL(1, bitfield_get(&b, 8));
+
+    /* Wrong length or spare bits set */
+    TEST_ASSERT_EQUAL(0, bitfield_from_wire(&b, msg + 5, 1));
+    TEST_ASSERT_EQUAL(0, bitfield_from_wire(&b, msg + 5, 3));
+    TEST_ASSERT_EQUAL(0, bitfield_from_wire(&b, spare, 2));
+    TEST_ASSERT_EQUAL(3, bitfield_popcount(&b));
+}
+
+TEST(bitfield, bench_interesting)
+{
+    BENCH_ONLY();
+    /* 50 000 pieces, 200 peers: interesting = peer_has & ~we_have for each */
+    const size_t count = 50000, peers = 200;
+    size_t simd = 0, naive = 0;
+    double t0, t1, t2;
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&a, count));
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&b, count));
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&c, count));
+    random_fill(&a, 60);
+    random_fill(&b, 40);
+
+    t0 = now_ms();
+    for (size_t p = 0; p < peers; ++p)
+	simd += bitfield_andnot(&c, &a, &b);
+    t1 = now_ms();
+    for (size_t p = 0; p < peers; ++p) {
+	for (size_t i = 0; i < count; ++i) {
+	    if (bitfield_get(&a, i) && !bitfield_get(&b, i)) {
+		bitfield_set(&c, i);
+		naive++;
+	    } else {
+		bitfield_clear(&c, i);
+	    }
+	}
+    }
+    t2 = now_ms();
+    TEST_ASSERT_EQUAL(naive, simd);
+    printf("\n  %zu peers x %zu pieces: word-wide %.2f ms, bit by bit %.2f ms",
+	   peers, count, t1 - t0, t2 - t1);
+}
+
+TEST_GROUP_RUNNER(bitfield)
+{
+    RUN_TEST_CASE(bitfield, set_get_popcount);
+    RUN_TEST_CASE(bitfield, fill_keeps_spare_bits_clear);
+    RUN_TEST_CASE(bitfield, set_operations);
+    RUN_TEST_CASE(bitfield, any_andnot);
+    RUN_TEST_CASE(bitfield, find_next);
+    RUN_TEST_CASE(bitfield, wire);
+    RUN_TEST_CASE(bitfield, bench_interesting);
+}
@@ -0,0 +1,270 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include <bitfield.h>
+#include <block_tracker.h>
+#include <piece_assembler.h>
+#include <piece_picker.h>
+#include <client.h>
+#include <metainfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK PIECE_BLOCK_SIZE
+#define MAX_PEERS 8
+#define QUEUE 4
+
+static struct metainfo_file torrent;
+static struct piece_picker *pp;
+static struct block_tracker *bt;
+static struct bitfield full;
+static struct block_request cancelled[16];
+static size_t ncancelled;
+
+/* A peer of the simulated swarm serves its queue of requests, one block every period ticks */
+struct sim_peer {
+    struct block_request queue[QUEUE];
+    size_t n;
+    unsigned period;
+    unsigned wait;
+};
+
+static struct sim_peer sim[MAX_PEERS];
+
+static void make_tracker(size_t piece_length, size_t length)
+{
+    torrent.info.piece_length = piece_length;
+    torrent.info.length = length;
+    torrent.info.pieces_count = (length + piece_length - 1) / piece_length;
+    pp = piece_picker_new(torrent.info.pieces_count, NULL, 3);
+    TEST_ASSERT_NOT_NULL(pp);
+    piece_picker_set_random_first(pp, 0);
+    bt = block_tracker_new(&torrent, pp);
+    TEST_ASSERT_NOT_NULL(bt);
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&full, torrent.info.pieces_count));
+    bitfield_fill(&full, 1);
+    piece_picker_add_peer(pp, &full);
+}
+
+static void record_cancel(void *ctx, const struct block_request *req)
+{
+    (void)ctx;
+    cancelled[ncancelled++ % 16] = *req;
+}
+
+/* The cancel message reaches the simulated peer: drop the request from its queue */
+static void sim_cancel(void *ctx, const struct block_request *req)
+{
+    struct sim_peer *p = &sim[req->peer];
+    size_t *cancels = ctx;
+
+    for (size_t i = 0; i < p->n; ++i) {
+	if (p->queue[i].piece == req->piece && p->queue[i].begin == req->begin) {
+	    memmove(p->queue + i, p->queue + i + 1, (p->n - i - 1) * sizeof(*p->queue));
+	    p->n--;
+	    *cancels += 1;
+	    return;
+	}
+    }
+}
+
+/* Returns the tick at which every piece is complete */
+static size_t simulate(size_t npeers, int endgame, size_t *cancels)
+{
+    size_t tick;
+
+    block_tracker_set_endgame(bt, endgame);
+    block_tracker_set_cancel(bt, sim_cancel, cancels);
+    for (tick = 1; piece_picker_missing(pp) > 0 && tick < 100000; ++tick) {
+	for (size_t k = 0; k < npeers; ++k) {
+	    struct sim_peer *p = &sim[k];
+
+	    while (p->n < QUEUE && block_tracker_next(bt, (int)k, &full, 0, &p->queue[p->n]))
+		p->n++;
+	    if (p->n == 0 || ++p->wait < p->period)
+		continue;
+	    struct block_request req = p->queue[0];
+
+	    p->wait = 0;
+	    memmove(p->queue, p->queue + 1, (p->n - 1) * sizeof(*p->queue));
+	    p->n--;
+	    if (block_tracker_received(bt, (int)k, req.piece, req.begin, req.length) == BLOCK_TRACKER_COMPLETE)
+		piece_picker_done(pp, req.piece);
+	}
+    }
+    return tick;
+}
+
+
+TEST_GROUP(block_tracker);
+
+TEST_SETUP(block_tracker)
+{
+    memset(&torrent, 0, sizeof(torrent));
+    memset(sim, 0, sizeof(sim));
+    pp = NULL;
+    bt = NULL;
+    ncancelled = 0;
+}
+
+TEST_TEAR_DOWN(block_tracker)
+{
+    block_tracker_free(bt);
+    piece_picker_free(pp);
+    bitfield_free(&full);
+}
+
+
+TEST(block_tracker, requests_every_block_once)
+{
+    struct block_request req;
+    size_t requests = 0, bytes = 0;
+
+    /* Pieces of 40 000 bytes, the last one 20 000: 3 + 3 + 2 blocks */
+    make_tracker(40000, 100000);
+    while (block_tracker_next(bt, 1, &full, 0, &req)) {
+	TEST_ASSERT_EQUAL(1, req.peer);
+	TEST_ASSERT_EQUAL(0, req.begin % BLOCK);
+	requests++;
+	bytes += req.length;
+    }
+    TEST_ASSERT_EQUAL(8, requests);
+    TEST_ASSERT_EQUAL(100000, bytes);
+    TEST_ASSERT_EQUAL(8, block_tracker_outstanding(bt));
+    /* Everything is requested, but only from this peer */
+    TEST_ASSERT_EQUAL(1, block_tracker_in_endgame(bt));
+}
+
+TEST(block_tracker, received)
+{
+    struct block_request req;
+
+    make_tracker(40000, 40000);
+    for (size_t k = 0; k < 3; ++k)
+	TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 1, &full, 0, &req));
+
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_INVALID, block_tracker_received(bt, 1, 0, 100, BLOCK));
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_INVALID, block_tracker_received(bt, 1, 0, 2 * BLOCK, BLOCK));
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_INVALID, block_tracker_received(bt, 1, 7, 0, BLOCK));
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_ACCEPTED, block_tracker_received(bt, 1, 0, BLOCK, BLOCK));
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_DUPLICATE, block_tracker_received(bt, 1, 0, BLOCK, BLOCK));
+    TEST_ASSERT_EQUAL(BLOCK, block_tracker_duplicate_bytes(bt));
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_ACCEPTED, block_tracker_received(bt, 1, 0, 0, BLOCK));
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_COMPLETE, block_tracker_received(bt, 1, 0, 2 * BLOCK, 40000 - 2 * BLOCK));
+    TEST_ASSERT_EQUAL(0, block_tracker_outstanding(bt));
+    /* Late copies of a complete piece are overhead too */
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_DUPLICATE, block_tracker_received(bt, 2, 0, 0, BLOCK));
+    TEST_ASSERT_EQUAL(2 * BLOCK, block_tracker_duplicate_bytes(bt));
+}
+
+TEST(block_tracker, endgame_duplicates_and_cancels)
+{
+    struct block_request req, dup;
+
+    make_tracker(2 * BLOCK, 4 * BLOCK);
+    block_tracker_set_cancel(bt, record_cancel, NULL);
+    for (size_t k = 0; k < 3; ++k)
+	TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 1, &full, 0, &req));
+    /* A block is still unrequested: no endgame yet */
+    TEST_ASSERT_EQUAL(0, block_tracker_in_endgame(bt));
+    TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 2, &full, 0, &req));
+    TEST_ASSERT_EQUAL(1, block_tracker_in_endgame(bt));
+
+    /* Peer 2 now gets peer 1's blocks, never its own one again */
+    for (size_t k = 0; k < 3; ++k) {
+	TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 2, &full, 0, &dup));
+	TEST_ASSERT_FALSE(dup.piece == req.piece && dup.begin == req.begin);
+    }
+    TEST_ASSERT_EQUAL(0, block_tracker_next(bt, 2, &full, 0, &dup));
+    TEST_ASSERT_EQUAL(7, block_tracker_outstanding(bt));
+
+    /* The first copy to arrive cancels the other request */
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_ACCEPTED, block_tracker_received(bt, 2, dup.piece, dup.begin, dup.length));
+    TEST_ASSERT_EQUAL(1, ncancelled);
+    TEST_ASSERT_EQUAL(1, cancelled[0].peer);
+    TEST_ASSERT_EQUAL(dup.piece, cancelled[0].piece);
+    TEST_ASSERT_EQUAL(dup.begin, cancelled[0].begin);
+    TEST_ASSERT_EQUAL(5, block_tracker_outstanding(bt));
+    TEST_ASSERT_EQUAL(0, block_tracker_duplicate_bytes(bt));
+    /* The cancel crossed the block on the wire */
+    TEST_ASSERT_EQUAL(BLOCK_TRACKER_DUPLICATE, block_tracker_received(bt, 1, dup.piece, dup.begin, dup.length));
+    TEST_ASSERT_EQUAL(dup.length, block_tracker_duplicate_bytes(bt));
+}
+
+TEST(block_tracker, drop_peer)
+{
+    struct block_request req;
+
+    make_tracker(2 * BLOCK, 2 * BLOCK);
+    TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 1, &full, 0, &req));
+    TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 1, &full, 0, &req));
+    TEST_ASSERT_EQUAL(1, block_tracker_in_endgame(bt));
+
+    block_tracker_drop_peer(bt, 1);
+    TEST_ASSERT_EQUAL(0, block_tracker_outstanding(bt));
+    TEST_ASSERT_EQUAL(0, block_tracker_in_endgame(bt));
+    /* The piece stays in flight; its blocks go to the next peer */
+    TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 2, &full, 0, &req));
+    TEST_ASSERT_EQUAL(0, req.begin);
+    TEST_ASSERT_NOT_EQUAL(0, block_tracker_next(bt, 2, &full, 0, &req));
+    TEST_ASSERT_EQUAL(BLOCK, req.begin);
+    TEST_ASSERT_EQUAL(1, piece_picker_missing(pp));
+}
+
+TEST(block_tracker, client)
+{
+    struct metainfo_file info;
+    struct client *client;
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/simple.torrent"));
+    remove("sample.txt");
+    client = client_new(&info, 6881);
+    TEST_ASSERT_NOT_NULL(client);
+    TEST_ASSERT_NOT_NULL(client_blocks(client));
+    TEST_ASSERT_EQUAL(0, client_duplicate_bytes(client));
+    TEST_ASSERT_EQUAL(0, block_tracker_outstanding(client_blocks(client)));
+    client_free(client);
+    metainfo_file_free(&info);
+    remove("sample.txt");
+}
+
+TEST(block_tracker, tail_completion)
+{
+    /* 128 pieces of 4 blocks; 7 peers serve a block per tick, one every 25 ticks */
+    size_t without, with, cancels = 0;
+    uint64_t overhead;
+
+    make_tracker(4 * BLOCK, 128 * 4 * BLOCK);
+    for (size_t k = 0; k < MAX_PEERS; ++k)
+	sim[k].period = k == 0 ? 25 : 1;
+    without = simulate(MAX_PEERS, 0, &cancels);
+    TEST_ASSERT_EQUAL(0, piece_picker_missing(pp));
+
+    block_tracker_free(bt);
+    piece_picker_free(pp);
+    bitfield_free(&full);
+    memset(sim, 0, sizeof(sim));
+    make_tracker(4 * BLOCK, 128 * 4 * BLOCK);
+    for (size_t k = 0; k < MAX_PEERS; ++k)
+	sim[k].period = k == 0 ? 25 : 1;
+    with = simulate(MAX_PEERS, 1, &cancels);
+    overhead = block_tracker_duplicate_bytes(bt);
+    TEST_ASSERT_EQUAL(0, piece_picker_missing(pp));
+
+    printf("\n  512 blocks, one slow peer: %zu ticks without endgame, %zu with"
+	   " (%zu cancels, %llu duplicate bytes)",
+	   without, with, cancels, (unsigned long long)overhead);
+    TEST_ASSERT_TRUE(with < without);
+    TEST_ASSERT_TRUE(overhead <= 4 * (uint64_t)BLOCK * MAX_PEERS);
+}
+
+TEST_GROUP_RUNNER(block_tracker)
+{
+    RUN_TEST_CASE(block_tracker, requests_every_block_once);
+    RUN_TEST_CASE(block_tracker, received);
+    RUN_TEST_CASE(block_tracker, endgame_duplicates_and_cancels);
+    RUN_TEST_CASE(block_tracker, drop_peer);
+    RUN_TEST_CASE(block_tracker, client);
+    RUN_TEST_CASE(block_tracker, tail_completion);
+}
@@ -3,6 +3,13 @@
 #include <string.h>
 #include <client.h>
 #include <metainfo.h>
+#include <reactor.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "unity_fixture.h"
 #include "unity.h"
 
@@ -142,6 +149,61 @@ TEST(client, not_existing_file)
     metainfo_file_free(&info);
 }
 
+TEST(client, not_existing_file_prealloc)
+{
+    struct metainfo_file info;
+    struct client *client;
+    struct client_options opts = { .prealloc = STORAGE_PREALLOC_SPARSE };
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/simple.torrent"));
+
+    client = client_new_opts(&info, 6881, &opts);
+    TEST_ASSERT_NOT_NULL(client);
+
+    /* The file has its full size, but none of it counts as downloaded */
+    TEST_ASSERT_EQUAL(0, client_downloaded(client));
+    TEST_ASSERT_EQUAL(info.info.length, client_left(client));
+
+    client_free(client);
+
+    FILE *fp = fopen(info.info.name, "r");
+    TEST_ASSERT_NOT_NULL(fp);
+    fseek(fp, 0, SEEK_END);
+    TEST_ASSERT_EQUAL(info.info.length, ftell(fp));
+
+    fclose(fp);
+    metainfo_file_free(&info);
+}
+
+TEST(client, multi_file_existing_directory)
+{
+    static const char *files[] = { "multi/a/b.txt", "multi/empty", "multi/c.bin", "multi/d" };
+    static const long lengths[] = { 100, 0, 50000, 30 };
+    struct metainfo_file info;
+    struct client *client;
+    struct client_options opts = { .prealloc = STORAGE_PREALLOC_SPARSE };
+    struct stat st;
+
+    /* The directory is there, the files in it are not */
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/multi_file.torrent"));
+    TEST_ASSERT_EQUAL(0, mkdir("multi", 0755));
+
+    client = client_new_opts(&info, 6881, &opts);
+    TEST_ASSERT_NOT_NULL(client);
+    TEST_ASSERT_EQUAL(0, client_downloaded(client));
+    TEST_ASSERT_EQUAL(info.info.length, client_left(client));
+    client_free(client);
+
+    for (int i = 0; i < 4; ++i) {
+	TEST_ASSERT_EQUAL(0, stat(files[i], &st));
+	TEST_ASSERT_EQUAL(lengths[i], st.st_size);
+	remove(files[i]);
+    }
+    remove("multi/a");
+    remove("multi");
+    metainfo_file_free(&info);
+}
+
 TEST(client, existing_file_len_multiple)
 {
     struct metainfo_file info;
@@ -185,6 +247,33 @@ TEST(client, existing_file_len_multiple)
     metainfo_file_free(&info);
 }
 
+TEST(client, read_only_complete_file)
+{
+    struct metainfo_file info;
+    struct client *client;
+    struct client_options opts = { .prealloc = STORAGE_PREALLOC_SPARSE };
+
+    /* Complete data the client may read but not write, e.g. to seed it */
+    TEST_ASSERT_NOT_EQUAL(0, copy_file("test/existing_file_len_multiple",
+				       "existing_file_len_multiple"));
+    TEST_ASSERT_EQUAL(0, chmod("existing_file_len_multiple", 0444));
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info,
+						"test/existing_file_len_multiple.torrent"));
+
+    client = client_new(&info, 6881);
+    TEST_ASSERT_NOT_NULL(client);
+    TEST_ASSERT_EQUAL(info.info.length, client_downloaded(client));
+    TEST_ASSERT_EQUAL(0, client_left(client));
+    client_free(client);
+
+    client = client_new_opts(&info, 6881, &opts);
+    TEST_ASSERT_NOT_NULL(client);
+    TEST_ASSERT_EQUAL(0, client_left(client));
+    client_free(client);
+
+    metainfo_file_free(&info);
+}
+
 TEST(client, existing_file_len_non_multiple)
 {
     struct metainfo_file info;
@@ -590,6 +679,278 @@ TEST(client, ubuntu)
 }
 
 
+/* The remote end of engine_availability: a second engine in its own loop */
+static int remote_bitfields;
+
+static void remote_ready(void *ctx, struct peer_conn *conn)
+{
+    *(struct peer_conn **)ctx = conn;
+}
+
+static int remote_message(void *ctx, struct peer_conn *conn, const struct peer_msg *msg)
+{
+    (void)ctx;
+    (void)conn;
+    if (msg->id == PEER_MSG_BITFIELD)
+	remote_bitfields++;
+    return 1;
+}
+
+TEST(client, engine_availability)
+{
+    struct metainfo_file info;
+    struct client *client;
+    struct peer_conn *remote = NULL;
+    struct peer_engine_ops ops = { remote_ready, remote_message, NULL };
+    const uint8_t remote_id[20] = "-RR0001-rrrrrrrrrrrr";
+    int fds[2];
+
+    TEST_ASSERT_NOT_EQUAL(0, copy_file("test/incomplete_file_len_multiple",
+				       "incomplete_file_len_multiple"));
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info,
+						"test/incomplete_file_len_multiple.torrent"));
+    client = client_new(&info, 6881);
+    TEST_ASSERT_NOT_NULL(client);
+
+    struct reactor *r = reactor_new();
+    struct peer_engine *pe = peer_engine_new(r, info.info_hash, remote_id, &ops, &remote);
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    TEST_ASSERT_NOT_NULL(peer_engine_add(client_engine(client), fds[0], 0));
+    TEST_ASSERT_NOT_NULL(peer_engine_add(pe, fds[1], 0));
+
+    /* The client has the first piece and says so once connected */
+    remote_bitfields = 0;
+    for (int i = 0; i < 20 && remote_bitfields == 0; ++i) {
+	client_poll(client, 10);
+	reactor_run_once(r, 10);
+    }
+    TEST_ASSERT_NOT_NULL(remote);
+    TEST_ASSERT_EQUAL(1, remote_bitfields);
+    TEST_ASSERT_EQUAL(1, client_num_peers(client));
+
+    /* The remote announces the missing pieces, which the picker counts */
+    struct peer_msg have = { .id = PEER_MSG_HAVE, .index = 1 };
+    TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(remote, &have));
+    have.index = 2;
+    TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(remote, &have));
+    TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(remote, &have));
+    for (int i = 0; i < 20 && piece_picker_availability(client_picker(client), 2) == 0; ++i)
+	client_poll(client, 10);
+    TEST_ASSERT_EQUAL(1, piece_picker_availability(client_picker(client), 1));
+    TEST_ASSERT_EQUAL(1, piece_picker_availability(client_picker(client), 2));
+
+    /* And forgets them when the connection goes away */
+    peer_engine_free(pe);
+    for (int i = 0; i < 20 && peer_engine_count(client_engine(client)) > 0; ++i)
+	client_poll(client, 10);
+    TEST_ASSERT_EQUAL(0, peer_engine_count(client_engine(client)));
+    TEST_ASSERT_EQUAL(0, client_num_peers(client));
+    TEST_ASSERT_EQUAL(0, piece_picker_availability(client_picker(client), 1));
+    TEST_ASSERT_EQUAL(0, piece_picker_availability(client_picker(client), 2));
+
+    reactor_free(r);
+    client_free(client);
+    metainfo_file_free(&info);
+}
+
+TEST(client, peer_list_does_not_block)
+{
+    struct metainfo_file info;
+    struct client *client;
+    struct client_options opts = { .max_connecting = 4, .connect_timeout_ms = 100 };
+    struct peer_engine_connect_stats st;
+    struct bencode_value peers;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    char list[1024];
+    size_t n = 0;
+
+    /* Eight entries for a listener that never accepts nor answers */
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, bind(lfd, (struct sockaddr *)&addr, sizeof(addr)));
+    TEST_ASSERT_EQUAL(0, listen(lfd, 1));
+    TEST_ASSERT_EQUAL(0, getsockname(lfd, (struct sockaddr *)&addr, &len));
+    n += sprintf(list + n, "l");
+    for (int i = 0; i < 8; ++i)
+	n += sprintf(list + n, "d2:ip9:127.0.0.17:peer id20:-XX0001-%012d4:porti%uee",
+		     i, ntohs(addr.sin_port));
+    n += sprintf(list + n, "e");
+    TEST_ASSERT_EQUAL(n, bencode_value_decode(&peers, list, n));
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/simple.torrent"));
+    client = client_new_opts(&info, 6881, &opts);
+    TEST_ASSERT_NOT_NULL(client);
+
+    /* Returns at once, the connects run in client_poll() */
+    client_add_bencoded_peer_list(client, &peers);
+    peer_engine_connect_stats(client_engine(client), &st);
+    TEST_ASSERT_EQUAL(4, st.connecting);
+    TEST_ASSERT_EQUAL(4, st.queued);
+
+    for (int i = 0; i < 100 && st.connecting + st.queued > 0; ++i) {
+	client_poll(client, 20);
+	peer_engine_connect_stats(client_engine(client), &st);
+    }
+    TEST_ASSERT_EQUAL(8, st.timed_out);
+    TEST_ASSERT_EQUAL(0, peer_engine_count(client_engine(client)));
+
+    client_free(client);
+    metainfo_file_free(&info);
+    bencode_value_free(&peers);
+    close(lfd);
+}
+
+TEST(client, peer_list_resolves_names_and_skips_bad_entries)
+{
+    struct metainfo_file info;
+    struct client *client;
+    struct peer_engine_connect_stats st;
+    struct bencode_value peers;
+    const char list[] =
+	"l"
+	"d2:ip9:localhost7:peer id20:-XX0001-0000000000004:porti1ee"
+	"d2:ip9:127.0.0.17:peer id20:-XX0001-0000000000014:port4:6881e"
+	"d2:ipi1e7:peer id20:-XX0001-0000000000024:porti6881ee"
+	"d2:ip9:127.0.0.17:peer id20:-XX0001-0000000000034:porti70000ee"
+	"d2:ip3:::17:peer id20:-XX0001-0000000000044:porti1ee"
+	"e";
+
+    TEST_ASSERT_EQUAL(sizeof(list) - 1, bencode_value_decode(&peers, list, sizeof(list) - 1));
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/simple.torrent"));
+    client = client_new(&info, 6881);
+    TEST_ASSERT_NOT_NULL(client);
+
+    /* The numeric IPv6 entry is connected to at once, the name once resolved */
+    client_add_bencoded_peer_list(client, &peers);
+    peer_engine_connect_stats(client_engine(client), &st);
+    TEST_ASSERT_EQUAL(1, st.connecting + st.queued + st.failed);
+
+    for (int i = 0; i < 100 && st.connecting + st.queued + st.failed < 2; ++i) {
+	client_poll(client, 20);
+	peer_engine_connect_stats(client_engine(client), &st);
+    }
+    TEST_ASSERT_EQUAL(2, st.connecting + st.queued + st.failed);
+
+    client_free(client);
+    metainfo_file_free(&info);
+    bencode_value_free(&peers);
+}
+
+/* Registers 100 sockets, like a listener thread accepting them */
+struct adder {
+    struct client *client;
+    peer_handle_t handles[100];
+};
+
+static void *add_peers_thread(void *arg)
+{
+    struct adder *a = arg;
+
+    for (int i = 0; i < 100; ++i) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+	    a->handles[i] = PEER_HANDLE_NONE;
+	    continue;
+	}
+	close(fds[1]);
+	a->handles[i] = client_add_connected_peer(a->client, fds[0]);
+    }
+    return NULL;
+}
+
+TEST(client, connected_peers_from_threads)
+{
+    struct metainfo_file info;
+    struct adder adders[4];
+    pthread_t t[4];
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/simple.torrent"));
+    struct client *client = client_new(&info, 6881);
+    TEST_ASSERT_NOT_NULL(client);
+
+    for (int i = 0; i < 4; ++i) {
+	adders[i].client = client;
+	pthread_create(&t[i], NULL, add_peers_thread, &adders[i]);
+    }
+    for (int i = 0; i < 4; ++i)
+	pthread_join(t[i], NULL);
+    TEST_ASSERT_EQUAL(400, client_num_peers(client));
+
+    /* Each handle removes its own peer, once */
+    for (int i = 0; i < 4; ++i)
+	for (int j = 0; j < 100; j += 2)
+	    TEST_ASSERT_NOT_EQUAL(0, client_remove_peer(client, adders[i].handles[j]));
+    TEST_ASSERT_EQUAL(0, client_remove_peer(client, adders[0].handles[0]));
+    TEST_ASSERT_EQUAL(200, client_num_peers(client));
+
+    /* The rest are closed with the client */
+    client_free(client);
+    metainfo_file_free(&info);
+}
+
+/* Hands 25 handshaken sockets to the event loop, like a listener thread */
+struct handoff_source {
+    struct client *client;
+    int remote[25];
+};
+
+static void *handoff_thread(void *arg)
+{
+    struct handoff_source *src = arg;
+    const uint8_t peer_id[20] = "-HH0001-hhhhhhhhhhhh";
+
+    for (int i = 0; i < 25; ++i) {
+	int fds[2];
+	src->remote[i] = -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+	    continue;
+	src->remote[i] = fds[1];
+	client_handoff_peer(src->client, fds[0], peer_id);
+    }
+    return NULL;
+}
+
+TEST(client, handed_off_peers_join_engine)
+{
+    struct metainfo_file info;
+    struct handoff_source src[4];
+    struct handoff_queue_stats st;
+    pthread_t t[4];
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/simple.torrent"));
+    struct client *client = client_new(&info, 6881);
+    TEST_ASSERT_NOT_NULL(client);
+
+    for (int i = 0; i < 4; ++i) {
+	src[i].client = client;
+	pthread_create(&t[i], NULL, handoff_thread, &src[i]);
+    }
+    /* The loop adopts them while the threads are still handing off */
+    for (int i = 0; i < 200 && peer_engine_count(client_engine(client)) < 100; ++i)
+	client_poll(client, 10);
+    for (int i = 0; i < 4; ++i)
+	pthread_join(t[i], NULL);
+    for (int i = 0; i < 20 && peer_engine_count(client_engine(client)) < 100; ++i)
+	client_poll(client, 10);
+
+    TEST_ASSERT_EQUAL(100, peer_engine_count(client_engine(client)));
+    TEST_ASSERT_EQUAL(100, client_num_peers(client));
+    client_incoming_stats(client, &st);
+    TEST_ASSERT_EQUAL(100, st.pushed);
+    TEST_ASSERT_EQUAL(0, st.dropped);
+    TEST_ASSERT_EQUAL(0, st.depth);
+
+    client_free(client);
+    metainfo_file_free(&info);
+    for (int i = 0; i < 4; ++i)
+	for (int j = 0; j < 25; ++j)
+	    if (src[i].remote[j] >= 0)
+		close(src[i].remote[j]);
+}
+
 TEST_GROUP_RUNNER(client)
 {
     RUN_TEST_CASE(client, peer_id_generation);
@@ -597,7 +958,10 @@ TEST_GROUP_RUNNER(client)
     RUN_TEST_CASE(client, torrent_file);
 
     RUN_TEST_CASE(client, not_existing_file);
+    RUN_TEST_CASE(client, not_existing_file_prealloc);
+    RUN_TEST_CASE(client, multi_file_existing_directory);
     RUN_TEST_CASE(client, existing_file_len_multiple);
+    RUN_TEST_CASE(client, read_only_complete_file);
     RUN_TEST_CASE(client, existing_file_len_non_multiple);
     RUN_TEST_CASE(client, incomplete_file_len_multiple);
     RUN_TEST_CASE(client, incomplete_file_len_non_multiple);
@@ -612,4 +976,10 @@ TEST_GROUP_RUNNER(client)
     RUN_TEST_CASE(client, longer_file_len_non_multiple);
 
     RUN_TEST_CASE(client, ubuntu);
+
+    RUN_TEST_CASE(client, engine_availability);
+    RUN_TEST_CASE(client, peer_list_does_not_block);
+    RUN_TEST_CASE(client, peer_list_resolves_names_and_skips_bad_entries);
+    RUN_TEST_CASE(client, connected_peers_from_threads);
+    RUN_TEST_CASE(client, handed_off_peers_join_engine);
 }
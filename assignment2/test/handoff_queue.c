@@ -0,0 +1,210 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <handoff_queue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define PRODUCERS 4
+
+static struct handoff_queue *q;
+
+static int readable(int fd, int timeout_ms)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+
+    return poll(&p, 1, timeout_ms) == 1;
+}
+
+static struct handoff item(int fd)
+{
+    struct handoff h = { .fd = fd };
+
+    memset(h.peer_id, fd & 0xff, sizeof(h.peer_id));
+    return h;
+}
+
+TEST_GROUP(handoff_queue);
+
+TEST_SETUP(handoff_queue)
+{
+    q = NULL;
+}
+
+TEST_TEAR_DOWN(handoff_queue)
+{
+    handoff_queue_free(q);
+}
+
+TEST(handoff_queue, fifo_and_full)
+{
+    struct handoff_queue_stats st;
+    struct handoff h;
+
+    q = handoff_queue_new(3);
+    TEST_ASSERT_NOT_NULL(q);
+    TEST_ASSERT_EQUAL(0, handoff_queue_pop(q, &h));
+
+    /* Rounded up to four cells */
+    for (int i = 0; i < 4; ++i) {
+	h = item(100 + i);
+	TEST_ASSERT_NOT_EQUAL(0, handoff_queue_push(q, &h));
+    }
+    h = item(104);
+    TEST_ASSERT_EQUAL(0, handoff_queue_push(q, &h));
+    handoff_queue_stats(q, &st);
+    TEST_ASSERT_EQUAL(4, st.depth);
+    TEST_ASSERT_EQUAL(4, st.high_watermark);
+    TEST_ASSERT_EQUAL(4, st.pushed);
+    TEST_ASSERT_EQUAL(1, st.dropped);
+
+    /* Wraps around, in order */
+    for (int i = 0; i < 10; ++i) {
+	TEST_ASSERT_NOT_EQUAL(0, handoff_queue_pop(q, &h));
+	TEST_ASSERT_EQUAL(100 + i, h.fd);
+	TEST_ASSERT_EACH_EQUAL_UINT8((100 + i) & 0xff, h.peer_id, 20);
+	h = item(104 + i);
+	TEST_ASSERT_NOT_EQUAL(0, handoff_queue_push(q, &h));
+    }
+    for (int i = 10; i < 14; ++i) {
+	TEST_ASSERT_NOT_EQUAL(0, handoff_queue_pop(q, &h));
+	TEST_ASSERT_EQUAL(100 + i, h.fd);
+    }
+    TEST_ASSERT_EQUAL(0, handoff_queue_pop(q, &h));
+    handoff_queue_stats(q, &st);
+    TEST_ASSERT_EQUAL(0, st.depth);
+    TEST_ASSERT_EQUAL(4, st.high_watermark);
+}
+
+TEST(handoff_queue, wakeup)
+{
+    struct handoff h = item(1);
+    int fd;
+
+    q = handoff_queue_new(16);
+    TEST_ASSERT_NOT_NULL(q);
+    fd = handoff_queue_fd(q);
+    TEST_ASSERT_EQUAL(0, readable(fd, 0));
+
+    /* The consumer starts out waiting, so the first push wakes it */
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_push(q, &h));
+    TEST_ASSERT_NOT_EQUAL(0, readable(fd, 0));
+    handoff_queue_clear_wakeup(q);
+    TEST_ASSERT_EQUAL(0, readable(fd, 0));
+
+    /* Not again while it is still draining */
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_push(q, &h));
+    TEST_ASSERT_EQUAL(0, readable(fd, 0));
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_pop(q, &h));
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_pop(q, &h));
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_push(q, &h));
+    TEST_ASSERT_EQUAL(0, readable(fd, 0));
+
+    /* Once it has found the queue empty, the next push wakes it */
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_pop(q, &h));
+    TEST_ASSERT_EQUAL(0, handoff_queue_pop(q, &h));
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_push(q, &h));
+    TEST_ASSERT_NOT_EQUAL(0, readable(fd, 0));
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_pop(q, &h));
+}
+
+TEST(handoff_queue, free_closes_sockets)
+{
+    int fds[2];
+    struct handoff h;
+
+    q = handoff_queue_new(4);
+    TEST_ASSERT_NOT_NULL(q);
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    h = item(fds[0]);
+    TEST_ASSERT_NOT_EQUAL(0, handoff_queue_push(q, &h));
+    handoff_queue_free(q);
+    q = NULL;
+    TEST_ASSERT_EQUAL(-1, fcntl(fds[0], F_GETFD));
+    TEST_ASSERT_EQUAL(EBADF, errno);
+    close(fds[1]);
+}
+
+/* Each producer pushes its own increasing sequence, retrying when full */
+struct producer {
+    int id;
+    int n;
+    long retries;
+};
+
+static void *producer_thread(void *arg)
+{
+    struct producer *p = arg;
+
+    for (int i = 0; i < p->n; ++i) {
+	struct handoff h = { .fd = i };
+	h.peer_id[0] = (uint8_t)p->id;
+	while (!handoff_queue_push(q, &h)) {
+	    p->retries++;
+	    sched_yield();
+	}
+    }
+    return NULL;
+}
+
+TEST(handoff_queue, producers_to_one_consumer)
+{
+    pthread_t t[PRODUCERS];
+    struct producer p[PRODUCERS];
+    int next[PRODUCERS] = { 0 };
+    int n = 200000, got = 0, out_of_order = 0;
+    long wakeups = 0;
+    struct handoff_queue_stats st;
+    struct handoff h;
+
+    q = handoff_queue_new(HANDOFF_QUEUE_CAPACITY);
+    TEST_ASSERT_NOT_NULL(q);
+    double t0 = now_ms();
+    for (int i = 0; i < PRODUCERS; ++i) {
+	p[i] = (struct producer){ .id = i, .n = n };
+	pthread_create(&t[i], NULL, producer_thread, &p[i]);
+    }
+
+    /* The consumer sleeps on the descriptor like the event loop does */
+    while (got < PRODUCERS * n && readable(handoff_queue_fd(q), 2000)) {
+	wakeups++;
+	handoff_queue_clear_wakeup(q);
+	while (handoff_queue_pop(q, &h)) {
+	    int id = h.peer_id[0];
+	    if (h.fd != next[id])
+		out_of_order++;
+	    next[id] = h.fd + 1;
+	    got++;
+	}
+    }
+    for (int i = 0; i < PRODUCERS; ++i)
+	pthread_join(t[i], NULL);
+    double t1 = now_ms();
+
+    TEST_ASSERT_EQUAL(PRODUCERS * n, got);
+    TEST_ASSERT_EQUAL(0, out_of_order);
+    handoff_queue_stats(q, &st);
+    TEST_ASSERT_EQUAL(0, st.depth);
+    TEST_ASSERT_EQUAL(PRODUCERS * n, st.pushed);
+    TEST_ASSERT(st.high_watermark <= HANDOFF_QUEUE_CAPACITY);
+
+    printf("\n  %d producers: %.1f M items/s, %ld wakeups, high watermark %zu",
+	   PRODUCERS, got / ((t1 - t0) / 1e3) / 1e6, wakeups, st.high_watermark);
+}
+
+TEST_GROUP_RUNNER(handoff_queue)
+{
+    RUN_TEST_CASE(handoff_queue, fifo_and_full);
+    RUN_TEST_CASE(handoff_queue, wakeup);
+    RUN_TEST_CASE(handoff_queue, free_closes_sockets);
+    RUN_TEST_CASE(handoff_queue, producers_to_one_consumer);
+}
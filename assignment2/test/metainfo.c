@@ -1,8 +1,14 @@
 #include "unity_fixture.h"
 #include "unity.h"
 #include "unity_internals.h"
+#include "test_util.h"
 #include <metainfo.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 
 TEST_GROUP(metainfo);
@@ -244,6 +250,188 @@ TEST(metainfo, pieces_not_20_multiple)
 }
 
 
+TEST(metainfo, non_canonical_info_hash)
+{
+    struct metainfo_file file;
+    /* SHA1 of the info dictionary exactly as stored, keys out of order */
+    unsigned char expected_hash[20] = {
+	0x72, 0xd3, 0x28, 0x69, 0xeb, 0x59, 0xe7, 0x84, 0x1f, 0xf6,
+	0xcb, 0xdf, 0xbf, 0xb5, 0xfd, 0x5e, 0x00, 0xf0, 0xea, 0xe5
+    };
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&file, "test/non_canonical_info.torrent"));
+    TEST_ASSERT_EQUAL_STRING("odd.data", file.info.name);
+    TEST_ASSERT_EQUAL(10, file.info.length);
+    TEST_ASSERT_EQUAL_MEMORY(expected_hash, file.info_hash, 20);
+
+    metainfo_file_free(&file);
+}
+
+TEST(metainfo, read_from_pipe)
+{
+    struct metainfo_file file;
+    char buf[512], path[64];
+    int fds[2];
+    FILE *fp = fopen("test/simple.torrent", "rb");
+    size_t n;
+
+    /* A pipe cannot be mapped, so the loader falls back to read() */
+    TEST_ASSERT_NOT_NULL(fp);
+    n = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+    TEST_ASSERT_EQUAL(n, write(fds[1], buf, n));
+    close(fds[1]);
+    snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&file, path));
+    TEST_ASSERT_EQUAL_STRING("sample.txt", file.info.name);
+    TEST_ASSERT_EQUAL(3, metainfo_file_pieces_count(&file));
+
+    close(fds[0]);
+    metainfo_file_free(&file);
+}
+
+TEST(metainfo, digits_at_page_end)
+{
+    struct metainfo_file file;
+    char path[] = "/tmp/metainfo_XXXXXX";
+    long page = sysconf(_SC_PAGESIZE);
+    char *buf = malloc(page);
+    int fd = mkstemp(path);
+
+    /* A page-sized file is mapped without any byte after it; it ends in a string length */
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_TRUE(fd >= 0);
+    memset(buf, '7', page);
+    memcpy(buf, "d8:announce", 11);
+    TEST_ASSERT_EQUAL(page, write(fd, buf, page));
+    close(fd);
+
+    TEST_ASSERT_EQUAL(0, metainfo_file_read(&file, path));
+
+    unlink(path);
+    free(buf);
+}
+
+TEST(metainfo, bench_startup)
+{
+    BENCH_ONLY();
+    const int torrents = 200;
+    struct metainfo_file file;
+    double t0 = now_ms();
+
+    /* Startup cost of loading many large (432 KB) torrents */
+    for (int i = 0; i < torrents; ++i) {
+	TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&file, "test/ubuntu.torrent"));
+	metainfo_file_free(&file);
+    }
+    printf("\n  %d x ubuntu.torrent: %.2f ms total, %.3f ms each",
+	   torrents, now_ms() - t0, (now_ms() - t0) / torrents);
+}
+
+TEST(metainfo, single_file_span)
+{
+    struct metainfo_file file;
+    size_t first, last;
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&file, "test/simple.torrent"));
+    TEST_ASSERT_EQUAL(1, file.info.files_count);
+    TEST_ASSERT_EQUAL_STRING("sample.txt", file.info.files[0].path);
+    TEST_ASSERT_EQUAL(0, file.info.files[0].offset);
+    TEST_ASSERT_EQUAL(92063, file.info.files[0].length);
+    TEST_ASSERT_EQUAL(1, metainfo_file_piece_files(&file, 2, &first, &last));
+    TEST_ASSERT_EQUAL(0, first);
+    TEST_ASSERT_EQUAL(0, last);
+    TEST_ASSERT_EQUAL(0, metainfo_file_piece_files(&file, 3, &first, &last));
+
+    metainfo_file_free(&file);
+}
+
+TEST(metainfo, multi_file)
+{
+    struct metainfo_file file;
+    size_t first, last;
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&file, "test/multi_file.torrent"));
+    TEST_ASSERT_EQUAL_STRING("multi", file.info.name);
+    TEST_ASSERT_EQUAL(50130, file.info.length);
+    TEST_ASSERT_EQUAL(2, metainfo_file_pieces_count(&file));
+    TEST_ASSERT_EQUAL(4, file.info.files_count);
+
+    TEST_ASSERT_EQUAL_STRING("multi/a/b.txt", file.info.files[0].path);
+    TEST_ASSERT_EQUAL(0, file.info.files[0].offset);
+    TEST_ASSERT_EQUAL(100, file.info.files[0].length);
+    TEST_ASSERT_EQUAL_STRING("multi/empty", file.info.files[1].path);
+    TEST_ASSERT_EQUAL(100, file.info.files[1].offset);
+    TEST_ASSERT_EQUAL(0, file.info.files[1].length);
+    TEST_ASSERT_EQUAL_STRING("multi/c.bin", file.info.files[2].path);
+    TEST_ASSERT_EQUAL(100, file.info.files[2].offset);
+    TEST_ASSERT_EQUAL(50000, file.info.files[2].length);
+    TEST_ASSERT_EQUAL_STRING("multi/d", file.info.files[3].path);
+    TEST_ASSERT_EQUAL(50100, file.info.files[3].offset);
+
+    /* Piece 0 is bytes [0, 32768): a/b.txt, the empty file and part of c.bin */
+    TEST_ASSERT_EQUAL(3, metainfo_file_piece_files(&file, 0, &first, &last));
+    TEST_ASSERT_EQUAL(0, first);
+    TEST_ASSERT_EQUAL(2, last);
+    /* Piece 1 is bytes [32768, 50130): the rest of c.bin and d */
+    TEST_ASSERT_EQUAL(2, metainfo_file_piece_files(&file, 1, &first, &last));
+    TEST_ASSERT_EQUAL(2, first);
+    TEST_ASSERT_EQUAL(3, last);
+    TEST_ASSERT_EQUAL(0, metainfo_file_piece_files(&file, 2, &first, &last));
+
+    metainfo_file_free(&file);
+}
+
+TEST(metainfo, invalid_files_path)
+{
+    struct metainfo_file file;
+
+    TEST_ASSERT_EQUAL(0, metainfo_file_read(&file, "test/invalid_files_path.torrent"));
+}
+
+TEST(metainfo, hash_table_aligned)
+{
+    struct metainfo_file file;
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&file, "test/ubuntu.torrent"));
+    TEST_ASSERT_EQUAL(21613, file.info.pieces_count);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)file.info.hashes % METAINFO_HASHES_ALIGN);
+    TEST_ASSERT_EQUAL_PTR(file.info.hashes[21612], metainfo_file_piece_hash(&file, 21612));
+    TEST_ASSERT_NULL(metainfo_file_piece_hash(&file, 21613));
+
+    metainfo_file_free(&file);
+}
+
+TEST(metainfo, verify_hashes)
+{
+    struct metainfo_file file;
+    uint8_t digests[8][20];
+    uint8_t ok[8];
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&file, "test/ubuntu.torrent"));
+    for (size_t k = 0; k < 8; ++k)
+	memcpy(digests[k], metainfo_file_piece_hash(&file, 100 + k), 20);
+    digests[2][0] ^= 1;   /* differs in the SIMD part */
+    digests[5][19] ^= 1;  /* differs in the tail */
+
+    TEST_ASSERT_EQUAL(6, metainfo_file_verify_hashes(&file, 100, 8,
+						     (const uint8_t (*)[20])digests, ok));
+    TEST_ASSERT_EQUAL(1, ok[0]);
+    TEST_ASSERT_EQUAL(0, ok[2]);
+    TEST_ASSERT_EQUAL(0, ok[5]);
+    TEST_ASSERT_EQUAL(1, ok[7]);
+
+    /* Digests past the last piece never match */
+    memcpy(digests[0], metainfo_file_piece_hash(&file, 21612), 20);
+    TEST_ASSERT_EQUAL(1, metainfo_file_verify_hashes(&file, 21612, 2,
+						     (const uint8_t (*)[20])digests, ok));
+    TEST_ASSERT_EQUAL(0, ok[1]);
+
+    metainfo_file_free(&file);
+}
+
 TEST_GROUP_RUNNER(metainfo)
 {
     RUN_TEST_CASE(metainfo, parsing);
@@ -275,5 +463,14 @@ TEST_GROUP_RUNNER(metainfo)
     RUN_TEST_CASE(metainfo, missing_pieces);
     RUN_TEST_CASE(metainfo, invalid_pieces);
     RUN_TEST_CASE(metainfo, pieces_not_20_multiple);
+    RUN_TEST_CASE(metainfo, non_canonical_info_hash);
+    RUN_TEST_CASE(metainfo, read_from_pipe);
+    RUN_TEST_CASE(metainfo, digits_at_page_end);
+    RUN_TEST_CASE(metainfo, bench_startup);
+    RUN_TEST_CASE(metainfo, single_file_span);
+    RUN_TEST_CASE(metainfo, multi_file);
+    RUN_TEST_CASE(metainfo, invalid_files_path);
+    RUN_TEST_CASE(metainfo, hash_table_aligned);
+    RUN_TEST_CASE(metainfo, verify_hashes);
 
 }
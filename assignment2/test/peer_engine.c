@@ -0,0 +1,397 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <peer_engine.h>
+#include <reactor.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define BLOCK 16384
+
+/* One side of the tests: an engine and what its callbacks saw */
+struct side {
+    struct peer_engine *pe;
+    int ready;
+    int closed;
+    int messages;
+    int close_on_message;  // close the connection from the message callback
+    uint64_t bytes;
+    uint32_t sum;
+    struct peer_conn *last;
+    struct peer_conn **conns;  // every ready connection, when not NULL
+    size_t nconns;
+};
+
+static struct reactor *r;
+static struct side a, b;
+static const uint8_t info_hash[20] = "0123456789abcdefghij";
+static const uint8_t id_a[20] = "-AA0001-aaaaaaaaaaaa";
+static const uint8_t id_b[20] = "-BB0001-bbbbbbbbbbbb";
+
+static void on_ready(void *ctx, struct peer_conn *conn)
+{
+    struct side *s = ctx;
+
+    s->ready++;
+    s->last = conn;
+    if (s->conns)
+	s->conns[s->nconns++] = conn;
+}
+
+static int on_message(void *ctx, struct peer_conn *conn, const struct peer_msg *msg)
+{
+    struct side *s = ctx;
+
+    s->messages++;
+    s->bytes += msg->payload_len;
+    for (size_t i = 0; i < msg->payload_len; ++i)
+	s->sum = s->sum * 31 + msg->payload[i];
+    if (s->close_on_message)
+	peer_conn_close(conn);
+    return 1;
+}
+
+static void on_closed(void *ctx, struct peer_conn *conn)
+{
+    struct side *s = ctx;
+
+    (void)conn;
+    s->closed++;
+    if (s->last == conn)
+	s->last = NULL;
+}
+
+static const struct peer_engine_ops ops = { on_ready, on_message, on_closed };
+
+/* Runs the loop until done() holds or nothing happens for a while */
+static void run_until(int (*done)(void))
+{
+    for (int idle = 0; !done() && idle < 50;)
+	idle = reactor_run_once(r, 20) > 0 ? 0 : idle + 1;
+}
+
+static int both_ready(void)
+{
+    return a.ready && b.ready;
+}
+
+static int both_closed(void)
+{
+    return peer_engine_count(a.pe) == 0 && peer_engine_count(b.pe) == 0;
+}
+
+static void pair(void)
+{
+    int fds[2];
+
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    TEST_ASSERT_NOT_NULL(peer_engine_add(a.pe, fds[0], 0));
+    TEST_ASSERT_NOT_NULL(peer_engine_add(b.pe, fds[1], 0));
+}
+
+/* A listening socket on the loopback, bound to any free port */
+static int listen_loopback(struct sockaddr_in *addr, int backlog)
+{
+    socklen_t len = sizeof(*addr);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, bind(lfd, (struct sockaddr *)addr, sizeof(*addr)));
+    TEST_ASSERT_EQUAL(0, listen(lfd, backlog));
+    TEST_ASSERT_EQUAL(0, getsockname(lfd, (struct sockaddr *)addr, &len));
+    return lfd;
+}
+
+static void on_accept(void *arg, int fd, unsigned events)
+{
+    int cfd;
+
+    (void)arg;
+    (void)events;
+    while ((cfd = accept(fd, NULL, NULL)) >= 0)
+	peer_engine_add(b.pe, cfd, 0);
+}
+
+TEST_GROUP(peer_engine);
+
+TEST_SETUP(peer_engine)
+{
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    r = reactor_new();
+    TEST_ASSERT_NOT_NULL(r);
+    a.pe = peer_engine_new(r, info_hash, id_a, &ops, &a);
+    b.pe = peer_engine_new(r, info_hash, id_b, &ops, &b);
+    TEST_ASSERT_NOT_NULL(a.pe);
+    TEST_ASSERT_NOT_NULL(b.pe);
+}
+
+TEST_TEAR_DOWN(peer_engine)
+{
+    peer_engine_free(a.pe);
+    peer_engine_free(b.pe);
+    reactor_free(r);
+}
+
+TEST(peer_engine, handshake_and_messages)
+{
+    pair();
+    run_until(both_ready);
+    TEST_ASSERT_EQUAL(1, a.ready);
+    TEST_ASSERT_EQUAL(1, b.ready);
+    TEST_ASSERT_EQUAL(PEER_CONN_ACTIVE, peer_conn_state(a.last));
+    TEST_ASSERT_EQUAL_MEMORY(id_b, peer_conn_peer_id(a.last), 20);
+    TEST_ASSERT_EQUAL_MEMORY(id_a, peer_conn_peer_id(b.last), 20);
+
+    struct peer_msg interested = { .id = PEER_MSG_INTERESTED };
+    struct peer_msg unchoke = { .id = PEER_MSG_UNCHOKE };
+    TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(a.last, &interested));
+    TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(b.last, &unchoke));
+    TEST_ASSERT_EQUAL(1, peer_conn_wire(a.last)->am_interested);
+    TEST_ASSERT_EQUAL(0, peer_conn_wire(b.last)->am_choking);
+    reactor_run_once(r, 1000);
+    reactor_run_once(r, 100);
+    TEST_ASSERT_EQUAL(1, a.messages);
+    TEST_ASSERT_EQUAL(1, b.messages);
+    TEST_ASSERT_EQUAL(1, peer_conn_wire(b.last)->peer_interested);
+    TEST_ASSERT_EQUAL(0, peer_conn_wire(a.last)->peer_choking);
+
+    /* Closing one side closes the other */
+    peer_conn_close(a.last);
+    TEST_ASSERT_EQUAL(1, a.closed);
+    run_until(both_closed);
+    TEST_ASSERT_EQUAL(1, b.closed);
+    TEST_ASSERT_EQUAL(0, reactor_count(r));
+}
+
+TEST(peer_engine, info_hash_mismatch)
+{
+    const uint8_t other[20] = "jihgfedcba9876543210";
+
+    peer_engine_free(b.pe);
+    b.pe = peer_engine_new(r, other, id_b, &ops, &b);
+    TEST_ASSERT_NOT_NULL(b.pe);
+    pair();
+    run_until(both_closed);
+    TEST_ASSERT_EQUAL(0, a.ready + b.ready);
+    TEST_ASSERT_EQUAL(1, a.closed);
+    TEST_ASSERT_EQUAL(1, b.closed);
+}
+
+TEST(peer_engine, nonblocking_connect)
+{
+    struct sockaddr_in addr;
+    int lfd = listen_loopback(&addr, 4);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_NOT_EQUAL(0, reactor_set_nonblocking(fd));
+    int rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    TEST_ASSERT(rc == 0 || errno == EINPROGRESS);
+    struct peer_conn *conn = peer_engine_add(a.pe, fd, rc != 0);
+    TEST_ASSERT_NOT_NULL(conn);
+
+    TEST_ASSERT_NOT_NULL(peer_engine_add(b.pe, accept(lfd, NULL, NULL), 0));
+    close(lfd);
+    run_until(both_ready);
+    TEST_ASSERT_EQUAL(PEER_CONN_ACTIVE, peer_conn_state(conn));
+    TEST_ASSERT_EQUAL_MEMORY(id_b, peer_conn_peer_id(conn), 20);
+
+    /* A refused connect is reported as closed */
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_NOT_EQUAL(0, reactor_set_nonblocking(fd));
+    rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc != 0 && errno == EINPROGRESS) {
+	TEST_ASSERT_NOT_NULL(peer_engine_add(a.pe, fd, 1));
+	TEST_ASSERT_EQUAL(2, peer_engine_count(a.pe));
+	for (int i = 0; i < 50 && a.closed == 0; ++i)
+	    reactor_run_once(r, 20);
+	TEST_ASSERT_EQUAL(1, a.closed);
+    } else {
+	close(fd);
+    }
+    TEST_ASSERT_EQUAL(1, peer_engine_count(a.pe));
+}
+
+TEST(peer_engine, close_from_callback)
+{
+    struct peer_msg have = { .id = PEER_MSG_HAVE };
+
+    pair();
+    run_until(both_ready);
+    b.close_on_message = 1;
+
+    /* Three messages arrive in one read; only the first is delivered */
+    for (int i = 0; i < 3; ++i) {
+	have.index = i;
+	TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(a.last, &have));
+    }
+    run_until(both_closed);
+    TEST_ASSERT_EQUAL(1, b.messages);
+    TEST_ASSERT_EQUAL(1, b.closed);
+    TEST_ASSERT_EQUAL(1, a.closed);
+}
+
+TEST(peer_engine, queued_until_writable)
+{
+    uint8_t *block = malloc(BLOCK);
+    struct peer_msg piece = { .id = PEER_MSG_PIECE, .payload = block, .payload_len = BLOCK };
+    uint32_t sum = 0;
+    int n = 256;
+
+    for (int i = 0; i < BLOCK; ++i)
+	block[i] = (uint8_t)(i * 7);
+    pair();
+    run_until(both_ready);
+
+    /* 4 MiB without running the loop: more than the socket buffers hold */
+    for (int i = 0; i < n; ++i) {
+	piece.index = i;
+	block[0] = (uint8_t)i;
+	TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(a.last, &piece));
+	for (int j = 0; j < BLOCK; ++j)
+	    sum = sum * 31 + block[j];
+    }
+    TEST_ASSERT(peer_conn_queued(a.last) > 0);
+
+    for (int idle = 0; b.messages < n && idle < 50;)
+	idle = reactor_run_once(r, 20) > 0 ? 0 : idle + 1;
+    TEST_ASSERT_EQUAL(n, b.messages);
+    TEST_ASSERT_EQUAL((uint64_t)n * BLOCK, b.bytes);
+    TEST_ASSERT_EQUAL(sum, b.sum);
+    TEST_ASSERT_EQUAL(0, peer_conn_queued(a.last));
+    free(block);
+}
+
+TEST(peer_engine, bench_many_connections)
+{
+    BENCH_ONLY();
+    struct rlimit rl;
+    size_t pairs = 2000, rounds = 20;
+    struct peer_msg have = { .id = PEER_MSG_HAVE };
+
+    /* Four descriptors per pair at most, with room to spare */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur != RLIM_INFINITY && pairs > (rl.rlim_cur - 64) / 4)
+	pairs = (rl.rlim_cur - 64) / 4;
+
+    a.conns = malloc(pairs * sizeof(*a.conns));
+    double t0 = now_ms();
+    for (size_t i = 0; i < pairs; ++i)
+	pair();
+    for (int idle = 0; (size_t)a.ready < pairs && idle < 50;)
+	idle = reactor_run_once(r, 20) > 0 ? 0 : idle + 1;
+    double t1 = now_ms();
+    TEST_ASSERT_EQUAL(pairs, a.ready);
+    TEST_ASSERT_EQUAL(pairs, b.ready);
+    TEST_ASSERT_EQUAL(2 * pairs, reactor_count(r));
+
+    /* Every connection of a sends a have per round, b counts them */
+    double t2 = now_ms();
+    for (size_t round = 0; round < rounds; ++round) {
+	have.index = round;
+	for (size_t i = 0; i < pairs; ++i)
+	    TEST_ASSERT_NOT_EQUAL(0, peer_conn_send(a.conns[i], &have));
+	while (reactor_run_once(r, 0) > 0)
+	    ;
+    }
+    for (int idle = 0; (size_t)b.messages < pairs * rounds && idle < 50;)
+	idle = reactor_run_once(r, 20) > 0 ? 0 : idle + 1;
+    double t3 = now_ms();
+    TEST_ASSERT_EQUAL(pairs * rounds, b.messages);
+
+    printf("\n  %zu connections in one thread: set up in %.0f ms, %.0f messages/s",
+	   2 * pairs, t1 - t0, pairs * rounds / ((t3 - t2) / 1e3));
+    free(a.conns);
+}
+
+TEST(peer_engine, connect_cap)
+{
+    struct sockaddr_in addr;
+    struct peer_engine_connect_stats st;
+    size_t most = 0;
+    int lfd = listen_loopback(&addr, 64);
+
+    TEST_ASSERT_NOT_EQUAL(0, reactor_set_nonblocking(lfd));
+    TEST_ASSERT_NOT_EQUAL(0, reactor_add(r, lfd, on_accept, NULL));
+    peer_engine_set_connect_limits(a.pe, 4, 5000);
+    for (int i = 0; i < 20; ++i)
+	TEST_ASSERT_NOT_EQUAL(0, peer_engine_connect(a.pe, (struct sockaddr *)&addr, sizeof(addr)));
+    peer_engine_connect_stats(a.pe, &st);
+    TEST_ASSERT_EQUAL(4, st.connecting);
+    TEST_ASSERT_EQUAL(16, st.queued);
+
+    for (int idle = 0; a.ready < 20 && idle < 50;) {
+	idle = reactor_run_once(r, 20) > 0 ? 0 : idle + 1;
+	peer_engine_connect_stats(a.pe, &st);
+	if (st.connecting > most)
+	    most = st.connecting;
+    }
+    TEST_ASSERT_EQUAL(20, a.ready);
+    TEST_ASSERT(most <= 4);
+    peer_engine_connect_stats(a.pe, &st);
+    TEST_ASSERT_EQUAL(20, st.succeeded);
+    TEST_ASSERT_EQUAL(0, st.connecting + st.queued + st.failed + st.timed_out);
+
+    reactor_remove(r, lfd);
+    close(lfd);
+}
+
+TEST(peer_engine, connect_deadlines)
+{
+    struct sockaddr_in silent, refused;
+    struct peer_engine_connect_stats st;
+    int n = 50, timeout = 200;
+
+    /* Never accepts nor answers: connects either hang or wait for a handshake */
+    int lfd = listen_loopback(&silent, 1);
+    /* Nothing listens there any more */
+    close(listen_loopback(&refused, 1));
+
+    peer_engine_set_connect_limits(a.pe, n, timeout);
+    double t0 = now_ms();
+    for (int i = 0; i < n; ++i)
+	TEST_ASSERT_NOT_EQUAL(0, peer_engine_connect(a.pe, (struct sockaddr *)&silent,
+						     sizeof(silent)));
+    TEST_ASSERT_NOT_EQUAL(0, peer_engine_connect(a.pe, (struct sockaddr *)&refused,
+						 sizeof(refused)));
+    double t1 = now_ms();
+    do {
+	reactor_run_once(r, 50);
+	peer_engine_connect_stats(a.pe, &st);
+    } while (st.connecting + st.queued > 0 && now_ms() - t0 < 5000);
+    double t2 = now_ms();
+
+    TEST_ASSERT_EQUAL(n, st.timed_out);
+    TEST_ASSERT_EQUAL(1, st.failed);
+    TEST_ASSERT_EQUAL(0, st.succeeded + a.ready);
+    TEST_ASSERT_EQUAL(0, peer_engine_count(a.pe));
+    TEST_ASSERT(t2 - t0 >= timeout);
+    TEST_ASSERT(t2 - t0 < 10 * timeout);
+
+    printf("\n  %d unresponsive peers given up in %.0f ms (queued in %.1f ms);"
+	   " serially that is %d timeouts", n + 1, t2 - t0, t1 - t0, n);
+    close(lfd);
+}
+
+TEST_GROUP_RUNNER(peer_engine)
+{
+    RUN_TEST_CASE(peer_engine, handshake_and_messages);
+    RUN_TEST_CASE(peer_engine, info_hash_mismatch);
+    RUN_TEST_CASE(peer_engine, nonblocking_connect);
+    RUN_TEST_CASE(peer_engine, close_from_callback);
+    RUN_TEST_CASE(peer_engine, queued_until_writable);
+    RUN_TEST_CASE(peer_engine, connect_cap);
+    RUN_TEST_CASE(peer_engine, connect_deadlines);
+    RUN_TEST_CASE(peer_engine, bench_many_connections);
+}
@@ -0,0 +1,192 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <peer_table.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define WINDOW 64
+
+static struct peer_table *pt;
+
+TEST_GROUP(peer_table);
+
+TEST_SETUP(peer_table)
+{
+    pt = peer_table_new();
+    TEST_ASSERT_NOT_NULL(pt);
+}
+
+TEST_TEAR_DOWN(peer_table)
+{
+    peer_table_free(pt);
+}
+
+TEST(peer_table, insert_get_remove)
+{
+    struct peer_entry e;
+    int tag;
+
+    peer_handle_t h = peer_table_insert(pt, 7, &tag);
+    TEST_ASSERT_NOT_EQUAL(PEER_HANDLE_NONE, h);
+    TEST_ASSERT_EQUAL(1, peer_table_count(pt));
+    TEST_ASSERT_NOT_EQUAL(0, peer_table_get(pt, h, &e));
+    TEST_ASSERT_EQUAL(7, e.fd);
+    TEST_ASSERT_EQUAL_PTR(&tag, e.user);
+
+    memset(&e, 0, sizeof(e));
+    TEST_ASSERT_NOT_EQUAL(0, peer_table_remove(pt, h, &e));
+    TEST_ASSERT_EQUAL(7, e.fd);
+    TEST_ASSERT_EQUAL(0, peer_table_count(pt));
+    TEST_ASSERT_EQUAL(0, peer_table_get(pt, h, &e));
+    TEST_ASSERT_EQUAL(0, peer_table_remove(pt, h, NULL));
+    TEST_ASSERT_EQUAL(0, peer_table_get(pt, PEER_HANDLE_NONE, &e));
+    TEST_ASSERT_EQUAL(0, peer_table_remove(pt, (peer_handle_t)1 << 32 | 0xfffffff0u, NULL));
+}
+
+TEST(peer_table, stale_handles)
+{
+    struct peer_entry e;
+
+    peer_handle_t old = peer_table_insert(pt, 3, NULL);
+    TEST_ASSERT_NOT_EQUAL(0, peer_table_remove(pt, old, NULL));
+
+    /* The slot is reused, under a new generation */
+    peer_handle_t h = peer_table_insert(pt, 4, NULL);
+    TEST_ASSERT_EQUAL(old & 0xffffffffu, h & 0xffffffffu);
+    TEST_ASSERT_NOT_EQUAL(old, h);
+    TEST_ASSERT_EQUAL(0, peer_table_get(pt, old, &e));
+    TEST_ASSERT_EQUAL(0, peer_table_remove(pt, old, NULL));
+    TEST_ASSERT_NOT_EQUAL(0, peer_table_get(pt, h, &e));
+    TEST_ASSERT_EQUAL(4, e.fd);
+}
+
+static int count_fds(void *arg, peer_handle_t h, const struct peer_entry *e)
+{
+    long *sum = arg;
+
+    (void)h;
+    *sum += e->fd;
+    return 1;
+}
+
+TEST(peer_table, grows_across_slabs)
+{
+    size_t n = 3 * PEER_TABLE_SLAB + 5;
+    peer_handle_t *h = malloc(n * sizeof(*h));
+    struct peer_entry e;
+    long sum = 0, expected = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+	h[i] = peer_table_insert(pt, (int)i, NULL);
+	TEST_ASSERT_NOT_EQUAL(PEER_HANDLE_NONE, h[i]);
+    }
+    /* Handles taken before the table grew still work */
+    for (size_t i = 0; i < n; ++i) {
+	TEST_ASSERT_NOT_EQUAL(0, peer_table_get(pt, h[i], &e));
+	TEST_ASSERT_EQUAL(i, e.fd);
+    }
+    for (size_t i = 0; i < n; i += 2)
+	TEST_ASSERT_NOT_EQUAL(0, peer_table_remove(pt, h[i], NULL));
+    for (size_t i = 1; i < n; i += 2)
+	expected += i;
+    TEST_ASSERT_EQUAL(n / 2, peer_table_count(pt));
+    peer_table_foreach(pt, count_fds, &sum);
+    TEST_ASSERT_EQUAL(expected, sum);
+    free(h);
+}
+
+/* Each thread keeps WINDOW peers of its own and replaces them over and over */
+struct churn {
+    int id;
+    long ops;
+    int errors;
+};
+
+static void *churn_thread(void *arg)
+{
+    struct churn *c = arg;
+    peer_handle_t live[WINDOW];
+    struct peer_entry e;
+
+    for (int i = 0; i < WINDOW; ++i)
+	live[i] = peer_table_insert(pt, c->id * 1000000 + i, c);
+    for (long i = 0; i < c->ops; ++i) {
+	int k = i % WINDOW;
+	if (!peer_table_get(pt, live[k], &e) || e.user != c)
+	    c->errors++;
+	if (!peer_table_remove(pt, live[k], &e) || e.fd / 1000000 != c->id)
+	    c->errors++;
+	live[k] = peer_table_insert(pt, c->id * 1000000 + k, c);
+	if (live[k] == PEER_HANDLE_NONE)
+	    c->errors++;
+    }
+    for (int i = 0; i < WINDOW; ++i)
+	if (!peer_table_remove(pt, live[i], NULL))
+	    c->errors++;
+    return NULL;
+}
+
+/* Several threads remove the same handles; one of them wins each */
+static peer_handle_t contested[WINDOW];
+static int wins[THREADS];
+
+static void *remove_thread(void *arg)
+{
+    int id = *(int *)arg;
+
+    for (int i = 0; i < WINDOW; ++i)
+	wins[id] += peer_table_remove(pt, contested[i], NULL);
+    return NULL;
+}
+
+TEST(peer_table, concurrent_churn)
+{
+    pthread_t t[THREADS];
+    struct churn c[THREADS];
+    int ids[THREADS];
+    long ops = 200000;
+
+    double t0 = now_ms();
+    for (int i = 0; i < THREADS; ++i) {
+	c[i] = (struct churn){ .id = i + 1, .ops = ops };
+	pthread_create(&t[i], NULL, churn_thread, &c[i]);
+    }
+    for (int i = 0; i < THREADS; ++i)
+	pthread_join(t[i], NULL);
+    double t1 = now_ms();
+    for (int i = 0; i < THREADS; ++i)
+	TEST_ASSERT_EQUAL(0, c[i].errors);
+    TEST_ASSERT_EQUAL(0, peer_table_count(pt));
+
+    for (int i = 0; i < WINDOW; ++i)
+	contested[i] = peer_table_insert(pt, i, NULL);
+    for (int i = 0; i < THREADS; ++i) {
+	ids[i] = i;
+	wins[i] = 0;
+	pthread_create(&t[i], NULL, remove_thread, &ids[i]);
+    }
+    for (int i = 0; i < THREADS; ++i)
+	pthread_join(t[i], NULL);
+    int total = 0;
+    for (int i = 0; i < THREADS; ++i)
+	total += wins[i];
+    TEST_ASSERT_EQUAL(WINDOW, total);
+    TEST_ASSERT_EQUAL(0, peer_table_count(pt));
+
+    printf("\n  %d threads: %.1f M insert+get+remove per second",
+	   THREADS, THREADS * ops / ((t1 - t0) / 1e3) / 1e6);
+}
+
+TEST_GROUP_RUNNER(peer_table)
+{
+    RUN_TEST_CASE(peer_table, insert_get_remove);
+    RUN_TEST_CASE(peer_table, stale_handles);
+    RUN_TEST_CASE(peer_table, grows_across_slabs);
+    RUN_TEST_CASE(peer_table, concurrent_churn);
+}
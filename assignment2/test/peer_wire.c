@@ -0,0 +1,530 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <peer_wire.h>
+#include <metainfo.h>
+#include <storage.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/sha.h>
+
+#define BLOCK 16384
+#define DATA_FILE "peer_wire_data.bin"
+
+static struct peer_wire pw;
+static int fds[2];
+
+/* What the callback saw, compared against what was encoded */
+struct seen {
+    int id;
+    uint32_t index, begin, length;
+    size_t payload_len;
+    uint32_t sum;
+};
+
+static struct seen *expected, *got;
+static size_t nexpected, ngot;
+
+static uint32_t checksum(const uint8_t *p, size_t len)
+{
+    uint32_t s = 0;
+
+    for (size_t i = 0; i < len; ++i)
+	s = s * 31 + p[i];
+    return s;
+}
+
+static int record(void *ctx, const struct peer_msg *msg)
+{
+    struct seen *s = &got[ngot++];
+
+    (void)ctx;
+    s->id = msg->id;
+    s->index = msg->index;
+    s->begin = msg->begin;
+    s->length = msg->length;
+    s->payload_len = msg->payload_len;
+    s->sum = checksum(msg->payload, msg->payload_len);
+    return 1;
+}
+
+/* Appends msg with its payload to buf, and remembers it as expected */
+static size_t append(uint8_t *buf, const struct peer_msg *msg)
+{
+    size_t n = peer_wire_encode(msg, buf);
+    struct seen *s = &expected[nexpected++];
+
+    if (msg->payload_len)
+	memcpy(buf + n, msg->payload, msg->payload_len);
+    s->id = msg->id;
+    s->index = msg->index;
+    s->begin = msg->begin;
+    s->length = msg->length;
+    s->payload_len = msg->payload_len;
+    s->sum = checksum(msg->payload, msg->payload_len);
+    return n + msg->payload_len;
+}
+
+/* A stream of count random messages; payloads up to max_payload bytes */
+static size_t random_stream(uint8_t *buf, size_t count, size_t max_payload)
+{
+    static uint8_t payload[65536];
+    size_t n = 0;
+
+    for (size_t i = 0; i < sizeof(payload); ++i)
+	payload[i] = (uint8_t)rand();
+    for (size_t k = 0; k < count; ++k) {
+	struct peer_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.id = rand() % 10 - 1;
+	if (msg.id == PEER_MSG_HAVE || msg.id >= PEER_MSG_REQUEST)
+	    msg.index = (uint32_t)rand();
+	if (msg.id >= PEER_MSG_REQUEST)
+	    msg.begin = (uint32_t)rand();
+	if (msg.id == PEER_MSG_REQUEST || msg.id == PEER_MSG_CANCEL)
+	    msg.length = (uint32_t)rand();
+	if (msg.id == PEER_MSG_BITFIELD || msg.id == PEER_MSG_PIECE) {
+	    msg.payload = payload + rand() % 1024;
+	    msg.payload_len = (size_t)rand() % max_payload;
+	}
+	n += append(buf + n, &msg);
+    }
+    return n;
+}
+
+/* Feeds len bytes to the ring in chunks of 1 to max_chunk bytes, parsing after each */
+static void feed(const uint8_t *buf, size_t len, size_t max_chunk)
+{
+    size_t off = 0;
+
+    while (off < len) {
+	size_t space, n = 1 + (size_t)rand() % max_chunk;
+	uint8_t *p = peer_ring_write_ptr(&pw.in, &space);
+
+	if (n > space)
+	    n = space;
+	if (n > len - off)
+	    n = len - off;
+	TEST_ASSERT_TRUE(n > 0);
+	memcpy(p, buf + off, n);
+	peer_ring_commit(&pw.in, n);
+	off += n;
+	TEST_ASSERT_TRUE(peer_wire_parse(&pw, record, NULL) >= 0);
+    }
+}
+
+static void check_seen(void)
+{
+    TEST_ASSERT_EQUAL(nexpected, ngot);
+    for (size_t i = 0; i < ngot; ++i) {
+	TEST_ASSERT_EQUAL(expected[i].id, got[i].id);
+	TEST_ASSERT_EQUAL(expected[i].index, got[i].index);
+	TEST_ASSERT_EQUAL(expected[i].begin, got[i].begin);
+	TEST_ASSERT_EQUAL(expected[i].length, got[i].length);
+	TEST_ASSERT_EQUAL(expected[i].payload_len, got[i].payload_len);
+	TEST_ASSERT_EQUAL(expected[i].sum, got[i].sum);
+    }
+}
+
+/* Sends the same buffer over and over until total bytes are out */
+struct sender {
+    int fd;
+    const uint8_t *buf;
+    size_t len;
+    size_t total;
+};
+
+static void *sender_thread(void *arg)
+{
+    struct sender *s = arg;
+
+    for (size_t sent = 0; sent < s->total;) {
+	size_t n = s->len - sent % s->len;
+	ssize_t w = send(s->fd, s->buf + sent % s->len, n, MSG_NOSIGNAL);
+
+	if (w <= 0)
+	    break;
+	sent += (size_t)w;
+    }
+    return NULL;
+}
+
+struct bench {
+    size_t bytes;
+    size_t pieces;
+};
+
+static int count_piece(void *ctx, const struct peer_msg *msg)
+{
+    struct bench *b = ctx;
+
+    if (msg->id == PEER_MSG_PIECE) {
+	b->bytes += msg->payload_len;
+	b->pieces++;
+    }
+    return 1;
+}
+
+/* Receives total bytes from fd, in reads of at most chunk bytes; returns Gbit/s */
+static double receive(int fd, size_t total, size_t chunk, size_t *pieces)
+{
+    struct bench b = { 0, 0 };
+    size_t received = 0;
+    double t0 = now_ms();
+
+    while (received < total) {
+	size_t space;
+	uint8_t *p = peer_ring_write_ptr(&pw.in, &space);
+	ssize_t n = recv(fd, p, space < chunk ? space : chunk, 0);
+
+	TEST_ASSERT_TRUE(n > 0);
+	peer_ring_commit(&pw.in, (size_t)n);
+	received += (size_t)n;
+	TEST_ASSERT_TRUE(peer_wire_parse(&pw, count_piece, &b) >= 0);
+    }
+    *pieces = b.pieces;
+    return total * 8.0 / ((now_ms() - t0) * 1e6);
+}
+
+/* A connected pair of TCP sockets over loopback */
+static void tcp_pair(int *a, int *b)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL(0, bind(l, (struct sockaddr *)&addr, sizeof(addr)));
+    TEST_ASSERT_EQUAL(0, listen(l, 1));
+    TEST_ASSERT_EQUAL(0, getsockname(l, (struct sockaddr *)&addr, &len));
+    *a = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL(0, connect(*a, (struct sockaddr *)&addr, sizeof(addr)));
+    *b = accept(l, NULL, NULL);
+    TEST_ASSERT_TRUE(*b >= 0);
+    close(l);
+}
+
+
+TEST_GROUP(peer_wire);
+
+TEST_SETUP(peer_wire)
+{
+    TEST_ASSERT_NOT_EQUAL(0, peer_wire_init(&pw, PEER_WIRE_RING_SIZE));
+    fds[0] = fds[1] = -1;
+    expected = malloc(4096 * sizeof(struct seen));
+    got = malloc(4096 * sizeof(struct seen));
+    nexpected = ngot = 0;
+}
+
+TEST_TEAR_DOWN(peer_wire)
+{
+    peer_wire_free(&pw);
+    if (fds[0] >= 0)
+	close(fds[0]);
+    if (fds[1] >= 0)
+	close(fds[1]);
+    free(expected);
+    free(got);
+    remove(DATA_FILE);
+}
+
+
+TEST(peer_wire, encode)
+{
+    uint8_t buf[PEER_WIRE_HEADER_MAX];
+    struct peer_msg msg;
+    const uint8_t have[] = { 0, 0, 0, 5, 4, 0, 0, 1, 2 };
+    const uint8_t request[] = { 0, 0, 0, 13, 6, 0, 0, 0, 7, 0, 0, 0x40, 0, 0, 0, 0x40, 0 };
+    const uint8_t piece[] = { 0, 0, 0x40, 9, 7, 0, 0, 0, 7, 0, 0, 0, 0 };
+
+    memset(&msg, 0, sizeof(msg));
+    msg.id = PEER_MSG_KEEP_ALIVE;
+    TEST_ASSERT_EQUAL(4, peer_wire_encode(&msg, buf));
+    TEST_ASSERT_EQUAL(0, buf[3]);
+    msg.id = PEER_MSG_INTERESTED;
+    TEST_ASSERT_EQUAL(5, peer_wire_encode(&msg, buf));
+    TEST_ASSERT_EQUAL(1, buf[3]);
+    TEST_ASSERT_EQUAL(2, buf[4]);
+    msg.id = PEER_MSG_HAVE;
+    msg.index = 258;
+    TEST_ASSERT_EQUAL(9, peer_wire_encode(&msg, buf));
+    TEST_ASSERT_EQUAL_MEMORY(have, buf, 9);
+    msg.id = PEER_MSG_REQUEST;
+    msg.index = 7;
+    msg.begin = BLOCK;
+    msg.length = BLOCK;
+    TEST_ASSERT_EQUAL(17, peer_wire_encode(&msg, buf));
+    TEST_ASSERT_EQUAL_MEMORY(request, buf, 17);
+    /* The block itself is not copied into the header */
+    msg.id = PEER_MSG_PIECE;
+    msg.begin = 0;
+    msg.payload_len = BLOCK;
+    TEST_ASSERT_EQUAL(13, peer_wire_encode(&msg, buf));
+    TEST_ASSERT_EQUAL_MEMORY(piece, buf, 13);
+}
+
+TEST(peer_wire, parse_and_state)
+{
+    uint8_t buf[256];
+    size_t n = 0;
+    const uint8_t bits[] = { 0xa0 };
+    struct peer_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.id = PEER_MSG_BITFIELD;
+    msg.payload = bits;
+    msg.payload_len = 1;
+    n += append(buf + n, &msg);
+    memset(&msg, 0, sizeof(msg));
+    msg.id = PEER_MSG_UNCHOKE;
+    n += append(buf + n, &msg);
+    msg.id = PEER_MSG_INTERESTED;
+    n += append(buf + n, &msg);
+    msg.id = PEER_MSG_KEEP_ALIVE;
+    n += append(buf + n, &msg);
+    msg.id = PEER_MSG_CANCEL;
+    msg.index = 3;
+    msg.begin = BLOCK;
+    msg.length = 100;
+    n += append(buf + n, &msg);
+    /* An extension message this module does not know */
+    memset(&msg, 0, sizeof(msg));
+    msg.id = 20;
+    msg.payload = (const uint8_t *)"d1:md4:ut_pei1eee";
+    msg.payload_len = 18;
+    n += append(buf + n, &msg);
+
+    TEST_ASSERT_EQUAL(1, pw.peer_choking);
+    TEST_ASSERT_EQUAL(0, pw.peer_interested);
+    feed(buf, n, n);
+    check_seen();
+    TEST_ASSERT_EQUAL(0, pw.peer_choking);
+    TEST_ASSERT_EQUAL(1, pw.peer_interested);
+}
+
+TEST(peer_wire, partial_and_coalesced_reads)
+{
+    /* A small ring, so messages wrap around its end */
+    const size_t len = 4 * 1024 * 1024;
+    uint8_t *buf = malloc(len);
+    size_t n;
+
+    peer_wire_free(&pw);
+    TEST_ASSERT_NOT_EQUAL(0, peer_wire_init(&pw, 8192));
+    n = random_stream(buf, 4000, 3000);
+    TEST_ASSERT_TRUE(n < len);
+
+    /* One byte at a time, then reads that hold several messages */
+    feed(buf, n, 1);
+    check_seen();
+    ngot = 0;
+    feed(buf, n, 8192);
+    check_seen();
+
+    /* Same with the flat fallback buffer */
+    peer_ring_free(&pw.in);
+    TEST_ASSERT_NOT_EQUAL(0, peer_ring_init(&pw.in, 8192, 0));
+    TEST_ASSERT_EQUAL(0, pw.in.mirrored);
+    ngot = 0;
+    feed(buf, n, 3000);
+    check_seen();
+    free(buf);
+}
+
+TEST(peer_wire, mirrored_ring_wraps)
+{
+    size_t space, avail;
+    uint8_t *w;
+    const uint8_t *r;
+
+    TEST_ASSERT_EQUAL(1, pw.in.mirrored);
+    /* Move the ring close to its end, then write across it */
+    w = peer_ring_write_ptr(&pw.in, &space);
+    peer_ring_commit(&pw.in, pw.in.size - 10);
+    peer_ring_consume(&pw.in, pw.in.size - 11);
+    w = peer_ring_write_ptr(&pw.in, &space);
+    TEST_ASSERT_EQUAL(pw.in.size - 1, space);
+    memcpy(w, "across the end", 14);
+    peer_ring_commit(&pw.in, 14);
+    r = peer_ring_read_ptr(&pw.in, &avail);
+    TEST_ASSERT_EQUAL(15, avail);
+    TEST_ASSERT_EQUAL_MEMORY("across the end", r + 1, 14);
+    /* The wrapped bytes are at the start of the buffer too */
+    TEST_ASSERT_EQUAL_MEMORY("end", pw.in.buf + 1, 3);
+}
+
+static int stop(void *ctx, const struct peer_msg *msg)
+{
+    (void)ctx;
+    (void)msg;
+    return 0;
+}
+
+TEST(peer_wire, malformed)
+{
+    const uint8_t bad_have[] = { 0, 0, 0, 3, 4, 0, 1 };
+    const uint8_t too_long[] = { 0, 0x10, 0, 0, 7 };
+    const uint8_t choke[] = { 0, 0, 0, 1, 0 };
+    size_t space;
+
+    memcpy(peer_ring_write_ptr(&pw.in, &space), bad_have, sizeof(bad_have));
+    peer_ring_commit(&pw.in, sizeof(bad_have));
+    TEST_ASSERT_EQUAL(-1, peer_wire_parse(&pw, record, NULL));
+
+    peer_ring_consume(&pw.in, sizeof(bad_have));
+    memcpy(peer_ring_write_ptr(&pw.in, &space), too_long, sizeof(too_long));
+    peer_ring_commit(&pw.in, sizeof(too_long));
+    TEST_ASSERT_EQUAL(-1, peer_wire_parse(&pw, record, NULL));
+
+    peer_ring_consume(&pw.in, sizeof(too_long));
+    memcpy(peer_ring_write_ptr(&pw.in, &space), choke, sizeof(choke));
+    peer_ring_commit(&pw.in, sizeof(choke));
+    TEST_ASSERT_EQUAL(-1, peer_wire_parse(&pw, stop, NULL));
+    TEST_ASSERT_EQUAL(0, ngot);
+}
+
+static int write_block(void *ctx, const struct peer_msg *msg)
+{
+    struct storage *st = ctx;
+
+    if (msg->id != PEER_MSG_PIECE)
+	return 1;
+    /* Straight from the receive ring to the file */
+    return storage_write(st, (size_t)msg->index * 4 * BLOCK + msg->begin,
+			 msg->payload, msg->payload_len) == msg->payload_len;
+}
+
+TEST(peer_wire, blocks_to_storage)
+{
+    /* Four pieces of four blocks, sent out of order over a socket pair */
+    struct metainfo_file torrent;
+    struct metainfo_file_span span;
+    struct storage *st;
+    uint8_t *data, *back;
+    const size_t length = 16 * BLOCK;
+    struct peer_msg msg;
+
+    data = malloc(length);
+    back = malloc(length);
+    for (size_t i = 0; i < length; ++i)
+	data[i] = (uint8_t)rand();
+    memset(&torrent, 0, sizeof(torrent));
+    torrent.info.piece_length = 4 * BLOCK;
+    torrent.info.length = length;
+    torrent.info.pieces_count = 4;
+    span.path = DATA_FILE;
+    span.offset = 0;
+    span.length = length;
+    torrent.info.files = &span;
+    torrent.info.files_count = 1;
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_SPARSE));
+    st = storage_open_rw(&torrent);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    memset(&msg, 0, sizeof(msg));
+    msg.id = PEER_MSG_INTERESTED;
+    TEST_ASSERT_NOT_EQUAL(0, peer_wire_send(&pw, fds[0], &msg));
+    TEST_ASSERT_EQUAL(1, pw.am_interested);
+    for (size_t k = 0; k < 16; ++k) {
+	size_t b = (k * 7) % 16;
+
+	msg.id = PEER_MSG_PIECE;
+	msg.index = (uint32_t)(b / 4);
+	msg.begin = (uint32_t)(b % 4 * BLOCK);
+	msg.payload = data + b * BLOCK;
+	msg.payload_len = BLOCK;
+	TEST_ASSERT_NOT_EQUAL(0, peer_wire_send(&pw, fds[0], &msg));
+	TEST_ASSERT_TRUE(peer_wire_recv(&pw, fds[1]) > 0);
+	TEST_ASSERT_TRUE(peer_wire_parse(&pw, write_block, st) >= 0);
+    }
+    shutdown(fds[0], SHUT_WR);
+    while (peer_wire_recv(&pw, fds[1]) > 0)
+	TEST_ASSERT_TRUE(peer_wire_parse(&pw, write_block, st) >= 0);
+
+    TEST_ASSERT_EQUAL(length, storage_read(st, 0, back, length));
+    TEST_ASSERT_EQUAL_MEMORY(data, back, length);
+    storage_close(st);
+    free(data);
+    free(back);
+}
+
+TEST(peer_wire, bench_loopback)
+{
+    BENCH_ONLY();
+    /* 256 MiB of 16 KiB blocks with a have between them, over TCP loopback */
+    const size_t total = 256u << 20, msgs = 64;
+    size_t len = 0, pieces;
+    uint8_t *buf = malloc(msgs * (13 + BLOCK + 9));
+    static uint8_t block[BLOCK];
+    struct sender s;
+    pthread_t t;
+    double big, small, flat;
+    struct peer_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    for (size_t k = 0; k < msgs; ++k) {
+	msg.id = PEER_MSG_PIECE;
+	msg.index = (uint32_t)k;
+	msg.payload = block;
+	msg.payload_len = BLOCK;
+	len += append(buf + len, &msg);
+	msg.id = PEER_MSG_HAVE;
+	msg.payload = NULL;
+	msg.payload_len = 0;
+	len += append(buf + len, &msg);
+    }
+    tcp_pair(&fds[0], &fds[1]);
+    s.fd = fds[0];
+    s.buf = buf;
+    s.len = len;
+    s.total = total / len * len;
+
+    /* Coalesced: as much as the ring holds per read */
+    pthread_create(&t, NULL, sender_thread, &s);
+    big = receive(fds[1], s.total, pw.in.size, &pieces);
+    pthread_join(t, NULL);
+    TEST_ASSERT_EQUAL(s.total / len * msgs, pieces);
+
+    /* Partial: reads of at most 1000 bytes, most blocks span many of them */
+    s.total = total / 8 / len * len;
+    pthread_create(&t, NULL, sender_thread, &s);
+    small = receive(fds[1], s.total, 1000, &pieces);
+    pthread_join(t, NULL);
+    TEST_ASSERT_EQUAL(s.total / len * msgs, pieces);
+    s.total = total / len * len;
+
+    /* Coalesced into the flat fallback buffer */
+    peer_ring_free(&pw.in);
+    TEST_ASSERT_NOT_EQUAL(0, peer_ring_init(&pw.in, PEER_WIRE_RING_SIZE, 0));
+    pthread_create(&t, NULL, sender_thread, &s);
+    flat = receive(fds[1], s.total, pw.in.size, &pieces);
+    pthread_join(t, NULL);
+
+    printf("\n  %zu MiB of blocks: mirrored ring %.1f Gbit/s, 1000-byte reads %.1f Gbit/s,"
+	   " flat buffer %.1f Gbit/s", s.total >> 20, big, small, flat);
+    free(buf);
+}
+
+TEST_GROUP_RUNNER(peer_wire)
+{
+    RUN_TEST_CASE(peer_wire, encode);
+    RUN_TEST_CASE(peer_wire, parse_and_state);
+    RUN_TEST_CASE(peer_wire, partial_and_coalesced_reads);
+    RUN_TEST_CASE(peer_wire, mirrored_ring_wraps);
+    RUN_TEST_CASE(peer_wire, malformed);
+    RUN_TEST_CASE(peer_wire, blocks_to_storage);
+    RUN_TEST_CASE(peer_wire, bench_loopback);
+}
@@ -0,0 +1,203 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <metainfo.h>
+#include <piece_assembler.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+
+#define BLOCK PIECE_BLOCK_SIZE
+
+static struct metainfo_file torrent;
+static struct piece_assembler *pa;
+static char *data;
+
+/* An in-memory torrent over length bytes of random data */
+static void make_torrent(size_t piece_length, size_t length)
+{
+    size_t pieces = (length + piece_length - 1) / piece_length;
+
+    data = malloc(length);
+    TEST_ASSERT_NOT_NULL(data);
+    for (size_t i = 0; i < length; ++i)
+	data[i] = (char)rand();
+
+    torrent.info.piece_length = piece_length;
+    torrent.info.length = length;
+    torrent.info.pieces_count = pieces;
+    torrent.info.hashes = malloc(pieces * SHA_DIGEST_LENGTH);
+    TEST_ASSERT_NOT_NULL(torrent.info.hashes);
+    for (size_t i = 0; i < pieces; ++i) {
+	size_t len = i == pieces - 1 ? length - i * piece_length : piece_length;
+	SHA1((unsigned char *)data + i * piece_length, len, torrent.info.hashes[i]);
+    }
+
+    pa = piece_assembler_new(&torrent);
+    TEST_ASSERT_NOT_NULL(pa);
+}
+
+static enum piece_block_result add(size_t piece, size_t block)
+{
+    size_t begin = block * BLOCK;
+    size_t offset = piece * torrent.info.piece_length + begin;
+    size_t end = (piece + 1) * torrent.info.piece_length;
+    size_t len;
+
+    if (end > torrent.info.length)
+	end = torrent.info.length;
+    len = end - offset < BLOCK ? end - offset : BLOCK;
+    return piece_assembler_add(pa, piece, begin, data + offset, len);
+}
+
+
+TEST_GROUP(piece_assembler);
+
+TEST_SETUP(piece_assembler)
+{
+    data = NULL;
+    pa = NULL;
+    memset(&torrent, 0, sizeof(torrent));
+}
+
+TEST_TEAR_DOWN(piece_assembler)
+{
+    piece_assembler_free(pa);
+    free(torrent.info.hashes);
+    free(data);
+}
+
+
+TEST(piece_assembler, in_order)
+{
+    make_torrent(4 * BLOCK, 8 * BLOCK);
+
+    for (size_t k = 0; k < 3; ++k)
+	TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(1, k));
+    TEST_ASSERT_EQUAL(0, piece_assembler_buffered(pa));
+    TEST_ASSERT_EQUAL(1, piece_assembler_in_flight(pa));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_VALID, add(1, 3));
+    TEST_ASSERT_EQUAL(0, piece_assembler_in_flight(pa));
+}
+
+TEST(piece_assembler, out_of_order)
+{
+    make_torrent(4 * BLOCK, 8 * BLOCK);
+
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 3));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 1));
+    TEST_ASSERT_EQUAL(2 * BLOCK, piece_assembler_buffered(pa));
+    /* Block 0 lets block 1 be hashed; block 3 still waits for block 2 */
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 0));
+    TEST_ASSERT_EQUAL(BLOCK, piece_assembler_buffered(pa));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_VALID, add(0, 2));
+    TEST_ASSERT_EQUAL(0, piece_assembler_buffered(pa));
+}
+
+TEST(piece_assembler, short_last_piece)
+{
+    /* The last piece is one full block and a 100-byte block */
+    make_torrent(4 * BLOCK, 9 * BLOCK + 100);
+
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(2, 1));
+    TEST_ASSERT_EQUAL(100, piece_assembler_buffered(pa));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_VALID, add(2, 0));
+    /* Past the end of the last piece */
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ERROR, piece_assembler_add(pa, 2, 2 * BLOCK, data, 1));
+}
+
+TEST(piece_assembler, corrupt)
+{
+    make_torrent(2 * BLOCK, 4 * BLOCK);
+
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(1, 1));
+    data[2 * BLOCK + 5] ^= 1;
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_CORRUPT, add(1, 0));
+    TEST_ASSERT_EQUAL(0, piece_assembler_in_flight(pa));
+
+    /* The piece starts over and can still complete */
+    data[2 * BLOCK + 5] ^= 1;
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(1, 0));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_VALID, add(1, 1));
+}
+
+TEST(piece_assembler, duplicates)
+{
+    make_torrent(4 * BLOCK, 4 * BLOCK);
+
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 0));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_DUPLICATE, add(0, 0));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 2));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_DUPLICATE, add(0, 2));
+    TEST_ASSERT_EQUAL(BLOCK, piece_assembler_buffered(pa));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 1));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_VALID, add(0, 3));
+}
+
+TEST(piece_assembler, invalid_blocks)
+{
+    make_torrent(4 * BLOCK, 8 * BLOCK);
+
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ERROR, piece_assembler_add(pa, 2, 0, data, BLOCK));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ERROR, piece_assembler_add(pa, 0, 100, data, BLOCK));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ERROR, piece_assembler_add(pa, 0, 0, data, BLOCK - 1));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ERROR, piece_assembler_add(pa, 0, 4 * BLOCK, data, BLOCK));
+    TEST_ASSERT_EQUAL(0, piece_assembler_in_flight(pa));
+}
+
+TEST(piece_assembler, interleaved_and_abort)
+{
+    make_torrent(2 * BLOCK, 6 * BLOCK);
+
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 1));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(2, 1));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(1, 0));
+    TEST_ASSERT_EQUAL(3, piece_assembler_in_flight(pa));
+    TEST_ASSERT_EQUAL(2 * BLOCK, piece_assembler_buffered(pa));
+
+    piece_assembler_abort(pa, 0);
+    piece_assembler_abort(pa, 0);
+    TEST_ASSERT_EQUAL(2, piece_assembler_in_flight(pa));
+    TEST_ASSERT_EQUAL(BLOCK, piece_assembler_buffered(pa));
+
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_VALID, add(1, 1));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_VALID, add(2, 0));
+    TEST_ASSERT_EQUAL(PIECE_BLOCK_ACCEPTED, add(0, 0));
+}
+
+TEST(piece_assembler, bench_stream)
+{
+    BENCH_ONLY();
+    /* 32 MiB in 256 KiB pieces; each piece arrives with its blocks pairwise swapped */
+    const size_t piece_length = 256 * 1024, length = 32 * 1024 * 1024;
+    const size_t pieces = length / piece_length, blocks = piece_length / BLOCK;
+    size_t valid = 0;
+    double t0, t1;
+
+    make_torrent(piece_length, length);
+
+    t0 = now_ms();
+    for (size_t i = 0; i < pieces; ++i) {
+	for (size_t k = 0; k < blocks; ++k)
+	    valid += add(i, k ^ 1) == PIECE_BLOCK_VALID;
+    }
+    t1 = now_ms();
+    TEST_ASSERT_EQUAL(pieces, valid);
+    printf("\n  32 MiB, half the blocks out of order: %.2f ms (%.0f MiB/s)",
+	   t1 - t0, 32 / ((t1 - t0) / 1e3));
+}
+
+TEST_GROUP_RUNNER(piece_assembler)
+{
+    RUN_TEST_CASE(piece_assembler, in_order);
+    RUN_TEST_CASE(piece_assembler, out_of_order);
+    RUN_TEST_CASE(piece_assembler, short_last_piece);
+    RUN_TEST_CASE(piece_assembler, corrupt);
+    RUN_TEST_CASE(piece_assembler, duplicates);
+    RUN_TEST_CASE(piece_assembler, invalid_blocks);
+    RUN_TEST_CASE(piece_assembler, interleaved_and_abort);
+    RUN_TEST_CASE(piece_assembler, bench_stream);
+}
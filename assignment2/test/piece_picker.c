@@ -0,0 +1,556 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <bitfield.h>
+#include <piece_picker.h>
+#include <client.h>
+#include <metainfo.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PEERS 300
+
+static struct piece_picker *pp;
+static struct bitfield peers[MAX_PEERS];
+static size_t npeers;
+
+/* A peer with the given pieces, terminated by (size_t)-1 */
+static struct bitfield *peer(size_t pieces, ...)
+{
+    struct bitfield *bf = &peers[npeers++];
+    va_list ap;
+    size_t i;
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(bf, pieces));
+    va_start(ap, pieces);
+    while ((i = va_arg(ap, size_t)) != (size_t)-1)
+	bitfield_set(bf, i);
+    va_end(ap);
+    return bf;
+}
+
+static struct bitfield *seed(size_t pieces)
+{
+    struct bitfield *bf = &peers[npeers++];
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(bf, pieces));
+    bitfield_fill(bf, 1);
+    return bf;
+}
+
+#define END ((size_t)-1)
+
+/* A peer of the simulated swarm downloads one piece at a time, rate blocks per tick */
+#define SIM_BLOCKS 16
+#define SIM_FAST 8
+
+struct sim_peer {
+    struct bitfield *has;
+    unsigned rate;
+    size_t piece;
+    unsigned progress;
+};
+
+/* Returns the tick at which the first first_n pieces are all complete */
+static size_t simulate(size_t pieces, struct sim_peer *sp, size_t n, size_t window,
+		       size_t urgent, size_t first_n, size_t *duplicates)
+{
+    uint8_t *got = malloc(pieces);
+    size_t next = 0, tick;
+
+    memset(got, 0, pieces);
+    *duplicates = 0;
+    pp = piece_picker_new(pieces, NULL, 21);
+    for (size_t k = 0; k < n; ++k) {
+	piece_picker_add_peer(pp, sp[k].has);
+	sp[k].piece = PIECE_PICKER_NONE;
+    }
+    for (tick = 1; next < first_n && tick < 100000; ++tick) {
+	if (window)
+	    piece_picker_set_deadline_window(pp, next, window, urgent);
+	for (size_t k = 0; k < n; ++k) {
+	    struct sim_peer *p = &sp[k];
+
+	    /* Someone else finished it first: cancelled */
+	    if (p->piece != PIECE_PICKER_NONE && got[p->piece]) {
+		p->piece = PIECE_PICKER_NONE;
+		*duplicates += 1;
+	    }
+	    if (p->piece == PIECE_PICKER_NONE) {
+		p->piece = piece_picker_pick_flags(pp, p->has,
+						   p->rate >= SIM_FAST ? PIECE_PICKER_FAST_PEER : 0);
+		p->progress = 0;
+		if (p->piece == PIECE_PICKER_NONE)
+		    continue;
+	    }
+	    p->progress += p->rate;
+	    if (p->progress >= SIM_BLOCKS) {
+		got[p->piece] = 1;
+		piece_picker_done(pp, p->piece);
+		p->piece = PIECE_PICKER_NONE;
+	    }
+	}
+	while (next < pieces && got[next])
+	    next++;
+    }
+    piece_picker_free(pp);
+    pp = NULL;
+    free(got);
+    return tick;
+}
+
+
+TEST_GROUP(piece_picker);
+
+TEST_SETUP(piece_picker)
+{
+    pp = NULL;
+    npeers = 0;
+}
+
+TEST_TEAR_DOWN(piece_picker)
+{
+    piece_picker_free(pp);
+    for (size_t i = 0; i < npeers; ++i)
+	bitfield_free(&peers[i]);
+}
+
+
+TEST(piece_picker, availability)
+{
+    struct bitfield *a, *b;
+
+    pp = piece_picker_new(10, NULL, 1);
+    TEST_ASSERT_NOT_NULL(pp);
+    a = peer(10, 1, 2, 3, END);
+    b = peer(10, 2, 3, END);
+    piece_picker_add_peer(pp, a);
+    piece_picker_add_peer(pp, b);
+    piece_picker_peer_have(pp, 3);
+
+    TEST_ASSERT_EQUAL(0, piece_picker_availability(pp, 0));
+    TEST_ASSERT_EQUAL(1, piece_picker_availability(pp, 1));
+    TEST_ASSERT_EQUAL(2, piece_picker_availability(pp, 2));
+    TEST_ASSERT_EQUAL(3, piece_picker_availability(pp, 3));
+
+    piece_picker_remove_peer(pp, a);
+    TEST_ASSERT_EQUAL(0, piece_picker_availability(pp, 1));
+    TEST_ASSERT_EQUAL(1, piece_picker_availability(pp, 2));
+    TEST_ASSERT_EQUAL(2, piece_picker_availability(pp, 3));
+}
+
+TEST(piece_picker, rarest_first)
+{
+    struct bitfield *s;
+
+    pp = piece_picker_new(8, NULL, 7);
+    piece_picker_set_random_first(pp, 0);
+    /* Piece 5 is on one peer, 2 on two, every other piece on three */
+    piece_picker_add_peer(pp, peer(8, 0, 1, 2, 3, 4, 6, 7, END));
+    piece_picker_add_peer(pp, peer(8, 0, 1, 3, 4, 6, 7, END));
+    s = seed(8);
+    piece_picker_add_peer(pp, s);
+
+    TEST_ASSERT_EQUAL(5, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(2, piece_picker_pick(pp, s));
+    /* Piece 6 becomes the most common */
+    piece_picker_peer_have(pp, 6);
+    for (size_t k = 0; k < 5; ++k)
+	TEST_ASSERT_NOT_EQUAL(6, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(6, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(1, piece_picker_in_endgame(pp));
+}
+
+TEST(piece_picker, picks_in_availability_order)
+{
+    /* Random bitfields come and go; picks must never get less rare */
+    const size_t pieces = 500;
+    struct bitfield *s;
+    uint32_t last = 0;
+
+    pp = piece_picker_new(pieces, NULL, 13);
+    piece_picker_set_random_first(pp, 0);
+    for (size_t k = 0; k < 40; ++k) {
+	struct bitfield *bf = &peers[npeers++];
+
+	TEST_ASSERT_NOT_EQUAL(0, bitfield_init(bf, pieces));
+	for (size_t i = 0; i < pieces; ++i) {
+	    if (rand() % 3 == 0)
+		bitfield_set(bf, i);
+	}
+	piece_picker_add_peer(pp, bf);
+	if (k % 4 == 3)
+	    piece_picker_remove_peer(pp, &peers[k - 2]);
+	piece_picker_peer_have(pp, (size_t)rand() % pieces);
+    }
+    s = seed(pieces);
+    for (size_t k = 0; k < pieces; ++k) {
+	size_t p = piece_picker_pick(pp, s);
+	uint32_t a = piece_picker_availability(pp, p);
+
+	TEST_ASSERT_TRUE(a >= last);
+	last = a;
+	if (k % 7 == 0)
+	    piece_picker_done(pp, p);
+    }
+}
+
+TEST(piece_picker, only_pieces_the_peer_has)
+{
+    struct bitfield *a;
+
+    pp = piece_picker_new(100, NULL, 3);
+    piece_picker_set_random_first(pp, 0);
+    piece_picker_add_peer(pp, seed(100));
+    a = peer(100, 42, 77, END);
+    piece_picker_add_peer(pp, a);
+
+    size_t first = piece_picker_pick(pp, a), second = piece_picker_pick(pp, a);
+    TEST_ASSERT_TRUE((first == 42 && second == 77) || (first == 77 && second == 42));
+    TEST_ASSERT_EQUAL(PIECE_PICKER_NONE, piece_picker_pick(pp, a));
+
+    /* An aborted piece can be picked again */
+    piece_picker_abort(pp, 77);
+    TEST_ASSERT_EQUAL(77, piece_picker_pick(pp, a));
+}
+
+TEST(piece_picker, skips_what_we_have)
+{
+    struct bitfield have, *s;
+
+    TEST_ASSERT_NOT_EQUAL(0, bitfield_init(&have, 6));
+    bitfield_set(&have, 0);
+    bitfield_set(&have, 3);
+    pp = piece_picker_new(6, &have, 5);
+    bitfield_free(&have);
+    piece_picker_set_random_first(pp, 0);
+    s = seed(6);
+    piece_picker_add_peer(pp, s);
+    TEST_ASSERT_EQUAL(4, piece_picker_missing(pp));
+
+    piece_picker_done(pp, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(3, piece_picker_missing(pp));
+    for (size_t k = 0; k < 3; ++k) {
+	size_t p = piece_picker_pick(pp, s);
+	TEST_ASSERT_TRUE(p != 0 && p != 3 && p < 6);
+    }
+    /* Availability of complete pieces is still tracked */
+    TEST_ASSERT_EQUAL(1, piece_picker_availability(pp, 0));
+}
+
+TEST(piece_picker, random_first)
+{
+    /* Piece 20 is the rarest; random-first picks it only by chance */
+    size_t rarest_picked = 0;
+
+    for (uint32_t s = 1; s <= 50; ++s) {
+	struct bitfield *full = seed(64), *most = seed(64);
+
+	bitfield_clear(most, 20);
+	pp = piece_picker_new(64, NULL, s);
+	piece_picker_add_peer(pp, full);
+	piece_picker_add_peer(pp, most);
+	rarest_picked += piece_picker_pick(pp, full) == 20;
+
+	piece_picker_set_random_first(pp, 0);
+	piece_picker_abort(pp, 20);
+	TEST_ASSERT_EQUAL(20, piece_picker_pick(pp, full));
+	piece_picker_free(pp);
+	pp = NULL;
+    }
+    TEST_ASSERT_TRUE(rarest_picked < 10);
+}
+
+TEST(piece_picker, endgame)
+{
+    struct bitfield *a, *b;
+
+    pp = piece_picker_new(4, NULL, 9);
+    piece_picker_set_random_first(pp, 0);
+    a = seed(4);
+    b = peer(4, 1, END);
+    piece_picker_add_peer(pp, a);
+    piece_picker_add_peer(pp, b);
+
+    TEST_ASSERT_EQUAL(1, piece_picker_pick(pp, b));
+    TEST_ASSERT_EQUAL(0, piece_picker_in_endgame(pp));
+    for (size_t k = 0; k < 3; ++k)
+	TEST_ASSERT_NOT_EQUAL(PIECE_PICKER_NONE, piece_picker_pick(pp, a));
+    TEST_ASSERT_EQUAL(1, piece_picker_in_endgame(pp));
+
+    /* Every missing piece is in flight: b gets piece 1 a second time */
+    TEST_ASSERT_EQUAL(1, piece_picker_pick(pp, b));
+    piece_picker_done(pp, 1);
+    TEST_ASSERT_EQUAL(PIECE_PICKER_NONE, piece_picker_pick(pp, b));
+    TEST_ASSERT_NOT_EQUAL(PIECE_PICKER_NONE, piece_picker_pick(pp, a));
+
+    piece_picker_done(pp, 0);
+    piece_picker_done(pp, 2);
+    piece_picker_done(pp, 3);
+    TEST_ASSERT_EQUAL(0, piece_picker_missing(pp));
+    TEST_ASSERT_EQUAL(0, piece_picker_in_endgame(pp));
+    TEST_ASSERT_EQUAL(PIECE_PICKER_NONE, piece_picker_pick(pp, a));
+}
+
+TEST(piece_picker, priorities)
+{
+    struct bitfield *s;
+
+    pp = piece_picker_new(8, NULL, 17);
+    piece_picker_set_random_first(pp, 0);
+    piece_picker_add_peer(pp, peer(8, 0, END));
+    s = seed(8);
+    piece_picker_add_peer(pp, s);
+
+    /* Skipped pieces are neither picked nor missing */
+    piece_picker_set_priority(pp, 0, PIECE_PRIORITY_SKIP);
+    piece_picker_set_priority(pp, 1, PIECE_PRIORITY_SKIP);
+    TEST_ASSERT_EQUAL(6, piece_picker_missing(pp));
+    /* Higher priority beats rarity, the highest first */
+    piece_picker_set_priority(pp, 6, 3);
+    piece_picker_set_priority(pp, 4, 5);
+    piece_picker_set_priority(pp, 7, 99);
+    TEST_ASSERT_EQUAL(PIECE_PRIORITY_MAX, piece_picker_priority(pp, 7));
+    TEST_ASSERT_EQUAL(7, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(4, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(6, piece_picker_pick(pp, s));
+    for (size_t k = 0; k < 3; ++k) {
+	size_t p = piece_picker_pick(pp, s);
+	TEST_ASSERT_TRUE(p == 2 || p == 3 || p == 5);
+    }
+    /* Every needed piece is in flight; the skipped ones stay out of endgame */
+    TEST_ASSERT_EQUAL(1, piece_picker_in_endgame(pp));
+    TEST_ASSERT_NOT_EQUAL(0, piece_picker_pick(pp, s));
+    TEST_ASSERT_NOT_EQUAL(1, piece_picker_pick(pp, s));
+
+    /* Un-skipping makes the piece wanted again */
+    piece_picker_set_priority(pp, 0, PIECE_PRIORITY_NORMAL);
+    TEST_ASSERT_EQUAL(7, piece_picker_missing(pp));
+    TEST_ASSERT_EQUAL(0, piece_picker_in_endgame(pp));
+    TEST_ASSERT_EQUAL(0, piece_picker_pick(pp, s));
+    piece_picker_done(pp, 7);
+    TEST_ASSERT_EQUAL(6, piece_picker_missing(pp));
+}
+
+TEST(piece_picker, deadline_window)
+{
+    struct bitfield *slow, *fast;
+
+    pp = piece_picker_new(32, NULL, 19);
+    slow = seed(32);
+    fast = seed(32);
+    piece_picker_add_peer(pp, slow);
+    piece_picker_add_peer(pp, fast);
+    piece_picker_set_deadline_window(pp, 10, 4, 2);
+
+    /* In order, ahead of random-first */
+    TEST_ASSERT_EQUAL(10, piece_picker_pick(pp, slow));
+    TEST_ASSERT_EQUAL(11, piece_picker_pick(pp, slow));
+    /* The urgent pieces are in flight: a fast peer duplicates the earliest */
+    TEST_ASSERT_EQUAL(10, piece_picker_pick_flags(pp, fast, PIECE_PICKER_FAST_PEER));
+    TEST_ASSERT_EQUAL(2, piece_picker_requests(pp, 10));
+    TEST_ASSERT_EQUAL(11, piece_picker_pick_flags(pp, fast, PIECE_PICKER_FAST_PEER));
+    TEST_ASSERT_EQUAL(12, piece_picker_pick_flags(pp, fast, PIECE_PICKER_FAST_PEER));
+    TEST_ASSERT_EQUAL(13, piece_picker_pick(pp, slow));
+    /* Past the window, normal order resumes */
+    size_t p = piece_picker_pick(pp, slow);
+    TEST_ASSERT_TRUE(p < 10 || p > 13);
+
+    /* Losing one of two requests keeps the piece in flight */
+    piece_picker_abort(pp, 10);
+    TEST_ASSERT_EQUAL(1, piece_picker_requests(pp, 10));
+    TEST_ASSERT_NOT_EQUAL(10, piece_picker_pick(pp, slow));
+    piece_picker_abort(pp, 10);
+    TEST_ASSERT_EQUAL(10, piece_picker_pick(pp, slow));
+
+    /* Sliding the window forward */
+    piece_picker_done(pp, 10);
+    piece_picker_done(pp, 11);
+    piece_picker_set_deadline_window(pp, 12, 4, 1);
+    TEST_ASSERT_EQUAL(14, piece_picker_pick(pp, slow));
+    TEST_ASSERT_EQUAL(12, piece_picker_pick_flags(pp, fast, PIECE_PICKER_FAST_PEER));
+    TEST_ASSERT_EQUAL(15, piece_picker_pick_flags(pp, fast, PIECE_PICKER_FAST_PEER));
+}
+
+TEST(piece_picker, client)
+{
+    struct metainfo_file info;
+    struct client *client;
+
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/simple.torrent"));
+    remove("sample.txt");
+    client = client_new(&info, 6881);
+    TEST_ASSERT_NOT_NULL(client);
+    TEST_ASSERT_NOT_NULL(client_picker(client));
+    TEST_ASSERT_EQUAL(metainfo_file_pieces_count(&info), piece_picker_missing(client_picker(client)));
+
+    TEST_ASSERT_NOT_EQUAL(0, client_set_piece_priority(client, 0, PIECE_PRIORITY_MAX));
+    TEST_ASSERT_EQUAL(PIECE_PRIORITY_MAX, piece_picker_priority(client_picker(client), 0));
+    TEST_ASSERT_EQUAL(0, client_set_piece_priority(client, metainfo_file_pieces_count(&info), 0));
+    TEST_ASSERT_NOT_EQUAL(0, client_set_streaming(client, 0, 4, 1));
+    TEST_ASSERT_EQUAL(0, client_set_streaming(client, info.info.length, 4, 1));
+    client_free(client);
+    metainfo_file_free(&info);
+    remove("sample.txt");
+}
+
+TEST(piece_picker, bench_swarm)
+{
+    BENCH_ONLY();
+    /* 50 000 pieces, 300 peers holding random halves; then pick the whole torrent */
+    const size_t pieces = 50000;
+    size_t picked = 0, p;
+    double t0, t1, t2;
+
+    pp = piece_picker_new(pieces, NULL, 11);
+    piece_picker_set_random_first(pp, 0);
+    for (size_t k = 0; k < MAX_PEERS; ++k) {
+	struct bitfield *bf = &peers[npeers++];
+
+	TEST_ASSERT_NOT_EQUAL(0, bitfield_init(bf, pieces));
+	for (size_t i = 0; i < pieces; ++i) {
+	    if (rand() & 1)
+		bitfield_set(bf, i);
+	}
+    }
+
+    t0 = now_ms();
+    for (size_t k = 0; k < MAX_PEERS; ++k)
+	piece_picker_add_peer(pp, &peers[k]);
+    t1 = now_ms();
+    for (size_t k = 0; piece_picker_missing(pp) > 0 && k < 4 * pieces; ++k) {
+	p = piece_picker_pick(pp, &peers[k % MAX_PEERS]);
+	if (p != PIECE_PICKER_NONE) {
+	    piece_picker_done(pp, p);
+	    picked++;
+	}
+    }
+    t2 = now_ms();
+    TEST_ASSERT_EQUAL(pieces, picked);
+    printf("\n  %d bitfields of %zu pieces: %.2f ms, %zu picks: %.2f ms (%.2f us/pick)",
+	   MAX_PEERS, pieces, t1 - t0, picked, t2 - t1, (t2 - t1) * 1e3 / picked);
+}
+
+TEST(piece_picker, aborted_piece_returns_to_its_bucket)
+{
+    struct bitfield *s, *a;
+
+    pp = piece_picker_new(6, NULL, 5);
+    piece_picker_set_random_first(pp, 0);
+    s = seed(6);
+    a = peer(6, 0, 1, 2, 3, END);
+    piece_picker_add_peer(pp, s);
+    piece_picker_add_peer(pp, a);
+    piece_picker_add_peer(pp, peer(6, 0, 1, END));
+
+    /* 4 and 5 are the rarest, then 2 and 3 */
+    size_t first = piece_picker_pick(pp, s);
+    TEST_ASSERT_TRUE(first == 4 || first == 5);
+    TEST_ASSERT_EQUAL(9 - first, piece_picker_pick(pp, s));
+    size_t third = piece_picker_pick(pp, s);
+    TEST_ASSERT_TRUE(third == 2 || third == 3);
+
+    /* Availability changes while in flight still count once it is back */
+    piece_picker_peer_have(pp, 5);
+    piece_picker_peer_have(pp, 5);
+    piece_picker_abort(pp, 5);
+    piece_picker_abort(pp, third);
+    TEST_ASSERT_EQUAL(3, piece_picker_availability(pp, 5));
+    TEST_ASSERT_EQUAL(5 - third, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(third, piece_picker_pick(pp, s));
+    TEST_ASSERT_EQUAL(5, piece_picker_pick(pp, s));
+    piece_picker_done(pp, 4);
+    size_t p = piece_picker_pick(pp, a);
+    TEST_ASSERT_TRUE(p == 0 || p == 1);
+    TEST_ASSERT_EQUAL(1 - p, piece_picker_pick(pp, a));
+    TEST_ASSERT_EQUAL(1, piece_picker_in_endgame(pp));
+}
+
+TEST(piece_picker, bench_in_flight)
+{
+    BENCH_ONLY();
+    /* Every piece goes in flight and none completes: picks must not walk over them */
+    const size_t pieces = 50000;
+    struct bitfield *s = seed(pieces);
+    size_t picked = 0, p;
+    double t0, t1;
+
+    pp = piece_picker_new(pieces, NULL, 13);
+    piece_picker_set_random_first(pp, 0);
+    piece_picker_add_peer(pp, s);
+    for (size_t k = 1; k < 8; ++k) {
+	struct bitfield *bf = &peers[npeers++];
+
+	TEST_ASSERT_NOT_EQUAL(0, bitfield_init(bf, pieces));
+	for (size_t i = 0; i < pieces; ++i) {
+	    if (rand() % 8 < k)
+		bitfield_set(bf, i);
+	}
+	piece_picker_add_peer(pp, bf);
+    }
+
+    t0 = now_ms();
+    while (!piece_picker_in_endgame(pp) && piece_picker_pick(pp, s) != PIECE_PICKER_NONE)
+	picked++;
+    t1 = now_ms();
+    TEST_ASSERT_EQUAL(pieces, picked);
+
+    /* Given back, a piece is picked again, and only it */
+    piece_picker_abort(pp, 1234);
+    TEST_ASSERT_EQUAL(0, piece_picker_in_endgame(pp));
+    TEST_ASSERT_EQUAL(1234, piece_picker_pick(pp, s));
+    p = piece_picker_pick(pp, s);
+    TEST_ASSERT_NOT_EQUAL(PIECE_PICKER_NONE, p);
+    TEST_ASSERT_EQUAL(2, piece_picker_requests(pp, p));
+    printf("\n  %zu picks with everything before them in flight: %.2f ms (%.3f us/pick)",
+	   picked, t1 - t0, (t1 - t0) * 1e3 / picked);
+}
+
+TEST(piece_picker, time_to_first_bytes)
+{
+    /* 256 pieces; one slow seed, peers holding random 60% at mixed speeds */
+    const size_t pieces = 256, first_n = 32, window = 8, n = 12;
+    const unsigned rates[] = { 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 8, 8 };
+    struct sim_peer sp[12];
+    size_t rarest, stream, dedup, dups, dups_off;
+
+    for (size_t k = 0; k < n; ++k) {
+	sp[k].has = k == 0 ? seed(pieces) : peer(pieces, END);
+	sp[k].rate = rates[k];
+	for (size_t i = 0; k > 0 && i < pieces; ++i) {
+	    if (rand() % 10 < 6)
+		bitfield_set(sp[k].has, i);
+	}
+    }
+
+    rarest = simulate(pieces, sp, n, 0, 0, first_n, &dups_off);
+    stream = simulate(pieces, sp, n, window, 0, first_n, &dups_off);
+    dedup = simulate(pieces, sp, n, window, 2, first_n, &dups);
+    printf("\n  first %zu of %zu pieces: rarest-first %zu ticks, window of %zu %zu ticks,"
+	   " with urgent duplicates %zu ticks (%zu duplicate pieces)",
+	   first_n, pieces, rarest, window, stream, dedup, dups);
+    TEST_ASSERT_TRUE(stream < rarest);
+    TEST_ASSERT_TRUE(dedup < rarest);
+}
+
+TEST_GROUP_RUNNER(piece_picker)
+{
+    RUN_TEST_CASE(piece_picker, availability);
+    RUN_TEST_CASE(piece_picker, rarest_first);
+    RUN_TEST_CASE(piece_picker, picks_in_availability_order);
+    RUN_TEST_CASE(piece_picker, only_pieces_the_peer_has);
+    RUN_TEST_CASE(piece_picker, skips_what_we_have);
+    RUN_TEST_CASE(piece_picker, random_first);
+    RUN_TEST_CASE(piece_picker, endgame);
+    RUN_TEST_CASE(piece_picker, priorities);
+    RUN_TEST_CASE(piece_picker, deadline_window);
+    RUN_TEST_CASE(piece_picker, client);
+    RUN_TEST_CASE(piece_picker, bench_swarm);
+    RUN_TEST_CASE(piece_picker, aborted_piece_returns_to_its_bucket);
+    RUN_TEST_CASE(piece_picker, bench_in_flight);
+    RUN_TEST_CASE(piece_picker, time_to_first_bytes);
+}
@@ -0,0 +1,156 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include <reactor.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static struct reactor *r;
+static int fds[2][2];
+
+/* What a handler saw */
+struct calls {
+    int n;
+    int fd;
+    unsigned events;
+    int remove_other;  // fd to remove from inside the handler, or -1
+};
+
+static void handler(void *arg, int fd, unsigned events)
+{
+    struct calls *c = arg;
+
+    c->n++;
+    c->fd = fd;
+    c->events |= events;
+    if (c->remove_other >= 0)
+	reactor_remove(r, c->remove_other);
+}
+
+static void expire(void *arg)
+{
+    ++*(int *)arg;
+}
+
+TEST_GROUP(reactor);
+
+TEST_SETUP(reactor)
+{
+    r = reactor_new();
+    TEST_ASSERT_NOT_NULL(r);
+    for (int i = 0; i < 2; ++i) {
+	TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+	TEST_ASSERT_NOT_EQUAL(0, reactor_set_nonblocking(fds[i][0]));
+	TEST_ASSERT_NOT_EQUAL(0, reactor_set_nonblocking(fds[i][1]));
+    }
+}
+
+TEST_TEAR_DOWN(reactor)
+{
+    reactor_free(r);
+    for (int i = 0; i < 2; ++i) {
+	close(fds[i][0]);
+	close(fds[i][1]);
+    }
+}
+
+TEST(reactor, edge_triggered)
+{
+    struct calls c = { .remove_other = -1 };
+    char buf[8];
+
+    TEST_ASSERT_NOT_EQUAL(0, reactor_add(r, fds[0][0], handler, &c));
+    TEST_ASSERT_EQUAL(0, reactor_add(r, fds[0][0], handler, &c));
+    TEST_ASSERT_EQUAL(1, reactor_count(r));
+
+    /* Writable right away, reported once */
+    TEST_ASSERT_EQUAL(1, reactor_run_once(r, 1000));
+    TEST_ASSERT_EQUAL(fds[0][0], c.fd);
+    TEST_ASSERT_EQUAL(REACTOR_WRITE, c.events);
+    TEST_ASSERT_EQUAL(0, reactor_run_once(r, 0));
+
+    /* Readable once data arrives, not again until more does */
+    c.events = 0;
+    TEST_ASSERT_EQUAL(3, write(fds[0][1], "abc", 3));
+    TEST_ASSERT_EQUAL(1, reactor_run_once(r, 1000));
+    TEST_ASSERT(c.events & REACTOR_READ);
+    TEST_ASSERT_EQUAL(3, read(fds[0][0], buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(-1, read(fds[0][0], buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(EAGAIN, errno);
+    TEST_ASSERT_EQUAL(0, reactor_run_once(r, 0));
+
+    /* The other end closing */
+    c.events = 0;
+    close(fds[0][1]);
+    fds[0][1] = -1;
+    TEST_ASSERT_EQUAL(1, reactor_run_once(r, 1000));
+    TEST_ASSERT(c.events & REACTOR_HANGUP);
+
+    reactor_remove(r, fds[0][0]);
+    TEST_ASSERT_EQUAL(0, reactor_count(r));
+}
+
+TEST(reactor, remove_from_handler)
+{
+    struct calls a = { .remove_other = -1 }, b = { .remove_other = -1 };
+
+    TEST_ASSERT_NOT_EQUAL(0, reactor_add(r, fds[0][0], handler, &a));
+    TEST_ASSERT_NOT_EQUAL(0, reactor_add(r, fds[1][0], handler, &b));
+    reactor_run_once(r, 1000);
+    reactor_run_once(r, 0);
+    a.n = b.n = 0;
+
+    /* Both become readable; whichever runs first removes the other */
+    a.remove_other = fds[1][0];
+    b.remove_other = fds[0][0];
+    TEST_ASSERT_EQUAL(1, write(fds[0][1], "x", 1));
+    TEST_ASSERT_EQUAL(1, write(fds[1][1], "x", 1));
+    TEST_ASSERT_EQUAL(1, reactor_run_once(r, 1000));
+    TEST_ASSERT_EQUAL(1, a.n + b.n);
+    TEST_ASSERT_EQUAL(1, reactor_count(r));
+
+    /* The descriptor can be registered again */
+    int gone = a.n ? fds[1][0] : fds[0][0];
+    struct calls c = { .remove_other = -1 };
+    TEST_ASSERT_NOT_EQUAL(0, reactor_add(r, gone, handler, &c));
+    TEST_ASSERT(reactor_run_once(r, 1000) >= 1);
+    TEST_ASSERT(c.events & REACTOR_READ);
+}
+
+TEST(reactor, timers)
+{
+    struct reactor_timer early, late;
+    int fired_early = 0, fired_late = 0;
+
+    memset(&early, 0, sizeof(early));
+    memset(&late, 0, sizeof(late));
+    uint64_t t0 = reactor_now_ms();
+    reactor_timer_set(r, &late, t0 + 60, expire, &fired_late);
+    reactor_timer_set(r, &early, t0 + 20, expire, &fired_early);
+
+    /* No descriptors: the wait ends at the earliest deadline, not at -1 */
+    TEST_ASSERT_EQUAL(1, reactor_run_once(r, -1));
+    TEST_ASSERT_EQUAL(1, fired_early);
+    TEST_ASSERT_EQUAL(0, fired_late);
+    TEST_ASSERT(reactor_now_ms() - t0 >= 20);
+
+    /* A cancelled timer does not fire, and can be set again */
+    reactor_timer_cancel(r, &late);
+    reactor_timer_cancel(r, &late);
+    TEST_ASSERT_EQUAL(0, reactor_run_once(r, 80));
+    TEST_ASSERT_EQUAL(0, fired_late);
+    reactor_timer_set(r, &late, reactor_now_ms(), expire, &fired_late);
+    TEST_ASSERT_EQUAL(1, reactor_run_once(r, 1000));
+    TEST_ASSERT_EQUAL(1, fired_late);
+}
+
+TEST_GROUP_RUNNER(reactor)
+{
+    RUN_TEST_CASE(reactor, edge_triggered);
+    RUN_TEST_CASE(reactor, remove_from_handler);
+    RUN_TEST_CASE(reactor, timers);
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <client.h>
+#include <metainfo.h>
+#include <resume.h>
+#include "unity_fixture.h"
+#include "unity.h"
+
+#define DATA "existing_file_len_non_multiple"
+#define SIDECAR "existing_file_len_non_multiple.resume"
+
+static struct metainfo_file info;
+
+static int copy_file(const char *src, const char *dst)
+{
+    int c;
+    FILE *fp1 = fopen(src, "rb");
+    if (fp1 == NULL) return 0;
+
+    FILE *fp2 = fopen(dst, "wb");
+    if (fp2 == NULL) {
+	fclose(fp1);
+	return 0;
+    }
+
+    while ((c = fgetc(fp1)) != EOF)
+	fputc(c, fp2);
+
+    fclose(fp1);
+    fclose(fp2);
+
+    return 1;
+}
+
+/* Overwrites one byte of the data file; keep_mtime restores the old mtime */
+static void corrupt(long offset, int keep_mtime)
+{
+    struct stat st;
+    struct timespec times[2];
+    FILE *fp;
+
+    TEST_ASSERT_EQUAL(0, stat(DATA, &st));
+    fp = fopen(DATA, "r+b");
+    TEST_ASSERT_NOT_NULL(fp);
+    fseek(fp, offset, SEEK_SET);
+    fputc('#', fp);
+    fclose(fp);
+    if (keep_mtime) {
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	TEST_ASSERT_EQUAL(0, utimensat(AT_FDCWD, DATA, times, 0));
+    }
+}
+
+static size_t start(int force_recheck)
+{
+    struct client_options opts = { .resume_path = SIDECAR, .force_recheck = force_recheck };
+    struct client *client = client_new_opts(&info, 6881, &opts);
+    size_t downloaded;
+
+    TEST_ASSERT_NOT_NULL(client);
+    downloaded = client_downloaded(client);
+    TEST_ASSERT_EQUAL(info.info.length - downloaded, client_left(client));
+    client_free(client);
+    return downloaded;
+}
+
+
+TEST_GROUP(resume);
+
+TEST_SETUP(resume)
+{
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&info, "test/existing_file_len_non_multiple.torrent"));
+    TEST_ASSERT_NOT_EQUAL(0, copy_file("test/existing_file_len_non_multiple", DATA));
+}
+
+TEST_TEAR_DOWN(resume)
+{
+    metainfo_file_free(&info);
+    remove(DATA);
+    remove(SIDECAR);
+}
+
+
+TEST(resume, first_start_writes_sidecar)
+{
+    uint8_t have[1], stale[1];
+
+    TEST_ASSERT_EQUAL(13, start(0));
+    TEST_ASSERT_NOT_EQUAL(0, resume_load(SIDECAR, &info, have, stale));
+    TEST_ASSERT_EQUAL(0xe0, have[0]);
+    TEST_ASSERT_EQUAL(0, stale[0]);
+}
+
+TEST(resume, trusted_when_unchanged)
+{
+    TEST_ASSERT_EQUAL(13, start(0));
+
+    /* Same size and mtime: the sidecar is trusted and nothing is rehashed */
+    corrupt(6, 1);
+    TEST_ASSERT_EQUAL(13, start(0));
+}
+
+TEST(resume, force_recheck)
+{
+    TEST_ASSERT_EQUAL(13, start(0));
+
+    corrupt(6, 1);
+    TEST_ASSERT_EQUAL(8, start(1));
+    /* The recheck result is what gets saved */
+    TEST_ASSERT_EQUAL(8, start(0));
+}
+
+TEST(resume, rechecked_when_mtime_changes)
+{
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000000000, 0 } };
+
+    TEST_ASSERT_EQUAL(13, start(0));
+
+    corrupt(12, 0);
+    TEST_ASSERT_EQUAL(0, utimensat(AT_FDCWD, DATA, times, 0));
+    TEST_ASSERT_EQUAL(10, start(0));
+}
+
+TEST(resume, ignores_other_torrent)
+{
+    struct metainfo_file other;
+    uint8_t have[1], stale[1];
+
+    TEST_ASSERT_EQUAL(13, start(0));
+    TEST_ASSERT_NOT_EQUAL(0, metainfo_file_read(&other, "test/existing_file_len_multiple.torrent"));
+    TEST_ASSERT_EQUAL(0, resume_load(SIDECAR, &other, have, stale));
+    metainfo_file_free(&other);
+
+    TEST_ASSERT_EQUAL(0, resume_load("test/noexisting.resume", &info, have, stale));
+}
+
+TEST_GROUP_RUNNER(resume)
+{
+    RUN_TEST_CASE(resume, first_start_writes_sidecar);
+    RUN_TEST_CASE(resume, trusted_when_unchanged);
+    RUN_TEST_CASE(resume, force_recheck);
+    RUN_TEST_CASE(resume, rechecked_when_mtime_changes);
+    RUN_TEST_CASE(resume, ignores_other_torrent);
+}
@@ -5,8 +5,22 @@
 static void run_tests(void)
 {
     RUN_TEST_GROUP(bencode);
+    RUN_TEST_GROUP(bencode_stream);
     RUN_TEST_GROUP(metainfo);
     RUN_TEST_GROUP(client);
+    RUN_TEST_GROUP(verify);
+    RUN_TEST_GROUP(resume);
+    RUN_TEST_GROUP(sha1_mb);
+    RUN_TEST_GROUP(piece_assembler);
+    RUN_TEST_GROUP(storage);
+    RUN_TEST_GROUP(bitfield);
+    RUN_TEST_GROUP(piece_picker);
+    RUN_TEST_GROUP(block_tracker);
+    RUN_TEST_GROUP(peer_wire);
+    RUN_TEST_GROUP(reactor);
+    RUN_TEST_GROUP(peer_engine);
+    RUN_TEST_GROUP(peer_table);
+    RUN_TEST_GROUP(handoff_queue);
     RUN_TEST_GROUP(handshake);
     RUN_TEST_GROUP(listen_peers);
     RUN_TEST_GROUP(tracker);
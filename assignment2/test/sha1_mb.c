@@ -0,0 +1,196 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <sha1_mb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+
+static const enum sha1_impl impls[] = { SHA1_IMPL_SCALAR, SHA1_IMPL_AVX2, SHA1_IMPL_SHANI };
+
+static uint8_t *buffer;
+
+static void fill_random(uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+	p[i] = (uint8_t)rand();
+}
+
+
+TEST_GROUP(sha1_mb);
+
+TEST_SETUP(sha1_mb)
+{
+    buffer = NULL;
+}
+
+TEST_TEAR_DOWN(sha1_mb)
+{
+    free(buffer);
+    sha1_mb_set_impl(SHA1_IMPL_AUTO);
+}
+
+
+TEST(sha1_mb, known_vectors)
+{
+    uint8_t out[SHA1_MB_DIGEST_LENGTH];
+    const uint8_t abc[] = {
+	0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+	0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+    };
+    const uint8_t empty[] = {
+	0xda, 0x39, 0xa3, 0xee, 0x5e, 0x6b, 0x4b, 0x0d, 0x32, 0x55,
+	0xbf, 0xef, 0x95, 0x60, 0x18, 0x90, 0xaf, 0xd8, 0x07, 0x09
+    };
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+	if (!sha1_mb_set_impl(impls[k]))
+	    continue;
+	sha1("abc", 3, out);
+	TEST_ASSERT_EQUAL_MEMORY(abc, out, SHA1_MB_DIGEST_LENGTH);
+	sha1("", 0, out);
+	TEST_ASSERT_EQUAL_MEMORY(empty, out, SHA1_MB_DIGEST_LENGTH);
+    }
+}
+
+TEST(sha1_mb, matches_openssl)
+{
+    /* Every length around the one- and two-block padding boundaries */
+    const size_t n = 200;
+    const uint8_t *data[200];
+    size_t len[200];
+    uint8_t out[200][SHA1_MB_DIGEST_LENGTH], expected[SHA1_MB_DIGEST_LENGTH];
+
+    buffer = malloc(n * 300);
+    TEST_ASSERT_NOT_NULL(buffer);
+    fill_random(buffer, n * 300);
+    for (size_t i = 0; i < n; ++i) {
+	data[i] = buffer + i * 300 + i % 7;
+	len[i] = i;
+    }
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+	if (!sha1_mb_set_impl(impls[k]))
+	    continue;
+	/* Odd batch sizes leave idle lanes in the multi-buffer kernel */
+	for (size_t batch = 1; batch <= 13; batch += 4) {
+	    memset(out, 0, sizeof(out));
+	    for (size_t i = 0; i < n; i += batch)
+		sha1_mb(data + i, len + i, n - i < batch ? n - i : batch, out + i);
+	    for (size_t i = 0; i < n; ++i) {
+		SHA1(data[i], len[i], expected);
+		TEST_ASSERT_EQUAL_MEMORY(expected, out[i], SHA1_MB_DIGEST_LENGTH);
+	    }
+	}
+    }
+}
+
+TEST(sha1_mb, mixed_lengths)
+{
+    /* Lanes finish after very different numbers of blocks */
+    const size_t len[8] = { 16384, 0, 65, 200000, 64, 1, 131072, 55 };
+    const uint8_t *data[8];
+    uint8_t out[8][SHA1_MB_DIGEST_LENGTH], expected[SHA1_MB_DIGEST_LENGTH];
+    size_t offset = 0;
+
+    buffer = malloc(420000);
+    TEST_ASSERT_NOT_NULL(buffer);
+    fill_random(buffer, 420000);
+    for (size_t i = 0; i < 8; ++i) {
+	data[i] = buffer + offset;
+	offset += len[i];
+    }
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+	if (!sha1_mb_set_impl(impls[k]))
+	    continue;
+	sha1_mb(data, len, 8, out);
+	for (size_t i = 0; i < 8; ++i) {
+	    SHA1(data[i], len[i], expected);
+	    TEST_ASSERT_EQUAL_MEMORY(expected, out[i], SHA1_MB_DIGEST_LENGTH);
+	}
+    }
+}
+
+TEST(sha1_mb, incremental)
+{
+    const size_t length = 10000;
+    uint8_t out[SHA1_MB_DIGEST_LENGTH], expected[SHA1_MB_DIGEST_LENGTH];
+    struct sha1_ctx ctx;
+
+    buffer = malloc(length);
+    TEST_ASSERT_NOT_NULL(buffer);
+    fill_random(buffer, length);
+    SHA1(buffer, length, expected);
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+	if (!sha1_mb_set_impl(impls[k]))
+	    continue;
+	for (size_t step = 1; step <= 257; step += 64) {
+	    sha1_init(&ctx);
+	    for (size_t off = 0; off < length; off += step)
+		sha1_update(&ctx, buffer + off, length - off < step ? length - off : step);
+	    sha1_final(&ctx, out);
+	    TEST_ASSERT_EQUAL_MEMORY(expected, out, SHA1_MB_DIGEST_LENGTH);
+	}
+    }
+}
+
+TEST(sha1_mb, dispatch)
+{
+    enum sha1_impl detected = sha1_mb_get_impl();
+
+    TEST_ASSERT_NOT_EQUAL(SHA1_IMPL_AUTO, detected);
+    TEST_ASSERT_NOT_EQUAL(0, sha1_mb_set_impl(SHA1_IMPL_SCALAR));
+    TEST_ASSERT_EQUAL(SHA1_IMPL_SCALAR, sha1_mb_get_impl());
+    TEST_ASSERT_EQUAL(1, sha1_mb_batch());
+    TEST_ASSERT_NOT_EQUAL(0, sha1_mb_set_impl(SHA1_IMPL_AUTO));
+    TEST_ASSERT_EQUAL(detected, sha1_mb_get_impl());
+}
+
+TEST(sha1_mb, bench_pieces)
+{
+    BENCH_ONLY();
+    /* 128 pieces of 256 KiB, the per-piece OpenSSL call against each kernel */
+    const size_t piece = 256 * 1024, n = 128;
+    const uint8_t *data[128];
+    size_t len[128];
+    uint8_t out[128][SHA1_MB_DIGEST_LENGTH];
+    double t0, t1, gib = (double)(piece * n) / (1 << 30);
+
+    buffer = malloc(piece * n);
+    TEST_ASSERT_NOT_NULL(buffer);
+    fill_random(buffer, piece * n);
+    for (size_t i = 0; i < n; ++i) {
+	data[i] = buffer + i * piece;
+	len[i] = piece;
+    }
+
+    t0 = now_ms();
+    for (size_t i = 0; i < n; ++i)
+	SHA1(data[i], len[i], out[i]);
+    t1 = now_ms();
+    printf("\n  openssl SHA1 per piece: %.2f GiB/s", gib / ((t1 - t0) / 1e3));
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+	if (!sha1_mb_set_impl(impls[k]))
+	    continue;
+	t0 = now_ms();
+	sha1_mb(data, len, n, out);
+	t1 = now_ms();
+	printf("\n  sha1_mb %-6s: %.2f GiB/s", sha1_impl_name(impls[k]), gib / ((t1 - t0) / 1e3));
+    }
+}
+
+TEST_GROUP_RUNNER(sha1_mb)
+{
+    RUN_TEST_CASE(sha1_mb, known_vectors);
+    RUN_TEST_CASE(sha1_mb, matches_openssl);
+    RUN_TEST_CASE(sha1_mb, mixed_lengths);
+    RUN_TEST_CASE(sha1_mb, incremental);
+    RUN_TEST_CASE(sha1_mb, dispatch);
+    RUN_TEST_CASE(sha1_mb, bench_pieces);
+}
@@ -0,0 +1,286 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <metainfo.h>
+#include <storage.h>
+#include <verify.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#define DATA_FILE "storage_data.bin"
+#define DATA_DIR "storage_dir"
+#define DATA_FILE_A "storage_dir/a/one.bin"
+#define DATA_FILE_B "storage_dir/b/c/two.bin"
+
+static struct metainfo_file torrent;
+static struct metainfo_file_span spans[2];
+static char *data;
+
+/* An in-memory torrent over length bytes; piece zero_piece is all zeros */
+static void make_torrent(size_t piece_length, size_t length, size_t zero_piece)
+{
+    size_t pieces = (length + piece_length - 1) / piece_length;
+
+    data = malloc(length);
+    TEST_ASSERT_NOT_NULL(data);
+    for (size_t i = 0; i < length; ++i)
+	data[i] = i / piece_length == zero_piece ? 0 : (char)rand();
+
+    memset(&torrent, 0, sizeof(torrent));
+    torrent.info.name = DATA_FILE;
+    torrent.info.piece_length = piece_length;
+    torrent.info.length = length;
+    torrent.info.pieces_count = pieces;
+    torrent.info.hashes = malloc(pieces * SHA_DIGEST_LENGTH);
+    TEST_ASSERT_NOT_NULL(torrent.info.hashes);
+    for (size_t i = 0; i < pieces; ++i) {
+	size_t len = i == pieces - 1 ? length - i * piece_length : piece_length;
+	SHA1((unsigned char *)data + i * piece_length, len, torrent.info.hashes[i]);
+    }
+    spans[0].path = DATA_FILE;
+    spans[0].offset = 0;
+    spans[0].length = length;
+    torrent.info.files = spans;
+    torrent.info.files_count = 1;
+}
+
+/* Writes piece i of the data into DATA_FILE without changing its size */
+static void write_piece(size_t i)
+{
+    size_t len = storage_piece_size(&torrent, i);
+    int fd = open(DATA_FILE, O_WRONLY);
+
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(len, pwrite(fd, data + i * torrent.info.piece_length, len,
+				  (off_t)(i * torrent.info.piece_length)));
+    close(fd);
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat st;
+
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    return st.st_size;
+}
+
+static off_t allocated(const char *path)
+{
+    struct stat st;
+
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+    return (off_t)st.st_blocks * 512;
+}
+
+
+TEST_GROUP(storage);
+
+TEST_SETUP(storage)
+{
+    data = NULL;
+    memset(&torrent, 0, sizeof(torrent));
+}
+
+TEST_TEAR_DOWN(storage)
+{
+    free(torrent.info.hashes);
+    free(data);
+    remove(DATA_FILE);
+    remove(DATA_FILE_A);
+    remove(DATA_FILE_B);
+    rmdir(DATA_DIR "/b/c");
+    rmdir(DATA_DIR "/b");
+    rmdir(DATA_DIR "/a");
+    rmdir(DATA_DIR);
+}
+
+
+TEST(storage, create_none)
+{
+    make_torrent(16384, 8 * 16384, (size_t)-1);
+
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_NONE));
+    TEST_ASSERT_EQUAL(0, file_size(DATA_FILE));
+}
+
+TEST(storage, create_sparse)
+{
+    struct storage *st;
+
+    make_torrent(16384, 64 * 16384 + 100, (size_t)-1);
+
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_SPARSE));
+    TEST_ASSERT_EQUAL(torrent.info.length, file_size(DATA_FILE));
+    TEST_ASSERT_TRUE(allocated(DATA_FILE) < 16384);
+
+    st = storage_open(&torrent);
+    TEST_ASSERT_NOT_NULL(st);
+    for (size_t i = 0; i < 65; ++i)
+	TEST_ASSERT_EQUAL(1, storage_piece_is_hole(st, i));
+    storage_close(st);
+
+    /* A written piece is data, its neighbours are still holes */
+    write_piece(10);
+    st = storage_open(&torrent);
+    TEST_ASSERT_EQUAL(1, storage_piece_is_hole(st, 9));
+    TEST_ASSERT_EQUAL(0, storage_piece_is_hole(st, 10));
+    TEST_ASSERT_EQUAL(1, storage_piece_is_hole(st, 11));
+    storage_close(st);
+}
+
+TEST(storage, create_full)
+{
+    struct storage *st;
+
+    make_torrent(16384, 64 * 16384 + 100, (size_t)-1);
+
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_FULL));
+    TEST_ASSERT_EQUAL(torrent.info.length, file_size(DATA_FILE));
+    TEST_ASSERT_TRUE(allocated(DATA_FILE) >= (off_t)torrent.info.length);
+
+    /* Allocated but never written blocks still read as zeros; written ones do not */
+    write_piece(0);
+    st = storage_open(&torrent);
+    TEST_ASSERT_EQUAL(0, storage_piece_is_hole(st, 0));
+    storage_close(st);
+}
+
+TEST(storage, keeps_existing_data)
+{
+    FILE *fp;
+    char buf[10];
+
+    make_torrent(16384, 4 * 16384, (size_t)-1);
+    fp = fopen(DATA_FILE, "wb");
+    fwrite(data, 1, 10, fp);
+    fclose(fp);
+
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_SPARSE));
+    TEST_ASSERT_EQUAL(torrent.info.length, file_size(DATA_FILE));
+    fp = fopen(DATA_FILE, "rb");
+    TEST_ASSERT_EQUAL(10, fread(buf, 1, 10, fp));
+    fclose(fp);
+    TEST_ASSERT_EQUAL_MEMORY(data, buf, 10);
+
+    /* Never shrinks a longer file */
+    TEST_ASSERT_EQUAL(0, truncate(DATA_FILE, 5 * 16384));
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_FULL));
+    TEST_ASSERT_EQUAL(5 * 16384, file_size(DATA_FILE));
+}
+
+TEST(storage, multi_file_dirs)
+{
+    make_torrent(16384, 4 * 16384, (size_t)-1);
+    spans[0].path = DATA_FILE_A;
+    spans[0].length = 16384 + 7;
+    spans[1].path = DATA_FILE_B;
+    spans[1].offset = 16384 + 7;
+    spans[1].length = torrent.info.length - spans[1].offset;
+    torrent.info.files_count = 2;
+
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_SPARSE));
+    TEST_ASSERT_EQUAL(spans[0].length, file_size(DATA_FILE_A));
+    TEST_ASSERT_EQUAL(spans[1].length, file_size(DATA_FILE_B));
+}
+
+TEST(storage, write_across_files)
+{
+    struct storage *st;
+    char *buf;
+
+    make_torrent(16384, 4 * 16384, (size_t)-1);
+    spans[0].path = DATA_FILE_A;
+    spans[0].length = 16384 + 7;
+    spans[1].path = DATA_FILE_B;
+    spans[1].offset = 16384 + 7;
+    spans[1].length = torrent.info.length - spans[1].offset;
+    torrent.info.files_count = 2;
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_SPARSE));
+
+    /* Read-only storage refuses, the writable one crosses the file boundary */
+    st = storage_open(&torrent);
+    TEST_ASSERT_EQUAL(0, storage_write(st, 16384, data + 16384, 16384));
+    storage_close(st);
+    st = storage_open_rw(&torrent);
+    TEST_ASSERT_NOT_NULL(st);
+    for (size_t i = 0; i < 4; ++i)
+	TEST_ASSERT_EQUAL(16384, storage_write(st, i * 16384, data + i * 16384, 16384));
+    TEST_ASSERT_EQUAL(0, storage_write(st, torrent.info.length, data, 1));
+    buf = malloc(torrent.info.length);
+    TEST_ASSERT_EQUAL(torrent.info.length, storage_read(st, 0, buf, torrent.info.length));
+    TEST_ASSERT_EQUAL_MEMORY(data, buf, torrent.info.length);
+    free(buf);
+    storage_close(st);
+}
+
+TEST(storage, verify_skips_holes)
+{
+    /* Piece 3 is all zeros, so it is valid even though it was never written */
+    uint8_t have[3];
+
+    make_torrent(16384, 20 * 16384 + 100, 3);
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_SPARSE));
+    write_piece(0);
+    write_piece(20);
+
+    TEST_ASSERT_EQUAL(2 * 16384 + 100, verify_torrent(&torrent, have, NULL));
+    TEST_ASSERT_EQUAL(0x90, have[0]);
+    TEST_ASSERT_EQUAL(0, have[1]);
+    TEST_ASSERT_EQUAL(0x08, have[2]);
+}
+
+TEST(storage, bench_sparse_verify)
+{
+    BENCH_ONLY();
+    /* 256 MiB that was preallocated but never written */
+    const size_t piece_length = 256 * 1024, length = 256 * 1024 * 1024;
+    struct verify_options opts = { .threads = 1 };
+    uint8_t have[128];
+    double t0, t1;
+    FILE *fp;
+
+    make_torrent(piece_length, 4 * piece_length, (size_t)-1);
+    /* Only the hashes of the first pieces are real; the rest never match */
+    free(torrent.info.hashes);
+    torrent.info.length = spans[0].length = length;
+    torrent.info.pieces_count = length / piece_length;
+    torrent.info.hashes = calloc(torrent.info.pieces_count, SHA_DIGEST_LENGTH);
+    TEST_ASSERT_NOT_NULL(torrent.info.hashes);
+
+    TEST_ASSERT_NOT_EQUAL(0, storage_create(&torrent, STORAGE_PREALLOC_SPARSE));
+    t0 = now_ms();
+    TEST_ASSERT_EQUAL(0, verify_torrent(&torrent, have, &opts));
+    t1 = now_ms();
+    printf("\n  256 MiB sparse, holes skipped: %.2f ms", t1 - t0);
+
+    /* The same zeros written out have to be read and hashed */
+    memset(data, 0, 4 * piece_length);
+    fp = fopen(DATA_FILE, "wb");
+    TEST_ASSERT_NOT_NULL(fp);
+    for (size_t off = 0; off < length; off += 4 * piece_length)
+	fwrite(data, 1, 4 * piece_length, fp);
+    fclose(fp);
+    t0 = now_ms();
+    TEST_ASSERT_EQUAL(0, verify_torrent(&torrent, have, &opts));
+    t1 = now_ms();
+    printf("\n  256 MiB of written zeros, read back: %.2f ms", t1 - t0);
+}
+
+TEST_GROUP_RUNNER(storage)
+{
+    RUN_TEST_CASE(storage, create_none);
+    RUN_TEST_CASE(storage, create_sparse);
+    RUN_TEST_CASE(storage, create_full);
+    RUN_TEST_CASE(storage, keeps_existing_data);
+    RUN_TEST_CASE(storage, multi_file_dirs);
+    RUN_TEST_CASE(storage, write_across_files);
+    RUN_TEST_CASE(storage, verify_skips_holes);
+    RUN_TEST_CASE(storage, bench_sparse_verify);
+}
@@ -0,0 +1,29 @@
+#ifndef TEST_UTIL_H_INCLUDED
+#define TEST_UTIL_H_INCLUDED
+
+#include <stdlib.h>
+#include <time.h>
+#include "unity.h"
+
+/* Monotonic time in milliseconds, for timing tests and benchmarks */
+static inline double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Benchmarks take a while and print their timings, so they are skipped
+ * unless BENCH is set in the environment:
+ *
+ *     BENCH=1 ./run_tests -n bench_
+ */
+#define BENCH_ONLY()							\
+    do {								\
+	if (!getenv("BENCH"))						\
+	    TEST_IGNORE_MESSAGE("benchmark, set BENCH=1 to run");	\
+    } while (0)
+
+#endif
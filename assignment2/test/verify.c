@@ -0,0 +1,241 @@
+#include "unity_fixture.h"
+#include "unity.h"
+#include "unity_internals.h"
+#include "test_util.h"
+#include <metainfo.h>
+#include <verify.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#define DATA_FILE "verify_data.bin"
+#define DATA_FILE_A "verify_data.a"
+#define DATA_FILE_B "verify_data.b"
+
+static struct metainfo_file torrent;
+static struct metainfo_file_span spans[2];
+static char *data;
+
+/* Builds an in-memory torrent over length bytes of random data, written to DATA_FILE */
+static void make_torrent(size_t piece_length, size_t length)
+{
+    size_t pieces = (length + piece_length - 1) / piece_length;
+    FILE *fp;
+
+    data = malloc(length);
+    TEST_ASSERT_NOT_NULL(data);
+    for (size_t i = 0; i < length; ++i)
+	data[i] = (char)rand();
+
+    memset(&torrent, 0, sizeof(torrent));
+    torrent.info.name = DATA_FILE;
+    torrent.info.piece_length = piece_length;
+    torrent.info.length = length;
+    torrent.info.pieces_count = pieces;
+    torrent.info.hashes = malloc(pieces * SHA_DIGEST_LENGTH);
+    TEST_ASSERT_NOT_NULL(torrent.info.hashes);
+    for (size_t i = 0; i < pieces; ++i) {
+	size_t len = i == pieces - 1 ? length - i * piece_length : piece_length;
+	SHA1((unsigned char *)data + i * piece_length, len, torrent.info.hashes[i]);
+    }
+    spans[0].path = DATA_FILE;
+    spans[0].offset = 0;
+    spans[0].length = length;
+    torrent.info.files = spans;
+    torrent.info.files_count = 1;
+
+    fp = fopen(DATA_FILE, "wb");
+    TEST_ASSERT_NOT_NULL(fp);
+    TEST_ASSERT_EQUAL(length, fwrite(data, 1, length, fp));
+    fclose(fp);
+}
+
+static void corrupt(size_t offset)
+{
+    FILE *fp = fopen(DATA_FILE, "r+b");
+
+    TEST_ASSERT_NOT_NULL(fp);
+    fseek(fp, offset, SEEK_SET);
+    fputc(data[offset] ^ 0x5a, fp);
+    fclose(fp);
+}
+
+static int bit(const uint8_t *have, size_t i)
+{
+    return (have[i / 8] >> (7 - i % 8)) & 1;
+}
+
+struct progress_log {
+    size_t calls;
+    size_t last;
+    size_t total;
+    int monotonic;
+};
+
+static void on_progress(void *ctx, size_t done, size_t total)
+{
+    struct progress_log *log = ctx;
+
+    if (done < log->last)
+	log->monotonic = 0;
+    log->calls++;
+    log->last = done;
+    log->total = total;
+}
+
+
+TEST_GROUP(verify);
+
+TEST_SETUP(verify)
+{
+    data = NULL;
+    memset(&torrent, 0, sizeof(torrent));
+}
+
+TEST_TEAR_DOWN(verify)
+{
+    free(torrent.info.hashes);
+    free(data);
+    remove(DATA_FILE);
+    remove(DATA_FILE_A);
+    remove(DATA_FILE_B);
+}
+
+
+TEST(verify, all_valid)
+{
+    const size_t pieces = 65;
+    uint8_t have[9];
+
+    make_torrent(16384, 64 * 16384 + 1000);
+    for (unsigned threads = 1; threads <= 4; ++threads) {
+	struct verify_options opts = { .threads = threads };
+
+	memset(have, 0xff, sizeof(have));
+	TEST_ASSERT_EQUAL(torrent.info.length, verify_torrent(&torrent, have, &opts));
+	for (size_t i = 0; i < pieces; ++i)
+	    TEST_ASSERT_EQUAL(1, bit(have, i));
+	/* Spare bits of the last byte are cleared */
+	TEST_ASSERT_EQUAL(0x80, have[8]);
+    }
+}
+
+TEST(verify, corrupted_pieces)
+{
+    uint8_t have[9];
+    struct verify_options opts = { .threads = 3 };
+
+    make_torrent(16384, 64 * 16384 + 1000);
+    corrupt(3 * 16384 + 17);
+    corrupt(40 * 16384);
+    corrupt(64 * 16384 + 999);
+
+    TEST_ASSERT_EQUAL(62 * 16384, verify_torrent(&torrent, have, &opts));
+    for (size_t i = 0; i < 65; ++i)
+	TEST_ASSERT_EQUAL(i != 3 && i != 40 && i != 64, bit(have, i));
+}
+
+TEST(verify, truncated_file)
+{
+    uint8_t have[9];
+
+    make_torrent(16384, 64 * 16384 + 1000);
+    TEST_ASSERT_EQUAL(0, truncate(DATA_FILE, 10 * 16384 + 5));
+
+    TEST_ASSERT_EQUAL(10 * 16384, verify_torrent(&torrent, have, NULL));
+    TEST_ASSERT_EQUAL(0xff, have[0]);
+    TEST_ASSERT_EQUAL(0xc0, have[1]);
+    TEST_ASSERT_EQUAL(0, have[2]);
+}
+
+TEST(verify, missing_file)
+{
+    uint8_t have[9];
+
+    make_torrent(16384, 64 * 16384 + 1000);
+    remove(DATA_FILE);
+
+    TEST_ASSERT_EQUAL(0, verify_torrent(&torrent, have, NULL));
+    for (size_t i = 0; i < sizeof(have); ++i)
+	TEST_ASSERT_EQUAL(0, have[i]);
+}
+
+TEST(verify, multi_file)
+{
+    /* The split is not on a piece boundary, so piece 4 spans both files */
+    const size_t split = 4 * 16384 + 123;
+    uint8_t have[9];
+    struct verify_options opts = { .threads = 2 };
+    FILE *fp;
+
+    make_torrent(16384, 64 * 16384 + 1000);
+    spans[0].path = DATA_FILE_A;
+    spans[0].length = split;
+    spans[1].path = DATA_FILE_B;
+    spans[1].offset = split;
+    spans[1].length = torrent.info.length - split;
+    torrent.info.files_count = 2;
+
+    fp = fopen(DATA_FILE_A, "wb");
+    fwrite(data, 1, split, fp);
+    fclose(fp);
+    fp = fopen(DATA_FILE_B, "wb");
+    fwrite(data + split, 1, torrent.info.length - split, fp);
+    fclose(fp);
+
+    TEST_ASSERT_EQUAL(torrent.info.length, verify_torrent(&torrent, have, &opts));
+
+    remove(DATA_FILE_B);
+    TEST_ASSERT_EQUAL(4 * 16384, verify_torrent(&torrent, have, &opts));
+    TEST_ASSERT_EQUAL(0xf0, have[0]);
+}
+
+TEST(verify, progress)
+{
+    uint8_t have[9];
+    struct progress_log log = { .monotonic = 1 };
+    struct verify_options opts = { .threads = 4, .progress = on_progress, .progress_ctx = &log };
+
+    make_torrent(16384, 64 * 16384 + 1000);
+    verify_torrent(&torrent, have, &opts);
+
+    TEST_ASSERT_EQUAL(5, log.calls);
+    TEST_ASSERT_EQUAL(65, log.last);
+    TEST_ASSERT_EQUAL(65, log.total);
+    TEST_ASSERT_TRUE(log.monotonic);
+}
+
+TEST(verify, bench_threads)
+{
+    BENCH_ONLY();
+    const size_t piece_length = 256 * 1024;
+    uint8_t have[16];
+    double t0, t1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    make_torrent(piece_length, 32 * 1024 * 1024);
+
+    for (unsigned threads = 1; threads <= 8; threads *= 2) {
+	struct verify_options opts = { .threads = threads };
+
+	t0 = now_ms();
+	TEST_ASSERT_EQUAL(torrent.info.length, verify_torrent(&torrent, have, &opts));
+	t1 = now_ms();
+	printf("\n  32 MiB, %u thread(s) on %ld CPU(s): %.2f ms (%.0f MiB/s)",
+	       threads, cpus, t1 - t0, 32 / ((t1 - t0) / 1e3));
+    }
+}
+
+TEST_GROUP_RUNNER(verify)
+{
+    RUN_TEST_CASE(verify, all_valid);
+    RUN_TEST_CASE(verify, corrupted_pieces);
+    RUN_TEST_CASE(verify, truncated_file);
+    RUN_TEST_CASE(verify, missing_file);
+    RUN_TEST_CASE(verify, multi_file);
+    RUN_TEST_CASE(verify, progress);
+    RUN_TEST_CASE(verify, bench_threads);
+}